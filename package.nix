@@ -6,6 +6,7 @@
   pkg-config,
   boost,
   sourceHighlight,
+  zstd,
   version,
   src,
   # Installation directory for Android patching (compile-time constant)
@@ -24,6 +25,7 @@ gcc14Stdenv.mkDerivation {
   buildInputs = [
     boost
     sourceHighlight
+    zstd
   ];
   # Set compile-time constants
   # old-glibc: patchnar depends on this glibc, so if it changes, patchnar rebuilds
@@ -0,0 +1,289 @@
+/*
+ * Binary cache output in the file:// layout Nix substitutes from
+ */
+
+#include "binary_cache.h"
+#include "fdstream.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+namespace nar {
+
+namespace {
+
+constexpr const char* STORE_DIR = "/nix/store/";
+constexpr size_t STORE_DIR_LEN = 11;
+constexpr size_t HASH_LEN = 32;  // Store path hash part, nix base-32
+constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+void makeDir(const std::string& path)
+{
+    if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw std::runtime_error("binary cache: cannot create " + path + ": " + strerror(errno));
+    }
+}
+
+bool isBase32(char c)
+{
+    static constexpr auto table = [] {
+        std::array<bool, 256> t{};
+        for (const char* p = "0123456789abcdfghijklmnpqrsvwxyz"; *p; ++p) {
+            t[static_cast<unsigned char>(*p)] = true;
+        }
+        return t;
+    }();
+    return table[static_cast<unsigned char>(c)];
+}
+
+// "/nix/store/<hash>-name" -> "<hash>"; empty if not a store path
+std::string hashPart(const std::string& storePath)
+{
+    if (storePath.rfind(STORE_DIR, 0) != 0) {
+        return {};
+    }
+    const std::string base = storePath.substr(std::strlen(STORE_DIR));
+    if (base.size() <= HASH_LEN || base[HASH_LEN] != '-') {
+        return {};
+    }
+    return base.substr(0, HASH_LEN);
+}
+
+std::string baseName(const std::string& storePath)
+{
+    return storePath.substr(storePath.rfind('/') + 1);
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// BinaryCache
+// ============================================================================
+
+BinaryCache::BinaryCache(std::string dir, int compressionLevel)
+    : dir_(std::move(dir)), level_(compressionLevel)
+{
+    makeDir(dir_);
+    makeDir(dir_ + "/nar");
+
+    const std::string info = dir_ + "/nix-cache-info";
+    if (access(info.c_str(), F_OK) != 0) {
+        const std::string text = "StoreDir: /nix/store\nWantMassQuery: 1\nPriority: 40\n";
+        writeFileAtomically(info, text.data(), text.size());
+    }
+}
+
+// ============================================================================
+// BinaryCacheOutputBuf
+// ============================================================================
+
+BinaryCacheOutputBuf::BinaryCacheOutputBuf(const BinaryCache& cache,
+                                           const std::vector<std::string>& candidates)
+    : cache_(cache), buffer_(BUFFER_SIZE), compressed_(ZSTD_CStreamOutSize())
+{
+    for (const auto& path : candidates) {
+        if (std::string hash = hashPart(path); !hash.empty()) {
+            candidates_.emplace(std::move(hash), path);
+        }
+    }
+
+    cctx_ = ZSTD_createCCtx();
+    if (!cctx_) {
+        throw std::runtime_error("binary cache: cannot create zstd context");
+    }
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, cache_.compressionLevel());
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_checksumFlag, 1);
+
+    tempPath_ = cache_.dir() + "/nar/.nar.zst.XXXXXX";
+    fd_ = ::mkostemp(tempPath_.data(), O_CLOEXEC);
+    if (fd_ < 0) {
+        const int err = errno;
+        ZSTD_freeCCtx(cctx_);
+        throw std::runtime_error("binary cache: cannot create " + tempPath_ + ": " + strerror(err));
+    }
+
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+BinaryCacheOutputBuf::~BinaryCacheOutputBuf()
+{
+    if (fd_ >= 0) {
+        // Not finished: drop the partial file
+        ::close(fd_);
+        ::unlink(tempPath_.c_str());
+    }
+    ZSTD_freeCCtx(cctx_);
+}
+
+BinaryCacheOutputBuf::int_type BinaryCacheOutputBuf::overflow(int_type ch)
+{
+    flushBuffer();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int BinaryCacheOutputBuf::sync()
+{
+    flushBuffer();
+    return 0;
+}
+
+void BinaryCacheOutputBuf::flushBuffer()
+{
+    const size_t size = pptr() - pbase();
+    if (size == 0) {
+        return;
+    }
+
+    narHash_.update(std::as_bytes(std::span(pbase(), size)));
+    narSize_ += size;
+    scanReferences(pbase(), size);
+    compress(pbase(), size, false);
+
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+// Look for hash parts of candidate paths, skipping ahead past any byte
+// that cannot be part of a hash (as Nix's reference scanner does). Any
+// other "/nix/store/<hash>-" is a reference nobody declared.
+void BinaryCacheOutputBuf::scanReferences(const char* data, size_t size)
+{
+    if (candidates_.empty()) {
+        return;
+    }
+
+    auto scan = [&](const char* s, size_t n) {
+        size_t i = 0;
+        while (i + HASH_LEN <= n) {
+            size_t j = HASH_LEN;
+            while (j > 0 && isBase32(s[i + j - 1])) {
+                --j;
+            }
+            if (j > 0) {
+                i += j;
+                continue;
+            }
+            auto it = candidates_.find(std::string_view(s + i, HASH_LEN));
+            if (it != candidates_.end()) {
+                found_.insert(it->second);
+            } else if (i >= STORE_DIR_LEN && i + HASH_LEN < n && s[i + HASH_LEN] == '-' &&
+                       std::memcmp(s + i - STORE_DIR_LEN, STORE_DIR, STORE_DIR_LEN) == 0) {
+                unlisted_.emplace(s + i - STORE_DIR_LEN, STORE_DIR_LEN + HASH_LEN);
+            }
+            ++i;
+        }
+    };
+
+    // Hashes (with the store directory before and '-' after) straddling
+    // the previous block
+    constexpr size_t CONTEXT = STORE_DIR_LEN + HASH_LEN;
+    std::string seam = tail_;
+    seam.append(data, std::min(size, CONTEXT));
+    scan(seam.data(), seam.size());
+    scan(data, size);
+
+    if (size >= CONTEXT) {
+        tail_.assign(data + size - CONTEXT, CONTEXT);
+    } else {
+        tail_ = seam.substr(seam.size() - std::min(seam.size(), CONTEXT));
+    }
+}
+
+void BinaryCacheOutputBuf::compress(const char* data, size_t size, bool end)
+{
+    ZSTD_inBuffer in{data, size, 0};
+    const ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+
+    for (;;) {
+        ZSTD_outBuffer out{compressed_.data(), compressed_.size(), 0};
+        const size_t remaining = ZSTD_compressStream2(cctx_, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            throw std::runtime_error(std::string("binary cache: zstd: ") + ZSTD_getErrorName(remaining));
+        }
+
+        if (out.pos > 0) {
+            pwriteExact(fd_, compressed_.data(), out.pos, static_cast<off_t>(fileSize_));
+            fileHash_.update(std::as_bytes(std::span(compressed_.data(), out.pos)));
+            fileSize_ += out.pos;
+        }
+
+        const bool done = end ? remaining == 0 : in.pos == in.size;
+        if (done) {
+            break;
+        }
+    }
+}
+
+std::string BinaryCacheOutputBuf::finish(const std::string& storePath, const std::string& deriver,
+                                         const std::vector<std::string>* references)
+{
+    const std::string hash = hashPart(storePath);
+    if (hash.empty()) {
+        throw std::runtime_error("binary cache: not a store path: " + storePath);
+    }
+
+    flushBuffer();
+    if (!references && !unlisted_.empty()) {
+        // The narinfo would describe an incomplete closure
+        std::string paths;
+        for (const auto& path : unlisted_) {
+            paths += " " + path + "-...";
+        }
+        throw std::runtime_error("binary cache: " + storePath +
+                                 " refers to store paths that are not candidates:" + paths);
+    }
+    compress(nullptr, 0, true);
+
+    if (::fsync(fd_) < 0 || ::close(fd_) < 0) {
+        fd_ = -1;
+        ::unlink(tempPath_.c_str());
+        throw std::runtime_error("binary cache: cannot write " + tempPath_ + ": " + strerror(errno));
+    }
+    fd_ = -1;
+
+    const std::string fileHash = toNixBase32(fileHash_.finish());
+    const std::string url = "nar/" + fileHash + ".nar.zst";
+    if (::rename(tempPath_.c_str(), (cache_.dir() + "/" + url).c_str()) < 0) {
+        const int err = errno;
+        ::unlink(tempPath_.c_str());
+        throw std::runtime_error("binary cache: cannot rename to " + url + ": " + strerror(err));
+    }
+
+    std::set<std::string> refs = references
+        ? std::set<std::string>(references->begin(), references->end())
+        : found_;
+
+    std::string info;
+    info += "StorePath: " + storePath + "\n";
+    info += "URL: " + url + "\n";
+    info += "Compression: zstd\n";
+    info += "FileHash: sha256:" + fileHash + "\n";
+    info += "FileSize: " + std::to_string(fileSize_) + "\n";
+    info += "NarHash: sha256:" + toNixBase32(narHash_.finish()) + "\n";
+    info += "NarSize: " + std::to_string(narSize_) + "\n";
+    info += "References:";
+    for (const auto& ref : refs) {
+        info += " " + baseName(ref);
+    }
+    info += "\n";
+    if (!deriver.empty()) {
+        info += "Deriver: " + baseName(deriver) + "\n";
+    }
+
+    const std::string infoPath = cache_.dir() + "/" + hash + ".narinfo";
+    writeFileAtomically(infoPath, info.data(), info.size());
+    return infoPath;
+}
+
+} // namespace nar
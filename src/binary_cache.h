@@ -0,0 +1,106 @@
+/*
+ * Binary cache output in the file:// layout Nix substitutes from
+ *
+ *   DIR/nix-cache-info
+ *   DIR/nar/<filehash>.nar.zst     zstd-compressed NAR
+ *   DIR/<hashpart>.narinfo         NarHash, NarSize, FileHash, ..., References
+ *
+ * BinaryCacheOutputBuf takes one patched NAR as it is written and does
+ * everything in that single pass: SHA-256 and size of the NAR, reference
+ * scanning, zstd compression into a temp file under DIR/nar, and SHA-256
+ * and size of the compressed file. finish() renames the file to its hash
+ * and writes the .narinfo, so a cache never exposes a partial entry.
+ */
+
+#ifndef BINARY_CACHE_H
+#define BINARY_CACHE_H
+
+#include "sha256.h"
+
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+
+namespace nar {
+
+// ============================================================================
+// BinaryCache - Cache directory and settings
+// ============================================================================
+
+class BinaryCache {
+public:
+    // Creates DIR, DIR/nar and DIR/nix-cache-info as needed
+    explicit BinaryCache(std::string dir, int compressionLevel = 3);
+
+    const std::string& dir() const { return dir_; }
+    int compressionLevel() const { return level_; }
+
+private:
+    std::string dir_;
+    int level_;
+};
+
+// ============================================================================
+// BinaryCacheOutputBuf - Writes one NAR into the cache
+// ============================================================================
+
+class BinaryCacheOutputBuf : public std::streambuf {
+public:
+    // `candidates` are the store paths the NAR may refer to; occurrences of
+    // their hash parts are the References when finish() gets no list, and
+    // finish() then fails if the NAR names any other /nix/store/<hash>-
+    BinaryCacheOutputBuf(const BinaryCache& cache, const std::vector<std::string>& candidates);
+    ~BinaryCacheOutputBuf() override;
+
+    BinaryCacheOutputBuf(const BinaryCacheOutputBuf&) = delete;
+    BinaryCacheOutputBuf& operator=(const BinaryCacheOutputBuf&) = delete;
+
+    // Complete the entry for `storePath`; `references` (full store paths)
+    // replaces the scanned set when given. Returns the .narinfo path.
+    std::string finish(const std::string& storePath, const std::string& deriver,
+                       const std::vector<std::string>* references = nullptr);
+
+protected:
+    int_type overflow(int_type ch) override;
+    int sync() override;
+
+private:
+    void flushBuffer();
+    void scanReferences(const char* data, size_t size);
+    void compress(const char* data, size_t size, bool end);
+
+    const BinaryCache& cache_;
+    ZSTD_CCtx_s* cctx_ = nullptr;
+    int fd_ = -1;
+    std::string tempPath_;
+
+    std::vector<char> buffer_;      // Put area
+    std::vector<char> compressed_;  // zstd output block
+
+    Sha256 narHash_;
+    Sha256 fileHash_;
+    uint64_t narSize_ = 0;
+    uint64_t fileSize_ = 0;
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+
+    // Hash part (32 chars) -> store path, and the ones seen so far
+    std::unordered_map<std::string, std::string, StringHash, std::equal_to<>> candidates_;
+    std::set<std::string> found_;
+    std::set<std::string> unlisted_;  // "/nix/store/<hash>" of non-candidates
+    std::string tail_;  // Last bytes of the previous block (matches across blocks)
+};
+
+} // namespace nar
+
+#endif // BINARY_CACHE_H
@@ -0,0 +1,254 @@
+/*
+ * Content-defined chunking store for patched NARs
+ */
+
+#include "chunk_store.h"
+#include "fdstream.h"
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nar {
+
+namespace {
+
+constexpr const char* LIST_MAGIC = "patchnar-chunks-1";
+
+// Gear table: 256 fixed pseudo-random words (splitmix64). Changing it
+// changes every chunk boundary, so it must stay stable across versions.
+constexpr std::array<uint64_t, 256> makeGearTable()
+{
+    std::array<uint64_t, 256> table{};
+    uint64_t x = 0x70617463686e6172ull;  // "patchnar"
+    for (auto& entry : table) {
+        x += 0x9e3779b97f4a7c15ull;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}
+
+constexpr auto GEAR = makeGearTable();
+
+// Normalized chunking masks for an 8 KiB average (FastCDC): 15 bits below
+// the average size, 11 bits above. The gear hash shifts left, so the high
+// bits depend on the most recent bytes.
+constexpr uint64_t MASK_SMALL = 0x0003590703530000ull;
+constexpr uint64_t MASK_LARGE = 0x0000d90003530000ull;
+
+void makeDir(const std::string& path)
+{
+    if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw std::runtime_error("chunk store: cannot create " + path + ": " + strerror(errno));
+    }
+}
+
+bool validName(const std::string& name)
+{
+    return !name.empty() && name[0] != '.' && name.find('/') == std::string::npos;
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// ChunkStore
+// ============================================================================
+
+ChunkStore::ChunkStore(std::string dir)
+    : dir_(std::move(dir))
+{
+    makeDir(dir_);
+    makeDir(dir_ + "/chunks");
+    makeDir(dir_ + "/nars");
+}
+
+std::string ChunkStore::chunkPath(const std::string& hash) const
+{
+    return dir_ + "/chunks/" + hash.substr(0, 2) + "/" + hash;
+}
+
+bool ChunkStore::putChunk(const ChunkRef& ref, const char* data)
+{
+    const std::string path = chunkPath(ref.hash);
+    if (access(path.c_str(), F_OK) == 0) {
+        return false;  // Content-addressed: same name, same bytes
+    }
+
+    makeDir(dir_ + "/chunks/" + ref.hash.substr(0, 2));
+    writeFileAtomically(path, data, ref.size);
+    return true;
+}
+
+void ChunkStore::putList(const std::string& name, const std::vector<ChunkRef>& chunks,
+                         uint64_t narSize, const std::string& narHash)
+{
+    if (!validName(name)) {
+        throw std::runtime_error("chunk store: invalid NAR name '" + name + "'");
+    }
+
+    std::string list;
+    list += LIST_MAGIC;
+    list += "\nnar-size " + std::to_string(narSize);
+    list += "\nnar-sha256 " + narHash + "\n";
+    for (const auto& chunk : chunks) {
+        list += chunk.hash + " " + std::to_string(chunk.size) + "\n";
+    }
+
+    writeFileAtomically(dir_ + "/nars/" + name, list.data(), list.size());
+}
+
+void ChunkStore::restore(const std::string& name, int outFd) const
+{
+    if (!validName(name)) {
+        throw std::runtime_error("chunk store: invalid NAR name '" + name + "'");
+    }
+
+    const std::string listPath = dir_ + "/nars/" + name;
+    std::ifstream list(listPath);
+    if (!list) {
+        throw std::runtime_error("chunk store: no NAR named '" + name + "' in " + dir_);
+    }
+
+    std::string line;
+    if (!std::getline(list, line) || line != LIST_MAGIC) {
+        throw std::runtime_error("chunk store: " + listPath + " is not a chunk list");
+    }
+
+    uint64_t expected = 0;
+    uint64_t written = 0;
+    while (std::getline(list, line)) {
+        std::istringstream fields(line);
+        std::string hash;
+        std::string value;
+        fields >> hash >> value;
+
+        if (hash == "nar-size") {
+            expected = std::stoull(value);
+            continue;
+        }
+        if (hash == "nar-sha256" || hash.empty()) {
+            continue;
+        }
+
+        const uint64_t size = std::stoull(value);
+        const std::string path = chunkPath(hash);
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("chunk store: missing chunk " + hash);
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || static_cast<uint64_t>(st.st_size) != size) {
+            ::close(fd);
+            throw std::runtime_error("chunk store: chunk " + hash + " has the wrong size");
+        }
+
+        try {
+            sendRange(fd, 0, outFd, size);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        written += size;
+    }
+
+    if (written != expected) {
+        throw std::runtime_error("chunk store: " + listPath + " is truncated");
+    }
+}
+
+// ============================================================================
+// ChunkingOutputBuf
+// ============================================================================
+
+ChunkingOutputBuf::ChunkingOutputBuf(ChunkStore& store, std::streambuf* downstream)
+    : store_(store), downstream_(downstream)
+{
+    chunk_.reserve(ChunkStore::MAX_CHUNK);
+}
+
+void ChunkingOutputBuf::consume(const char* s, size_t n)
+{
+    narHash_.update(std::as_bytes(std::span(s, n)));
+    stats_.bytes += n;
+
+    for (size_t i = 0; i < n; ++i) {
+        const auto byte = static_cast<unsigned char>(s[i]);
+        chunk_.push_back(s[i]);
+        gear_ = (gear_ << 1) + GEAR[byte];
+
+        const size_t size = chunk_.size();
+        if (size < ChunkStore::MIN_CHUNK) {
+            continue;
+        }
+        const uint64_t mask = size < ChunkStore::AVG_CHUNK ? MASK_SMALL : MASK_LARGE;
+        if ((gear_ & mask) == 0 || size >= ChunkStore::MAX_CHUNK) {
+            cut();
+        }
+    }
+}
+
+void ChunkingOutputBuf::cut()
+{
+    if (chunk_.empty()) {
+        return;
+    }
+
+    const auto digest = Sha256::hash(std::as_bytes(std::span(chunk_.data(), chunk_.size())));
+    ChunkStore::ChunkRef ref{.hash = toHex(digest), .size = chunk_.size()};
+    if (store_.putChunk(ref, chunk_.data())) {
+        stats_.newChunks++;
+        stats_.newBytes += ref.size;
+    }
+    stats_.chunks++;
+    chunks_.push_back(std::move(ref));
+
+    chunk_.clear();
+    gear_ = 0;
+}
+
+ChunkingOutputBuf::int_type ChunkingOutputBuf::overflow(int_type ch)
+{
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
+    }
+    const char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+std::streamsize ChunkingOutputBuf::xsputn(const char* s, std::streamsize n)
+{
+    if (downstream_ && downstream_->sputn(s, n) != n) {
+        return 0;
+    }
+    consume(s, static_cast<size_t>(n));
+    return n;
+}
+
+int ChunkingOutputBuf::sync()
+{
+    return downstream_ ? downstream_->pubsync() : 0;
+}
+
+std::string ChunkingOutputBuf::finish(const std::string& name)
+{
+    cut();
+    const std::string narHash = toHex(narHash_.finish());
+    const std::string listName = name.empty() ? narHash : name;
+    store_.putList(listName, chunks_, stats_.bytes, narHash);
+    return listName;
+}
+
+} // namespace nar
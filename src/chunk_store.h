@@ -0,0 +1,109 @@
+/*
+ * Content-defined chunking store for patched NARs
+ *
+ * Successive builds of a package patch to NARs that differ in a few
+ * places. Cutting the byte stream where a rolling hash of the last bytes
+ * hits a pattern (instead of at fixed offsets) makes chunk boundaries
+ * follow the content, so an insertion only changes the chunks around it
+ * and everything else is shared between NARs.
+ *
+ * Layout of a store directory:
+ *   chunks/ab/abcdef...   Chunk contents, named by SHA-256 (the index)
+ *   nars/NAME             Chunk list: header, then "<sha256> <size>" lines
+ *
+ * Chunking uses a gear hash with normalized cut masks (FastCDC): cuts are
+ * harder to hit before the average size and easier after it, keeping
+ * sizes close to the average between the minimum and maximum.
+ */
+
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include "sha256.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// ChunkStore - Directory of content-addressed chunks and chunk lists
+// ============================================================================
+
+class ChunkStore {
+public:
+    static constexpr size_t MIN_CHUNK = 2 * 1024;
+    static constexpr size_t AVG_CHUNK = 8 * 1024;
+    static constexpr size_t MAX_CHUNK = 64 * 1024;
+
+    struct ChunkRef {
+        std::string hash;  // Hex SHA-256
+        uint64_t size;
+    };
+
+    struct Stats {
+        size_t chunks = 0;       // Chunks in the stored NAR
+        size_t newChunks = 0;    // Chunks that were not in the store yet
+        uint64_t bytes = 0;      // NAR size
+        uint64_t newBytes = 0;   // Bytes actually written to the store
+    };
+
+    // Opens (creating if needed) the store at `dir`
+    explicit ChunkStore(std::string dir);
+
+    // Add one chunk if it is not present yet; returns true when added
+    bool putChunk(const ChunkRef& ref, const char* data);
+
+    // Write the chunk list of a NAR under `name` (atomically replaced)
+    void putList(const std::string& name, const std::vector<ChunkRef>& chunks,
+                 uint64_t narSize, const std::string& narHash);
+
+    // Stream NAR `name` to `outFd` straight from the chunk files
+    void restore(const std::string& name, int outFd) const;
+
+private:
+    std::string chunkPath(const std::string& hash) const;
+
+    std::string dir_;
+};
+
+// ============================================================================
+// ChunkingOutputBuf - Cuts a byte stream into chunks and stores them
+// ============================================================================
+
+// Everything written is also passed to `downstream` (if any), so the
+// store can be filled while the NAR still goes to stdout
+class ChunkingOutputBuf : public std::streambuf {
+public:
+    ChunkingOutputBuf(ChunkStore& store, std::streambuf* downstream);
+
+    // Store the final chunk and the chunk list. An empty name stores the
+    // list under the SHA-256 of the NAR. Returns the name used.
+    std::string finish(const std::string& name);
+
+    const ChunkStore::Stats& stats() const { return stats_; }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    void consume(const char* s, size_t n);
+    void cut();
+
+    ChunkStore& store_;
+    std::streambuf* downstream_;
+    std::vector<char> chunk_;
+    uint64_t gear_ = 0;
+    Sha256 narHash_;
+    std::vector<ChunkStore::ChunkRef> chunks_;
+    ChunkStore::Stats stats_;
+};
+
+} // namespace nar
+
+#endif // CHUNK_STORE_H
@@ -0,0 +1,82 @@
+/*
+ * CPU capacity classes for placing worker threads
+ */
+
+#include "cpu_topology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+
+namespace nar {
+
+namespace {
+
+// First number in a sysfs file; 0 if missing or unreadable
+uint64_t readSysfsNumber(const std::string& path)
+{
+    std::ifstream file(path);
+    uint64_t value = 0;
+    if (!(file >> value)) {
+        return 0;
+    }
+    return value;
+}
+
+uint64_t cpuCapacity(const std::string& dir, int cpu)
+{
+    const std::string base = dir + "/cpu" + std::to_string(cpu);
+    if (const uint64_t capacity = readSysfsNumber(base + "/cpu_capacity")) {
+        return capacity;
+    }
+    return readSysfsNumber(base + "/cpufreq/cpuinfo_max_freq");
+}
+
+} // anonymous namespace
+
+std::vector<CpuClass> cpuClasses(const std::string& sysfsCpuDir)
+{
+    std::vector<int> allowed;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+
+    std::map<uint64_t, std::vector<int>, std::greater<>> byCapacity;
+    for (int cpu : allowed) {
+        const uint64_t capacity = cpuCapacity(sysfsCpuDir, cpu);
+        if (capacity == 0) {
+            // Partial data would misplace the unknown cores
+            return {CpuClass{0, allowed}};
+        }
+        byCapacity[capacity].push_back(cpu);
+    }
+
+    std::vector<CpuClass> classes;
+    for (auto& [capacity, cpus] : byCapacity) {
+        classes.push_back({capacity, std::move(cpus)});
+    }
+    if (classes.empty()) {
+        classes.push_back({});
+    }
+    return classes;
+}
+
+bool pinCurrentThread(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+} // namespace nar
@@ -0,0 +1,35 @@
+/*
+ * CPU capacity classes for placing worker threads
+ *
+ * Phones pair a few fast cores with several slow ones (big.LITTLE). The
+ * kernel publishes each core's relative performance in
+ * /sys/devices/system/cpu/cpuN/cpu_capacity (1024 = fastest); without it
+ * the maximum frequency in cpufreq/cpuinfo_max_freq is the best guess.
+ * Cores this process may run on are grouped by that value so workers can
+ * be pinned to a class and heavy work kept off the slow cores.
+ */
+
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nar {
+
+struct CpuClass {
+    uint64_t capacity = 0;  // cpu_capacity or cpuinfo_max_freq; 0 if unknown
+    std::vector<int> cpus;
+};
+
+// Allowed CPUs grouped by capacity, fastest class first. A single class
+// (nothing to place) when sysfs has no data for some CPU or all are equal.
+std::vector<CpuClass> cpuClasses(const std::string& sysfsCpuDir = "/sys/devices/system/cpu");
+
+// Restrict the calling thread to `cpus`; false if the kernel refused
+bool pinCurrentThread(const std::vector<int>& cpus);
+
+} // namespace nar
+
+#endif // CPU_TOPOLOGY_H
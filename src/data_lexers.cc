@@ -0,0 +1,170 @@
+// data_lexers.cc - Native value scanners for JSON, pkg-config and libtool files
+
+#include "data_lexers.h"
+
+#include <cctype>
+#include <cstring>
+
+namespace {
+
+constexpr std::string_view JSON_LANG = "json.lang";
+constexpr std::string_view PKGCONFIG_LANG = "pkgconfig.lang";
+constexpr std::string_view LIBTOOL_LANG = "libtool.lang";
+
+bool endsWith(std::string_view s, std::string_view suffix)
+{
+    return s.size() > suffix.size() && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+bool isBlank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// End of the logical line starting at i: physical lines ending in a
+// backslash continue it
+size_t logicalLineEnd(std::string_view s, size_t i)
+{
+    while (true) {
+        const size_t end = s.find('\n', i);
+        if (end == std::string_view::npos) {
+            return s.size();
+        }
+        const size_t last = end > 0 && s[end - 1] == '\r' ? end - 1 : end;
+        if (last == 0 || s[last - 1] != '\\') {
+            return end;
+        }
+        i = end + 1;
+    }
+}
+
+} // anonymous namespace
+
+std::string detectDataFormat(std::string_view filename, std::string_view content)
+{
+    if (endsWith(filename, ".json")) {
+        return std::string(JSON_LANG);
+    }
+    if (endsWith(filename, ".pc")) {
+        return std::string(PKGCONFIG_LANG);
+    }
+    if (endsWith(filename, ".la")) {
+        // "# libfoo.la - a libtool library file"
+        const std::string_view first = content.substr(0, content.find('\n'));
+        if (first.starts_with("# ") && first.find("libtool library file") != std::string_view::npos) {
+            return std::string(LIBTOOL_LANG);
+        }
+    }
+    return "";
+}
+
+bool hasOnlyNativeLexer(const std::string& langFile)
+{
+    return langFile == PKGCONFIG_LANG || langFile == LIBTOOL_LANG;
+}
+
+// ============================================================================
+// JSON
+// ============================================================================
+
+// Outside strings only '"' matters, inside only the closing '"', so both
+// are memchr() jumps; a quote preceded by an odd run of backslashes is
+// escaped. Strings without a '/' hold no paths and are not returned.
+std::vector<SourceSpan> lexJson(std::string_view content)
+{
+    std::vector<SourceSpan> spans;
+    const char* s = content.data();
+    const size_t n = content.size();
+
+    size_t i = 0;
+    while (i < n) {
+        const auto* open = static_cast<const char*>(std::memchr(s + i, '"', n - i));
+        if (!open) {
+            break;
+        }
+        const size_t begin = static_cast<size_t>(open - s);
+
+        size_t end = n;  // Unterminated: up to the end
+        for (size_t from = begin + 1; from < n;) {
+            const auto* close = static_cast<const char*>(std::memchr(s + from, '"', n - from));
+            if (!close) {
+                break;
+            }
+            const size_t pos = static_cast<size_t>(close - s);
+            size_t backslashes = 0;
+            while (pos - backslashes > begin + 1 && s[pos - backslashes - 1] == '\\') {
+                backslashes++;
+            }
+            from = pos + 1;
+            if (backslashes % 2 == 0) {
+                end = from;
+                break;
+            }
+        }
+
+        if (std::memchr(s + begin, '/', end - begin)) {
+            spans.push_back({begin, end, SourceSpan::Kind::String});
+        }
+        i = end;
+    }
+    return spans;
+}
+
+// ============================================================================
+// pkg-config
+// ============================================================================
+
+std::vector<SourceSpan> lexPkgConfig(std::string_view content)
+{
+    std::vector<SourceSpan> spans;
+    size_t i = 0;
+    while (i < content.size()) {
+        const size_t end = logicalLineEnd(content, i);
+
+        size_t pos = i;
+        while (pos < end && isBlank(content[pos])) {
+            pos++;
+        }
+        // Variable or keyword name, then '=' or ':'
+        const size_t name = pos;
+        while (pos < end && (std::isalnum(static_cast<unsigned char>(content[pos])) ||
+                             content[pos] == '_' || content[pos] == '.' || content[pos] == '-')) {
+            pos++;
+        }
+        while (pos < end && isBlank(content[pos])) {
+            pos++;
+        }
+        if (pos > name && pos < end && (content[pos] == '=' || content[pos] == ':') && pos + 1 < end) {
+            spans.push_back({pos + 1, end, SourceSpan::Kind::String});
+        }
+
+        i = end + 1;
+    }
+    return spans;
+}
+
+// ============================================================================
+// libtool
+// ============================================================================
+
+std::vector<SourceSpan> lexLibtool(std::string_view content)
+{
+    static constexpr std::string_view KEYS[] = {"libdir=", "dependency_libs="};
+
+    std::vector<SourceSpan> spans;
+    size_t i = 0;
+    while (i < content.size()) {
+        const size_t end = logicalLineEnd(content, i);
+        const std::string_view line = content.substr(i, end - i);
+
+        for (std::string_view key : KEYS) {
+            if (line.starts_with(key) && line.size() > key.size()) {
+                spans.push_back({i + key.size(), end, SourceSpan::Kind::String});
+                break;
+            }
+        }
+
+        i = end + 1;
+    }
+    return spans;
+}
@@ -0,0 +1,36 @@
+// data_lexers.h - Native value scanners for JSON, pkg-config and libtool files
+//
+// Metadata files that carry many store paths but need no tokenizer: the
+// spans patchSourceStrings() translates are found with a few memchr()
+// calls and line splits, and only the values that can hold paths are
+// returned.
+//
+// - json.lang: string literals (keys and values) that contain a '/';
+//   escaped quotes are recognized, nothing else needs decoding
+// - pkgconfig.lang (*.pc): the value of every variable (name=value) and
+//   keyword (Name: value), including continuation lines
+// - libtool.lang (*.la, libtool library files only): the libdir and
+//   dependency_libs values
+//
+// pkgconfig.lang and libtool.lang are not source-highlight languages;
+// they are patched by default (unless --no-data-formats), natively even
+// with --no-native-lexers.
+
+#pragma once
+
+#include "script_lexers.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Language of a file with a native data lexer ("" if none), from its
+// name and, for *.la, its first line
+std::string detectDataFormat(std::string_view filename, std::string_view content);
+
+// True for languages only the native lexers know
+bool hasOnlyNativeLexer(const std::string& langFile);
+
+std::vector<SourceSpan> lexJson(std::string_view content);
+std::vector<SourceSpan> lexPkgConfig(std::string_view content);
+std::vector<SourceSpan> lexLibtool(std::string_view content);
@@ -0,0 +1,597 @@
+/*
+ * File-descriptor backed stream buffers
+ */
+
+#include "fdstream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nar {
+
+// ============================================================================
+// FdInputBuf
+// ============================================================================
+
+FdInputBuf::FdInputBuf(int fd, size_t bufferSize)
+    : fd_(fd), bufferStart_(0), buffer_(bufferSize)
+{
+    // Offsets are absolute, so start from wherever the descriptor is
+    off_t pos = lseek(fd_, 0, SEEK_CUR);
+    bufferStart_ = pos < 0 ? 0 : pos;
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+}
+
+ssize_t FdInputBuf::readSome(char* buf, size_t n)
+{
+    while (true) {
+        ssize_t got = ::read(fd_, buf, n);
+        if (got >= 0) {
+            return got;
+        }
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("read error: ") + strerror(errno));
+        }
+    }
+}
+
+FdInputBuf::int_type FdInputBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    bufferStart_ += egptr() - eback();
+    ssize_t got = readSome(buffer_.data(), buffer_.size());
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + got);
+    if (got == 0) {
+        return traits_type::eof();
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize FdInputBuf::xsgetn(char* s, std::streamsize n)
+{
+    std::streamsize done = 0;
+
+    // Drain what is already buffered
+    std::streamsize avail = egptr() - gptr();
+    if (avail > 0) {
+        std::streamsize take = std::min(avail, n);
+        std::memcpy(s, gptr(), take);
+        gbump(static_cast<int>(take));
+        done += take;
+    }
+
+    // Large reads bypass the buffer entirely (no double copy for contents)
+    while (n - done >= static_cast<std::streamsize>(buffer_.size())) {
+        bufferStart_ += egptr() - eback();
+        setg(buffer_.data(), buffer_.data(), buffer_.data());
+        ssize_t got = readSome(s + done, n - done);
+        if (got == 0) {
+            return done;
+        }
+        bufferStart_ += got;
+        done += got;
+    }
+
+    // Small remainder goes through the buffer
+    while (done < n) {
+        if (underflow() == traits_type::eof()) {
+            break;
+        }
+        std::streamsize take = std::min<std::streamsize>(egptr() - gptr(), n - done);
+        std::memcpy(s + done, gptr(), take);
+        gbump(static_cast<int>(take));
+        done += take;
+    }
+    return done;
+}
+
+FdInputBuf::pos_type FdInputBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                                         std::ios_base::openmode which)
+{
+    if (!(which & std::ios_base::in)) {
+        return pos_type(off_type(-1));
+    }
+
+    const off_t current = bufferStart_ + (gptr() - eback());
+    off_t target;
+    if (dir == std::ios_base::cur) {
+        target = current + off;
+    } else if (dir == std::ios_base::beg) {
+        target = off;
+    } else {
+        return pos_type(off_type(-1));  // SEEK_END not needed for NAR parsing
+    }
+
+    if (target == current) {
+        return pos_type(target);
+    }
+
+    // Stay inside the buffer when possible
+    if (target >= bufferStart_ && target <= bufferStart_ + (egptr() - eback())) {
+        setg(eback(), eback() + (target - bufferStart_), egptr());
+        return pos_type(target);
+    }
+
+    if (lseek(fd_, target, SEEK_SET) < 0) {
+        return pos_type(off_type(-1));
+    }
+    bufferStart_ = target;
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+    return pos_type(target);
+}
+
+FdInputBuf::pos_type FdInputBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+// ============================================================================
+// BlockRing
+// ============================================================================
+
+BlockRing::BlockRing(size_t blockSize, size_t depth)
+    : blocks_(std::max<size_t>(2, depth))
+{
+    for (auto& block : blocks_) {
+        block.data.resize(blockSize);
+        free_.push_back(&block);
+    }
+}
+
+BlockRing::Block* BlockRing::takeFree()
+{
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return closed_ || !free_.empty(); });
+    if (closed_) {
+        return nullptr;
+    }
+    Block* block = free_.front();
+    free_.pop_front();
+    return block;
+}
+
+void BlockRing::putFull(Block* block)
+{
+    {
+        std::lock_guard lock(mutex_);
+        full_.push_back(block);
+        ++outstanding_;
+    }
+    cv_.notify_all();
+}
+
+BlockRing::Block* BlockRing::takeFull()
+{
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return closed_ || !full_.empty(); });
+    if (full_.empty()) {
+        return nullptr;  // Closed and drained
+    }
+    Block* block = full_.front();
+    full_.pop_front();
+    return block;
+}
+
+void BlockRing::putFree(Block* block)
+{
+    {
+        std::lock_guard lock(mutex_);
+        free_.push_back(block);
+        --outstanding_;
+    }
+    cv_.notify_all();
+}
+
+void BlockRing::waitDrained()
+{
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return closed_ || outstanding_ == 0; });
+}
+
+void BlockRing::close()
+{
+    {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+void BlockRing::setError(std::exception_ptr error)
+{
+    std::lock_guard lock(mutex_);
+    if (!error_) {
+        error_ = std::move(error);
+    }
+}
+
+std::exception_ptr BlockRing::error()
+{
+    std::lock_guard lock(mutex_);
+    return error_;
+}
+
+// ============================================================================
+// ReadAheadInputBuf
+// ============================================================================
+
+ReadAheadInputBuf::ReadAheadInputBuf(int fd, size_t blockSize, size_t depth)
+    : fd_(fd), wakeFd_(eventfd(0, EFD_CLOEXEC)), ring_(blockSize, depth)
+{
+    if (wakeFd_ < 0) {
+        throw std::runtime_error(std::string("eventfd error: ") + strerror(errno));
+    }
+    setg(nullptr, nullptr, nullptr);
+    thread_ = std::thread([this] { readLoop(); });
+}
+
+ReadAheadInputBuf::~ReadAheadInputBuf()
+{
+    // The reader may be parked in poll() on a pipe that never ends
+    ring_.close();
+    const uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = ::write(wakeFd_, &one, sizeof(one));
+    thread_.join();
+    ::close(wakeFd_);
+}
+
+void ReadAheadInputBuf::readLoop()
+{
+    try {
+        while (BlockRing::Block* block = ring_.takeFree()) {
+            pollfd fds[2] = {{.fd = fd_, .events = POLLIN, .revents = 0},
+                             {.fd = wakeFd_, .events = POLLIN, .revents = 0}};
+            while (::poll(fds, 2, -1) < 0) {
+                if (errno != EINTR) {
+                    throw std::runtime_error(std::string("poll error: ") + strerror(errno));
+                }
+            }
+            if (fds[1].revents) {
+                return;  // Shutting down
+            }
+
+            ssize_t got;
+            while ((got = ::read(fd_, block->data.data(), block->data.size())) < 0) {
+                if (errno != EINTR) {
+                    throw std::runtime_error(std::string("read error: ") + strerror(errno));
+                }
+            }
+
+            // Hand over whatever arrived; a zero-size block marks EOF
+            block->size = static_cast<size_t>(got);
+            ring_.putFull(block);
+            if (got == 0) {
+                return;
+            }
+        }
+    } catch (...) {
+        ring_.setError(std::current_exception());
+        ring_.close();
+    }
+}
+
+ReadAheadInputBuf::int_type ReadAheadInputBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    if (current_) {
+        ring_.putFree(current_);
+        current_ = nullptr;
+        setg(nullptr, nullptr, nullptr);
+    }
+    if (eof_) {
+        return traits_type::eof();
+    }
+
+    BlockRing::Block* block = ring_.takeFull();
+    if (!block || block->size == 0) {
+        eof_ = true;
+        if (block) {
+            ring_.putFree(block);
+        }
+        if (auto error = ring_.error()) {
+            std::rethrow_exception(error);
+        }
+        return traits_type::eof();
+    }
+
+    current_ = block;
+    setg(block->data.data(), block->data.data(), block->data.data() + block->size);
+    return traits_type::to_int_type(*gptr());
+}
+
+// ============================================================================
+// WriteBehindOutputBuf
+// ============================================================================
+
+WriteBehindOutputBuf::WriteBehindOutputBuf(int fd, size_t blockSize, size_t depth)
+    : fd_(fd), ring_(blockSize, depth)
+{
+    setp(nullptr, nullptr);
+    thread_ = std::thread([this] { writeLoop(); });
+}
+
+WriteBehindOutputBuf::~WriteBehindOutputBuf()
+{
+    try {
+        sync();
+    } catch (...) {
+        // Already reported through flush(), or unwinding from another error
+    }
+
+    // Zero-size block tells the writer to finish
+    BlockRing::Block* end = current_ ? current_ : ring_.takeFree();
+    end->size = 0;
+    ring_.putFull(end);
+    thread_.join();
+}
+
+void WriteBehindOutputBuf::writeLoop()
+{
+    while (BlockRing::Block* block = ring_.takeFull()) {
+        const size_t size = block->size;
+
+        // After an error keep draining so the producer never blocks
+        if (size > 0 && !ring_.error()) {
+            try {
+                const char* p = block->data.data();
+                size_t left = size;
+                while (left > 0) {
+                    ssize_t put = ::write(fd_, p, left);
+                    if (put < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        throw std::runtime_error(std::string("write error: ") + strerror(errno));
+                    }
+                    p += put;
+                    left -= put;
+                }
+            } catch (...) {
+                ring_.setError(std::current_exception());
+            }
+        }
+
+        ring_.putFree(block);
+        if (size == 0) {
+            return;
+        }
+    }
+}
+
+// Hand the current block to the writer
+void WriteBehindOutputBuf::submit()
+{
+    if (current_) {
+        current_->size = pptr() - pbase();
+        ring_.putFull(current_);
+        current_ = nullptr;
+        setp(nullptr, nullptr);
+    }
+}
+
+// Make a fresh block current (waits while the writer is a full ring behind)
+void WriteBehindOutputBuf::nextBlock()
+{
+    if (auto error = ring_.error()) {
+        std::rethrow_exception(error);
+    }
+    current_ = ring_.takeFree();
+    setp(current_->data.data(), current_->data.data() + current_->data.size());
+}
+
+WriteBehindOutputBuf::int_type WriteBehindOutputBuf::overflow(int_type ch)
+{
+    submit();
+    nextBlock();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize WriteBehindOutputBuf::xsputn(const char* s, std::streamsize n)
+{
+    std::streamsize done = 0;
+    while (done < n) {
+        if (pptr() == epptr()) {
+            submit();
+            nextBlock();
+        }
+        const std::streamsize take = std::min<std::streamsize>(epptr() - pptr(), n - done);
+        std::memcpy(pptr(), s + done, take);
+        pbump(static_cast<int>(take));
+        done += take;
+    }
+    return done;
+}
+
+int WriteBehindOutputBuf::sync()
+{
+    if (current_ && pptr() > pbase()) {
+        submit();
+    }
+    ring_.waitDrained();
+    if (auto error = ring_.error()) {
+        std::rethrow_exception(error);
+    }
+    return 0;
+}
+
+// ============================================================================
+// Helpers
+// ============================================================================
+
+void preadExact(int fd, void* buf, size_t n, off_t offset)
+{
+    auto* p = static_cast<char*>(buf);
+    while (n > 0) {
+        ssize_t got = ::pread(fd, p, n, offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("pread error: ") + strerror(errno));
+        }
+        if (got == 0) {
+            throw std::runtime_error("Unexpected EOF reading NAR");
+        }
+        p += got;
+        n -= got;
+        offset += got;
+    }
+}
+
+void pwriteExact(int fd, const void* buf, size_t n, off_t offset)
+{
+    auto* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t put = ::pwrite(fd, p, n, offset);
+        if (put < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("pwrite error: ") + strerror(errno));
+        }
+        p += put;
+        n -= put;
+        offset += put;
+    }
+}
+
+void copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, uint64_t n)
+{
+    while (n > 0) {
+        loff_t in = inOffset;
+        loff_t out = outOffset;
+        ssize_t done = ::copy_file_range(inFd, &in, outFd, &out, n, 0);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            break;  // Unsupported (EXDEV, ENOSYS, ...) - fall back below
+        }
+        inOffset += done;
+        outOffset += done;
+        n -= done;
+    }
+
+    std::vector<char> buffer(std::min<uint64_t>(n, 1 << 20));
+    while (n > 0) {
+        const size_t chunk = std::min<uint64_t>(n, buffer.size());
+        preadExact(inFd, buffer.data(), chunk, inOffset);
+        pwriteExact(outFd, buffer.data(), chunk, outOffset);
+        inOffset += chunk;
+        outOffset += chunk;
+        n -= chunk;
+    }
+}
+
+void sendRange(int inFd, off_t inOffset, int outFd, uint64_t n)
+{
+    while (n > 0) {
+        ssize_t done = ::sendfile(outFd, inFd, &inOffset, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            break;  // Unsupported (EINVAL, ENOSYS, ...) - fall back below
+        }
+        n -= done;
+    }
+
+    std::vector<char> buffer(std::min<uint64_t>(n, 1 << 20));
+    while (n > 0) {
+        const size_t chunk = std::min<uint64_t>(n, buffer.size());
+        preadExact(inFd, buffer.data(), chunk, inOffset);
+        const char* p = buffer.data();
+        size_t left = chunk;
+        while (left > 0) {
+            ssize_t put = ::write(outFd, p, left);
+            if (put < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("write error: ") + strerror(errno));
+            }
+            p += put;
+            left -= put;
+        }
+        inOffset += chunk;
+        n -= chunk;
+    }
+}
+
+int createTempFile()
+{
+    const char* tmpdir = getenv("TMPDIR");
+    std::string dir = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+
+    int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    // Filesystems without O_TMPFILE: create and unlink immediately
+    std::string pattern = dir + "/patchnar-XXXXXX";
+    fd = ::mkostemp(pattern.data(), O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("cannot create temp file in " + dir + ": " + strerror(errno));
+    }
+    ::unlink(pattern.c_str());
+    return fd;
+}
+
+void writeFileAtomically(const std::string& path, const char* data, size_t size)
+{
+    std::string temp = path + ".XXXXXX";
+    int fd = ::mkostemp(temp.data(), O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("cannot create " + temp + ": " + strerror(errno));
+    }
+
+    try {
+        pwriteExact(fd, data, size, 0);
+    } catch (...) {
+        ::close(fd);
+        ::unlink(temp.c_str());
+        throw;
+    }
+    ::close(fd);
+
+    if (::rename(temp.c_str(), path.c_str()) < 0) {
+        const int err = errno;
+        ::unlink(temp.c_str());
+        throw std::runtime_error("cannot rename to " + path + ": " + strerror(err));
+    }
+}
+
+bool isRegularFile(int fd)
+{
+    struct stat st{};
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool isPlaceableFile(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return isRegularFile(fd) && flags >= 0 && !(flags & O_APPEND);
+}
+
+} // namespace nar
@@ -0,0 +1,228 @@
+/*
+ * File-descriptor backed stream buffers
+ *
+ * std::cin cannot be relied on for seeking, and the parallel processor
+ * needs absolute file offsets that match pread() on the same descriptor.
+ * FdInputBuf is a plain buffered reader over a descriptor that keeps
+ * track of the file offset of its buffer, so tellg()/seekg() map directly
+ * to lseek() positions.
+ *
+ * For pipes, ReadAheadInputBuf and WriteBehindOutputBuf move the blocking
+ * read()/write() calls onto their own threads. Blocks circulate through a
+ * small fixed pool (BlockRing), so the I/O thread fills or drains one block
+ * while the parser works on another, and never runs more than the pool
+ * size ahead.
+ */
+
+#ifndef FDSTREAM_H
+#define FDSTREAM_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// FdInputBuf - Buffered, seekable input from a file descriptor
+// ============================================================================
+
+class FdInputBuf : public std::streambuf {
+public:
+    explicit FdInputBuf(int fd, size_t bufferSize = 256 * 1024);
+
+    int fd() const { return fd_; }
+
+protected:
+    int_type underflow() override;
+    std::streamsize xsgetn(char* s, std::streamsize n) override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    ssize_t readSome(char* buf, size_t n);
+
+    int fd_;
+    off_t bufferStart_;  // File offset of eback()
+    std::vector<char> buffer_;
+};
+
+// std::istream owning an FdInputBuf
+class FdInputStream : public std::istream {
+public:
+    explicit FdInputStream(int fd) : std::istream(nullptr), buf_(fd) { rdbuf(&buf_); }
+
+    int fd() const { return buf_.fd(); }
+
+private:
+    FdInputBuf buf_;
+};
+
+// ============================================================================
+// BlockRing - Fixed pool of I/O blocks shared by a producer and a consumer
+// ============================================================================
+
+class BlockRing {
+public:
+    struct Block {
+        std::vector<char> data;
+        size_t size = 0;  // Bytes used; 0 marks end of stream
+    };
+
+    BlockRing(size_t blockSize, size_t depth);
+
+    // Producer: get an empty block (waits), then hand it over filled
+    // takeFree() returns nullptr once the ring is closed
+    Block* takeFree();
+    void putFull(Block* block);
+
+    // Consumer: get the next filled block (waits), then give it back
+    // takeFull() returns nullptr once the ring is closed
+    Block* takeFull();
+    void putFree(Block* block);
+
+    // Wait until every filled block has been given back
+    void waitDrained();
+
+    // Wake and refuse all waiters (shutdown)
+    void close();
+
+    // First error raised by the I/O thread, if any
+    void setError(std::exception_ptr error);
+    std::exception_ptr error();
+
+private:
+    std::vector<Block> blocks_;
+    std::deque<Block*> free_;
+    std::deque<Block*> full_;
+    size_t outstanding_ = 0;  // Filled but not yet given back
+    bool closed_ = false;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+// ============================================================================
+// ReadAheadInputBuf - Input prefetched by a reader thread
+// ============================================================================
+
+class ReadAheadInputBuf : public std::streambuf {
+public:
+    explicit ReadAheadInputBuf(int fd, size_t blockSize = 1 << 20, size_t depth = 4);
+    ~ReadAheadInputBuf() override;
+
+    ReadAheadInputBuf(const ReadAheadInputBuf&) = delete;
+    ReadAheadInputBuf& operator=(const ReadAheadInputBuf&) = delete;
+
+protected:
+    int_type underflow() override;
+
+private:
+    void readLoop();
+
+    int fd_;
+    int wakeFd_;  // eventfd that interrupts a blocked read at shutdown
+    BlockRing ring_;
+    BlockRing::Block* current_ = nullptr;
+    bool eof_ = false;
+    std::thread thread_;
+};
+
+// std::istream owning a ReadAheadInputBuf; I/O errors propagate as
+// exceptions instead of looking like a truncated stream
+class ReadAheadInputStream : public std::istream {
+public:
+    explicit ReadAheadInputStream(int fd) : std::istream(nullptr), buf_(fd)
+    {
+        rdbuf(&buf_);
+        exceptions(std::ios_base::badbit);
+    }
+
+private:
+    ReadAheadInputBuf buf_;
+};
+
+// ============================================================================
+// WriteBehindOutputBuf - Output drained by a writer thread
+// ============================================================================
+
+class WriteBehindOutputBuf : public std::streambuf {
+public:
+    explicit WriteBehindOutputBuf(int fd, size_t blockSize = 1 << 20, size_t depth = 4);
+    ~WriteBehindOutputBuf() override;  // Flushes, errors are dropped
+
+    WriteBehindOutputBuf(const WriteBehindOutputBuf&) = delete;
+    WriteBehindOutputBuf& operator=(const WriteBehindOutputBuf&) = delete;
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;  // Waits until everything is written; throws on error
+
+private:
+    void writeLoop();
+    void submit();
+    void nextBlock();
+
+    int fd_;
+    BlockRing ring_;
+    BlockRing::Block* current_ = nullptr;
+    std::thread thread_;
+};
+
+// std::ostream owning a WriteBehindOutputBuf; flush() reports write errors
+class WriteBehindOutputStream : public std::ostream {
+public:
+    explicit WriteBehindOutputStream(int fd) : std::ostream(nullptr), buf_(fd)
+    {
+        rdbuf(&buf_);
+        exceptions(std::ios_base::badbit);
+    }
+
+private:
+    WriteBehindOutputBuf buf_;
+};
+
+// Read exactly n bytes at offset (throws std::runtime_error on EOF/error)
+void preadExact(int fd, void* buf, size_t n, off_t offset);
+
+// Write exactly n bytes at offset (throws std::runtime_error on error)
+void pwriteExact(int fd, const void* buf, size_t n, off_t offset);
+
+// Copy n bytes between descriptors at explicit offsets, in the kernel when
+// possible (copy_file_range), else through a small bounce buffer
+void copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, uint64_t n);
+
+// Send n bytes of inFd starting at inOffset to outFd's current position
+// (sendfile() when possible; works for pipes and files alike)
+void sendRange(int inFd, off_t inOffset, int outFd, uint64_t n);
+
+// Anonymous read/write temp file (unlinked; gone when closed)
+// Placed in $TMPDIR, or /tmp when unset
+int createTempFile();
+
+// True if fd refers to a regular file (seekable, pread-able)
+bool isRegularFile(int fd);
+
+// Write a whole file via a temp file next to `path` renamed over it, so
+// readers never see it partially written
+void writeFileAtomically(const std::string& path, const char* data, size_t size);
+
+// True if fd is a regular file that pwrite() can place data in
+// (not opened with O_APPEND, where Linux ignores the offset)
+bool isPlaceableFile(int fd);
+
+} // namespace nar
+
+#endif // FDSTREAM_H
@@ -0,0 +1,264 @@
+// lexer_restarts.cc - Line starts where source-highlight is in its main state
+
+#include "lexer_restarts.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace {
+
+// Lexer region within a line; Comment ends with the line
+enum class Region : uint8_t { Code, Double, Single, Backtick, Brace, Comment };
+
+// One way the lexer may have gone so far in the current line
+struct Hypothesis {
+    Region region = Region::Code;
+    bool skip = false;     // Next byte is escaped
+    uint8_t heredoc = 0;   // 1 + index of a heredoc opened on this line (0 = none)
+
+    bool operator==(const Hypothesis&) const = default;
+};
+
+// One way the lexer may be at a line start
+struct LineState {
+    Region region = Region::Code;
+    std::string heredoc;  // In a heredoc body ending at this word
+    bool dashed = false;  // <<-: the word may be indented with tabs
+
+    bool operator==(const LineState&) const = default;
+};
+
+struct Heredoc {
+    std::string word;
+    bool dashed;
+};
+
+// More outcomes than this and the rest of the file has no restart points
+constexpr size_t MAX_HYPOTHESES = 16;
+
+constexpr std::array<bool, 256> SPECIAL = [] {
+    std::array<bool, 256> special{};
+    for (unsigned char c : std::string_view("\\\"'`#${}<")) {
+        special[c] = true;
+    }
+    return special;
+}();
+
+bool isSpecial(char c)
+{
+    return SPECIAL[static_cast<unsigned char>(c)];
+}
+
+template<class T>
+void addUnique(std::vector<T>& states, T state)
+{
+    if (std::find(states.begin(), states.end(), state) == states.end()) {
+        states.push_back(std::move(state));
+    }
+}
+
+// "<<WORD", "<<-WORD", "<<'WORD'", "<<\"WORD\"" or "<<\\WORD" at line[p]
+bool parseHeredoc(std::string_view line, size_t p, Heredoc& heredoc)
+{
+    if (p + 1 >= line.size() || line[p + 1] != '<' || (p > 0 && line[p - 1] == '<') ||
+        (p + 2 < line.size() && line[p + 2] == '<')) {
+        return false;
+    }
+    size_t i = p + 2;
+    heredoc.dashed = i < line.size() && line[i] == '-';
+    i += heredoc.dashed;
+    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+
+    heredoc.word.clear();
+    if (i < line.size() && (line[i] == '\'' || line[i] == '"')) {
+        const size_t close = line.find(line[i], i + 1);
+        if (close == std::string_view::npos) {
+            return false;
+        }
+        heredoc.word = line.substr(i + 1, close - i - 1);
+    } else {
+        i += i < line.size() && line[i] == '\\';
+        const size_t end = std::min(line.find_first_of(" \t;|&<>()", i), line.size());
+        heredoc.word = line.substr(i, end - i);
+    }
+    return !heredoc.word.empty();
+}
+
+// Every way the lexer can go on byte p from hypothesis h
+void step(std::string_view line, size_t p, Hypothesis h, std::vector<Heredoc>& heredocs,
+          std::vector<Hypothesis>& out)
+{
+    if (h.skip) {
+        h.skip = false;
+        addUnique(out, h);
+        return;
+    }
+
+    const char c = line[p];
+    const char next = p + 1 < line.size() ? line[p + 1] : '\n';
+    auto to = [&](Region region) {
+        Hypothesis moved = h;
+        moved.region = region;
+        addUnique(out, moved);
+    };
+
+    // Whether a backslash escapes is up to the .lang file; it only
+    // matters before a byte that could change the region
+    if (c == '\\' && h.region != Region::Comment && h.region != Region::Brace && isSpecial(next)) {
+        Hypothesis escaped = h;
+        escaped.skip = true;
+        addUnique(out, escaped);
+        addUnique(out, h);
+        return;
+    }
+
+    switch (h.region) {
+    case Region::Comment:
+        break;
+    case Region::Code:
+        switch (c) {
+        case '"':
+            to(Region::Double);
+            return;
+        case '\'':
+            to(Region::Single);
+            return;
+        case '`':
+            to(Region::Backtick);
+            break;
+        case '#':
+            // A word starting with '#' is a comment for any shell lexer;
+            // one inside a word ("a#b", "$#") may or may not be
+            to(Region::Comment);
+            if (p == 0 || line[p - 1] == ' ') {
+                return;
+            }
+            break;
+        case '$':
+            if (next == '{') {
+                to(Region::Brace);
+            }
+            break;
+        case '<': {
+            Heredoc heredoc;
+            if (h.heredoc == 0 && heredocs.size() < 255 && parseHeredoc(line, p, heredoc)) {
+                heredocs.push_back(std::move(heredoc));
+                Hypothesis opened = h;
+                opened.heredoc = static_cast<uint8_t>(heredocs.size());
+                addUnique(out, opened);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        break;
+    case Region::Double:
+        if (c == '"') {
+            to(Region::Code);
+            return;
+        }
+        break;
+    case Region::Single:
+        if (c == '\'') {
+            to(Region::Code);
+            return;
+        }
+        break;
+    case Region::Backtick:
+        if (c == '`') {
+            to(Region::Code);
+            return;
+        }
+        break;
+    case Region::Brace:
+        if (c == '}') {
+            to(Region::Code);
+            return;
+        }
+        break;
+    }
+    addUnique(out, h);
+}
+
+// Line states the next line can start in; false if there are too many
+bool scanLine(std::string_view line, const LineState& start, std::vector<LineState>& out)
+{
+    if (!start.heredoc.empty()) {
+        std::string_view word = line;
+        if (start.dashed) {
+            word.remove_prefix(std::min(word.find_first_not_of('\t'), word.size()));
+        }
+        addUnique(out, word == start.heredoc ? LineState{} : start);
+        return true;
+    }
+
+    std::vector<Heredoc> heredocs;
+    std::vector<Hypothesis> hypotheses{{.region = start.region}};
+    std::vector<Hypothesis> next;
+    bool skipping = false;
+
+    for (size_t p = 0; p < line.size(); ++p) {
+        if (!skipping && !isSpecial(line[p])) {
+            continue;
+        }
+        next.clear();
+        skipping = false;
+        for (const Hypothesis& h : hypotheses) {
+            step(line, p, h, heredocs, next);
+        }
+        if (next.size() > MAX_HYPOTHESES) {
+            return false;
+        }
+        hypotheses.swap(next);
+        skipping = std::any_of(hypotheses.begin(), hypotheses.end(),
+                               [](const Hypothesis& h) { return h.skip; });
+    }
+
+    for (const Hypothesis& h : hypotheses) {
+        const bool code = h.region == Region::Code || h.region == Region::Comment;
+        if (code && h.heredoc) {
+            const Heredoc& heredoc = heredocs[h.heredoc - 1];
+            addUnique(out, LineState{Region::Code, heredoc.word, heredoc.dashed});
+        } else {
+            addUnique(out, LineState{code ? Region::Code : h.region, {}, false});
+        }
+    }
+    return out.size() <= MAX_HYPOTHESES;
+}
+
+} // anonymous namespace
+
+std::optional<std::vector<size_t>> findRestartPoints(std::string_view content,
+                                                     const std::string& langFile)
+{
+    if (langFile != "sh.lang" && langFile != "zsh.lang") {
+        return std::nullopt;
+    }
+
+    std::vector<size_t> restarts{0};
+    std::vector<LineState> states{LineState{}};
+    std::vector<LineState> next;
+
+    size_t i = 0;
+    while (i < content.size()) {
+        const size_t end = std::min(content.find('\n', i), content.size());
+
+        next.clear();
+        for (const LineState& state : states) {
+            if (!scanLine(content.substr(i, end - i), state, next)) {
+                return restarts;
+            }
+        }
+        states.swap(next);
+
+        i = end + 1;
+        if (i < content.size() && states.size() == 1 && states.front() == LineState{}) {
+            restarts.push_back(i);
+        }
+    }
+    return restarts;
+}
@@ -0,0 +1,27 @@
+// lexer_restarts.h - Line starts where source-highlight is in its main state
+//
+// Tokenizing a whole script to patch a handful of store paths wastes most
+// of the work. If a line start is known to find the lexer in its main
+// state with nothing pending, tokenizing from there gives the same tokens
+// as tokenizing from the top, so only the lines between the restart
+// points around each match need to be tokenized (patchSourceStrings).
+//
+// The pre-scan follows the quoting rules of shell scripts, but does not
+// need to know exactly how a .lang file treats each construct: wherever
+// the lexer might go either way (a '#' inside a word that may or may not
+// start a comment, a backslash that may or may not escape, backticks,
+// ${...}, heredocs), both outcomes are followed. A line start is a
+// restart point only if every outcome is back in plain code there.
+
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Restart points in increasing order, starting with 0, or nullopt if
+// langFile has no pre-scan (only sh.lang and zsh.lang do)
+std::optional<std::vector<size_t>> findRestartPoints(std::string_view content,
+                                                     const std::string& langFile);
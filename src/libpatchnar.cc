@@ -0,0 +1,593 @@
+/*
+ * libpatchnar - Embeddable NAR patcher (C API)
+ *
+ * NAR-to-NAR sessions run a BasicNarFeedProcessor on the feeding thread:
+ * its parser is a coroutine that suspends when a fed buffer is used up, so
+ * a session holds no thread and patchnar_loop can multiplex any number of
+ * them over epoll.
+ *
+ * Other sessions run the streaming processor on a worker thread that reads
+ * through FeedInputBuf: the parser consumes the caller's buffer in place,
+ * and patchnar_session_feed() returns when the parser asks for more. The
+ * worker only runs while the caller is blocked in feed/finish, so the
+ * output callback never races with the caller.
+ */
+
+#include "libpatchnar.h"
+
+#include "fdstream.h"
+#include "nar.h"
+#include "nar_feed.h"
+#include "patcher.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <sys/epoll.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+thread_local std::string lastError;
+
+// Run f, turning exceptions into -1 plus lastError
+template<class F>
+int guarded(F&& f)
+{
+    try {
+        f();
+        lastError.clear();
+        return 0;
+    } catch (const std::exception& e) {
+        lastError = e.what();
+    } catch (...) {
+        lastError = "unknown error";
+    }
+    return -1;
+}
+
+// ============================================================================
+// FeedInputBuf - Input handed over one caller buffer at a time
+// ============================================================================
+
+class FeedInputBuf : public std::streambuf {
+public:
+    // Caller side: publish a buffer and wait until it is consumed or the
+    // reader is done; returns false if the reader is done
+    bool feed(const char* data, size_t size)
+    {
+        std::unique_lock lock(mutex_);
+        if (size == 0) {
+            return !done_;
+        }
+        data_ = data;
+        size_ = size;
+        pending_ = true;
+        cv_.notify_all();
+        cv_.wait(lock, [&] { return !pending_ || done_; });
+        return !done_;
+    }
+
+    void endOfInput()
+    {
+        std::lock_guard lock(mutex_);
+        eof_ = true;
+        cv_.notify_all();
+    }
+
+    // Reader side: no more reads will happen (worker finished or failed)
+    void readerDone()
+    {
+        std::lock_guard lock(mutex_);
+        done_ = true;
+        cv_.notify_all();
+    }
+
+    void waitReaderDone()
+    {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [&] { return done_; });
+    }
+
+    void abort()
+    {
+        std::lock_guard lock(mutex_);
+        aborted_ = true;
+        cv_.notify_all();
+    }
+
+protected:
+    int_type underflow() override
+    {
+        std::unique_lock lock(mutex_);
+
+        // Asking for more means the buffer being read is used up
+        if (reading_) {
+            reading_ = false;
+            pending_ = false;
+            setg(nullptr, nullptr, nullptr);
+            cv_.notify_all();
+        }
+
+        cv_.wait(lock, [&] { return pending_ || eof_ || aborted_; });
+        if (aborted_) {
+            throw std::runtime_error("session aborted");
+        }
+        if (!pending_) {
+            return traits_type::eof();
+        }
+
+        auto* p = const_cast<char*>(data_);
+        setg(p, p, p + size_);
+        reading_ = true;
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool pending_ = false;   // A fed buffer is not fully consumed yet
+    bool reading_ = false;   // The get area points into the fed buffer
+    bool eof_ = false;
+    bool done_ = false;
+    bool aborted_ = false;
+};
+
+// ============================================================================
+// CallbackOutputBuf - Output delivered through the user's callback
+// ============================================================================
+
+class CallbackOutputBuf : public std::streambuf {
+public:
+    CallbackOutputBuf(patchnar_output_fn output, void* user)
+        : output_(output), user_(user), buffer_(64 * 1024)
+    {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        flushBuffer();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        // Large writes (file contents) go to the callback without a copy
+        if (n >= static_cast<std::streamsize>(buffer_.size())) {
+            flushBuffer();
+            deliver(s, n);
+            return n;
+        }
+        if (n > epptr() - pptr()) {
+            flushBuffer();
+        }
+        std::memcpy(pptr(), s, n);
+        pbump(static_cast<int>(n));
+        return n;
+    }
+
+    int sync() override
+    {
+        flushBuffer();
+        return 0;
+    }
+
+private:
+    void flushBuffer()
+    {
+        if (pptr() > pbase()) {
+            deliver(pbase(), pptr() - pbase());
+            setp(buffer_.data(), buffer_.data() + buffer_.size());
+        }
+    }
+
+    void deliver(const char* data, size_t size)
+    {
+        if (output_(user_, data, size) != 0) {
+            throw std::runtime_error("output callback aborted the session");
+        }
+    }
+
+    patchnar_output_fn output_;
+    void* user_;
+    std::vector<char> buffer_;
+};
+
+} // anonymous namespace
+
+// ============================================================================
+// Opaque handles
+// ============================================================================
+
+struct patchnar_config {
+    patchnar::PatchConfig config;
+};
+
+struct patchnar_session {
+    patchnar_session(const patchnar::PatchConfig& patchConfig, patchnar_output_fn output, void* user)
+        : config(patchConfig), outBuf(output, user), out(&outBuf)
+    {
+        out.exceptions(std::ios_base::badbit);
+        if (config.inputFormat == nar::ArchiveFormat::Nar &&
+            config.outputFormat == nar::ArchiveFormat::Nar) {
+            const patchnar::Patcher patcher(config);
+            feeder = std::make_unique<nar::BasicNarFeedProcessor<patchnar::Patcher>>(out, patcher);
+            feeder->setPathRules(config.pathRules.empty() ? nullptr : &config.pathRules);
+            feeder->setAnchors(patcher.anchors());
+        } else {
+            worker = std::thread([this] { run(); });
+        }
+    }
+
+    void run()
+    {
+        try {
+            std::istream in(&inBuf);
+            in.exceptions(std::ios_base::badbit);
+            patchnar::patchStream(config, in, out);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        inBuf.readerDone();
+    }
+
+    // Returns false once the NAR has ended; later input is ignored
+    bool feed(const char* data, size_t size)
+    {
+        if (finished) {
+            throw std::logic_error("session already finished");
+        }
+        if (feeder) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            try {
+                feeder->feed(std::as_bytes(std::span(data, size)));
+            } catch (...) {
+                error = std::current_exception();
+                throw;
+            }
+            return !feeder->done();
+        }
+        if (!inBuf.feed(data, size)) {
+            // The NAR ended (or failed) inside this buffer; finish() reports errors
+            inBuf.waitReaderDone();
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void finish()
+    {
+        if (!finished) {
+            finished = true;
+            if (feeder) {
+                if (!error) {
+                    feeder->finish();
+                }
+            } else {
+                inBuf.endOfInput();
+                worker.join();
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    const patchnar::PatchConfig config;
+    CallbackOutputBuf outBuf;
+    std::ostream out;
+
+    // NAR to NAR
+    std::unique_ptr<nar::BasicNarFeedProcessor<patchnar::Patcher>> feeder;
+
+    // Other formats
+    FeedInputBuf inBuf;
+    std::thread worker;
+
+    std::exception_ptr error;  // Written by the worker before readerDone()
+    bool finished = false;
+};
+
+// One session attached to a loop; epoll hands it to one thread at a time
+struct LoopEntry {
+    patchnar_session* session;
+    int fd;
+};
+
+struct patchnar_loop {
+    patchnar_loop(patchnar_done_fn doneFn, void* doneUser)
+        : epfd(epoll_create1(EPOLL_CLOEXEC)), done(doneFn), user(doneUser)
+    {
+        if (epfd < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        }
+    }
+
+    ~patchnar_loop()
+    {
+        close(epfd);
+        for (LoopEntry* entry : entries) {
+            delete entry;
+        }
+    }
+
+    // Feed the entry until its descriptor runs dry; true when it is done
+    bool service(LoopEntry& entry, std::vector<char>& buffer);
+
+    void detach(LoopEntry* entry)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, entry->fd, nullptr);
+        std::lock_guard lock(mutex);
+        std::erase(entries, entry);
+        delete entry;
+    }
+
+    const int epfd;
+    patchnar_done_fn done;
+    void* user;
+
+    std::mutex mutex;
+    std::vector<LoopEntry*> entries;
+};
+
+namespace {
+
+// Reads per wakeup before yielding the thread to other sessions
+constexpr size_t LOOP_READ_SIZE = 64 * 1024;
+constexpr int LOOP_READS_PER_WAKEUP = 16;
+constexpr int LOOP_MAX_EVENTS = 64;
+
+} // anonymous namespace
+
+bool patchnar_loop::service(LoopEntry& entry, std::vector<char>& buffer)
+{
+    for (int i = 0; i < LOOP_READS_PER_WAKEUP; ++i) {
+        const ssize_t n = read(entry.fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (n == 0 || !entry.session->feed(buffer.data(), static_cast<size_t>(n))) {
+            entry.session->finish();
+            return true;
+        }
+    }
+    return false;
+}
+
+// ============================================================================
+// C API
+// ============================================================================
+
+extern "C" {
+
+const char* patchnar_last_error(void)
+{
+    return lastError.c_str();
+}
+
+patchnar_config* patchnar_config_new(void)
+{
+    patchnar_config* config = nullptr;
+    guarded([&] { config = new patchnar_config; });
+    return config;
+}
+
+void patchnar_config_free(patchnar_config* config)
+{
+    delete config;
+}
+
+int patchnar_config_set_prefix(patchnar_config* config, const char* prefix)
+{
+    return guarded([&] { config->config.prefix = prefix; });
+}
+
+int patchnar_config_set_old_glibc(patchnar_config* config, const char* path)
+{
+    return guarded([&] { config->config.oldGlibcPath = path; });
+}
+
+int patchnar_config_set_glibc(patchnar_config* config, const char* path)
+{
+    return guarded([&] { config->config.glibcPath = path; });
+}
+
+int patchnar_config_add_mapping(patchnar_config* config, const char* old_path, const char* new_path)
+{
+    return guarded([&] {
+        if (!config->config.addMapping(old_path, new_path)) {
+            throw std::invalid_argument("mapping basenames differ in length");
+        }
+    });
+}
+
+int patchnar_config_load_mappings(patchnar_config* config, const char* filename)
+{
+    return guarded([&] {
+        if (!config->config.loadMappings(filename)) {
+            throw std::runtime_error(std::string("cannot open mappings file: ") + filename);
+        }
+    });
+}
+
+int patchnar_config_add_prefix_to(patchnar_config* config, const char* path)
+{
+    return guarded([&] { config->config.addPrefixToPaths.push_back(path); });
+}
+
+int patchnar_config_add_lang(patchnar_config* config, const char* lang_file)
+{
+    return guarded([&] { config->config.patchableLangFiles.insert(lang_file); });
+}
+
+int patchnar_config_add_rule(patchnar_config* config, const char* spec)
+{
+    return guarded([&] { config->config.pathRules.add(spec); });
+}
+
+int patchnar_config_set_formats(patchnar_config* config, const char* input, const char* output)
+{
+    return guarded([&] {
+        config->config.inputFormat = nar::parseArchiveFormat(input);
+        config->config.outputFormat = nar::parseArchiveFormat(output);
+    });
+}
+
+void patchnar_config_set_debug(patchnar_config* config, int enabled)
+{
+    config->config.debug = enabled != 0;
+}
+
+int patchnar_patch_fd(const patchnar_config* config, int in_fd, int out_fd, unsigned jobs)
+{
+    return guarded([&] {
+        nar::WriteBehindOutputStream out(out_fd);
+        patchnar::patchNar(config->config, in_fd, out, out_fd, jobs);
+        out.flush();
+    });
+}
+
+patchnar_session* patchnar_session_new(const patchnar_config* config,
+                                       patchnar_output_fn output, void* user)
+{
+    patchnar_session* session = nullptr;
+    guarded([&] { session = new patchnar_session(config->config, output, user); });
+    return session;
+}
+
+int patchnar_session_feed(patchnar_session* session, const void* data, size_t size)
+{
+    return guarded([&] { session->feed(static_cast<const char*>(data), size); });
+}
+
+int patchnar_session_finish(patchnar_session* session)
+{
+    return guarded([&] { session->finish(); });
+}
+
+void patchnar_session_free(patchnar_session* session)
+{
+    if (!session) {
+        return;
+    }
+    if (session->worker.joinable()) {
+        session->inBuf.abort();
+        session->worker.join();
+    }
+    delete session;
+}
+
+patchnar_loop* patchnar_loop_new(patchnar_done_fn done, void* user)
+{
+    patchnar_loop* loop = nullptr;
+    guarded([&] { loop = new patchnar_loop(done, user); });
+    return loop;
+}
+
+void patchnar_loop_free(patchnar_loop* loop)
+{
+    delete loop;
+}
+
+int patchnar_loop_add(patchnar_loop* loop, patchnar_session* session, int fd)
+{
+    return guarded([&] {
+        const int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw std::system_error(errno, std::generic_category(), "fcntl");
+        }
+
+        auto entry = std::make_unique<LoopEntry>(LoopEntry{session, fd});
+        {
+            std::lock_guard lock(loop->mutex);
+            loop->entries.push_back(entry.get());
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = entry.get();
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            const int err = errno;
+            std::lock_guard lock(loop->mutex);
+            std::erase(loop->entries, entry.get());
+            throw std::system_error(err, std::generic_category(), "epoll_ctl");
+        }
+        entry.release();
+    });
+}
+
+int patchnar_loop_run(patchnar_loop* loop, int timeout_ms)
+{
+    thread_local std::vector<char> buffer(LOOP_READ_SIZE);
+    epoll_event events[LOOP_MAX_EVENTS];
+    {
+        std::lock_guard lock(loop->mutex);
+        if (loop->entries.empty()) {
+            return 0;
+        }
+    }
+
+    const int ready = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+        lastError = std::string("epoll_wait: ") + std::strerror(errno);
+        return -1;
+    }
+
+    for (int i = 0; i < ready; ++i) {
+        // EPOLLONESHOT: no other thread gets this entry until it is re-armed
+        auto* entry = static_cast<LoopEntry*>(events[i].data.ptr);
+        bool done = false;
+        int status = guarded([&] { done = loop->service(*entry, buffer); });
+
+        if (status == 0 && !done) {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = entry;
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, entry->fd, &event) == 0) {
+                continue;
+            }
+            lastError = std::string("epoll_ctl: ") + std::strerror(errno);
+            status = -1;
+        }
+
+        patchnar_session* session = entry->session;
+        loop->detach(entry);
+        loop->done(loop->user, session, status);
+    }
+
+    std::lock_guard lock(loop->mutex);
+    return static_cast<int>(loop->entries.size());
+}
+
+} // extern "C"
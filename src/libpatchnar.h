@@ -0,0 +1,126 @@
+/*
+ * libpatchnar - Embeddable NAR patcher (C API)
+ *
+ * Patch NARs in-process instead of spawning patchnar and piping through it.
+ *
+ * A config holds the patch settings (prefix, glibc, hash mappings, ...). It
+ * starts from patchnar's compile-time defaults and must not be changed
+ * while a session or patchnar_patch_fd() uses it.
+ *
+ * Two ways to patch:
+ * - patchnar_patch_fd(): descriptor to descriptor, same as the CLI
+ *   (parallel and in-place output for regular files)
+ * - Sessions: push input buffers with patchnar_session_feed() and receive
+ *   output through a callback, for NARs that arrive in pieces. Input is
+ *   parsed straight from the caller's buffers and file contents are passed
+ *   to the callback without intermediate copies.
+ *
+ * NAR sessions never block and use no threads of their own: the parser
+ * suspends when a buffer is used up and continues in the next feed, so
+ * one thread can drive any number of them. A loop feeds sessions from
+ * non-blocking descriptors with epoll; several threads may run the same
+ * loop. (Sessions reading tar or export streams use a worker thread.)
+ *
+ * Functions returning int return 0 on success and -1 on error; the
+ * message is then available from patchnar_last_error() on the same thread.
+ */
+
+#ifndef LIBPATCHNAR_H
+#define LIBPATCHNAR_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct patchnar_config patchnar_config;
+typedef struct patchnar_session patchnar_session;
+
+/* Last error message of the calling thread ("" if none) */
+const char* patchnar_last_error(void);
+
+/* ---- Configuration ---- */
+
+patchnar_config* patchnar_config_new(void);
+void patchnar_config_free(patchnar_config* config);
+
+int patchnar_config_set_prefix(patchnar_config* config, const char* prefix);
+int patchnar_config_set_old_glibc(patchnar_config* config, const char* path);
+int patchnar_config_set_glibc(patchnar_config* config, const char* path);
+
+/* Hash mapping between full store paths (basenames must be equally long) */
+int patchnar_config_add_mapping(patchnar_config* config, const char* old_path, const char* new_path);
+/* Mappings file: "OLD_PATH NEW_PATH" per line */
+int patchnar_config_load_mappings(patchnar_config* config, const char* filename);
+
+int patchnar_config_add_prefix_to(patchnar_config* config, const char* path);
+int patchnar_config_add_lang(patchnar_config* config, const char* lang_file);
+/* Path rule "GLOB=ACTION" (see patchnar --rule) */
+int patchnar_config_add_rule(patchnar_config* config, const char* spec);
+/* Archive formats read and written: "nar" (default), "tar" or "export"
+ * (nix-store --export streams; input and output must both be export) */
+int patchnar_config_set_formats(patchnar_config* config, const char* input, const char* output);
+void patchnar_config_set_debug(patchnar_config* config, int enabled);
+
+/* ---- One-shot descriptor patching ---- */
+
+/* Read a NAR from in_fd and write the patched NAR to out_fd.
+ * jobs > 1 patches files in parallel when in_fd is a regular file. */
+int patchnar_patch_fd(const patchnar_config* config, int in_fd, int out_fd, unsigned jobs);
+
+/* ---- Sessions ---- */
+
+/* Receives patched output. `data` is only valid during the call. Called
+ * only while a thread is inside patchnar_session_feed() or
+ * patchnar_session_finish() (on that thread for NAR sessions, on the
+ * session's worker thread otherwise). Return 0 to go on, non-zero to
+ * abort the session. */
+typedef int (*patchnar_output_fn)(void* user, const void* data, size_t size);
+
+/* The config is copied and may be freed once the session exists */
+patchnar_session* patchnar_session_new(const patchnar_config* config,
+                                       patchnar_output_fn output, void* user);
+
+/* Feed the next piece of input; returns once all of it has been consumed
+ * (or the NAR has ended). The buffer may be reused afterwards. */
+int patchnar_session_feed(patchnar_session* session, const void* data, size_t size);
+
+/* Signal end of input and wait until all output has been delivered */
+int patchnar_session_finish(patchnar_session* session);
+
+/* Abandons an unfinished session */
+void patchnar_session_free(patchnar_session* session);
+
+/* ---- Loops ---- */
+
+typedef struct patchnar_loop patchnar_loop;
+
+/* Called when a session's descriptor reached EOF or its NAR ended, with
+ * status 0, or when the session failed, with -1 (the message is in
+ * patchnar_last_error() during the call). The session is no longer
+ * attached and may be freed from the callback; the loop never closes
+ * descriptors. */
+typedef void (*patchnar_done_fn)(void* user, patchnar_session* session, int status);
+
+patchnar_loop* patchnar_loop_new(patchnar_done_fn done, void* user);
+
+/* Detaches (without finishing) any sessions still attached */
+void patchnar_loop_free(patchnar_loop* loop);
+
+/* Feed `session` from `fd` whenever it is readable; fd is made
+ * non-blocking. A session must be attached to one loop at a time. */
+int patchnar_loop_add(patchnar_loop* loop, patchnar_session* session, int fd);
+
+/* Wait up to timeout_ms (-1 = forever) for readable descriptors and feed
+ * their sessions. Returns the number of sessions still attached (0 at once
+ * if there are none), or -1.
+ * Several threads may call it at once; each session is fed by one thread
+ * at a time, and its output callback runs on that thread. */
+int patchnar_loop_run(patchnar_loop* loop, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBPATCHNAR_H */
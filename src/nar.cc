@@ -3,29 +3,77 @@
  *
  * Streaming architecture:
  * - C++23 std::generator yields NarNode items as parsed (no tree allocation)
- * - Serial processing loop for patching and writing
+ * - Serial processing loop (BasicNarProcessor::process, in nar.h)
  * - Order preserved naturally through sequential iteration
  * - Memory: O(max_file) - one file in memory at a time
  */
 
 #include "nar.h"
+#include "tar.h"
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include <string_view>
 
 namespace nar {
 
 // ============================================================================
-// Constants
+// ArchiveFormat
 // ============================================================================
 
-static constexpr const char* NAR_MAGIC = "nix-archive-1";
+ArchiveFormat parseArchiveFormat(const std::string& name)
+{
+    if (name == "nar") {
+        return ArchiveFormat::Nar;
+    }
+    if (name == "tar") {
+        return ArchiveFormat::Tar;
+    }
+    if (name == "export") {
+        return ArchiveFormat::Export;
+    }
+    throw std::invalid_argument("unknown archive format '" + name + "' (expected nar, tar or export)");
+}
 
 // ============================================================================
-// NarProcessor - Constructor
+// AnchorScanner
 // ============================================================================
 
-NarProcessor::NarProcessor(std::istream& in, std::ostream& out)
+AnchorScanner::AnchorScanner(const std::vector<std::string>& anchors)
+    : anchors_(&anchors), cursors_(anchors.size(), 0)
+{
+}
+
+void AnchorScanner::scan(std::span<const std::byte> contents, size_t end)
+{
+    const std::string_view arrived(reinterpret_cast<const char*>(contents.data()), end);
+    for (size_t k = 0; k < anchors_->size(); ++k) {
+        const std::string& anchor = (*anchors_)[k];
+        size_t& cursor = cursors_[k];
+        for (size_t pos = arrived.find(anchor, cursor); pos != std::string_view::npos;
+             pos = arrived.find(anchor, pos + 1)) {
+            matches_.push_back({pos, static_cast<uint32_t>(k)});
+        }
+        // A match starting later may end in the next block
+        if (end >= anchor.size()) {
+            cursor = std::max(cursor, end - anchor.size() + 1);
+        }
+    }
+}
+
+ContentAnchors AnchorScanner::finish()
+{
+    std::sort(matches_.begin(), matches_.end(),
+              [](const AnchorMatch& a, const AnchorMatch& b) { return a.offset < b.offset; });
+    return {anchors_, std::move(matches_)};
+}
+
+// ============================================================================
+// NarStream - Constructor
+// ============================================================================
+
+NarStream::NarStream(std::istream& in, std::ostream& out)
     : in_(in), out_(out), parseGen_(parse())
 {
 }
@@ -34,7 +82,7 @@ NarProcessor::NarProcessor(std::istream& in, std::ostream& out)
 // Low-level I/O Operations
 // ============================================================================
 
-void NarProcessor::readExact(void* buf, size_t n)
+void NarStream::readExact(void* buf, size_t n)
 {
     in_.read(static_cast<char*>(buf), n);
     if (static_cast<size_t>(in_.gcount()) != n) {
@@ -42,14 +90,14 @@ void NarProcessor::readExact(void* buf, size_t n)
     }
 }
 
-uint64_t NarProcessor::readU64()
+uint64_t NarStream::readU64()
 {
     uint64_t val;
     readExact(&val, sizeof(val));
     return val;  // NAR uses little-endian (native on x86/ARM)
 }
 
-std::string NarProcessor::readString()
+std::string NarStream::readString()
 {
     uint64_t len = readU64();
     std::string s(len, '\0');
@@ -67,12 +115,16 @@ std::string NarProcessor::readString()
     return s;
 }
 
-std::vector<std::byte> NarProcessor::readBytes()
+void NarStream::readContents(NarNode& node)
 {
     uint64_t len = readU64();
-    std::vector<std::byte> data(len);
-    if (len > 0) {
-        readExact(data.data(), len);
+    node.content.resize(len);
+    if (!anchors_.empty()) {
+        node.anchors = readScanned(node.content, anchors_, [this](std::byte* dest, size_t n, size_t) {
+            readExact(dest, n);
+        });
+    } else if (len > 0) {
+        readExact(node.content.data(), len);
     }
 
     // Skip padding to 8-byte boundary
@@ -83,10 +135,24 @@ std::vector<std::byte> NarProcessor::readBytes()
     }
 
     stats_.totalBytes += len;
-    return data;
 }
 
-void NarProcessor::expectString(const std::string& expected)
+void NarStream::skipBytes(NarNode& node)
+{
+    uint64_t len = readU64();
+    node.contentOffset = static_cast<uint64_t>(in_.tellg());
+    node.contentSize = len;
+
+    // Seek past content and padding; a truncated file fails on the next read
+    const uint64_t pad = (8 - len % 8) % 8;
+    if (!in_.seekg(static_cast<std::streamoff>(len + pad), std::ios_base::cur)) {
+        throw std::runtime_error("Cannot seek past NAR contents (input not seekable?)");
+    }
+
+    stats_.totalBytes += len;
+}
+
+void NarStream::expectString(const std::string& expected)
 {
     std::string s = readString();
     if (s != expected) {
@@ -94,12 +160,12 @@ void NarProcessor::expectString(const std::string& expected)
     }
 }
 
-void NarProcessor::writeU64(uint64_t n)
+void NarStream::writeU64(uint64_t n)
 {
     out_.write(reinterpret_cast<const char*>(&n), sizeof(n));
 }
 
-void NarProcessor::writeString(const std::string& s)
+void NarStream::writeString(const std::string& s)
 {
     writeU64(s.size());
     out_.write(s.data(), s.size());
@@ -112,33 +178,34 @@ void NarProcessor::writeString(const std::string& s)
     }
 }
 
-void NarProcessor::writeBytes(std::span<const std::byte> data)
-{
-    writeU64(data.size());
-    out_.write(reinterpret_cast<const char*>(data.data()), data.size());
-
-    // Padding to 8-byte boundary
-    size_t pad = (8 - data.size() % 8) % 8;
-    if (pad > 0) {
-        static constexpr char zeros[8] = {0};
-        out_.write(zeros, pad);
-    }
-}
-
 // ============================================================================
 // Generator-based Parsing
 // ============================================================================
 
-std::generator<NarNode> NarProcessor::parse()
+std::generator<NarNode> NarStream::parse()
 {
+    if (inputFormat_ == ArchiveFormat::Tar) {
+        for (auto&& node : parseTar(in_, rules_, stats_)) {
+            co_yield std::move(node);
+        }
+        co_return;
+    }
+
+    if (!resumeDirectories_.empty()) {
+        for (auto&& node : parseResumed()) {
+            co_yield std::move(node);
+        }
+        co_return;
+    }
+
     expectString(NAR_MAGIC);
 
-    for (auto&& node : parseNode("")) {
+    for (auto&& node : parseNode("", rules_ ? rules_->root() : PathRules::Cursor{})) {
         co_yield std::move(node);
     }
 }
 
-std::generator<NarNode> NarProcessor::parseNode(std::string path)
+std::generator<NarNode> NarStream::parseNode(std::string path, PathRules::Cursor cursor)
 {
     expectString("(");
     expectString("type");
@@ -146,13 +213,17 @@ std::generator<NarNode> NarProcessor::parseNode(std::string path)
     std::string nodeType = readString();
 
     if (nodeType == "regular") {
-        co_yield parseRegular(path);
+        NarNode node = parseRegular(path);
+        node.action = cursor.action;
+        co_yield std::move(node);
         expectString(")");
     } else if (nodeType == "symlink") {
-        co_yield parseSymlink(path);
+        NarNode node = parseSymlink(path);
+        node.action = cursor.action;
+        co_yield std::move(node);
         expectString(")");
     } else if (nodeType == "directory") {
-        for (auto&& node : parseDirectory(std::move(path))) {
+        for (auto&& node : parseDirectory(std::move(path), std::move(cursor))) {
             co_yield std::move(node);
         }
     } else {
@@ -160,7 +231,7 @@ std::generator<NarNode> NarProcessor::parseNode(std::string path)
     }
 }
 
-NarNode NarProcessor::parseRegular(const std::string& path)
+NarNode NarStream::parseRegular(const std::string& path)
 {
     NarNode node{
         .type = NarNode::Type::RegularFile,
@@ -173,9 +244,15 @@ NarNode NarProcessor::parseRegular(const std::string& path)
         node.executable = true;
         expectString("");  // Empty executable marker value
         expectString("contents");
-        node.content = readBytes();
-    } else if (marker == "contents") {
-        node.content = readBytes();
+        marker = "contents";
+    }
+
+    if (marker == "contents") {
+        if (skipContents_) {
+            skipBytes(node);
+        } else {
+            readContents(node);
+        }
     } else {
         throw std::runtime_error("Expected 'executable' or 'contents', got '" + marker + "'");
     }
@@ -184,7 +261,7 @@ NarNode NarProcessor::parseRegular(const std::string& path)
     return node;
 }
 
-NarNode NarProcessor::parseSymlink(const std::string& path)
+NarNode NarStream::parseSymlink(const std::string& path)
 {
     expectString("target");
     std::string target = readString();
@@ -197,10 +274,18 @@ NarNode NarProcessor::parseSymlink(const std::string& path)
     };
 }
 
-std::generator<NarNode> NarProcessor::parseDirectory(std::string path)
+std::generator<NarNode> NarStream::parseDirectory(std::string path, PathRules::Cursor cursor)
 {
-    co_yield NarNode{.type = NarNode::Type::DirectoryStart, .path = path};
+    co_yield NarNode{.type = NarNode::Type::DirectoryStart, .path = path, .action = cursor.action};
 
+    for (auto&& node : parseEntries(std::move(path), std::move(cursor))) {
+        co_yield std::move(node);
+    }
+}
+
+// Entries of a directory up to and including its DirectoryEnd
+std::generator<NarNode> NarStream::parseEntries(std::string path, PathRules::Cursor cursor)
+{
     while (true) {
         std::string marker = readString();
 
@@ -219,9 +304,12 @@ std::generator<NarNode> NarProcessor::parseDirectory(std::string path)
 
         std::string childPath = path.empty() ? name : path + "/" + name;
 
+        // Advance the rule automaton by one path segment
+        PathRules::Cursor childCursor = rules_ ? rules_->step(cursor, name) : PathRules::Cursor{};
+
         co_yield NarNode{.type = NarNode::Type::EntryStart, .name = std::move(name), .path = childPath};
 
-        for (auto&& node : parseNode(childPath)) {
+        for (auto&& node : parseNode(childPath, std::move(childCursor))) {
             co_yield std::move(node);
         }
 
@@ -233,85 +321,141 @@ std::generator<NarNode> NarProcessor::parseDirectory(std::string path)
     co_yield NarNode{.type = NarNode::Type::DirectoryEnd, .path = std::move(path)};
 }
 
+// Finish the open directories innermost first, closing the entry each
+// one is in; rule cursors are recomputed from the directory paths
+std::generator<NarNode> NarStream::parseResumed()
+{
+    const std::vector<std::string> directories = std::move(resumeDirectories_);
+    if (directories.front() != "") {
+        throw std::runtime_error("NAR resume point must start at the root directory");
+    }
+
+    for (size_t level = directories.size(); level-- > 0;) {
+        const std::string& path = directories[level];
+
+        PathRules::Cursor cursor = rules_ ? rules_->root() : PathRules::Cursor{};
+        for (size_t start = 0; rules_ && start < path.size();) {
+            const size_t end = std::min(path.find('/', start), path.size());
+            cursor = rules_->step(cursor, std::string_view(path).substr(start, end - start));
+            start = end + 1;
+        }
+
+        for (auto&& node : parseEntries(path, std::move(cursor))) {
+            co_yield std::move(node);
+        }
+
+        if (level > 0) {
+            expectString(")");
+            co_yield NarNode{.type = NarNode::Type::EntryEnd, .path = path};
+        }
+    }
+}
+
 // ============================================================================
 // Node Writer
 // ============================================================================
 
-void NarProcessor::writeNode(const NarNode& node)
+// Little-endian u64 followed by padded string, appended to a buffer
+void appendNarString(std::string& buf, std::string_view s)
+{
+    const uint64_t len = s.size();
+    buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buf.append(s);
+    buf.append((8 - s.size() % 8) % 8, '\0');
+}
+
+NodeFraming encodeFraming(const NarNode& node, uint64_t contentSize)
 {
+    NodeFraming framing;
+    std::string& head = framing.head;
+
     switch (node.type) {
         case NarNode::Type::Invalid:
             throw std::runtime_error("Attempted to write Invalid NarNode (uninitialized node)");
 
         case NarNode::Type::DirectoryStart:
-            writeString("(");
-            writeString("type");
-            writeString("directory");
+            appendNarString(head, "(");
+            appendNarString(head, "type");
+            appendNarString(head, "directory");
             break;
 
         case NarNode::Type::DirectoryEnd:
-            writeString(")");
+            appendNarString(head, ")");
             break;
 
         case NarNode::Type::EntryStart:
-            writeString("entry");
-            writeString("(");
-            writeString("name");
-            writeString(node.name);
-            writeString("node");
+            appendNarString(head, "entry");
+            appendNarString(head, "(");
+            appendNarString(head, "name");
+            appendNarString(head, node.name);
+            appendNarString(head, "node");
             break;
 
         case NarNode::Type::EntryEnd:
-            writeString(")");
+            appendNarString(head, ")");
             break;
 
         case NarNode::Type::RegularFile:
-            writeString("(");
-            writeString("type");
-            writeString("regular");
+            appendNarString(head, "(");
+            appendNarString(head, "type");
+            appendNarString(head, "regular");
             if (node.executable) {
-                writeString("executable");
-                writeString("");
+                appendNarString(head, "executable");
+                appendNarString(head, "");
             }
-            writeString("contents");
-            writeBytes(node.content);
-            writeString(")");
+            appendNarString(head, "contents");
+            head.append(reinterpret_cast<const char*>(&contentSize), sizeof(contentSize));
+            // Content goes between head and tail
+            framing.tail.append((8 - contentSize % 8) % 8, '\0');
+            appendNarString(framing.tail, ")");
             break;
 
         case NarNode::Type::Symlink:
-            writeString("(");
-            writeString("type");
-            writeString("symlink");
-            writeString("target");
-            writeString(node.target);
-            writeString(")");
+            appendNarString(head, "(");
+            appendNarString(head, "type");
+            appendNarString(head, "symlink");
+            appendNarString(head, "target");
+            appendNarString(head, node.target);
+            appendNarString(head, ")");
             break;
     }
+
+    return framing;
 }
 
-// ============================================================================
-// Main Processing Loop (Serial)
-// ============================================================================
+void NarStream::writeHeader()
+{
+    if (outputFormat_ == ArchiveFormat::Nar) {
+        writeString(NAR_MAGIC);
+    }
+}
 
-void NarProcessor::process()
+void NarStream::writeTrailer()
 {
-    writeString(NAR_MAGIC);
-
-    // Simple serial processing loop
-    // TBB parallel_pipeline disabled for now due to ordering issues
-    for (auto&& node : parseGen_) {
-        // Patch content
-        if (node.type == NarNode::Type::RegularFile && contentPatcher_) {
-            node.content = contentPatcher_(node.content, node.executable, node.path);
-        } else if (node.type == NarNode::Type::Symlink && symlinkPatcher_) {
-            node.target = symlinkPatcher_(std::move(node.target));
-        }
+    if (outputFormat_ == ArchiveFormat::Tar) {
+        writeTarTrailer(out_);
+    }
+}
 
-        // Write node
-        writeNode(node);
+void NarStream::writeNode(const NarNode& node)
+{
+    if (outputFormat_ == ArchiveFormat::Tar) {
+        writeTarNode(out_, node);
+        return;
     }
 
-    out_.flush();
+    writeNarNode(out_, node);
+}
+
+void writeNarNode(std::ostream& out, const NarNode& node)
+{
+    const NodeFraming framing = encodeFraming(node, node.content.size());
+
+    out.write(framing.head.data(), framing.head.size());
+    if (node.type == NarNode::Type::RegularFile) {
+        out.write(reinterpret_cast<const char*>(node.content.data()), node.content.size());
+        out.write(framing.tail.data(), framing.tail.size());
+    }
 }
 
 } // namespace nar
@@ -9,13 +9,17 @@
  * Processing architecture:
  * - Generator yields NarNode items as parsed (no tree in memory)
  * - Serial processing loop for patching and writing
+ * - Patchers are supplied as a compile-time Policy so the loop can be
+ *   specialized and inlined; NarProcessor is the type-erased variant
  * - Memory: O(max_file) - one file at a time
  */
 
 #ifndef NAR_H
 #define NAR_H
 
+#include <algorithm>
 #include <cstddef>
+#include <concepts>
 #include <cstdint>
 #include <functional>
 #include <generator>
@@ -23,10 +27,23 @@
 #include <ostream>
 #include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "path_rules.h"
+
 namespace nar {
 
+static constexpr const char* NAR_MAGIC = "nix-archive-1";
+
+// Archive format read or written by NarStream (see tar.h for tar).
+// Export is a `nix-store --export` stream of NARs; its framing is handled
+// around NarStream (see nix_export.h), which then reads plain NARs.
+enum class ArchiveFormat { Nar, Tar, Export };
+
+// "nar", "tar" or "export"; throws std::invalid_argument otherwise
+ArchiveFormat parseArchiveFormat(const std::string& name);
+
 // ============================================================================
 // Patcher function types (shared between NarNode and NarProcessor)
 // ============================================================================
@@ -35,6 +52,60 @@ using ContentPatcher = std::function<std::vector<std::byte>(
     std::span<const std::byte>, bool, const std::string&)>;
 using SymlinkPatcher = std::function<std::string(std::string)>;
 
+// ============================================================================
+// ContentAnchors - Strings found in contents while reading them
+// ============================================================================
+
+// Where one of the reader's anchor strings starts in a file's contents
+struct AnchorMatch {
+    uint64_t offset;
+    uint32_t anchor;  // Index into ContentAnchors::anchors
+};
+
+// Found while a file's contents were copied in (NarStream::setAnchors),
+// so patchers need not search them again. Offsets are into the contents
+// as read, before any patching.
+struct ContentAnchors {
+    const std::vector<std::string>* anchors = nullptr;  // nullptr = not scanned
+    std::vector<AnchorMatch> matches;                   // By offset
+};
+
+// Finds anchors in contents that arrive block by block: each scan()
+// searches only what the new block completed, while it is still in cache
+class AnchorScanner {
+public:
+    // `anchors` (non-empty strings) must outlive the scanner and its result
+    explicit AnchorScanner(const std::vector<std::string>& anchors);
+
+    // contents[0, end) have arrived
+    void scan(std::span<const std::byte> contents, size_t end);
+    ContentAnchors finish();
+
+private:
+    const std::vector<std::string>* anchors_;
+    std::vector<size_t> cursors_;  // Per anchor: first offset not yet tried
+    std::vector<AnchorMatch> matches_;
+};
+
+// Contents are read and scanned in blocks of this size
+static constexpr size_t SCAN_BLOCK_SIZE = 64 << 10;  // 64KB
+
+// Fill contents with read(dest, size, offset) block by block, finding the
+// anchors in each block right after it is read
+template<class Read>
+ContentAnchors readScanned(std::span<std::byte> contents, const std::vector<std::string>& anchors,
+                           Read&& read)
+{
+    AnchorScanner scanner(anchors);
+    for (size_t done = 0; done < contents.size();) {
+        const size_t n = std::min(SCAN_BLOCK_SIZE, contents.size() - done);
+        read(contents.data() + done, n, done);
+        done += n;
+        scanner.scan(contents, done);
+    }
+    return scanner.finish();
+}
+
 // ============================================================================
 // NarNode - Data node yielded by the generator
 // ============================================================================
@@ -53,19 +124,103 @@ struct NarNode {
     std::vector<std::byte> content;      // File content (for RegularFile)
     std::string target;                  // Symlink target (for Symlink)
     bool executable = false;             // For RegularFile
+    const PathAction* action = nullptr;  // Matched path rule (nullptr = default)
+    uint64_t contentOffset = 0;          // Input offset of content (index pass only)
+    uint64_t contentSize = 0;            // Content length (index pass only)
+    ContentAnchors anchors;              // Anchors in content (for RegularFile)
+};
+
+// ============================================================================
+// NodeFraming - Serialized form of a node
+// ============================================================================
+
+// Output bytes of a node are head + content + tail; for everything but
+// regular files the head holds the whole node and tail is empty
+struct NodeFraming {
+    std::string head;
+    std::string tail;
+
+    uint64_t size(uint64_t contentSize) const { return head.size() + contentSize + tail.size(); }
+};
+
+NodeFraming encodeFraming(const NarNode& node, uint64_t contentSize);
+
+// Append a length-prefixed, padded NAR string to a buffer
+void appendNarString(std::string& buf, std::string_view s);
+
+// Write a node in NAR form (what NarStream writes for NAR output)
+void writeNarNode(std::ostream& out, const NarNode& node);
+
+// ============================================================================
+// PatchPolicy - Compile-time patcher interface for BasicNarProcessor
+// ============================================================================
+
+// A policy patches nodes in place; leaving the argument untouched means
+// "unchanged" and costs nothing (no copy, no allocation).
+// The action is the node's path rule (Kind::Default when no rule matched);
+// Kind::Skip nodes never reach the policy.
+template<class P>
+concept PatchPolicy = requires(P& policy, std::vector<std::byte>& content,
+                               bool executable, const std::string& path,
+                               std::string& target, const PathAction& action,
+                               const ContentAnchors& anchors) {
+    { policy.patchContent(content, executable, path, action, anchors) } -> std::same_as<void>;
+    { policy.patchSymlink(target, path, action) } -> std::same_as<void>;
+};
+
+// Policy that forwards to std::function patchers (type-erased, runtime-set)
+struct FunctionPolicy {
+    ContentPatcher contentPatcher;
+    SymlinkPatcher symlinkPatcher;
+
+    void patchContent(std::vector<std::byte>& content, bool executable, const std::string& path,
+                      [[maybe_unused]] const PathAction& action,
+                      [[maybe_unused]] const ContentAnchors& anchors)
+    {
+        if (contentPatcher) {
+            content = contentPatcher(content, executable, path);
+        }
+    }
+
+    void patchSymlink(std::string& target, [[maybe_unused]] const std::string& path,
+                      [[maybe_unused]] const PathAction& action)
+    {
+        if (symlinkPatcher) {
+            target = symlinkPatcher(std::move(target));
+        }
+    }
 };
 
 // ============================================================================
-// NarProcessor - True streaming processor with inline patching
+// NarStream - NAR parser and writer shared by all processor variants
 // ============================================================================
 
-class NarProcessor {
+class NarStream {
 public:
-    NarProcessor(std::istream& in, std::ostream& out);
+    NarStream(std::istream& in, std::ostream& out);
 
-    void setContentPatcher(ContentPatcher patcher) { contentPatcher_ = std::move(patcher); }
-    void setSymlinkPatcher(SymlinkPatcher patcher) { symlinkPatcher_ = std::move(patcher); }
-    void process();
+    // Path rules evaluated incrementally while descending (must outlive parsing)
+    void setPathRules(const PathRules* rules) { rules_ = rules; }
+
+    // Index pass: record content offset/size and seek past contents instead
+    // of reading them (requires a seekable input stream)
+    void setSkipContents(bool skip) { skipContents_ = skip; }
+
+    // Read or write tar instead of NAR (streaming processors only; set
+    // before processing starts)
+    void setInputFormat(ArchiveFormat format) { inputFormat_ = format; }
+    void setOutputFormat(ArchiveFormat format) { outputFormat_ = format; }
+
+    // Resume parsing between two entries (NAR input only, set before
+    // processing starts): the input is positioned right after a complete
+    // entry of directories.back(), which is nested in the directories
+    // before it ("" is the root). The magic is not read again; the rest
+    // of the NAR is yielded from there.
+    void setResumePoint(std::vector<std::string> directories) { resumeDirectories_ = std::move(directories); }
+
+    // Find these strings in file contents while reading them, into
+    // NarNode::anchors (NAR input only; none = contents are read in one go)
+    void setAnchors(std::vector<std::string> anchors) { anchors_ = std::move(anchors); }
 
     struct Stats {
         size_t filesPatched = 0;
@@ -75,35 +230,103 @@ public:
     };
     const Stats& stats() const { return stats_; }
 
-private:
+protected:
     // Generator-based parsing
     std::generator<NarNode> parse();
-    std::generator<NarNode> parseNode(std::string path);
-    std::generator<NarNode> parseDirectory(std::string path);
+    std::generator<NarNode> parseNode(std::string path, PathRules::Cursor cursor);
+    std::generator<NarNode> parseDirectory(std::string path, PathRules::Cursor cursor);
+    std::generator<NarNode> parseEntries(std::string path, PathRules::Cursor cursor);
+    std::generator<NarNode> parseResumed();
     NarNode parseRegular(const std::string& path);
     NarNode parseSymlink(const std::string& path);
 
-    // Streaming write
+    // Streaming write (archive header, nodes, archive trailer)
+    void writeHeader();
     void writeNode(const NarNode& node);
+    void writeTrailer();
 
     // Low-level I/O
     void readExact(void* buf, size_t n);
     uint64_t readU64();
     std::string readString();
-    std::vector<std::byte> readBytes();
+    void readContents(NarNode& node);
+    void skipBytes(NarNode& node);
     void expectString(const std::string& expected);
     void writeU64(uint64_t n);
     void writeString(const std::string& s);
-    void writeBytes(std::span<const std::byte> data);
 
     std::istream& in_;
     std::ostream& out_;
-    ContentPatcher contentPatcher_;
-    SymlinkPatcher symlinkPatcher_;
+    const PathRules* rules_ = nullptr;
+    bool skipContents_ = false;
+    ArchiveFormat inputFormat_ = ArchiveFormat::Nar;
+    ArchiveFormat outputFormat_ = ArchiveFormat::Nar;
+    std::vector<std::string> resumeDirectories_;
+    std::vector<std::string> anchors_;
     Stats stats_;
     std::generator<NarNode> parseGen_;
 };
 
+// ============================================================================
+// BasicNarProcessor - Streaming processor with inline (policy) patching
+// ============================================================================
+
+template<PatchPolicy Policy>
+class BasicNarProcessor : public NarStream {
+public:
+    BasicNarProcessor(std::istream& in, std::ostream& out, Policy policy = Policy{})
+        : NarStream(in, out), policy_(std::move(policy))
+    {
+    }
+
+    Policy& policy() { return policy_; }
+    void process();
+
+private:
+    Policy policy_;
+};
+
+// Main processing loop (serial), instantiated per policy so the patchers
+// are compiled together with the parse/write loop
+template<PatchPolicy Policy>
+void BasicNarProcessor<Policy>::process()
+{
+    writeHeader();
+
+    static const PathAction defaultAction;
+
+    for (auto&& node : parseGen_) {
+        const PathAction& action = node.action ? *node.action : defaultAction;
+
+        // Patch content in place (skipped subtrees are copied verbatim)
+        if (action.kind == PathAction::Kind::Skip) {
+            // Nothing to do
+        } else if (node.type == NarNode::Type::RegularFile) {
+            policy_.patchContent(node.content, node.executable, node.path, action, node.anchors);
+        } else if (node.type == NarNode::Type::Symlink) {
+            policy_.patchSymlink(node.target, node.path, action);
+        }
+
+        // Write node
+        writeNode(node);
+    }
+
+    writeTrailer();
+    out_.flush();
+}
+
+// ============================================================================
+// NarProcessor - Type-erased processor with std::function patchers
+// ============================================================================
+
+class NarProcessor : public BasicNarProcessor<FunctionPolicy> {
+public:
+    using BasicNarProcessor::BasicNarProcessor;
+
+    void setContentPatcher(ContentPatcher patcher) { policy().contentPatcher = std::move(patcher); }
+    void setSymlinkPatcher(SymlinkPatcher patcher) { policy().symlinkPatcher = std::move(patcher); }
+};
+
 } // namespace nar
 
 #endif // NAR_H
@@ -0,0 +1,174 @@
+/*
+ * Batches of NARs patched concurrently on one work-stealing pool
+ */
+
+#include "nar_batch.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+
+namespace nar {
+
+std::vector<BatchItem> readBatchFile(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("cannot open batch file: " + path);
+    }
+
+    std::vector<BatchItem> items;
+    std::string line;
+    size_t lineNo = 0;
+    while (std::getline(file, line)) {
+        ++lineNo;
+        std::istringstream fields(line);
+        BatchItem item;
+        if (!(fields >> item.input) || item.input[0] == '#') {
+            continue;
+        }
+        std::string extra;
+        if (!(fields >> item.output) || fields >> extra) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": expected INPUT OUTPUT");
+        }
+        struct stat st;
+        if (::stat(item.input.c_str(), &st) == 0) {
+            item.size = static_cast<uint64_t>(st.st_size);
+        }
+        items.push_back(std::move(item));
+    }
+    return items;
+}
+
+namespace {
+
+// ============================================================================
+// Pool - Per-worker queues with stealing, and the memory budget
+// ============================================================================
+
+class Pool {
+public:
+    Pool(const std::vector<BatchItem>& items, unsigned workers, uint64_t memoryBudget)
+        : items_(items), queues_(workers), budget_(std::max<uint64_t>(memoryBudget, 1))
+    {
+        std::vector<size_t> bySize(items.size());
+        for (size_t i = 0; i < bySize.size(); ++i) {
+            bySize[i] = i;
+        }
+        std::stable_sort(bySize.begin(), bySize.end(),
+                         [&](size_t a, size_t b) { return items[a].size > items[b].size; });
+        for (size_t i = 0; i < bySize.size(); ++i) {
+            queues_[i % workers].items.push_back(bySize[i]);
+        }
+    }
+
+    // Next item for `worker`, largest of its own first; nullopt when all
+    // queues are empty
+    std::optional<size_t> take(unsigned worker)
+    {
+        {
+            Queue& own = queues_[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.items.empty()) {
+                const size_t item = own.items.front();
+                own.items.pop_front();
+                return item;
+            }
+        }
+
+        // Steal from the fullest queue; retry if it was emptied meanwhile
+        while (true) {
+            Queue* victim = nullptr;
+            size_t most = 0;
+            for (Queue& queue : queues_) {
+                std::lock_guard lock(queue.mutex);
+                if (queue.items.size() > most) {
+                    most = queue.items.size();
+                    victim = &queue;
+                }
+            }
+            if (!victim) {
+                return std::nullopt;
+            }
+            std::lock_guard lock(victim->mutex);
+            if (!victim->items.empty()) {
+                const size_t item = victim->items.back();
+                victim->items.pop_back();
+                return item;
+            }
+        }
+    }
+
+    uint64_t reserve(size_t item)
+    {
+        const uint64_t need = std::min(items_[item].size, budget_);
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [&] { return used_ == 0 || used_ + need <= budget_; });
+        used_ += need;
+        return need;
+    }
+
+    void release(uint64_t bytes)
+    {
+        {
+            std::lock_guard lock(mutex_);
+            used_ -= bytes;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> items;  // Largest first
+    };
+
+    const std::vector<BatchItem>& items_;
+    std::vector<Queue> queues_;
+
+    const uint64_t budget_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t used_ = 0;
+};
+
+} // anonymous namespace
+
+std::vector<std::exception_ptr> runBatch(const std::vector<BatchItem>& items, unsigned workers,
+                                         uint64_t memoryBudget,
+                                         const std::function<void(const BatchItem&)>& process)
+{
+    std::vector<std::exception_ptr> errors(items.size());
+    workers = static_cast<unsigned>(std::clamp<size_t>(items.size(), 1, std::max(1u, workers)));
+    Pool pool(items, workers, memoryBudget);
+
+    auto work = [&](unsigned worker) {
+        while (const std::optional<size_t> item = pool.take(worker)) {
+            const uint64_t reserved = pool.reserve(*item);
+            try {
+                process(items[*item]);
+            } catch (...) {
+                errors[*item] = std::current_exception();
+            }
+            pool.release(reserved);
+        }
+    };
+
+    {
+        std::vector<std::jthread> threads;
+        for (unsigned i = 1; i < workers; ++i) {
+            threads.emplace_back(work, i);
+        }
+        work(0);
+    }
+    return errors;
+}
+
+} // namespace nar
@@ -0,0 +1,50 @@
+/*
+ * Batches of NARs patched concurrently on one work-stealing pool
+ *
+ * A closure is hundreds of NARs of very different sizes. Patching them one
+ * after another leaves cores idle on tiny or symlink-only NARs, and a
+ * process per NAR reloads the mappings and recompiles the highlighters
+ * each time. runBatch() instead spreads the NARs over a fixed pool:
+ *
+ * - Scheduling: NARs are sorted by size, largest first, and dealt round
+ *   robin into one queue per worker. A worker takes the largest NAR left
+ *   in its own queue; when that is empty it steals the smallest NAR from
+ *   the fullest other queue, so the big ones are started early and the
+ *   tail is evened out with small ones
+ * - Memory: a NAR holds min(size, budget) of a shared budget while it is
+ *   patched (its size bounds what streaming it keeps in memory). A worker
+ *   waits until its NAR fits; a NAR always fits when nothing else runs
+ * - Failures: a NAR that fails does not stop the others; its error is
+ *   returned in its slot
+ */
+
+#ifndef NAR_BATCH_H
+#define NAR_BATCH_H
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace nar {
+
+struct BatchItem {
+    std::string input;
+    std::string output;
+    uint64_t size = 0;  // Input size, for scheduling
+};
+
+// "INPUT OUTPUT" per line; blank lines and lines starting with '#' are
+// ignored. Sizes are taken from the input files.
+std::vector<BatchItem> readBatchFile(const std::string& path);
+
+// Calls process(item) for every item on `workers` threads (see above).
+// Returns one entry per item: null on success, else what it threw.
+std::vector<std::exception_ptr> runBatch(const std::vector<BatchItem>& items, unsigned workers,
+                                         uint64_t memoryBudget,
+                                         const std::function<void(const BatchItem&)>& process);
+
+} // namespace nar
+
+#endif // NAR_BATCH_H
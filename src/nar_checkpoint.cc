@@ -0,0 +1,142 @@
+/*
+ * Checkpoints for resuming an interrupted patch of a NAR file
+ */
+
+#include "nar_checkpoint.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace nar {
+
+namespace {
+
+constexpr std::string_view CHECKPOINT_MAGIC = "patchnar-checkpoint-1";
+
+// Paths in a checkpoint are NAR paths; anything longer is corruption
+constexpr uint64_t MAX_STRING = 1 << 20;
+
+void appendU64(std::string& buf, uint64_t n)
+{
+    buf.append(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+class CheckpointReader {
+public:
+    explicit CheckpointReader(std::istream& in) : in_(in) {}
+
+    uint64_t readU64()
+    {
+        uint64_t n;
+        readExact(&n, sizeof(n));
+        return n;
+    }
+
+    std::string readString()
+    {
+        const uint64_t len = readU64();
+        if (len > MAX_STRING) {
+            throw std::runtime_error("checkpoint: string too long");
+        }
+        std::string s(len, '\0');
+        readExact(s.data(), len);
+        char padding[8];
+        readExact(padding, (8 - len % 8) % 8);
+        return s;
+    }
+
+private:
+    void readExact(void* buf, size_t n)
+    {
+        in_.read(static_cast<char*>(buf), static_cast<std::streamsize>(n));
+        if (static_cast<size_t>(in_.gcount()) != n) {
+            throw std::runtime_error("checkpoint: unexpected end of file");
+        }
+    }
+
+    std::istream& in_;
+};
+
+void writeAll(int fd, const std::string& data, const std::string& file)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error("cannot write checkpoint " + file + ": " + strerror(errno));
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+} // anonymous namespace
+
+void saveCheckpoint(const std::string& file, const Checkpoint& checkpoint)
+{
+    std::string data;
+    appendNarString(data, CHECKPOINT_MAGIC);
+    appendU64(data, checkpoint.inputOffset);
+    appendU64(data, checkpoint.outputOffset);
+    appendU64(data, checkpoint.narSize);
+    appendU64(data, checkpoint.directories.size());
+    for (const auto& directory : checkpoint.directories) {
+        appendNarString(data, directory);
+    }
+    appendNarString(data, checkpoint.hashState);
+
+    const std::string temp = file + ".tmp";
+    const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("cannot create checkpoint " + temp + ": " + strerror(errno));
+    }
+    try {
+        writeAll(fd, data, temp);
+        if (::fsync(fd) != 0) {
+            throw std::runtime_error("cannot sync checkpoint " + temp + ": " + strerror(errno));
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+
+    if (::rename(temp.c_str(), file.c_str()) != 0) {
+        throw std::runtime_error("cannot rename checkpoint to " + file + ": " + strerror(errno));
+    }
+}
+
+Checkpoint loadCheckpoint(const std::string& file)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open checkpoint " + file);
+    }
+    CheckpointReader reader(in);
+
+    if (reader.readString() != CHECKPOINT_MAGIC) {
+        throw std::runtime_error("not a patchnar checkpoint: " + file);
+    }
+
+    Checkpoint checkpoint;
+    checkpoint.inputOffset = reader.readU64();
+    checkpoint.outputOffset = reader.readU64();
+    checkpoint.narSize = reader.readU64();
+    const uint64_t depth = reader.readU64();
+    if (depth == 0 || depth > MAX_STRING) {
+        throw std::runtime_error("checkpoint: bad directory depth");
+    }
+    for (uint64_t i = 0; i < depth; ++i) {
+        checkpoint.directories.push_back(reader.readString());
+    }
+    checkpoint.hashState = reader.readString();
+    return checkpoint;
+}
+
+} // namespace nar
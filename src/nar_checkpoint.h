@@ -0,0 +1,129 @@
+/*
+ * Checkpoints for resuming an interrupted patch of a NAR file
+ *
+ * Between two entries of a directory the parser's whole state is the
+ * input offset and the stack of open directories, and the patched NAR
+ * written so far is final. A checkpoint records that, plus the output
+ * offset and the running SHA-256 of the output, so a restarted run seeks
+ * both files, truncates the output and parses on from the same entry.
+ *
+ *   "patchnar-checkpoint-1"
+ *   u64 input offset, u64 output offset, u64 NAR bytes written
+ *   u64 number of open directories, then their paths (outermost first)
+ *   SHA-256 state of the NAR bytes written
+ *
+ * Integers are u64 little-endian and strings are NAR strings. Checkpoints
+ * are replaced atomically (written to FILE.tmp, synced, renamed), after
+ * the output they describe has been synced.
+ */
+
+#ifndef NAR_CHECKPOINT_H
+#define NAR_CHECKPOINT_H
+
+#include "nar.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// Checkpoint
+// ============================================================================
+
+struct Checkpoint {
+    uint64_t inputOffset = 0;
+    uint64_t outputOffset = 0;  // Absolute, in the output file
+    uint64_t narSize = 0;       // NAR bytes written (and hashed) so far
+    std::vector<std::string> directories;
+    std::string hashState;      // Sha256::saveState() of those bytes
+};
+
+// Replace `file` by the checkpoint atomically
+void saveCheckpoint(const std::string& file, const Checkpoint& checkpoint);
+
+// Throws std::runtime_error if `file` is not a checkpoint
+Checkpoint loadCheckpoint(const std::string& file);
+
+// ============================================================================
+// BasicNarCheckpointProcessor - Serial processor that can stop and resume
+// ============================================================================
+
+// After every entry that ends at least `interval` input bytes past the
+// last checkpoint, the output is flushed and `save` is called with the
+// parser state. The input must be seekable (tellg).
+template<PatchPolicy Policy>
+class BasicNarCheckpointProcessor : public NarStream {
+public:
+    using SaveFunction = std::function<void(uint64_t inputOffset, const std::vector<std::string>& directories)>;
+
+    BasicNarCheckpointProcessor(std::istream& in, std::ostream& out, uint64_t interval,
+                                SaveFunction save, Policy policy = Policy{})
+        : NarStream(in, out), interval_(interval), save_(std::move(save)), policy_(std::move(policy))
+    {
+    }
+
+    // Continue from a checkpoint: `in` and `out` are positioned at its
+    // offsets and the NAR header has been written already
+    void resume(std::vector<std::string> directories)
+    {
+        directories_ = directories;
+        setResumePoint(std::move(directories));
+    }
+
+    void process();
+
+private:
+    uint64_t interval_;
+    SaveFunction save_;
+    Policy policy_;
+    std::vector<std::string> directories_;  // Open directories
+};
+
+template<PatchPolicy Policy>
+void BasicNarCheckpointProcessor<Policy>::process()
+{
+    if (directories_.empty()) {
+        writeHeader();
+    }
+
+    static const PathAction defaultAction;
+    uint64_t lastSaved = static_cast<uint64_t>(in_.tellg());
+
+    for (auto&& node : parseGen_) {
+        const PathAction& action = node.action ? *node.action : defaultAction;
+
+        if (action.kind == PathAction::Kind::Skip) {
+            // Nothing to do
+        } else if (node.type == NarNode::Type::RegularFile) {
+            policy_.patchContent(node.content, node.executable, node.path, action, node.anchors);
+        } else if (node.type == NarNode::Type::Symlink) {
+            policy_.patchSymlink(node.target, node.path, action);
+        }
+
+        writeNode(node);
+
+        if (node.type == NarNode::Type::DirectoryStart) {
+            directories_.push_back(node.path);
+        } else if (node.type == NarNode::Type::DirectoryEnd) {
+            directories_.pop_back();
+        } else if (node.type == NarNode::Type::EntryEnd) {
+            // The parser is between two entries of directories_.back()
+            const uint64_t offset = static_cast<uint64_t>(in_.tellg());
+            if (offset - lastSaved >= interval_) {
+                out_.flush();
+                save_(offset, directories_);
+                lastSaved = offset;
+            }
+        }
+    }
+
+    out_.flush();
+}
+
+} // namespace nar
+
+#endif // NAR_CHECKPOINT_H
@@ -0,0 +1,397 @@
+/*
+ * Binary deltas between an unpatched NAR and its patched form
+ */
+
+#include "nar_delta.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace nar {
+
+namespace {
+
+constexpr std::string_view DELTA_MAGIC = "patchnar-delta-1";
+
+// Block matching: old contents are indexed every BLOCK_STEP bytes by the
+// BLOCK bytes starting there. Copies shorter than MIN_COPY would cost
+// more to encode than the bytes themselves.
+constexpr size_t BLOCK = 32;
+constexpr size_t BLOCK_STEP = 16;
+constexpr size_t MIN_COPY = 32;
+
+uint64_t blockKey(const std::byte* p)
+{
+    uint64_t words[BLOCK / 8];
+    std::memcpy(words, p, BLOCK);
+    uint64_t h = 0;
+    for (uint64_t w : words) {
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+size_t matchLength(std::span<const std::byte> from, size_t offset,
+                   std::span<const std::byte> to, size_t pos)
+{
+    const size_t limit = std::min(from.size() - offset, to.size() - pos);
+    size_t n = 0;
+    while (n < limit && from[offset + n] == to[pos + n]) {
+        n++;
+    }
+    return n;
+}
+
+// One edit of a file: a range of the old contents, or of the new ones
+// to be carried literally
+struct DeltaOp {
+    bool copy;
+    uint64_t offset;
+    uint64_t length;
+};
+
+std::vector<DeltaOp> diffContents(std::span<const std::byte> from, std::span<const std::byte> to)
+{
+    std::vector<DeltaOp> ops;
+    std::unordered_map<uint64_t, uint64_t> index;  // Built on the first miss
+    bool indexed = false;
+
+    auto addCopy = [&](uint64_t offset, uint64_t length) {
+        if (!ops.empty() && ops.back().copy && ops.back().offset + ops.back().length == offset) {
+            ops.back().length += length;
+        } else {
+            ops.push_back({true, offset, length});
+        }
+    };
+
+    size_t pos = 0;
+    size_t literal = 0;  // Start of the pending literal run
+    size_t expect = 0;   // Old offset that lines up with pos if bytes were only replaced
+
+    while (pos < to.size()) {
+        size_t offset = 0;
+        size_t length = 0;
+
+        if (expect < from.size()) {
+            length = matchLength(from, expect, to, pos);
+            offset = expect;
+        }
+
+        if (length < MIN_COPY && pos + BLOCK <= to.size() && from.size() >= BLOCK) {
+            if (!indexed) {
+                index.reserve(from.size() / BLOCK_STEP + 1);
+                for (size_t o = 0; o + BLOCK <= from.size(); o += BLOCK_STEP) {
+                    index.try_emplace(blockKey(from.data() + o), o);
+                }
+                indexed = true;
+            }
+            if (auto it = index.find(blockKey(to.data() + pos)); it != index.end()) {
+                length = matchLength(from, it->second, to, pos);
+                offset = it->second;
+            }
+        }
+
+        if (length < MIN_COPY) {
+            pos++;
+            expect++;
+            continue;
+        }
+
+        // Matches found through the index start up to BLOCK_STEP bytes late
+        while (pos > literal && offset > 0 && from[offset - 1] == to[pos - 1]) {
+            pos--;
+            offset--;
+            length++;
+        }
+        if (pos > literal) {
+            ops.push_back({false, literal, pos - literal});
+        }
+        addCopy(offset, length);
+        pos += length;
+        expect = offset + length;
+        literal = pos;
+    }
+
+    if (literal < to.size()) {
+        ops.push_back({false, literal, to.size() - literal});
+    }
+    return ops;
+}
+
+// ============================================================================
+// Delta reading
+// ============================================================================
+
+class DeltaReader {
+public:
+    explicit DeltaReader(std::istream& in) : in_(in) {}
+
+    uint64_t readU64()
+    {
+        uint64_t val;
+        readExact(&val, sizeof(val));
+        return val;
+    }
+
+    // Reads a string of at most maxSize bytes into `out` (appended)
+    template<class Buffer>
+    void readString(Buffer& out, uint64_t maxSize)
+    {
+        const uint64_t len = readU64();
+        if (len > maxSize) {
+            throw std::runtime_error("delta: string too long");
+        }
+        const size_t start = out.size();
+        out.resize(start + len);
+        readExact(out.data() + start, len);
+
+        char padding[8];
+        readExact(padding, (8 - len % 8) % 8);
+    }
+
+    std::string readTag()
+    {
+        std::string tag;
+        readString(tag, 16);
+        return tag;
+    }
+
+private:
+    void readExact(void* buf, size_t n)
+    {
+        in_.read(static_cast<char*>(buf), static_cast<std::streamsize>(n));
+        if (static_cast<size_t>(in_.gcount()) != n) {
+            throw std::runtime_error("Unexpected EOF reading delta");
+        }
+    }
+
+    std::istream& in_;
+};
+
+// ============================================================================
+// DeltaApplier - Streams the base NAR, replacing edited nodes
+// ============================================================================
+
+class DeltaApplier : public NarStream {
+public:
+    DeltaApplier(std::istream& base, std::istream& delta, std::ostream& out)
+        : NarStream(base, out), delta_(delta)
+    {
+    }
+
+    // Returns the size and hash recorded in the delta
+    std::pair<uint64_t, Sha256::Digest> process();
+
+private:
+    void nextRecord();
+    void applyFile(NarNode& node);
+
+    DeltaReader delta_;
+    std::string tag_;      // Tag of the next record
+    uint64_t index_ = 0;   // Node index of the next record ("file"/"link")
+    std::vector<std::byte> patched_;
+};
+
+void DeltaApplier::nextRecord()
+{
+    tag_ = delta_.readTag();
+    if (tag_ == "file" || tag_ == "link") {
+        const uint64_t index = delta_.readU64();
+        if (index < index_) {
+            throw std::runtime_error("delta: records out of order");
+        }
+        index_ = index;
+    } else if (tag_ != "done") {
+        throw std::runtime_error("delta: unknown record '" + tag_ + "'");
+    }
+}
+
+void DeltaApplier::applyFile(NarNode& node)
+{
+    const uint64_t size = delta_.readU64();
+    patched_.clear();
+    patched_.reserve(size);
+
+    for (std::string op = delta_.readTag(); op != "end"; op = delta_.readTag()) {
+        if (op == "copy") {
+            const uint64_t offset = delta_.readU64();
+            const uint64_t length = delta_.readU64();
+            if (offset > node.content.size() || length > node.content.size() - offset ||
+                length > size - patched_.size()) {
+                throw std::runtime_error("delta: copy out of range in " + node.path);
+            }
+            patched_.insert(patched_.end(), node.content.begin() + offset,
+                            node.content.begin() + offset + length);
+        } else if (op == "data") {
+            delta_.readString(patched_, size - patched_.size());
+        } else {
+            throw std::runtime_error("delta: unknown operation '" + op + "'");
+        }
+    }
+
+    if (patched_.size() != size) {
+        throw std::runtime_error("delta: size mismatch in " + node.path);
+    }
+    node.content.swap(patched_);
+}
+
+std::pair<uint64_t, Sha256::Digest> DeltaApplier::process()
+{
+    std::string magic;
+    delta_.readString(magic, DELTA_MAGIC.size());
+    if (magic != DELTA_MAGIC) {
+        throw std::runtime_error("not a patchnar delta");
+    }
+
+    writeHeader();
+    nextRecord();
+
+    uint64_t index = 0;
+    for (auto&& node : parseGen_) {
+        if (tag_ != "done" && index_ == index) {
+            if (tag_ == "file" && node.type == NarNode::Type::RegularFile) {
+                applyFile(node);
+            } else if (tag_ == "link" && node.type == NarNode::Type::Symlink) {
+                node.target.clear();
+                delta_.readString(node.target, 4096);
+            } else {
+                throw std::runtime_error("delta: node " + std::to_string(index) +
+                                         " is not a " + (tag_ == "file" ? "file" : "symlink"));
+            }
+            nextRecord();
+        }
+
+        writeNode(node);
+        index++;
+    }
+    writeTrailer();
+    out_.flush();
+
+    if (tag_ != "done") {
+        throw std::runtime_error("delta: edits past the end of the base NAR");
+    }
+    const uint64_t size = delta_.readU64();
+    std::string hash;
+    delta_.readString(hash, 32);
+    Sha256::Digest digest{};
+    if (hash.size() != digest.size()) {
+        throw std::runtime_error("delta: bad hash");
+    }
+    std::memcpy(digest.data(), hash.data(), digest.size());
+    return {size, digest};
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// HashingOutputBuf
+// ============================================================================
+
+HashingOutputBuf::int_type HashingOutputBuf::overflow(int_type ch)
+{
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
+    }
+    const char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+std::streamsize HashingOutputBuf::xsputn(const char* s, std::streamsize n)
+{
+    if (downstream_ && downstream_->sputn(s, n) != n) {
+        return 0;
+    }
+    hash_.update(std::string_view(s, static_cast<size_t>(n)));
+    size_ += static_cast<uint64_t>(n);
+    return n;
+}
+
+int HashingOutputBuf::sync()
+{
+    return downstream_ ? downstream_->pubsync() : 0;
+}
+
+// ============================================================================
+// DeltaWriter
+// ============================================================================
+
+DeltaWriter::DeltaWriter(std::ostream& out)
+    : out_(out)
+{
+    writeString(DELTA_MAGIC);
+}
+
+void DeltaWriter::writeU64(uint64_t n)
+{
+    out_.write(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+void DeltaWriter::writeString(std::string_view s)
+{
+    writeU64(s.size());
+    out_.write(s.data(), static_cast<std::streamsize>(s.size()));
+    static constexpr char zeros[8] = {0};
+    out_.write(zeros, static_cast<std::streamsize>((8 - s.size() % 8) % 8));
+}
+
+void DeltaWriter::addFile(uint64_t index, std::span<const std::byte> from, std::span<const std::byte> to)
+{
+    writeString("file");
+    writeU64(index);
+    writeU64(to.size());
+
+    for (const DeltaOp& op : diffContents(from, to)) {
+        if (op.copy) {
+            writeString("copy");
+            writeU64(op.offset);
+            writeU64(op.length);
+            stats_.copiedBytes += op.length;
+        } else {
+            writeString("data");
+            writeString({reinterpret_cast<const char*>(to.data()) + op.offset, op.length});
+            stats_.literalBytes += op.length;
+        }
+    }
+
+    writeString("end");
+    stats_.files++;
+}
+
+void DeltaWriter::addSymlink(uint64_t index, const std::string& target)
+{
+    writeString("link");
+    writeU64(index);
+    writeString(target);
+    stats_.symlinks++;
+}
+
+void DeltaWriter::finish(uint64_t narSize, const Sha256::Digest& narHash)
+{
+    writeString("done");
+    writeU64(narSize);
+    writeString({reinterpret_cast<const char*>(narHash.data()), narHash.size()});
+    out_.flush();
+}
+
+// ============================================================================
+// applyDelta
+// ============================================================================
+
+void applyDelta(std::istream& base, std::istream& delta, std::ostream& out)
+{
+    HashingOutputBuf hashing(out.rdbuf());
+    std::ostream hashed(&hashing);
+    hashed.exceptions(std::ios_base::badbit);
+
+    DeltaApplier applier(base, delta, hashed);
+    const auto [size, hash] = applier.process();
+
+    if (hashing.size() != size || hashing.finish() != hash) {
+        throw std::runtime_error("delta: result does not match (wrong base NAR?)");
+    }
+}
+
+} // namespace nar
@@ -0,0 +1,170 @@
+/*
+ * Binary deltas between an unpatched NAR and its patched form
+ *
+ * Devices usually have the unpatched NAR from the public binary cache
+ * already; a delta carries only what patching changed. Patching never
+ * adds, removes or reorders nodes, so edits are keyed by node index (the
+ * position of the node in the NarNode stream both sides parse). A changed
+ * file is rebuilt from COPY ranges of its old contents and literal DATA;
+ * a changed symlink just carries its new target.
+ *
+ *   "patchnar-delta-1"
+ *   repeat:  "file" u64 index, u64 new size, op..., "end"
+ *            "link" u64 index, target
+ *     op:    "copy" u64 offset, u64 length  |  "data" bytes
+ *   "done"   u64 size and SHA-256 (32 bytes) of the patched NAR
+ *
+ * Integers are u64 little-endian and strings are NAR strings (length,
+ * padded to 8 bytes). Applying streams the base NAR through the parser,
+ * so memory is O(max_file) as when patching; the result is checked
+ * against the recorded size and hash once it has been written.
+ */
+
+#ifndef NAR_DELTA_H
+#define NAR_DELTA_H
+
+#include "nar.h"
+#include "sha256.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// HashingOutputBuf - SHA-256 and size of everything written
+// ============================================================================
+
+// Bytes are passed on to `downstream` when it is set
+class HashingOutputBuf : public std::streambuf {
+public:
+    explicit HashingOutputBuf(std::streambuf* downstream = nullptr) : downstream_(downstream) {}
+
+    // Continue after `size` bytes that were hashed into `hash`
+    HashingOutputBuf(std::streambuf* downstream, Sha256 hash, uint64_t size)
+        : downstream_(downstream), hash_(std::move(hash)), size_(size)
+    {
+    }
+
+    uint64_t size() const { return size_; }
+    const Sha256& hash() const { return hash_; }
+    Sha256::Digest finish() { return hash_.finish(); }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    std::streambuf* downstream_;
+    Sha256 hash_;
+    uint64_t size_ = 0;
+};
+
+// ============================================================================
+// DeltaWriter - Encodes node edits
+// ============================================================================
+
+class DeltaWriter {
+public:
+    // Writes the delta magic
+    explicit DeltaWriter(std::ostream& out);
+
+    // Record node `index` changing from `from` to `to` (must differ)
+    void addFile(uint64_t index, std::span<const std::byte> from, std::span<const std::byte> to);
+    void addSymlink(uint64_t index, const std::string& target);
+
+    // Record the patched NAR's size and hash; nothing may be added after
+    void finish(uint64_t narSize, const Sha256::Digest& narHash);
+
+    struct Stats {
+        size_t files = 0;
+        size_t symlinks = 0;
+        uint64_t copiedBytes = 0;   // Reused from the base NAR
+        uint64_t literalBytes = 0;  // Carried in the delta
+    };
+    const Stats& stats() const { return stats_; }
+
+private:
+    void writeU64(uint64_t n);
+    void writeString(std::string_view s);
+
+    std::ostream& out_;
+    Stats stats_;
+};
+
+// ============================================================================
+// BasicNarDeltaProcessor - Patch a NAR, emitting a delta instead of the NAR
+// ============================================================================
+
+// The patched NAR is still serialized into `nar` (typically a stream over
+// a HashingOutputBuf) so its size and hash can be recorded
+template<PatchPolicy Policy>
+class BasicNarDeltaProcessor : public NarStream {
+public:
+    BasicNarDeltaProcessor(std::istream& in, std::ostream& nar, DeltaWriter& delta,
+                           Policy policy = Policy{})
+        : NarStream(in, nar), delta_(delta), policy_(std::move(policy))
+    {
+    }
+
+    void process();
+
+private:
+    DeltaWriter& delta_;
+    Policy policy_;
+};
+
+template<PatchPolicy Policy>
+void BasicNarDeltaProcessor<Policy>::process()
+{
+    writeHeader();
+
+    static const PathAction defaultAction;
+    std::vector<std::byte> original;
+    uint64_t index = 0;
+
+    for (auto&& node : parseGen_) {
+        const PathAction& action = node.action ? *node.action : defaultAction;
+
+        if (action.kind == PathAction::Kind::Skip) {
+            // Unchanged
+        } else if (node.type == NarNode::Type::RegularFile) {
+            original.assign(node.content.begin(), node.content.end());
+            policy_.patchContent(node.content, node.executable, node.path, action, node.anchors);
+            if (node.content != original) {
+                delta_.addFile(index, original, node.content);
+            }
+        } else if (node.type == NarNode::Type::Symlink) {
+            const std::string target = node.target;
+            policy_.patchSymlink(node.target, node.path, action);
+            if (node.target != target) {
+                delta_.addSymlink(index, node.target);
+            }
+        }
+
+        writeNode(node);
+        index++;
+    }
+
+    writeTrailer();
+    out_.flush();
+}
+
+// ============================================================================
+// applyDelta - Rebuild the patched NAR from the base NAR and a delta
+// ============================================================================
+
+// Throws std::runtime_error on a malformed delta, a delta that does not
+// fit the base NAR, or a result whose size or hash differs from the one
+// recorded (by then the result has been written to `out`)
+void applyDelta(std::istream& base, std::istream& delta, std::ostream& out);
+
+} // namespace nar
+
+#endif // NAR_DELTA_H
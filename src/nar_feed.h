@@ -0,0 +1,409 @@
+/*
+ * Push-driven NAR processing for many concurrent streams
+ *
+ * NarStream pulls its input from a std::istream, so a stream that has no
+ * data yet blocks the thread parsing it. BasicNarFeedProcessor turns that
+ * around: the parser is a chain of coroutines that suspends whenever the
+ * input fed so far runs dry, and feed() resumes it with the next piece.
+ * Nothing blocks, so one thread can interleave any number of sessions;
+ * its state between feeds is the suspended coroutine frames (one per open
+ * directory level) and the contents of the file being read.
+ *
+ * Nodes are patched and written as soon as they are complete, exactly as
+ * BasicNarProcessor does. Contents are copied straight from the fed
+ * pieces into the node buffer and scanned for anchors piece by piece.
+ */
+
+#ifndef NAR_FEED_H
+#define NAR_FEED_H
+
+#include "nar.h"
+
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace nar {
+
+// ============================================================================
+// FeedTask - Lazily started coroutine that can be awaited
+// ============================================================================
+
+// Awaiting a FeedTask starts it and resumes the awaiter once it finishes
+// (symmetric transfer, so deep nesting does not grow the stack)
+template<class T = void>
+class FeedTask {
+public:
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            template<class Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+            {
+                auto continuation = h.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    struct VoidPromise : PromiseBase {
+        FeedTask get_return_object() { return FeedTask(Handle::from_promise(static_cast<promise_type&>(*this))); }
+        void return_void() {}
+    };
+
+    struct ValuePromise : PromiseBase {
+        std::optional<T> value;
+
+        FeedTask get_return_object() { return FeedTask(Handle::from_promise(static_cast<promise_type&>(*this))); }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    struct promise_type : std::conditional_t<std::is_void_v<T>, VoidPromise, ValuePromise> {};
+    using Handle = std::coroutine_handle<promise_type>;
+
+    FeedTask(FeedTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    FeedTask& operator=(FeedTask&& other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    ~FeedTask()
+    {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool done() const { return handle_.done(); }
+    Handle handle() const { return handle_; }
+
+    // Rethrow what the finished coroutine threw, if anything
+    void check() const
+    {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+
+    T await_resume()
+    {
+        check();
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*handle_.promise().value);
+        }
+    }
+
+private:
+    explicit FeedTask(Handle handle) : handle_(handle) {}
+
+    Handle handle_;
+};
+
+// ============================================================================
+// BasicNarFeedProcessor - Non-blocking processor with inline patching
+// ============================================================================
+
+template<PatchPolicy Policy>
+class BasicNarFeedProcessor {
+public:
+    BasicNarFeedProcessor(std::ostream& out, Policy policy = Policy{})
+        : out_(out), policy_(std::move(policy)), task_(parse())
+    {
+        waiting_ = task_.handle();
+    }
+
+    BasicNarFeedProcessor(const BasicNarFeedProcessor&) = delete;
+    BasicNarFeedProcessor& operator=(const BasicNarFeedProcessor&) = delete;
+
+    // Set before the first feed()
+    void setPathRules(const PathRules* rules) { rules_ = rules; }
+    void setAnchors(std::vector<std::string> anchors) { anchors_ = std::move(anchors); }
+
+    // Parse, patch and write as much as `data` completes. Returns the
+    // bytes consumed: all of them, unless the NAR ended inside `data`.
+    // Throws on malformed input; the processor is unusable afterwards.
+    size_t feed(std::span<const std::byte> data);
+
+    // End of input: throws unless the NAR is complete
+    void finish();
+
+    // The whole NAR has been read and written
+    bool done() const { return task_.done(); }
+
+private:
+    // Awaitable filling dest from the fed input; suspends while it runs dry
+    struct Read {
+        BasicNarFeedProcessor& processor;
+        std::span<std::byte> dest;
+        AnchorScanner* scanner = nullptr;
+
+        bool await_ready() { return processor.take(*this); }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            processor.waiting_ = h;
+            processor.pending_ = this;
+        }
+        void await_resume() {}
+
+        size_t filled = 0;
+    };
+
+    // Copy what is available into the pending read; true once it is full
+    bool take(Read& read);
+
+    Read read(std::span<std::byte> dest, AnchorScanner* scanner = nullptr) { return Read{*this, dest, scanner}; }
+
+    FeedTask<uint64_t> readU64();
+    FeedTask<std::string> readString();
+    FeedTask<> expectString(std::string_view expected);
+    FeedTask<> readContents(NarNode& node);
+
+    FeedTask<> parse();
+    FeedTask<> parseNode(std::string path, PathRules::Cursor cursor);
+    FeedTask<> parseEntries(std::string path, PathRules::Cursor cursor);
+
+    void handle(NarNode& node);
+
+    std::ostream& out_;
+    Policy policy_;
+    const PathRules* rules_ = nullptr;
+    std::vector<std::string> anchors_;
+
+    std::span<const std::byte> input_;     // Rest of the piece being fed
+    std::coroutine_handle<> waiting_;      // Coroutine to resume on input
+    Read* pending_ = nullptr;              // Its unfinished read, if any
+    FeedTask<> task_;
+};
+
+template<PatchPolicy Policy>
+bool BasicNarFeedProcessor<Policy>::take(Read& read)
+{
+    const size_t n = std::min(read.dest.size() - read.filled, input_.size());
+    if (n > 0) {
+        std::memcpy(read.dest.data() + read.filled, input_.data(), n);
+        input_ = input_.subspan(n);
+        read.filled += n;
+        if (read.scanner) {
+            read.scanner->scan(read.dest, read.filled);
+        }
+    }
+    return read.filled == read.dest.size();
+}
+
+template<PatchPolicy Policy>
+size_t BasicNarFeedProcessor<Policy>::feed(std::span<const std::byte> data)
+{
+    input_ = data;
+    while (waiting_ && !task_.done()) {
+        if (pending_) {
+            if (!take(*pending_)) {
+                break;  // All consumed, still short
+            }
+            pending_ = nullptr;
+        }
+        std::exchange(waiting_, {}).resume();
+    }
+    if (task_.done()) {
+        task_.check();
+    }
+    const size_t consumed = data.size() - input_.size();
+    input_ = {};
+    return consumed;
+}
+
+template<PatchPolicy Policy>
+void BasicNarFeedProcessor<Policy>::finish()
+{
+    if (!task_.done()) {
+        throw std::runtime_error("Unexpected EOF reading NAR");
+    }
+    task_.check();
+    out_.flush();
+}
+
+// ============================================================================
+// Primitive reads
+// ============================================================================
+
+template<PatchPolicy Policy>
+FeedTask<uint64_t> BasicNarFeedProcessor<Policy>::readU64()
+{
+    uint64_t val;
+    co_await read(std::as_writable_bytes(std::span(&val, 1)));
+    co_return val;  // NAR uses little-endian (native on x86/ARM)
+}
+
+template<PatchPolicy Policy>
+FeedTask<std::string> BasicNarFeedProcessor<Policy>::readString()
+{
+    const uint64_t len = co_await readU64();
+    // Strings are names, targets and markers; contents go to readContents
+    if (len > (1u << 24)) {
+        throw std::runtime_error("NAR parse error: string too long");
+    }
+    std::string s(len, '\0');
+    co_await read(std::as_writable_bytes(std::span(s)));
+
+    std::byte padding[8];
+    co_await read(std::span(padding, (8 - len % 8) % 8));
+    co_return s;
+}
+
+template<PatchPolicy Policy>
+FeedTask<> BasicNarFeedProcessor<Policy>::expectString(std::string_view expected)
+{
+    const std::string s = co_await readString();
+    if (s != expected) {
+        throw std::runtime_error("NAR parse error: expected '" + std::string(expected) + "', got '" + s + "'");
+    }
+}
+
+template<PatchPolicy Policy>
+FeedTask<> BasicNarFeedProcessor<Policy>::readContents(NarNode& node)
+{
+    const uint64_t len = co_await readU64();
+    node.content.resize(len);
+    if (anchors_.empty()) {
+        co_await read(node.content);
+    } else {
+        AnchorScanner scanner(anchors_);
+        co_await read(node.content, &scanner);
+        node.anchors = scanner.finish();
+    }
+
+    std::byte padding[8];
+    co_await read(std::span(padding, (8 - len % 8) % 8));
+}
+
+// ============================================================================
+// Parsing (mirrors NarStream::parse, one coroutine per nesting level)
+// ============================================================================
+
+template<PatchPolicy Policy>
+FeedTask<> BasicNarFeedProcessor<Policy>::parse()
+{
+    co_await expectString(NAR_MAGIC);
+    std::string header;
+    appendNarString(header, NAR_MAGIC);
+    out_.write(header.data(), static_cast<std::streamsize>(header.size()));
+
+    PathRules::Cursor root = rules_ ? rules_->root() : PathRules::Cursor{};
+    co_await parseNode("", std::move(root));
+    out_.flush();
+}
+
+template<PatchPolicy Policy>
+FeedTask<> BasicNarFeedProcessor<Policy>::parseNode(std::string path, PathRules::Cursor cursor)
+{
+    co_await expectString("(");
+    co_await expectString("type");
+    const std::string nodeType = co_await readString();
+
+    if (nodeType == "regular") {
+        NarNode node{.type = NarNode::Type::RegularFile, .path = std::move(path), .action = cursor.action};
+        std::string marker = co_await readString();
+        if (marker == "executable") {
+            node.executable = true;
+            co_await expectString("");  // Empty executable marker value
+            marker = co_await readString();
+        }
+        if (marker != "contents") {
+            throw std::runtime_error("Expected 'executable' or 'contents', got '" + marker + "'");
+        }
+        co_await readContents(node);
+        co_await expectString(")");
+        handle(node);
+    } else if (nodeType == "symlink") {
+        co_await expectString("target");
+        NarNode node{.type = NarNode::Type::Symlink, .path = std::move(path), .action = cursor.action};
+        node.target = co_await readString();
+        co_await expectString(")");
+        handle(node);
+    } else if (nodeType == "directory") {
+        NarNode start{.type = NarNode::Type::DirectoryStart, .path = path, .action = cursor.action};
+        handle(start);
+        co_await parseEntries(std::move(path), std::move(cursor));
+    } else {
+        throw std::runtime_error("Unknown node type: " + nodeType);
+    }
+}
+
+// Entries of a directory up to and including its DirectoryEnd
+template<PatchPolicy Policy>
+FeedTask<> BasicNarFeedProcessor<Policy>::parseEntries(std::string path, PathRules::Cursor cursor)
+{
+    while (true) {
+        const std::string marker = co_await readString();
+        if (marker == ")") {
+            break;
+        }
+        if (marker != "entry") {
+            throw std::runtime_error("Expected 'entry' or ')', got '" + marker + "'");
+        }
+
+        co_await expectString("(");
+        co_await expectString("name");
+        std::string name = co_await readString();
+        co_await expectString("node");
+
+        std::string childPath = path.empty() ? name : path + "/" + name;
+        PathRules::Cursor childCursor = rules_ ? rules_->step(cursor, name) : PathRules::Cursor{};
+
+        NarNode entry{.type = NarNode::Type::EntryStart, .name = std::move(name), .path = childPath};
+        handle(entry);
+
+        co_await parseNode(childPath, std::move(childCursor));
+
+        co_await expectString(")");
+        NarNode end{.type = NarNode::Type::EntryEnd, .path = std::move(childPath)};
+        handle(end);
+    }
+
+    NarNode end{.type = NarNode::Type::DirectoryEnd, .path = std::move(path)};
+    handle(end);
+}
+
+// Patch (unless skipped by rule) and write, as BasicNarProcessor does
+template<PatchPolicy Policy>
+void BasicNarFeedProcessor<Policy>::handle(NarNode& node)
+{
+    static const PathAction defaultAction;
+    const PathAction& action = node.action ? *node.action : defaultAction;
+
+    if (action.kind == PathAction::Kind::Skip) {
+        // Nothing to do
+    } else if (node.type == NarNode::Type::RegularFile) {
+        policy_.patchContent(node.content, node.executable, node.path, action, node.anchors);
+    } else if (node.type == NarNode::Type::Symlink) {
+        policy_.patchSymlink(node.target, node.path, action);
+    }
+
+    writeNarNode(out_, node);
+}
+
+} // namespace nar
+
+#endif // NAR_FEED_H
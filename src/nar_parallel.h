@@ -0,0 +1,720 @@
+/*
+ * Parallel NAR processor for seekable input
+ *
+ * Processing architecture:
+ * - Index pass: skip-scan the whole NAR, recording every node plus the
+ *   offset and size of each file's contents (contents are not read)
+ * - Scheduling: files are patched on a worker pool, most expensive first
+ *   (size weighted by the policy's cost estimate), with contents fetched
+ *   by pread() so workers never share a stream position
+ * - Ordered assembly (any output): the calling thread writes nodes in
+ *   original NAR order, waiting only for the next file it needs
+ * - Placed assembly (output is a regular file, see setOutputFd): a node's
+ *   output offset is the sum of the sizes before it, so it is known once
+ *   every earlier file is patched. The "frontier" is the first node whose
+ *   offset is not yet known. A file finished at the frontier is pwrite()n
+ *   straight into place by its worker; one finished ahead of it is spilled
+ *   to an anonymous temp file and later moved with copy_file_range(), so
+ *   patched contents never wait in memory for slow predecessors
+ * - Memory: bounded by a budget on loaded contents. In ordered mode the
+ *   file the writer needs next may always start; in placed mode contents
+ *   leave memory as soon as they are patched, so the budget only limits
+ *   how many files are patched at once
+ * - Placement (setCpuClasses): on big.LITTLE CPUs workers are pinned to a
+ *   capacity class, fastest first. Workers on fast cores take the most
+ *   expensive files, those on slow cores the cheapest
+ * - Adaptive workers (setAdaptiveWorkers, ordered mode): the writer
+ *   measures how long it waits for patched files and how long it is
+ *   blocked writing. Workers are parked while the output is the
+ *   bottleneck, leaving the cores to whatever consumes it, and woken
+ *   again when the writer starves
+ *
+ * The policy's patchContent() is called concurrently and must be
+ * thread-safe; patchSymlink() is called by one thread at a time.
+ */
+
+#ifndef NAR_PARALLEL_H
+#define NAR_PARALLEL_H
+
+#include "cpu_topology.h"
+#include "fdstream.h"
+#include "nar.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace nar {
+
+// Optional policy hook: relative cost of patching a file, given its node
+// (content not loaded) and the first bytes of its content
+template<class P>
+concept CostEstimatingPolicy = requires(P& policy, const NarNode& node,
+                                        std::span<const std::byte> head) {
+    { policy.estimateCost(node, head) } -> std::convertible_to<uint64_t>;
+};
+
+// ============================================================================
+// ParallelNarProcessor - Index, schedule by cost, assemble in order
+// ============================================================================
+
+template<PatchPolicy Policy>
+class ParallelNarProcessor : public NarStream {
+public:
+    // `in` must be a seekable stream over `inFd` (e.g. FdInputStream)
+    ParallelNarProcessor(std::istream& in, int inFd, std::ostream& out,
+                         unsigned jobs, Policy policy = Policy{})
+        : NarStream(in, out), inFd_(inFd), jobs_(std::max(1u, jobs)),
+          policy_(std::move(policy))
+    {
+    }
+
+    Policy& policy() { return policy_; }
+
+    // Upper bound on bytes of file contents held in memory at once
+    void setMemoryBudget(uint64_t bytes) { memoryBudget_ = bytes; }
+
+    // Write with pwrite() at computed offsets instead of through the output
+    // stream. `fd` must satisfy isPlaceableFile(); output starts at its
+    // current offset, and the file is truncated and positioned at the end
+    // of the NAR when done. The output stream is then left unused.
+    void setOutputFd(int fd) { outFd_ = fd; }
+
+    // Capacity classes to pin workers to (cpuClasses()); fewer than two
+    // leaves the workers unpinned, all taking the most expensive files
+    void setCpuClasses(std::vector<CpuClass> classes) { cpuClasses_ = std::move(classes); }
+
+    // Ordered mode: tune the number of running workers to the output.
+    // onChange, if set, gets the new number of running workers and the
+    // pool size each time tuning changes it (on the calling thread)
+    using WorkersChanged = std::function<void(unsigned active, unsigned workers)>;
+    void setAdaptiveWorkers(bool adaptive, WorkersChanged onChange = {})
+    {
+        adaptive_ = adaptive;
+        workersChanged_ = std::move(onChange);
+    }
+
+    void process();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t NO_JOB = std::numeric_limits<size_t>::max();
+    static constexpr size_t WAIT = NO_JOB - 1;
+    static constexpr size_t HEAD_BYTES = 64;
+    static constexpr auto TUNE_WINDOW = std::chrono::milliseconds(50);
+
+    struct Placement {
+        std::vector<int> cpus;    // Empty: not pinned
+        bool cheapFirst = false;  // Slow core: take the cheapest files
+    };
+
+    enum class JobState : char {
+        Pending,   // Not started
+        Running,   // Loading or patching
+        Patched,   // Contents in memory (ordered mode)
+        Spilled,   // Contents in the spill file, waiting for the frontier
+        Placed     // Written to the output
+    };
+
+    void planJobs();
+    std::vector<Placement> placeWorkers(unsigned count) const;
+    size_t pickJob(bool cheapFirst);
+    void worker(unsigned id, const Placement& placement);
+    void loadContent(NarNode& node);
+    void releaseContent(size_t job);
+    void fail();
+    void stopWorkers();
+
+    void processOrdered();
+    void tune();
+    void processPlaced();
+    void finishPlaced(size_t job);
+    void advance();
+    void placeNode(size_t index, size_t job, std::span<const std::byte> content);
+    void flushPending();
+
+    int inFd_;
+    unsigned jobs_;
+    Policy policy_;
+    uint64_t memoryBudget_ = 256ull << 20;
+    std::vector<CpuClass> cpuClasses_;
+    bool adaptive_ = false;
+    WorkersChanged workersChanged_;
+
+    std::vector<NarNode> nodes_;       // Index (contents loaded on demand)
+    std::vector<size_t> fileNodes_;    // Node index of each job, NAR order
+    std::vector<size_t> nodeJob_;      // Job of each node (NO_JOB if none)
+    std::vector<size_t> byCost_;       // Job indices, most expensive first
+    std::vector<JobState> state_;      // Per job
+    std::vector<uint64_t> patchedSize_;  // Per job, once patched (placed mode)
+    std::vector<uint64_t> spillOffset_;  // Per job, once spilled
+
+    std::mutex mutex_;
+    std::condition_variable workCv_;   // Budget freed / shutdown
+    std::condition_variable doneCv_;   // A job finished / frontier stopped
+    size_t costCursor_ = 0;            // First byCost_ entry possibly unstarted
+    size_t cheapCursor_ = 0;           // Past the last byCost_ entry possibly unstarted
+    size_t headJob_ = 0;               // Lowest possibly unstarted job
+    size_t writerJob_ = 0;             // Job the writer needs next
+    uint64_t bufferedBytes_ = 0;       // Contents of loaded, unwritten jobs
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    std::vector<std::thread> threads_;
+    unsigned active_ = 0;              // Workers with a lower id may take jobs
+
+    // Adaptive workers (writer thread only): time in the current window
+    // spent waiting for patched files and blocked on the output
+    Clock::time_point windowStart_;
+    Clock::duration starved_{};
+    Clock::duration blocked_{};
+
+    // Placed mode (frontier_ and advancing_ guarded by mutex_; outOffset_
+    // and pending_ belong to whichever thread is advancing)
+    int outFd_ = -1;
+    int spillFd_ = -1;
+    uint64_t spillEnd_ = 0;            // Next free spill offset
+    size_t frontier_ = 0;              // First node without an output offset
+    bool advancing_ = false;           // Some thread is placing the frontier
+    uint64_t outOffset_ = 0;           // Output offset of the frontier node
+    std::string pending_;              // Unwritten framing, ends at outOffset_
+};
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::loadContent(NarNode& node)
+{
+    node.content.resize(node.contentSize);
+    if (!anchors_.empty()) {
+        node.anchors = readScanned(node.content, anchors_, [&](std::byte* dest, size_t n, size_t offset) {
+            preadExact(inFd_, dest, n, static_cast<off_t>(node.contentOffset + offset));
+        });
+    } else if (node.contentSize > 0) {
+        preadExact(inFd_, node.content.data(), node.contentSize,
+                   static_cast<off_t>(node.contentOffset));
+    }
+}
+
+// Drop a job's contents from memory and return its share of the budget
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::releaseContent(size_t job)
+{
+    NarNode& node = nodes_[fileNodes_[job]];
+    std::vector<std::byte>().swap(node.content);
+    node.anchors = {};
+    {
+        std::lock_guard lock(mutex_);
+        bufferedBytes_ -= node.contentSize;
+    }
+    workCv_.notify_all();
+}
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::planJobs()
+{
+    std::vector<uint64_t> cost;
+    nodeJob_.assign(nodes_.size(), NO_JOB);
+
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        const NarNode& node = nodes_[i];
+        if (node.type != NarNode::Type::RegularFile ||
+            (node.action && node.action->kind == PathAction::Kind::Skip)) {
+            continue;
+        }
+
+        uint64_t c = node.contentSize;
+        if constexpr (CostEstimatingPolicy<Policy>) {
+            std::byte head[HEAD_BYTES];
+            const size_t n = std::min<uint64_t>(node.contentSize, HEAD_BYTES);
+            preadExact(inFd_, head, n, static_cast<off_t>(node.contentOffset));
+            c = policy_.estimateCost(node, std::span<const std::byte>(head, n));
+        }
+
+        nodeJob_[i] = fileNodes_.size();
+        fileNodes_.push_back(i);
+        cost.push_back(c);
+    }
+
+    byCost_.resize(fileNodes_.size());
+    for (size_t j = 0; j < byCost_.size(); ++j) {
+        byCost_[j] = j;
+    }
+    // Ties keep NAR order so equal-cost files still stream early
+    std::stable_sort(byCost_.begin(), byCost_.end(),
+                     [&](size_t a, size_t b) { return cost[a] > cost[b]; });
+
+    cheapCursor_ = byCost_.size();
+    state_.assign(fileNodes_.size(), JobState::Pending);
+    patchedSize_.assign(fileNodes_.size(), 0);
+    spillOffset_.assign(fileNodes_.size(), 0);
+}
+
+// Fill each capacity class up to its core count, fastest first, then
+// spread any extra workers over the classes in turn
+template<PatchPolicy Policy>
+auto ParallelNarProcessor<Policy>::placeWorkers(unsigned count) const -> std::vector<Placement>
+{
+    std::vector<Placement> placements(count);
+    if (cpuClasses_.size() < 2) {
+        return placements;
+    }
+
+    const uint64_t top = cpuClasses_.front().capacity;
+    auto place = [&](unsigned worker, const CpuClass& cpuClass) {
+        placements[worker].cpus = cpuClass.cpus;
+        placements[worker].cheapFirst = cpuClass.capacity * 2 < top;
+    };
+    unsigned worker = 0;
+    for (const CpuClass& cpuClass : cpuClasses_) {
+        for (size_t i = 0; i < cpuClass.cpus.size() && worker < count; ++i) {
+            place(worker++, cpuClass);
+        }
+    }
+    for (size_t c = 0; worker < count; c = (c + 1) % cpuClasses_.size()) {
+        place(worker++, cpuClasses_[c]);
+    }
+    return placements;
+}
+
+// Choose the next job, most expensive first or (cheapFirst) cheapest
+// first (caller holds mutex_)
+// Returns NO_JOB when everything has started, WAIT when over budget
+template<PatchPolicy Policy>
+size_t ParallelNarProcessor<Policy>::pickJob(bool cheapFirst)
+{
+    while (costCursor_ < byCost_.size() && state_[byCost_[costCursor_]] != JobState::Pending) {
+        ++costCursor_;
+    }
+    if (costCursor_ == byCost_.size()) {
+        return NO_JOB;
+    }
+
+    auto fits = [&](size_t job) {
+        return state_[job] == JobState::Pending &&
+               bufferedBytes_ + nodes_[fileNodes_[job]].contentSize <= memoryBudget_;
+    };
+    if (cheapFirst) {
+        while (cheapCursor_ > costCursor_ && state_[byCost_[cheapCursor_ - 1]] != JobState::Pending) {
+            --cheapCursor_;
+        }
+        for (size_t i = cheapCursor_; i-- > costCursor_;) {
+            if (fits(byCost_[i])) {
+                return byCost_[i];
+            }
+        }
+    } else {
+        for (size_t i = costCursor_; i < byCost_.size(); ++i) {
+            if (fits(byCost_[i])) {
+                return byCost_[i];
+            }
+        }
+    }
+
+    // Nothing held at all: a single file larger than the budget may start
+    if (bufferedBytes_ == 0) {
+        return byCost_[costCursor_];
+    }
+
+    // Over budget: only the job the writer needs next may still start.
+    // Every job before it is written (hence started), so it is the
+    // earliest unstarted job whenever it has not started yet.
+    // (Placed mode frees memory without the writer and never needs this.)
+    while (headJob_ < state_.size() && state_[headJob_] != JobState::Pending) {
+        ++headJob_;
+    }
+    return outFd_ < 0 && headJob_ == writerJob_ ? headJob_ : WAIT;
+}
+
+// Record the first error and wake everyone up to unwind
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::fail()
+{
+    {
+        std::lock_guard lock(mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+        stopping_ = true;
+    }
+    workCv_.notify_all();
+    doneCv_.notify_all();
+}
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::worker(unsigned id, const Placement& placement)
+{
+    if (!placement.cpus.empty()) {
+        pinCurrentThread(placement.cpus);  // Best effort
+    }
+
+    while (true) {
+        size_t job = WAIT;
+        {
+            std::unique_lock lock(mutex_);
+            while (!stopping_ && (id >= active_ || (job = pickJob(placement.cheapFirst)) == WAIT)) {
+                workCv_.wait(lock);
+            }
+            if (stopping_ || job == NO_JOB) {
+                return;
+            }
+            state_[job] = JobState::Running;
+            bufferedBytes_ += nodes_[fileNodes_[job]].contentSize;
+        }
+
+        NarNode& node = nodes_[fileNodes_[job]];
+        try {
+            loadContent(node);
+            static const PathAction defaultAction;
+            policy_.patchContent(node.content, node.executable, node.path,
+                                 node.action ? *node.action : defaultAction, node.anchors);
+
+            if (outFd_ >= 0) {
+                finishPlaced(job);
+                continue;
+            }
+        } catch (...) {
+            fail();
+            return;
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            state_[job] = JobState::Patched;
+        }
+        doneCv_.notify_all();
+    }
+}
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::stopWorkers()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    workCv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+
+    if (spillFd_ >= 0) {
+        ::close(spillFd_);
+        spillFd_ = -1;
+    }
+}
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::process()
+{
+    // Phase 1: skip-scan index of the whole archive
+    setSkipContents(true);
+    for (auto&& node : parseGen_) {
+        nodes_.push_back(std::move(node));
+    }
+
+    // Phase 2: cost-ordered patching on the worker pool
+    planJobs();
+    if (outFd_ >= 0) {
+        spillFd_ = createTempFile();
+    }
+    const unsigned threadCount = std::min<size_t>(jobs_, fileNodes_.size());
+    const std::vector<Placement> placements = placeWorkers(threadCount);
+    active_ = threadCount;
+    for (unsigned t = 0; t < threadCount; ++t) {
+        threads_.emplace_back([this, t, placement = placements[t]] { worker(t, placement); });
+    }
+
+    // Phase 3: assembly
+    try {
+        if (outFd_ >= 0) {
+            processPlaced();
+        } else {
+            processOrdered();
+        }
+    } catch (...) {
+        stopWorkers();
+        throw;
+    }
+
+    stopWorkers();
+}
+
+// ============================================================================
+// Ordered assembly - write through the output stream in NAR order
+// ============================================================================
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::processOrdered()
+{
+    static const PathAction defaultAction;
+
+    writeString(NAR_MAGIC);
+    windowStart_ = Clock::now();
+
+    size_t nextJob = 0;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        NarNode& node = nodes_[i];
+        const PathAction& action = node.action ? *node.action : defaultAction;
+
+        if (nextJob < fileNodes_.size() && fileNodes_[nextJob] == i) {
+            const Clock::time_point waitStart = Clock::now();
+            {
+                std::unique_lock lock(mutex_);
+                doneCv_.wait(lock, [&] { return state_[nextJob] == JobState::Patched || error_; });
+                if (error_) {
+                    std::rethrow_exception(error_);
+                }
+            }
+            const Clock::time_point writeStart = Clock::now();
+            writeNode(node);
+            starved_ += writeStart - waitStart;
+            blocked_ += Clock::now() - writeStart;
+
+            releaseContent(nextJob);
+            ++nextJob;
+            {
+                std::lock_guard lock(mutex_);
+                writerJob_ = nextJob;
+            }
+            workCv_.notify_all();
+            if (adaptive_) {
+                tune();
+            }
+        } else if (node.type == NarNode::Type::RegularFile) {
+            // Skipped by rule: copy verbatim
+            loadContent(node);
+            writeNode(node);
+            std::vector<std::byte>().swap(node.content);
+            node.anchors = {};
+        } else {
+            if (node.type == NarNode::Type::Symlink &&
+                action.kind != PathAction::Kind::Skip) {
+                policy_.patchSymlink(node.target, node.path, action);
+            }
+            writeNode(node);
+        }
+    }
+
+    out_.flush();
+}
+
+// Once per window: one more worker if the writer waited for patched files
+// over a fifth of the time, one fewer if it was blocked on the output over
+// half of the time and hardly waited
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::tune()
+{
+    const Clock::time_point now = Clock::now();
+    const Clock::duration window = now - windowStart_;
+    if (window < TUNE_WINDOW) {
+        return;
+    }
+
+    unsigned before;
+    unsigned active;
+    {
+        std::lock_guard lock(mutex_);
+        before = active_;
+        if (starved_ * 5 > window && active_ < threads_.size()) {
+            ++active_;
+        } else if (blocked_ * 2 > window && starved_ * 20 < window && active_ > 1) {
+            --active_;
+        }
+        active = active_;
+    }
+    workCv_.notify_all();
+    if (workersChanged_ && active != before) {
+        workersChanged_(active, static_cast<unsigned>(threads_.size()));
+    }
+
+    windowStart_ = now;
+    starved_ = blocked_ = {};
+}
+
+// ============================================================================
+// Placed assembly - pwrite() each node at its final offset
+// ============================================================================
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::processPlaced()
+{
+    const off_t start = lseek(outFd_, 0, SEEK_CUR);
+    if (start < 0) {
+        throw std::runtime_error("Cannot determine output offset");
+    }
+    outOffset_ = static_cast<uint64_t>(start);
+    appendNarString(pending_, NAR_MAGIC);
+    outOffset_ += pending_.size();
+
+    // Place everything up to the first unfinished file, then let the
+    // workers carry the frontier forward as they finish
+    {
+        std::lock_guard lock(mutex_);
+        advancing_ = true;
+    }
+    advance();
+
+    {
+        std::unique_lock lock(mutex_);
+        doneCv_.wait(lock, [&] {
+            return (frontier_ == nodes_.size() && !advancing_) || error_;
+        });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    // Drop any stale tail of a pre-existing file and leave the descriptor
+    // where a sequential writer would have
+    const auto end = static_cast<off_t>(outOffset_);
+    if (ftruncate(outFd_, end) != 0 || lseek(outFd_, end, SEEK_SET) < 0) {
+        throw std::runtime_error("Cannot finalize output file");
+    }
+}
+
+// A worker finished patching `job`: place it if the frontier is waiting for
+// it, otherwise spill it and let whoever reaches it later move it
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::finishPlaced(size_t job)
+{
+    const size_t index = fileNodes_[job];
+    NarNode& node = nodes_[index];
+    const uint64_t size = node.content.size();
+
+    std::unique_lock lock(mutex_);
+    patchedSize_[job] = size;
+
+    if (frontier_ == index && !advancing_) {
+        advancing_ = true;
+        state_[job] = JobState::Placed;
+        lock.unlock();
+
+        placeNode(index, job, node.content);
+        releaseContent(job);
+        advance();
+        return;
+    }
+
+    const uint64_t offset = spillEnd_;
+    spillEnd_ += size;
+    lock.unlock();
+
+    pwriteExact(spillFd_, node.content.data(), size, static_cast<off_t>(offset));
+    releaseContent(job);
+
+    lock.lock();
+    spillOffset_[job] = offset;
+    state_[job] = JobState::Spilled;
+    // The frontier may have stopped here while this job was spilling
+    const bool takeOver = frontier_ == index && !advancing_;
+    if (takeOver) {
+        advancing_ = true;
+    }
+    lock.unlock();
+
+    if (takeOver) {
+        advance();
+    }
+}
+
+// Place nodes from the frontier until one is still being patched.
+// Caller holds the advancing role; it is given up on return.
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::advance()
+{
+    std::unique_lock lock(mutex_);
+    if (frontier_ < nodes_.size() && nodeJob_[frontier_] != NO_JOB &&
+        state_[nodeJob_[frontier_]] == JobState::Placed) {
+        ++frontier_;  // Placed by the caller from memory
+    }
+
+    while (frontier_ < nodes_.size() && !stopping_) {
+        const size_t index = frontier_;
+        const size_t job = nodeJob_[index];
+        if (job != NO_JOB) {
+            if (state_[job] != JobState::Spilled) {
+                break;  // Its worker takes over when it finishes
+            }
+            state_[job] = JobState::Placed;
+        }
+        lock.unlock();
+
+        placeNode(index, job, {});
+
+        lock.lock();
+        frontier_ = index + 1;
+    }
+
+    lock.unlock();
+    flushPending();
+    lock.lock();
+
+    advancing_ = false;
+    lock.unlock();
+    doneCv_.notify_all();
+}
+
+// Write one node at outOffset_ and move outOffset_ past it. Framing is
+// gathered in pending_ so runs of small nodes cost a single pwrite().
+// `content` holds a patched job's contents when placed from memory;
+// otherwise they come from the spill file (jobs) or the input (skipped).
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::placeNode(size_t index, size_t job,
+                                             std::span<const std::byte> content)
+{
+    static const PathAction defaultAction;
+    NarNode& node = nodes_[index];
+    const PathAction& action = node.action ? *node.action : defaultAction;
+
+    if (node.type == NarNode::Type::Symlink && action.kind != PathAction::Kind::Skip) {
+        policy_.patchSymlink(node.target, node.path, action);
+    }
+
+    const uint64_t contentSize = job != NO_JOB ? patchedSize_[job] : node.contentSize;
+    const NodeFraming framing = encodeFraming(node, contentSize);
+
+    pending_ += framing.head;
+    outOffset_ += framing.head.size();
+
+    if (node.type == NarNode::Type::RegularFile) {
+        flushPending();
+
+        const auto at = static_cast<off_t>(outOffset_);
+        if (job == NO_JOB) {
+            copyRange(inFd_, static_cast<off_t>(node.contentOffset), outFd_, at, contentSize);
+        } else if (!content.empty() || contentSize == 0) {
+            pwriteExact(outFd_, content.data(), contentSize, at);
+        } else {
+            copyRange(spillFd_, static_cast<off_t>(spillOffset_[job]), outFd_, at, contentSize);
+        }
+        outOffset_ += contentSize;
+
+        pending_ += framing.tail;
+        outOffset_ += framing.tail.size();
+    }
+}
+
+template<PatchPolicy Policy>
+void ParallelNarProcessor<Policy>::flushPending()
+{
+    if (pending_.empty()) {
+        return;
+    }
+    pwriteExact(outFd_, pending_.data(), pending_.size(),
+                static_cast<off_t>(outOffset_ - pending_.size()));
+    pending_.clear();
+}
+
+} // namespace nar
+
+#endif // NAR_PARALLEL_H
@@ -0,0 +1,120 @@
+/*
+ * nix-store --export stream framing
+ */
+
+#include "nix_export.h"
+#include "nar.h"
+
+#include <cstdint>
+#include <stdexcept>
+
+namespace nar {
+
+namespace {
+
+constexpr uint64_t EXPORT_MAGIC = 0x4558494e;  // "NIXE"
+
+// Guards against allocating garbage lengths from a corrupt stream
+constexpr uint64_t MAX_STRING = 1 << 20;
+constexpr uint64_t MAX_REFERENCES = 1 << 20;
+
+uint64_t readU64(std::istream& in)
+{
+    uint64_t val;
+    in.read(reinterpret_cast<char*>(&val), sizeof(val));
+    if (in.gcount() != sizeof(val)) {
+        throw std::runtime_error("Unexpected EOF reading export stream");
+    }
+    return val;
+}
+
+std::string readString(std::istream& in)
+{
+    const uint64_t len = readU64(in);
+    if (len > MAX_STRING) {
+        throw std::runtime_error("export stream: string too long");
+    }
+    const uint64_t padded = len + (8 - len % 8) % 8;
+    std::string s(padded, '\0');
+    in.read(s.data(), static_cast<std::streamsize>(padded));
+    if (static_cast<uint64_t>(in.gcount()) != padded) {
+        throw std::runtime_error("Unexpected EOF reading export stream");
+    }
+    s.resize(len);
+    return s;
+}
+
+void writeU64(std::ostream& out, uint64_t n)
+{
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+} // anonymous namespace
+
+bool readExportStart(std::istream& in)
+{
+    const uint64_t marker = readU64(in);
+    if (marker > 1) {
+        throw std::runtime_error("export stream: bad path marker " + std::to_string(marker));
+    }
+    return marker == 1;
+}
+
+ExportMetadata readExportMetadata(std::istream& in)
+{
+    if (readU64(in) != EXPORT_MAGIC) {
+        throw std::runtime_error("export stream: missing NIXE marker after NAR");
+    }
+
+    ExportMetadata metadata;
+    metadata.path = readString(in);
+
+    const uint64_t count = readU64(in);
+    if (count > MAX_REFERENCES) {
+        throw std::runtime_error("export stream: too many references");
+    }
+    metadata.references.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        metadata.references.push_back(readString(in));
+    }
+
+    metadata.deriver = readString(in);
+
+    // Legacy signature: it would not match the patched NAR anyway
+    if (readU64(in) == 1) {
+        readString(in);
+    }
+
+    return metadata;
+}
+
+void writeExportStart(std::ostream& out)
+{
+    writeU64(out, 1);
+}
+
+void writeExportMetadata(std::ostream& out, const ExportMetadata& metadata)
+{
+    std::string buf;
+    const uint64_t magic = EXPORT_MAGIC;
+    buf.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    appendNarString(buf, metadata.path);
+
+    const uint64_t count = metadata.references.size();
+    buf.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (const auto& reference : metadata.references) {
+        appendNarString(buf, reference);
+    }
+
+    appendNarString(buf, metadata.deriver);
+    buf.append(sizeof(uint64_t), '\0');  // No signature
+
+    out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+}
+
+void writeExportEnd(std::ostream& out)
+{
+    writeU64(out, 0);
+}
+
+} // namespace nar
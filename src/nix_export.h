@@ -0,0 +1,45 @@
+/*
+ * nix-store --export stream framing
+ *
+ * An export stream is a sequence of store paths, each a NAR followed by
+ * its metadata, as written by `nix-store --export` and read by
+ * `nix-store --import`:
+ *
+ *   repeat: u64 1, NAR, u64 0x4558494e ("NIXE"), path,
+ *           u64 n + n reference paths, deriver ("" if none),
+ *           u64 0 (or u64 1 + legacy signature)
+ *   end:    u64 0
+ *
+ * The NAR itself is self-delimiting and is read by the NAR parser
+ * directly from the same stream; these helpers only handle the framing.
+ */
+
+#ifndef NIX_EXPORT_H
+#define NIX_EXPORT_H
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace nar {
+
+struct ExportMetadata {
+    std::string path;
+    std::vector<std::string> references;
+    std::string deriver;
+};
+
+// Reads the marker before each path; false at the end of the stream
+bool readExportStart(std::istream& in);
+
+// Reads the metadata following a NAR (a legacy signature is dropped)
+ExportMetadata readExportMetadata(std::istream& in);
+
+void writeExportStart(std::ostream& out);
+void writeExportMetadata(std::ostream& out, const ExportMetadata& metadata);
+void writeExportEnd(std::ostream& out);
+
+} // namespace nar
+
+#endif // NIX_EXPORT_H
@@ -2568,6 +2568,340 @@ static void patchElf()
 }
 
 
+/* Parse the per-file operation at argv[i], advancing i past its
+   arguments; false if argv[i] is not one */
+static bool parseOperation(int argc, char * * argv, int & i)
+{
+    std::string arg(argv[i]);
+    if (arg == "--set-interpreter" || arg == "--interpreter") {
+        if (++i == argc) error("missing argument");
+        newInterpreter = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-interpreter") {
+        printInterpreter = true;
+    }
+    else if (arg == "--print-os-abi") {
+        printOsAbi = true;
+    }
+    else if (arg == "--set-os-abi") {
+        if (++i == argc) error("missing argument");
+        setOsAbi = true;
+        newOsAbi = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-soname") {
+        printSoname = true;
+    }
+    else if (arg == "--set-soname") {
+        if (++i == argc) error("missing argument");
+        setSoname = true;
+        newSoname = resolveArgument(argv[i]);
+    }
+    else if (arg == "--remove-rpath") {
+        removeRPath = true;
+    }
+    else if (arg == "--shrink-rpath") {
+        shrinkRPath = true;
+    }
+    else if (arg == "--allowed-rpath-prefixes") {
+        if (++i == argc) error("missing argument");
+        allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
+    }
+    else if (arg == "--set-rpath") {
+        if (++i == argc) error("missing argument");
+        setRPath = true;
+        newRPath = resolveArgument(argv[i]);
+    }
+    else if (arg == "--add-rpath") {
+        if (++i == argc) error("missing argument");
+        addRPath = true;
+        newRPath = resolveArgument(argv[i]);
+    }
+    else if (arg == "--print-rpath") {
+        printRPath = true;
+    }
+    else if (arg == "--print-needed") {
+        printNeeded = true;
+    }
+    else if (arg == "--add-needed") {
+        if (++i == argc) error("missing argument");
+        neededLibsToAdd.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--remove-needed") {
+        if (++i == argc) error("missing argument");
+        neededLibsToRemove.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--replace-needed") {
+        if (i+2 >= argc) error("missing argument(s)");
+        neededLibsToReplace[ argv[i+1] ] = argv[i+2];
+        i += 2;
+    }
+    else if (arg == "--clear-symbol-version") {
+        if (++i == argc) error("missing argument");
+        symbolsToClearVersion.insert(resolveArgument(argv[i]));
+    }
+    else if (arg == "--print-execstack") {
+        printExecstack = true;
+    }
+    else if (arg == "--clear-execstack") {
+        clearExecstack = true;
+    }
+    else if (arg == "--set-execstack") {
+        setExecstack = true;
+    }
+    else if (arg == "--no-default-lib") {
+        noDefaultLib = true;
+    }
+    else if (arg == "--add-debug-tag") {
+        addDebugTag = true;
+    }
+    else if (arg == "--rename-dynamic-symbols") {
+        renameDynamicSymbols = true;
+        if (++i == argc) error("missing argument");
+
+        const char* fname = argv[i];
+        std::ifstream infile(fname);
+        if (!infile) error(fmt("Cannot open map file ", fname));
+
+        std::string line, from, to;
+        size_t lineCount = 1;
+        while (std::getline(infile, line))
+        {
+            std::istringstream iss(line);
+            if (!(iss >> from))
+                break;
+            if (!(iss >> to))
+                error(fmt(fname, ":", lineCount, ": Map file line is missing the second element"));
+            if (symbolsToRenameKeys.count(from))
+                error(fmt(fname, ":", lineCount, ": Name '", from, "' appears twice in the map file"));
+            if (from.find('@') != std::string_view::npos || to.find('@') != std::string_view::npos)
+                error(fmt(fname, ":", lineCount, ": Name pair contains version tag: ", from, " ", to));
+            lineCount++;
+            symbolsToRename[*symbolsToRenameKeys.insert(from).first] = to;
+        }
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/* Forget the operations of the previous file in a batch */
+static void resetOperations()
+{
+    printInterpreter = false;
+    printOsAbi = false;
+    setOsAbi = false;
+    newOsAbi.clear();
+    printSoname = false;
+    setSoname = false;
+    newSoname.clear();
+    newInterpreter.clear();
+    shrinkRPath = false;
+    allowedRpathPrefixes.clear();
+    removeRPath = false;
+    setRPath = false;
+    addRPath = false;
+    addDebugTag = false;
+    renameDynamicSymbols = false;
+    printRPath = false;
+    newRPath.clear();
+    neededLibsToRemove.clear();
+    neededLibsToReplace.clear();
+    neededLibsToAdd.clear();
+    symbolsToClearVersion.clear();
+    symbolsToRename.clear();
+    symbolsToRenameKeys.clear();
+    printNeeded = false;
+    noDefaultLib = false;
+    printExecstack = false;
+    clearExecstack = false;
+    setExecstack = false;
+}
+
+
+/* One line of a --batch file: {"file": "...", "args": ["...", ...]}.
+   Only the JSON needed for that is understood: an object of strings and
+   arrays of strings. */
+class BatchLineParser
+{
+public:
+    BatchLineParser(std::string_view line, std::string where)
+        : line(line), where(std::move(where)) { }
+
+    void parse(std::string & file, std::vector<std::string> & args)
+    {
+        expect('{');
+        for (bool first = true; skipSpace(), peek() != '}'; first = false) {
+            if (!first) expect(',');
+            std::string key = parseString();
+            expect(':');
+            if (key == "file")
+                file = parseString();
+            else if (key == "args") {
+                expect('[');
+                for (bool firstArg = true; skipSpace(), peek() != ']'; firstArg = false) {
+                    if (!firstArg) expect(',');
+                    args.push_back(parseString());
+                }
+                expect(']');
+            }
+            else
+                fail(fmt("unknown key '", key, "'"));
+        }
+        expect('}');
+        skipSpace();
+        if (pos != line.size()) fail("trailing characters");
+    }
+
+private:
+    [[noreturn]] void fail(const std::string & msg) const
+    {
+        errno = 0;
+        error(fmt(where, ": ", msg));
+    }
+
+    void skipSpace()
+    {
+        while (pos < line.size() && std::isspace((unsigned char) line[pos])) pos++;
+    }
+
+    char peek() const
+    {
+        if (pos == line.size()) fail("unexpected end of line");
+        return line[pos];
+    }
+
+    void expect(char c)
+    {
+        skipSpace();
+        if (peek() != c) fail(fmt("expected '", c, "'"));
+        pos++;
+    }
+
+    unsigned int parseHex4()
+    {
+        if (pos + 4 > line.size()) fail("truncated \\u escape");
+        unsigned int n = 0;
+        for (int k = 0; k < 4; ++k) {
+            char c = line[pos++];
+            n <<= 4;
+            if (c >= '0' && c <= '9') n |= c - '0';
+            else if (c >= 'a' && c <= 'f') n |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') n |= c - 'A' + 10;
+            else fail("bad \\u escape");
+        }
+        return n;
+    }
+
+    static void appendUtf8(std::string & s, unsigned int cp)
+    {
+        if (cp < 0x80) s += (char) cp;
+        else if (cp < 0x800) {
+            s += (char) (0xc0 | (cp >> 6));
+            s += (char) (0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            s += (char) (0xe0 | (cp >> 12));
+            s += (char) (0x80 | ((cp >> 6) & 0x3f));
+            s += (char) (0x80 | (cp & 0x3f));
+        } else {
+            s += (char) (0xf0 | (cp >> 18));
+            s += (char) (0x80 | ((cp >> 12) & 0x3f));
+            s += (char) (0x80 | ((cp >> 6) & 0x3f));
+            s += (char) (0x80 | (cp & 0x3f));
+        }
+    }
+
+    std::string parseString()
+    {
+        expect('"');
+        std::string s;
+        while (true) {
+            char c = peek();
+            pos++;
+            if (c == '"') return s;
+            if (c != '\\') {
+                s += c;
+                continue;
+            }
+            c = peek();
+            pos++;
+            switch (c) {
+                case '"': case '\\': case '/': s += c; break;
+                case 'b': s += '\b'; break;
+                case 'f': s += '\f'; break;
+                case 'n': s += '\n'; break;
+                case 'r': s += '\r'; break;
+                case 't': s += '\t'; break;
+                case 'u': {
+                    unsigned int cp = parseHex4();
+                    if (cp >= 0xd800 && cp < 0xdc00 && line.substr(pos, 2) == "\\u") {
+                        pos += 2;
+                        unsigned int low = parseHex4();
+                        if (low < 0xdc00 || low >= 0xe000) fail("bad surrogate pair");
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    appendUtf8(s, cp);
+                    break;
+                }
+                default: fail(fmt("bad escape '\\", c, "'"));
+            }
+        }
+    }
+
+    std::string_view line;
+    std::string where;
+    size_t pos = 0;
+};
+
+
+/* --batch: every file is read once, gets all operations listed for it on
+   any line, in the same order as on the command line, and is written
+   once */
+static void patchBatch(const std::string & batchFileName)
+{
+    std::ifstream batchFile(batchFileName);
+    if (!batchFile) error(fmt("cannot open batch file ", batchFileName));
+
+    std::vector<std::string> files;
+    std::map<std::string, std::vector<std::string>> argsByFile;
+    std::string line;
+    size_t lineCount = 0;
+    while (std::getline(batchFile, line)) {
+        lineCount++;
+        if (trim(line).empty()) continue;
+
+        std::string file;
+        std::vector<std::string> args;
+        const std::string where = fmt(batchFileName, ":", lineCount);
+        BatchLineParser(line, where).parse(file, args);
+        if (file.empty()) error(fmt(where, ": missing \"file\""));
+
+        auto [it, inserted] = argsByFile.try_emplace(file);
+        if (inserted) files.push_back(file);
+        it->second.insert(it->second.end(), args.begin(), args.end());
+    }
+
+    for (const auto & file : files) {
+        std::vector<std::string> & args = argsByFile[file];
+        std::vector<char *> argv;
+        for (auto & arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+
+        resetOperations();
+        const int argc = (int) args.size();
+        for (int i = 0; i < argc; ++i) {
+            if (!parseOperation(argc, argv.data(), i))
+                error(fmt(batchFileName, ": ", file, ": not a per-file operation: ", argv[i]));
+        }
+        if (setRPath && addRPath)
+            error(fmt(batchFileName, ": ", file, ": --set-rpath option not allowed with --add-rpath"));
+
+        fileNames = {file};
+        patchElf();
+    }
+}
+
+
 static void showHelp(const std::string & progName)
 {
         fprintf(stderr, "syntax: %s\n\
@@ -2599,6 +2933,8 @@ static void showHelp(const std::string & progName)
   [--rename-dynamic-symbols NAME_MAP_FILE]\tRenames dynamic symbols. The map file should contain two symbols (old_name new_name) per line\n\
   [--no-clobber-old-sections]\t\tDo not clobber old section values - only use when the binary expects to find section info at the old location.\n\
   [--output FILE]\n\
+  [--batch FILE]\t\tPatch the files listed in FILE, one JSON object per line: {\"file\": \"...\", \"args\": [\"--set-rpath\", \"...\"]}.\n\
+  \t\t\t\tEach file is read and written once, with the operations of all its lines\n\
   [--debug]\n\
   [--version]\n\
   FILENAME...\n", progName.c_str());
@@ -2615,60 +2951,20 @@ static int mainWrapped(int argc, char * * argv)
     if (getenv("PATCHELF_DEBUG") != nullptr)
         debugMode = true;
 
+    std::string batchFileName;
+    bool sawOperation = false;
+
     int i;
     for (i = 1; i < argc; ++i) {
         std::string arg(argv[i]);
-        if (arg == "--set-interpreter" || arg == "--interpreter") {
-            if (++i == argc) error("missing argument");
-            newInterpreter = resolveArgument(argv[i]);
+        if (parseOperation(argc, argv, i)) {
+            sawOperation = true;
         }
         else if (arg == "--page-size") {
             if (++i == argc) error("missing argument");
             forcedPageSize = atoi(argv[i]);
             if (forcedPageSize <= 0) error("invalid argument to --page-size");
         }
-        else if (arg == "--print-interpreter") {
-            printInterpreter = true;
-        }
-        else if (arg == "--print-os-abi") {
-            printOsAbi = true;
-        }
-        else if (arg == "--set-os-abi") {
-            if (++i == argc) error("missing argument");
-            setOsAbi = true;
-            newOsAbi = resolveArgument(argv[i]);
-        }
-        else if (arg == "--print-soname") {
-            printSoname = true;
-        }
-        else if (arg == "--set-soname") {
-            if (++i == argc) error("missing argument");
-            setSoname = true;
-            newSoname = resolveArgument(argv[i]);
-        }
-        else if (arg == "--remove-rpath") {
-            removeRPath = true;
-        }
-        else if (arg == "--shrink-rpath") {
-            shrinkRPath = true;
-        }
-        else if (arg == "--allowed-rpath-prefixes") {
-            if (++i == argc) error("missing argument");
-            allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
-        }
-        else if (arg == "--set-rpath") {
-            if (++i == argc) error("missing argument");
-            setRPath = true;
-            newRPath = resolveArgument(argv[i]);
-        }
-        else if (arg == "--add-rpath") {
-            if (++i == argc) error("missing argument");
-            addRPath = true;
-            newRPath = resolveArgument(argv[i]);
-        }
-        else if (arg == "--print-rpath") {
-            printRPath = true;
-        }
         else if (arg == "--force-rpath") {
             /* Generally we prefer to emit DT_RUNPATH instead of
                DT_RPATH, as the latter is obsolete.  However, there is
@@ -2683,38 +2979,9 @@ static int mainWrapped(int argc, char * * argv)
                added. */
             forceRPath = true;
         }
-        else if (arg == "--print-needed") {
-            printNeeded = true;
-        }
         else if (arg == "--no-sort") {
             noSort = true;
         }
-        else if (arg == "--add-needed") {
-            if (++i == argc) error("missing argument");
-            neededLibsToAdd.insert(resolveArgument(argv[i]));
-        }
-        else if (arg == "--remove-needed") {
-            if (++i == argc) error("missing argument");
-            neededLibsToRemove.insert(resolveArgument(argv[i]));
-        }
-        else if (arg == "--replace-needed") {
-            if (i+2 >= argc) error("missing argument(s)");
-            neededLibsToReplace[ argv[i+1] ] = argv[i+2];
-            i += 2;
-        }
-        else if (arg == "--clear-symbol-version") {
-            if (++i == argc) error("missing argument");
-            symbolsToClearVersion.insert(resolveArgument(argv[i]));
-        }
-        else if (arg == "--print-execstack") {
-            printExecstack = true;
-        }
-        else if (arg == "--clear-execstack") {
-            clearExecstack = true;
-        }
-        else if (arg == "--set-execstack") {
-            setExecstack = true;
-        }
         else if (arg == "--output") {
             if (++i == argc) error("missing argument");
             outputFileName = resolveArgument(argv[i]);
@@ -2723,37 +2990,6 @@ static int mainWrapped(int argc, char * * argv)
         else if (arg == "--debug") {
             debugMode = true;
         }
-        else if (arg == "--no-default-lib") {
-            noDefaultLib = true;
-        }
-        else if (arg == "--add-debug-tag") {
-            addDebugTag = true;
-        }
-        else if (arg == "--rename-dynamic-symbols") {
-            renameDynamicSymbols = true;
-            if (++i == argc) error("missing argument");
-
-            const char* fname = argv[i];
-            std::ifstream infile(fname);
-            if (!infile) error(fmt("Cannot open map file ", fname));
-
-            std::string line, from, to;
-            size_t lineCount = 1;
-            while (std::getline(infile, line))
-            {
-                std::istringstream iss(line);
-                if (!(iss >> from))
-                    break;
-                if (!(iss >> to))
-                    error(fmt(fname, ":", lineCount, ": Map file line is missing the second element"));
-                if (symbolsToRenameKeys.count(from))
-                    error(fmt(fname, ":", lineCount, ": Name '", from, "' appears twice in the map file"));
-                if (from.find('@') != std::string_view::npos || to.find('@') != std::string_view::npos)
-                    error(fmt(fname, ":", lineCount, ": Name pair contains version tag: ", from, " ", to));
-                lineCount++;
-                symbolsToRename[*symbolsToRenameKeys.insert(from).first] = to;
-            }
-        }
         else if (arg == "--no-clobber-old-sections") {
             clobberOldSections = false;
         }
@@ -2765,11 +3001,22 @@ static int mainWrapped(int argc, char * * argv)
             printf(PACKAGE_STRING "\n");
             return 0;
         }
+        else if (arg == "--batch") {
+            if (++i == argc) error("missing argument");
+            batchFileName = argv[i];
+        }
         else {
             fileNames.push_back(arg);
         }
     }
 
+    if (!batchFileName.empty()) {
+        if (!fileNames.empty() || !outputFileName.empty() || sawOperation)
+            error("--batch takes files and operations only from the batch file");
+        patchBatch(batchFileName);
+        return 0;
+    }
+
     if (fileNames.empty()) error("missing filename");
 
     if (!outputFileName.empty() && fileNames.size() != 1)
@@ -2815,5 +3062,33 @@ ElfFile<ElfFileParamNames>::findSection(const SectionName & sectionName) const
     };
 }
 
+template<ElfFileParams>
+std::optional<size_t> ElfFile<ElfFileParamNames>::findRPathOffset() const
+{
+    auto shdrDynamic = tryFindSectionHeader(".dynamic");
+    if (!shdrDynamic || rdi(shdrDynamic->get().sh_type) == SHT_NOBITS)
+        return {};
+
+    auto shdrDynStr = tryFindSectionHeader(".dynstr");
+    if (!shdrDynStr)
+        return {};
+
+    const size_t strTab = rdi(shdrDynStr->get().sh_offset);
+
+    /* Same choice as getRPath() */
+    std::optional<size_t> offset;
+    auto dyn = (const Elf_Dyn *)(fileContents->data() + rdi(shdrDynamic->get().sh_offset));
+    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
+        if (rdi(dyn->d_tag) == DT_RPATH) {
+            if (!offset)
+                offset = strTab + rdi(dyn->d_un.d_val);
+        }
+        else if (rdi(dyn->d_tag) == DT_RUNPATH) {
+            offset = strTab + rdi(dyn->d_un.d_val);
+        }
+    }
+    return offset;
+}
+
 template class ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>;
 template class ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>;
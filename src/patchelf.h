@@ -84,6 +84,10 @@ public:
        Returns nullopt if the section is not found. */
     [[nodiscard]] std::optional<SectionInfo> findSection(const std::string & sectionName) const;
 
+    /* File offset of the string getRPath() returns (DT_RUNPATH, else
+       DT_RPATH, in .dynstr). Returns nullopt if there is none. */
+    [[nodiscard]] std::optional<size_t> findRPathOffset() const;
+
 private:
 
     struct CompPhdr
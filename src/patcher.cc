@@ -0,0 +1,1102 @@
+/*
+ * patcher.cc - Android patching of NAR contents (ELF, symlinks, scripts)
+ *
+ * Extracted from patchnar.cc so the patchers can be embedded (libpatchnar).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "patcher.h"
+#include "fdstream.h"
+#include "nar_checkpoint.h"
+#include "nar_delta.h"
+#include "nar_parallel.h"
+#include "nix_export.h"
+#include "elf.h"
+#include "patchelf.h"
+#include "data_lexers.h"
+#include "source_patcher.h"
+#include "verifier.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/regex.hpp>
+
+namespace patchnar {
+
+// ============================================================================
+// PatchConfig
+// ============================================================================
+
+PatchConfig::PatchConfig()
+    : prefix(INSTALL_PREFIX),
+      oldGlibcPath(OLD_GLIBC_PATH),
+      addPrefixToPaths{"/nix/var/"},
+      patchableLangFiles{"sh.lang", "zsh.lang"}
+{
+}
+
+void PatchConfig::log(const char* format, ...) const
+{
+    if (debug) {
+        va_list ap;
+        va_start(ap, format);
+        vfprintf(stderr, format, ap);
+        va_end(ap);
+    }
+}
+
+// Extracts basenames and validates length match
+bool PatchConfig::addMapping(const std::string& oldPath, const std::string& newPath)
+{
+    // Extract basename (everything after last /)
+    std::string oldBase = oldPath.substr(oldPath.rfind('/') + 1);
+    std::string newBase = newPath.substr(newPath.rfind('/') + 1);
+
+    // Validate same length (required for safe substitution in NAR)
+    if (oldBase.length() != newBase.length()) {
+        std::cerr << "patchnar: warning: skipping mapping " << oldBase
+                  << " -> " << newBase << " (length mismatch: "
+                  << oldBase.length() << " vs " << newBase.length() << ")\n";
+        return false;
+    }
+
+    log("  mapping: %s -> %s\n", oldBase.c_str(), newBase.c_str());
+    hashMappings.emplace(std::move(oldBase), std::move(newBase));
+    return true;
+}
+
+// Format: one mapping per line: "/nix/store/old-hash-name /nix/store/new-hash-name"
+bool PatchConfig::loadMappings(const std::string& filename)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "patchnar: warning: cannot open mappings file: " << filename << "\n";
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) continue;
+
+        size_t space = line.find(' ');
+        if (space == std::string::npos) continue;
+
+        std::string oldPath = line.substr(0, space);
+        std::string newPath = line.substr(space + 1);
+        addMapping(oldPath, newPath);
+    }
+
+    log("patchnar: loaded %zu hash mappings\n", hashMappings.size());
+    return true;
+}
+
+namespace {
+
+// Custom PreFormatter that translates Nix store paths in string literals
+// Extends CharTranslator for glibc regex replacement + manual prefix/hash handling
+class NixPathTranslator : public srchilite::CharTranslator {
+public:
+    NixPathTranslator(const PatchConfig& config, const std::string& glibcPattern)
+        : srchilite::CharTranslator(), config_(config)
+    {
+        // Use CharTranslator's regex for glibc path replacement
+        if (!glibcPattern.empty() && !config.glibcPath.empty()) {
+            set_translation(glibcPattern, config.glibcPath);
+        }
+    }
+
+protected:
+    const std::string doPreformat(const std::string& text) override {
+        const std::string& prefix = config_.prefix;
+
+        // 1. Apply CharTranslator's regex (glibc replacement)
+        std::string result = CharTranslator::doPreformat(text);
+
+        // 2. Apply hash mappings (dynamic lookup - can't use regex)
+        for (const auto& [oldHash, newHash] : config_.hashMappings) {
+            size_t pos = 0;
+            while ((pos = result.find(oldHash, pos)) != std::string::npos) {
+                result.replace(pos, oldHash.length(), newHash);
+                pos += newHash.length();
+            }
+        }
+
+        // 3. Add prefix to /nix/store/ paths (with already-prefixed check)
+        if (!prefix.empty()) {
+            size_t pos = 0;
+            while ((pos = result.find("/nix/store/", pos)) != std::string::npos) {
+                bool alreadyPrefixed = (pos >= prefix.length() &&
+                    result.substr(pos - prefix.length(), prefix.length()) == prefix);
+                if (!alreadyPrefixed) {
+                    result.insert(pos, prefix);
+                    pos += prefix.length();
+                }
+                pos += 11;  // Skip "/nix/store/"
+            }
+
+            // Add prefix to additional paths (e.g., /nix/var/)
+            for (const auto& pattern : config_.addPrefixToPaths) {
+                pos = 0;
+                while ((pos = result.find(pattern, pos)) != std::string::npos) {
+                    bool alreadyPrefixed = (pos >= prefix.length() &&
+                        result.substr(pos - prefix.length(), prefix.length()) == prefix);
+                    if (!alreadyPrefixed) {
+                        result.insert(pos, prefix);
+                        pos += prefix.length();
+                    }
+                    pos += pattern.length();
+                }
+            }
+        }
+
+        return result;
+    }
+
+private:
+    const PatchConfig& config_;
+};
+
+
+// Extensions to skip entirely (don't even call source-highlight)
+// These are documentation, binary, or compressed files that never need patching
+const std::unordered_set<std::string> SKIP_EXTENSIONS = {
+    // Documentation
+    ".html", ".htm", ".xhtml", ".css", ".svg",
+    // Images
+    ".png", ".jpg", ".jpeg", ".gif", ".ico", ".webp", ".bmp",
+    // Compressed/archives
+    ".xz", ".gz", ".bz2", ".zst", ".zip", ".tar", ".7z",
+    // Fonts
+    ".ttf", ".otf", ".woff", ".woff2", ".eot",
+    // Other binary/doc formats
+    ".pdf", ".ps", ".dvi", ".info", ".texi", ".texinfo",
+    // Haddock/Haskell docs
+    ".haddock", ".hi", ".o", ".a", ".so", ".dylib",
+};
+
+// Check if file should be skipped based on extension (non-patchable files)
+inline bool shouldSkipByExtension(const std::string& filename)
+{
+    std::string ext = getExtension(filename);
+    return !ext.empty() && SKIP_EXTENSIONS.count(ext) > 0;
+}
+
+// Apply hash mappings to content (text substitution, like sed)
+// This replaces old store path basenames with new ones
+// Spans of the content (e.g. translated strings) move with replacements
+// that change its length
+void applyHashMappings(const PatchConfig& config, std::vector<std::byte>& content,
+                       std::vector<SourceSpan>* spans = nullptr)
+{
+    if (config.hashMappings.empty()) return;
+
+    // Convert to string for easier manipulation
+    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
+    bool modified = false;
+
+    for (const auto& [oldHash, newHash] : config.hashMappings) {
+        size_t pos = 0;
+        while ((pos = str.find(oldHash, pos)) != std::string::npos) {
+            str.replace(pos, oldHash.length(), newHash);
+            if (spans && newHash.length() != oldHash.length()) {
+                auto move = [&](size_t& at) {
+                    if (at >= pos + oldHash.length()) {
+                        at = at - oldHash.length() + newHash.length();
+                    } else if (at > pos) {
+                        at = std::min(at, pos + newHash.length());
+                    }
+                };
+                for (auto& span : *spans) {
+                    move(span.begin);
+                    move(span.end);
+                }
+            }
+            pos += newHash.length();
+            modified = true;
+        }
+    }
+
+    if (modified) {
+        auto bytes = std::as_bytes(std::span(str));
+        content.assign(bytes.begin(), bytes.end());
+    }
+}
+
+// Check if content is an ELF file
+inline bool isElf(const std::span<const std::byte> content)
+{
+    if (content.size() < SELFMAG)
+        return false;
+    return memcmp(content.data(), ELFMAG, SELFMAG) == 0;
+}
+
+// Check if content has a shebang (starts with #!)
+// Used only to determine if shebang patching should be applied
+inline bool hasShebang(const std::span<const std::byte> content)
+{
+    if (content.size() < 2)
+        return false;
+    return std::to_integer<char>(content[0]) == '#' && std::to_integer<char>(content[1]) == '!';
+}
+
+// Check if ELF is 32-bit
+inline bool isElf32(const std::span<const std::byte> content)
+{
+    if (content.size() < EI_CLASS + 1)
+        return false;
+    return std::to_integer<unsigned char>(content[EI_CLASS]) == ELFCLASS32;
+}
+
+// Replace occurrences of old path with new path in string
+std::string replaceAll(std::string str,
+                       const std::string& from,
+                       const std::string& to)
+{
+    if (from.empty())
+        return str;
+
+    size_t pos = 0;
+    while ((pos = str.find(from, pos)) != std::string::npos) {
+        str.replace(pos, from.length(), to);
+        pos += to.length();
+    }
+    return str;
+}
+
+// Apply hash mappings to a string (for symlinks, etc.)
+// Returns the original string if no mappings match (avoids copy)
+std::string applyHashMappingsToString(const PatchConfig& config, std::string str)
+{
+    if (config.hashMappings.empty()) return str;
+
+    for (const auto& [oldHash, newHash] : config.hashMappings) {
+        size_t pos = 0;
+        while ((pos = str.find(oldHash, pos)) != std::string::npos) {
+            str.replace(pos, oldHash.length(), newHash);
+            pos += newHash.length();
+        }
+    }
+    return str;
+}
+
+// Unified store path transformation (glibc → hash mapping → prefix)
+// Used by: ELF interpreter, RPATH entries, symlinks
+// Order matters: glibc must be replaced before hash mappings are applied
+std::string transformStorePath(const PatchConfig& config, std::string path)
+{
+    // 1. Replace old glibc with Android glibc (must be first)
+    if (!config.oldGlibcPath.empty() && path.find(config.oldGlibcPath) != std::string::npos) {
+        path = replaceAll(std::move(path), config.oldGlibcPath, config.glibcPath);
+    }
+
+    // 2. Apply hash mappings for inter-package references
+    path = applyHashMappingsToString(config, std::move(path));
+
+    // 3. Add prefix to /nix/store paths
+    if (path.rfind("/nix/store/", 0) == 0) {
+        path.insert(0, config.prefix);
+    }
+
+    return path;
+}
+
+// Patch symlink target (takes by value to allow move semantics)
+std::string patchSymlinkTarget(const PatchConfig& config, std::string target)
+{
+    const std::string& oldGlibcPath = config.oldGlibcPath;
+
+    // Handle relative symlinks with glibc basename (e.g., ../../hash-glibc/lib/...)
+    // This must be done before transformStorePath since relative paths won't match oldGlibcPath
+    if (!oldGlibcPath.empty() && target.find(oldGlibcPath) == std::string::npos) {
+        const auto oldBase = oldGlibcPath.substr(oldGlibcPath.rfind('/') + 1);
+        const auto newBase = config.glibcPath.substr(config.glibcPath.rfind('/') + 1);
+        if (!oldBase.empty() && target.find(oldBase) != std::string::npos) {
+            target = replaceAll(std::move(target), oldBase, newBase);
+        }
+    }
+
+    return transformStorePath(config, std::move(target));
+}
+
+// Build new RPATH from old RPATH by transforming each entry
+std::string buildNewRpath(const PatchConfig& config, const std::string& oldRpath)
+{
+    if (oldRpath.empty()) {
+        return {};
+    }
+
+    std::string newRpath;
+    newRpath.reserve(oldRpath.size() + config.prefix.size() * 4);  // Estimate with prefix additions
+
+    std::string current;
+
+    for (size_t i = 0; i <= oldRpath.size(); ++i) {
+        if (i == oldRpath.size() || oldRpath[i] == ':') {
+            if (!current.empty()) {
+                if (!newRpath.empty()) {
+                    newRpath += ':';
+                }
+                newRpath += transformStorePath(config, std::move(current));
+                current.clear();
+            }
+        } else {
+            current += oldRpath[i];
+        }
+    }
+
+    return newRpath;
+}
+
+
+// Patch ELF binary content
+template<class ElfFileType>
+std::vector<std::byte> patchElfContent(
+    const PatchConfig& config,
+    const std::span<const std::byte> content,
+    [[maybe_unused]] const bool executable)
+{
+    // Convert span to vector for patchelf (unique_ptr converts to shared_ptr)
+    auto fileContents = std::make_unique<std::vector<unsigned char>>(
+        reinterpret_cast<const unsigned char*>(content.data()),
+        reinterpret_cast<const unsigned char*>(content.data()) + content.size());
+
+    try {
+        ElfFileType elfFile(std::move(fileContents));
+
+        // Get current interpreter
+        std::string interp;
+        try {
+            interp = elfFile.getInterpreter();
+        } catch (...) {
+            // No interpreter (probably a shared library)
+            interp.clear();
+        }
+
+        // Patch interpreter using unified transformation
+        if (!interp.empty()) {
+            std::string newInterp = transformStorePath(config, interp);
+            if (newInterp != interp) {
+                config.log("  interpreter: %s -> %s\n", interp.c_str(), newInterp.c_str());
+                elfFile.setInterpreter(newInterp);
+            }
+        }
+
+        // Patch RPATH/RUNPATH
+        try {
+            std::string currentRpath = elfFile.getRPath();
+            if (!currentRpath.empty()) {
+                std::string newRpath = buildNewRpath(config, currentRpath);
+                if (newRpath != currentRpath) {
+                    config.log("  rpath: %s -> %s\n", currentRpath.c_str(), newRpath.c_str());
+                    elfFile.modifyRPath(ElfFileType::rpSet, {}, newRpath);
+                }
+            }
+        } catch (...) {
+            // No RPATH section - that's fine
+        }
+
+        elfFile.rewriteSections();
+
+        // Convert back to std::byte
+        auto bytes = std::as_bytes(std::span(*elfFile.fileContents));
+        return std::vector<std::byte>(bytes.begin(), bytes.end());
+    } catch (const std::exception& e) {
+        config.log("  ELF patch failed: %s\n", e.what());
+        // Return original content on error
+        return std::vector<std::byte>(content.begin(), content.end());
+    }
+}
+
+// Patch shebang only (fallback when language detection fails)
+// Used for files with shebangs that can't be processed by source-highlight
+// Patches in place; content is left untouched when nothing changes
+void patchShebangOnly(const PatchConfig& config, std::vector<std::byte>& content)
+{
+    const std::string& prefix = config.prefix;
+    if (prefix.empty() || !hasShebang(content)) {
+        return;
+    }
+
+    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
+
+    // Find end of shebang line
+    size_t shebangEnd = str.find('\n');
+    if (shebangEnd == std::string::npos) shebangEnd = str.size();
+
+    std::string shebang = str.substr(0, shebangEnd);
+
+    // Only patch if shebang contains /nix/store
+    if (shebang.find("/nix/store/") == std::string::npos) {
+        return;
+    }
+
+    // Apply transformations to the shebang
+    // Note: transformStorePath only handles one path, so we need to find all paths
+    std::string newShebang = shebang;
+
+    // Replace glibc paths
+    if (!config.oldGlibcPath.empty()) {
+        newShebang = replaceAll(std::move(newShebang), config.oldGlibcPath, config.glibcPath);
+    }
+
+    // Apply hash mappings
+    newShebang = applyHashMappingsToString(config, std::move(newShebang));
+
+    // Add prefix to all /nix/store paths
+    size_t pos = 2;  // Skip #!
+    while ((pos = newShebang.find("/nix/store/", pos)) != std::string::npos) {
+        if (pos < prefix.length() ||
+            newShebang.substr(pos - prefix.length(), prefix.length()) != prefix) {
+            newShebang.insert(pos, prefix);
+            pos += prefix.length();
+        }
+        pos += 11;  // Skip "/nix/store/"
+    }
+
+    if (newShebang != shebang) {
+        config.log("  shebang (fallback): %s -> %s\n", shebang.c_str(), newShebang.c_str());
+        str.replace(0, shebangEnd, newShebang);
+        content.resize(str.size());
+        std::memcpy(content.data(), str.data(), str.size());
+    }
+}
+
+// The needles' matches among the anchors the reader found, or nullopt if
+// it did not look for all of them
+std::optional<std::vector<NeedleMatch>> needleMatches(std::span<const std::string> needles,
+                                                      const nar::ContentAnchors& anchors)
+{
+    if (!anchors.anchors || needles.empty()) {
+        return std::nullopt;
+    }
+    std::vector<bool> wanted(anchors.anchors->size(), false);
+    for (const auto& needle : needles) {
+        auto it = std::find(anchors.anchors->begin(), anchors.anchors->end(), needle);
+        if (it == anchors.anchors->end()) {
+            return std::nullopt;
+        }
+        wanted[static_cast<size_t>(it - anchors.anchors->begin())] = true;
+    }
+
+    std::vector<NeedleMatch> matches;
+    for (const auto& match : anchors.matches) {
+        if (wanted[match.anchor]) {
+            matches.push_back({match.offset, match.offset + (*anchors.anchors)[match.anchor].size()});
+        }
+    }
+    return matches;
+}
+
+// Patch source file content using source-highlight
+// Strings AND comments (including shebangs) are patched via NixPathTranslator
+// Patches in place; content is left untouched when nothing changes.
+// translated, if given, gets where the translated spans are in the result
+void patchSource(const PatchConfig& config, const std::string& glibcPattern,
+                 std::span<const std::string> needles, const nar::ContentAnchors& anchors,
+                 std::vector<std::byte>& content, const std::string& langFile,
+                 std::vector<SourceSpan>* translated)
+{
+    if (config.prefix.empty() || langFile.empty()) {
+        return;
+    }
+
+    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
+    auto makeTranslator = [&]() -> std::unique_ptr<srchilite::CharTranslator> {
+        return std::make_unique<NixPathTranslator>(config, glibcPattern);
+    };
+    const auto matches = needleMatches(needles, anchors);
+    std::string patched = patchSourceStrings(str, langFile, makeTranslator, config.tokenizeThreads,
+                                             config.nativeLexers, needles,
+                                             matches ? &*matches : nullptr, translated);
+
+    if (patched != str) {
+        content.resize(patched.size());
+        std::memcpy(content.data(), patched.data(), patched.size());
+    }
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Patcher
+// ============================================================================
+
+Patcher::Patcher(const PatchConfig& config)
+    : config_(&config)
+{
+    if (!config.oldGlibcPath.empty()) {
+        glibcPattern_ = boost::regex_replace(
+            config.oldGlibcPath, boost::regex(R"([.^$|()[\]{}*+?\\])"), R"(\\$&)");
+    }
+
+    // Hash mappings are left out: applyPlan maps the whole file anyway
+    if (config.localTokenization) {
+        needles_.push_back("/nix/store/");
+        needles_.insert(needles_.end(), config.addPrefixToPaths.begin(), config.addPrefixToPaths.end());
+        if (!glibcPattern_.empty() && !config.glibcPath.empty()) {
+            needles_.push_back(config.oldGlibcPath);
+        }
+    }
+}
+
+// Main content patcher (in place)
+// The path parameter is the relative path within the NAR (e.g., "bin/bash", "share/nix/nix.sh")
+// The action comes from --rule and can bypass classification for a subtree
+void Patcher::patchContent(
+    std::vector<std::byte>& content,
+    const bool executable,
+    const std::string& path,
+    const nar::PathAction& action,
+    const nar::ContentAnchors& anchors) const
+{
+    const FilePlan plan = planContent(content, path, action);
+    std::vector<SourceSpan> translated;
+    applyPlan(plan, content, executable, anchors, config_->verifier ? &translated : nullptr);
+    if (config_->verifier) {
+        config_->verifier->checkFile(path, content, plan, translated);
+    }
+}
+
+FilePlan Patcher::planContent(
+    std::span<const std::byte> content,
+    const std::string& path,
+    const nar::PathAction& action) const
+{
+    using Action = nar::PathAction::Kind;
+    const PatchConfig& config = *config_;
+
+    // === RULE-FORCED HANDLING ===
+    if (action.kind == Action::MapOnly) {
+        return {FilePlan::Kind::MapOnly, {}};
+    }
+    if (action.kind == Action::Script) {
+        config.log("  patching source %s (%zu bytes, lang=%s, by rule)\n",
+                   path.c_str(), content.size(), action.lang.c_str());
+        return {FilePlan::Kind::Source, action.lang};
+    }
+    if (action.kind == Action::Elf) {
+        if (isElf(content)) {
+            config.log("  patching ELF %s (%zu bytes, by rule)\n", path.c_str(), content.size());
+            return {FilePlan::Kind::Elf, {}};
+        }
+        config.log("  map-only %s (elf rule, not an ELF)\n", path.c_str());
+        return {FilePlan::Kind::MapOnly, {}};
+    }
+
+    // Extract filename from path
+    std::string filename;
+    size_t lastSlash = path.rfind('/');
+    filename = (lastSlash != std::string::npos) ? path.substr(lastSlash + 1) : path;
+
+    // === ELF FILES ===
+    if (isElf(content)) {
+        config.log("  patching ELF %s (%zu bytes)\n", path.c_str(), content.size());
+        return {FilePlan::Kind::Elf, {}};
+    }
+
+    // === SKIP NON-PATCHABLE EXTENSIONS ===
+    if (shouldSkipByExtension(filename)) {
+        config.log("  skipping %s (non-patchable extension)\n", path.c_str());
+        return {FilePlan::Kind::MapOnly, {}};
+    }
+
+    // === LANGUAGE DETECTION ===
+    // Data formats with native lexers first: no lang.map lookup or copy
+    const std::string_view view(reinterpret_cast<const char*>(content.data()), content.size());
+    std::string langFile = detectDataFormat(filename, view);
+    if (langFile.empty()) {
+        langFile = detectLanguageFromFile(filename, std::string(view));
+    }
+
+    // === SOURCE PATCHING (strings + comments including shebangs) ===
+    if (hasOnlyNativeLexer(langFile)) {
+        if (!config.dataFormats) {
+            config.log("  skipping %s (lang=%s, --no-data-formats)\n", path.c_str(), langFile.c_str());
+            return {FilePlan::Kind::MapOnly, {}};
+        }
+        config.log("  patching data %s (%zu bytes, lang=%s)\n",
+                   path.c_str(), content.size(), langFile.c_str());
+        return {FilePlan::Kind::Source, std::move(langFile)};
+    }
+    if (!langFile.empty() && config.patchableLangFiles.count(langFile)) {
+        config.log("  patching source %s (%zu bytes, lang=%s)\n",
+                   path.c_str(), content.size(), langFile.c_str());
+        return {FilePlan::Kind::Source, std::move(langFile)};
+    }
+    if (hasShebang(content)) {
+        // Fallback: patch shebang only when language detection fails
+        // This handles scripts with unusual interpreters (e.g., ld.so)
+        config.log("  patching shebang-only %s (%zu bytes)\n", path.c_str(), content.size());
+        return {FilePlan::Kind::Shebang, {}};
+    }
+    if (!langFile.empty()) {
+        config.log("  skipping %s (lang=%s not in whitelist)\n", path.c_str(), langFile.c_str());
+    }
+    return {FilePlan::Kind::MapOnly, {}};
+}
+
+void Patcher::applyPlan(const FilePlan& plan, std::vector<std::byte>& content, bool executable,
+                        const nar::ContentAnchors& anchors, std::vector<SourceSpan>* translated) const
+{
+    const PatchConfig& config = *config_;
+
+    switch (plan.kind) {
+    case FilePlan::Kind::MapOnly:
+        break;
+    case FilePlan::Kind::Source:
+        patchSource(config, glibcPattern_, needles_, anchors, content, plan.langFile, translated);
+        break;
+    case FilePlan::Kind::Elf:
+        content = isElf32(content)
+            ? patchElfContent<ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>>(config, content, executable)
+            : patchElfContent<ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>>(config, content, executable);
+        break;
+    case FilePlan::Kind::Shebang:
+        patchShebangOnly(config, content);
+        break;
+    }
+
+    applyHashMappings(config, content, translated);
+}
+
+void Patcher::patchSymlink(std::string& target, const std::string& path, const nar::PathAction& action) const
+{
+    if (action.kind == nar::PathAction::Kind::MapOnly) {
+        target = applyHashMappingsToString(*config_, std::move(target));
+    } else {
+        target = patchSymlinkTarget(*config_, std::move(target));
+    }
+    if (config_->verifier) {
+        config_->verifier->checkSymlink(path, target);
+    }
+}
+
+// Store path as the patched closure names it: glibc substitution and
+// hash mappings, no prefix
+std::string Patcher::mapStorePath(const std::string& path) const
+{
+    std::string mapped = path;
+    if (!config_->oldGlibcPath.empty() && !config_->glibcPath.empty()) {
+        mapped = replaceAll(std::move(mapped), config_->oldGlibcPath, config_->glibcPath);
+    }
+    return applyHashMappingsToString(*config_, std::move(mapped));
+}
+
+// Tokenization is far slower per byte than ELF rewriting, which is
+// slower than a plain hash-mapping scan
+uint64_t Patcher::estimateCost(const nar::NarNode& node, std::span<const std::byte> head) const
+{
+    using Action = nar::PathAction::Kind;
+    const auto kind = node.action ? node.action->kind : Action::Default;
+
+    if (kind == Action::MapOnly) {
+        return node.contentSize;
+    }
+    if (kind == Action::Script || (kind == Action::Default && hasShebang(head))) {
+        return node.contentSize * 16;
+    }
+    if (isElf(head)) {
+        return node.contentSize * 4;
+    }
+    return node.contentSize;
+}
+
+// ============================================================================
+// patchNar / patchStream
+// ============================================================================
+
+void patchNar(const PatchConfig& config, int inFd, std::ostream& out, int placeFd, unsigned jobs)
+{
+    const nar::PathRules* rules = config.pathRules.empty() ? nullptr : &config.pathRules;
+
+    const bool narOnly = config.inputFormat == nar::ArchiveFormat::Nar &&
+                         config.outputFormat == nar::ArchiveFormat::Nar;
+
+    if (jobs > 1 && narOnly && nar::isRegularFile(inFd)) {
+        // Seekable input: index, patch out of order, assemble in order
+        config.log("patchnar: parallel processing with %u jobs\n", jobs);
+        nar::FdInputStream input(inFd);
+        const Patcher patcher(config);
+        nar::ParallelNarProcessor<Patcher> processor(input, inFd, out, jobs, patcher);
+        processor.setPathRules(rules);
+        processor.setAnchors(patcher.anchors());
+        std::vector<nar::CpuClass> classes = nar::cpuClasses();
+        if (classes.size() > 1) {
+            for (const auto& cpuClass : classes) {
+                config.log("patchnar: %zu CPUs of capacity %llu\n", cpuClass.cpus.size(),
+                           static_cast<unsigned long long>(cpuClass.capacity));
+            }
+        }
+        processor.setCpuClasses(std::move(classes));
+        processor.setAdaptiveWorkers(true, [&config](unsigned active, unsigned workers) {
+            config.log("patchnar: %u of %u workers active\n", active, workers);
+        });
+        if (placeFd >= 0 && nar::isPlaceableFile(placeFd)) {
+            // Regular-file output: pwrite each node into place
+            config.log("patchnar: placing output with pwrite\n");
+            processor.setOutputFd(placeFd);
+        }
+        processor.process();
+    } else {
+        // Streaming: a reader thread prefetches input while we patch
+        nar::ReadAheadInputStream input(inFd);
+        patchStream(config, input, out);
+    }
+}
+
+namespace {
+
+// Parses the input once; every node is patched and written once per variant
+class VariantProcessor : public nar::NarStream {
+public:
+    VariantProcessor(std::istream& in, const std::vector<PatchConfig>& configs,
+                     const std::vector<std::ostream*>& outs)
+        : NarStream(in, *outs.front()), outs_(outs)
+    {
+        patchers_.reserve(configs.size());
+        std::vector<std::string> anchors;
+        for (const auto& config : configs) {
+            patchers_.emplace_back(config);
+            for (const auto& anchor : patchers_.back().anchors()) {
+                if (std::find(anchors.begin(), anchors.end(), anchor) == anchors.end()) {
+                    anchors.push_back(anchor);
+                }
+            }
+        }
+        setAnchors(std::move(anchors));
+    }
+
+    void process();
+
+private:
+    void writeTo(size_t variant, const nar::NarNode& node) { nar::writeNarNode(*outs_[variant], node); }
+
+    std::vector<Patcher> patchers_;
+    const std::vector<std::ostream*>& outs_;
+};
+
+void VariantProcessor::process()
+{
+    std::string header;
+    nar::appendNarString(header, nar::NAR_MAGIC);
+    for (std::ostream* out : outs_) {
+        out->write(header.data(), header.size());
+    }
+
+    static const nar::PathAction defaultAction;
+    const size_t variants = patchers_.size();
+    std::vector<std::byte> original;
+    std::vector<SourceSpan> translated;
+
+    for (auto&& node : parseGen_) {
+        const nar::PathAction& action = node.action ? *node.action : defaultAction;
+        const bool skip = action.kind == nar::PathAction::Kind::Skip;
+
+        if (!skip && node.type == nar::NarNode::Type::RegularFile) {
+            // Classification and language detection are shared
+            const FilePlan plan = patchers_.front().planContent(node.content, node.path, action);
+            if (variants > 1) {
+                original = node.content;
+            }
+            for (size_t i = 0; i < variants; ++i) {
+                if (i > 0) {
+                    node.content.assign(original.begin(), original.end());
+                }
+                Verifier* verifier = patchers_[i].config().verifier;
+                patchers_[i].applyPlan(plan, node.content, node.executable, node.anchors,
+                                       verifier ? &translated : nullptr);
+                if (verifier) {
+                    verifier->checkFile(node.path, node.content, plan, translated);
+                }
+                writeTo(i, node);
+            }
+        } else if (!skip && node.type == nar::NarNode::Type::Symlink) {
+            const std::string target = node.target;
+            for (size_t i = 0; i < variants; ++i) {
+                node.target = target;
+                patchers_[i].patchSymlink(node.target, node.path, action);
+                writeTo(i, node);
+            }
+        } else {
+            for (size_t i = 0; i < variants; ++i) {
+                writeTo(i, node);
+            }
+        }
+    }
+
+    for (std::ostream* out : outs_) {
+        out->flush();
+    }
+}
+
+} // anonymous namespace
+
+void patchVariants(const std::vector<PatchConfig>& configs, std::istream& in,
+                   const std::vector<std::ostream*>& outs)
+{
+    if (configs.empty() || configs.size() != outs.size()) {
+        throw std::invalid_argument("patchVariants: one output per config required");
+    }
+    for (const auto& config : configs) {
+        if (config.inputFormat != nar::ArchiveFormat::Nar || config.outputFormat != nar::ArchiveFormat::Nar) {
+            throw std::invalid_argument("variants are only written between NARs");
+        }
+    }
+
+    VariantProcessor processor(in, configs, outs);
+    processor.setPathRules(configs.front().pathRules.empty() ? nullptr : &configs.front().pathRules);
+    processor.process();
+}
+
+void writeDelta(const PatchConfig& config, std::istream& in, std::ostream& delta)
+{
+    if (config.inputFormat != nar::ArchiveFormat::Nar || config.outputFormat != nar::ArchiveFormat::Nar) {
+        throw std::invalid_argument("deltas are only written between NARs");
+    }
+
+    // The patched NAR is only hashed, for the delta to record
+    nar::HashingOutputBuf hashing;
+    std::ostream patched(&hashing);
+    nar::DeltaWriter writer(delta);
+
+    const Patcher patcher(config);
+    nar::BasicNarDeltaProcessor<Patcher> processor(in, patched, writer, patcher);
+    processor.setPathRules(config.pathRules.empty() ? nullptr : &config.pathRules);
+    processor.setAnchors(patcher.anchors());
+    processor.process();
+
+    const uint64_t size = hashing.size();
+    writer.finish(size, hashing.finish());
+
+    const auto& stats = writer.stats();
+    config.log("patchnar: delta: %zu files, %zu symlinks, %llu bytes copied, %llu literal\n",
+               stats.files, stats.symlinks,
+               static_cast<unsigned long long>(stats.copiedBytes),
+               static_cast<unsigned long long>(stats.literalBytes));
+}
+
+std::pair<uint64_t, nar::Sha256::Digest> patchNarCheckpointed(
+    const PatchConfig& config, int inFd, int outFd, const std::string& checkpointFile,
+    uint64_t interval, bool resume)
+{
+    if (config.inputFormat != nar::ArchiveFormat::Nar || config.outputFormat != nar::ArchiveFormat::Nar) {
+        throw std::invalid_argument("checkpoints are only written between NARs");
+    }
+    if (!nar::isRegularFile(inFd) || !nar::isPlaceableFile(outFd)) {
+        throw std::invalid_argument("checkpoints need regular files as input and output (output not O_APPEND)");
+    }
+
+    nar::Checkpoint checkpoint;
+    const bool resuming = resume && ::access(checkpointFile.c_str(), F_OK) == 0;
+    if (resuming) {
+        checkpoint = nar::loadCheckpoint(checkpointFile);
+        struct stat st;
+        if (::fstat(outFd, &st) != 0 || static_cast<uint64_t>(st.st_size) < checkpoint.outputOffset) {
+            throw std::runtime_error("output is shorter than the checkpoint (opened with > instead of 1<>?)");
+        }
+        config.log("patchnar: resuming at input offset %llu, output offset %llu\n",
+                   static_cast<unsigned long long>(checkpoint.inputOffset),
+                   static_cast<unsigned long long>(checkpoint.outputOffset));
+    } else {
+        const off_t pos = ::lseek(outFd, 0, SEEK_CUR);
+        if (pos < 0) {
+            throw std::runtime_error(std::string("cannot seek output: ") + strerror(errno));
+        }
+        checkpoint.outputOffset = static_cast<uint64_t>(pos);
+        checkpoint.hashState = nar::Sha256().saveState();
+    }
+    const uint64_t base = checkpoint.outputOffset - checkpoint.narSize;
+
+    // Whatever a crashed run wrote past the checkpoint is redone
+    if (::ftruncate(outFd, static_cast<off_t>(checkpoint.outputOffset)) != 0 ||
+        ::lseek(outFd, static_cast<off_t>(checkpoint.outputOffset), SEEK_SET) < 0) {
+        throw std::runtime_error(std::string("cannot position output: ") + strerror(errno));
+    }
+
+    nar::FdInputStream input(inFd);
+    input.exceptions(std::ios_base::badbit);
+    if (resuming && !input.seekg(static_cast<std::streamoff>(checkpoint.inputOffset))) {
+        throw std::runtime_error("cannot seek input to the checkpoint");
+    }
+
+    std::pair<uint64_t, nar::Sha256::Digest> result;
+    {
+        nar::WriteBehindOutputBuf writer(outFd);
+        nar::HashingOutputBuf hashing(&writer, nar::Sha256::loadState(checkpoint.hashState),
+                                      checkpoint.narSize);
+        std::ostream output(&hashing);
+        output.exceptions(std::ios_base::badbit);
+
+        // Called with the output flushed: make it durable before the
+        // checkpoint that claims it
+        auto save = [&](uint64_t inputOffset, const std::vector<std::string>& directories) {
+            if (::fdatasync(outFd) != 0) {
+                throw std::runtime_error(std::string("cannot sync output: ") + strerror(errno));
+            }
+            nar::saveCheckpoint(checkpointFile, {
+                .inputOffset = inputOffset,
+                .outputOffset = base + hashing.size(),
+                .narSize = hashing.size(),
+                .directories = directories,
+                .hashState = hashing.hash().saveState(),
+            });
+            config.log("patchnar: checkpoint at input offset %llu\n",
+                       static_cast<unsigned long long>(inputOffset));
+        };
+
+        const Patcher patcher(config);
+        nar::BasicNarCheckpointProcessor<Patcher> processor(input, output, interval, save, patcher);
+        processor.setPathRules(config.pathRules.empty() ? nullptr : &config.pathRules);
+        processor.setAnchors(patcher.anchors());
+        if (resuming) {
+            processor.resume(checkpoint.directories);
+        }
+        processor.process();
+
+        result = {hashing.size(), hashing.finish()};
+    }
+
+    if (::unlink(checkpointFile.c_str()) != 0 && errno != ENOENT) {
+        throw std::runtime_error("cannot remove checkpoint " + checkpointFile + ": " + strerror(errno));
+    }
+    return result;
+}
+
+size_t patchExport(const PatchConfig& config, std::istream& in, ExportSink& sink)
+{
+    const nar::PathRules* rules = config.pathRules.empty() ? nullptr : &config.pathRules;
+    const Patcher patcher(config);
+    size_t paths = 0;
+
+    while (nar::readExportStart(in)) {
+        // The NAR parser stops right after the NAR, before the metadata
+        nar::BasicNarProcessor<Patcher> processor(in, sink.beginPath(), patcher);
+        processor.setPathRules(rules);
+        processor.setAnchors(patcher.anchors());
+        processor.process();
+
+        nar::ExportMetadata metadata = nar::readExportMetadata(in);
+        config.log("patchnar: export: %s\n", metadata.path.c_str());
+        metadata.path = patcher.mapStorePath(metadata.path);
+        for (auto& reference : metadata.references) {
+            reference = patcher.mapStorePath(reference);
+        }
+        if (!metadata.deriver.empty()) {
+            metadata.deriver = patcher.mapStorePath(metadata.deriver);
+        }
+        sink.endPath(metadata);
+        paths++;
+    }
+
+    config.log("patchnar: export: %zu paths patched\n", paths);
+    return paths;
+}
+
+namespace {
+
+// Re-frames patched paths as an export stream
+class ExportStreamSink : public ExportSink {
+public:
+    explicit ExportStreamSink(std::ostream& out) : out_(out) {}
+
+    std::ostream& beginPath() override
+    {
+        nar::writeExportStart(out_);
+        return out_;
+    }
+
+    void endPath(const nar::ExportMetadata& metadata) override
+    {
+        nar::writeExportMetadata(out_, metadata);
+    }
+
+private:
+    std::ostream& out_;
+};
+
+} // anonymous namespace
+
+void patchStream(const PatchConfig& config, std::istream& in, std::ostream& out)
+{
+    const bool exportIn = config.inputFormat == nar::ArchiveFormat::Export;
+    const bool exportOut = config.outputFormat == nar::ArchiveFormat::Export;
+    if (exportIn != exportOut) {
+        throw std::invalid_argument("export streams can only be converted to export streams");
+    }
+    if (exportIn) {
+        ExportStreamSink sink(out);
+        patchExport(config, in, sink);
+        nar::writeExportEnd(out);
+        out.flush();
+        return;
+    }
+
+    const Patcher patcher(config);
+    nar::BasicNarProcessor<Patcher> processor(in, out, patcher);
+    processor.setPathRules(config.pathRules.empty() ? nullptr : &config.pathRules);
+    processor.setInputFormat(config.inputFormat);
+    if (config.inputFormat == nar::ArchiveFormat::Nar) {
+        processor.setAnchors(patcher.anchors());
+    }
+    processor.setOutputFormat(config.outputFormat);
+    processor.process();
+}
+
+// ============================================================================
+// patchBatch
+// ============================================================================
+
+std::vector<std::exception_ptr> patchBatch(const PatchConfig& config,
+                                           const std::vector<nar::BatchItem>& items,
+                                           unsigned workers, uint64_t memoryBudget)
+{
+    // The pool is the parallelism; scripts are tokenized on their worker
+    PatchConfig batchConfig = config;
+    batchConfig.tokenizeThreads = 1;
+    const Patcher patcher(batchConfig);
+    const nar::PathRules* rules = config.pathRules.empty() ? nullptr : &config.pathRules;
+
+    return nar::runBatch(items, workers, memoryBudget, [&](const nar::BatchItem& item) {
+        const int inFd = ::open(item.input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (inFd < 0) {
+            throw std::runtime_error("cannot open " + item.input + ": " + std::strerror(errno));
+        }
+        try {
+            std::ofstream out(item.output, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("cannot create " + item.output);
+            }
+            out.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+
+            nar::FdInputStream in(inFd);
+            nar::BasicNarProcessor<Patcher> processor(in, out, patcher);
+            processor.setPathRules(rules);
+            processor.setAnchors(patcher.anchors());
+            processor.process();
+            out.close();
+        } catch (...) {
+            ::close(inFd);
+            ::unlink(item.output.c_str());
+            throw;
+        }
+        ::close(inFd);
+        config.log("patchnar: batch: patched %s\n", item.input.c_str());
+    });
+}
+
+} // namespace patchnar
@@ -0,0 +1,235 @@
+/*
+ * patcher.h - Android patching of NAR contents (ELF, symlinks, scripts)
+ *
+ * PatchConfig holds everything that used to be patchnar's global state:
+ * prefix, glibc substitution, hash mappings, language whitelist and path
+ * rules. Patcher applies one config to file contents and symlink targets
+ * and is the PatchPolicy the NAR processors are instantiated with.
+ *
+ * A config is read-only while patching, so one config can back any number
+ * of Patchers and processors on any threads.
+ */
+
+#ifndef PATCHER_H
+#define PATCHER_H
+
+#include "nar.h"
+#include "nar_batch.h"
+#include "nix_export.h"
+#include "path_rules.h"
+#include "script_lexers.h"
+#include "sha256.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace patchnar {
+
+class Verifier;
+
+// ============================================================================
+// PatchConfig - What to patch and how
+// ============================================================================
+
+struct PatchConfig {
+    // Starts from the compile-time settings (INSTALL_PREFIX, OLD_GLIBC_PATH)
+    PatchConfig();
+
+    std::string prefix;        // Installation prefix added to /nix/store paths
+    std::string oldGlibcPath;  // Standard glibc store path to substitute
+    std::string glibcPath;     // Android glibc store path (replacement)
+
+    // Additional paths to prefix in script strings
+    // Default includes /nix/var/ which is commonly needed for nix daemon scripts
+    std::vector<std::string> addPrefixToPaths;
+
+    // Whitelist of language files worth tokenizing for string literal patching
+    // Default: shell scripts only
+    std::unordered_set<std::string> patchableLangFiles;
+
+    // Tokenize python.lang and perl.lang with the native lexers instead of
+    // source-highlight
+    bool nativeLexers = true;
+
+    // Patch pkg-config (*.pc) and libtool (*.la) files with their native
+    // data lexers; they are not languages --add-lang can name
+    bool dataFormats = true;
+
+    // Tokenize shell scripts with source-highlight only around the store
+    // paths in them (from lexer restart points) instead of from the top
+    bool localTokenization = true;
+
+    // Threads for tokenizing one huge shell script in pieces split at
+    // lexer restart points (1 = serial)
+    unsigned tokenizeThreads = 1;
+
+    // Hash mappings for inter-package reference substitution
+    // Maps old store path basename to new store path basename
+    // e.g., "abc123...-bash-5.2" -> "xyz789...-bash-5.2"
+    std::map<std::string, std::string> hashMappings;
+
+    // Per-subtree actions (evaluated by the NAR parser)
+    nar::PathRules pathRules;
+
+    // Archive formats patchNar() reads and writes (tar is streamed only)
+    nar::ArchiveFormat inputFormat = nar::ArchiveFormat::Nar;
+    nar::ArchiveFormat outputFormat = nar::ArchiveFormat::Nar;
+
+    // Checks every patched node when set (--verify); not owned
+    Verifier* verifier = nullptr;
+
+    bool debug = false;
+
+    // Add a single hash mapping from full store paths
+    // Basenames must have the same length; returns false (with a warning)
+    // when they do not
+    bool addMapping(const std::string& oldPath, const std::string& newPath);
+
+    // Load "OLD_PATH NEW_PATH" lines; returns false if the file cannot be read
+    bool loadMappings(const std::string& filename);
+
+    // printf-style output to stderr when debug is set
+    void log(const char* format, ...) const __attribute__((format(printf, 2, 3)));
+};
+
+// ============================================================================
+// FilePlan - How a file is patched
+// ============================================================================
+
+// Decided from the file alone (contents, name, path rule and the
+// patchable languages), so configs that differ only in their targets
+// (prefix, glibc, mappings) can share it
+struct FilePlan {
+    enum class Kind {
+        MapOnly,  // Hash mappings only
+        Source,   // Strings and comments of langFile, then hash mappings
+        Elf,      // Interpreter and RPATH, then hash mappings
+        Shebang,  // Shebang line only, then hash mappings
+    };
+
+    Kind kind;
+    std::string langFile;  // For Kind::Source
+};
+
+// ============================================================================
+// Patcher - PatchPolicy applying a PatchConfig
+// ============================================================================
+
+class Patcher {
+public:
+    // `config` must outlive the Patcher and stay unchanged while in use
+    explicit Patcher(const PatchConfig& config);
+
+    // PatchPolicy interface (content is patched in place)
+    void patchContent(std::vector<std::byte>& content, bool executable,
+                      const std::string& path, const nar::PathAction& action,
+                      const nar::ContentAnchors& anchors = {}) const;
+    void patchSymlink(std::string& target, const std::string& path, const nar::PathAction& action) const;
+
+    // patchContent in two steps: classify (includes language detection),
+    // then rewrite for this config's targets
+    FilePlan planContent(std::span<const std::byte> content, const std::string& path,
+                         const nar::PathAction& action) const;
+    // translated, if given, gets where the strings and comments passed
+    // through the translator are in the result (Kind::Source)
+    void applyPlan(const FilePlan& plan, std::vector<std::byte>& content, bool executable,
+                   const nar::ContentAnchors& anchors = {},
+                   std::vector<SourceSpan>* translated = nullptr) const;
+
+    // Strings for the NAR reader to find while reading contents
+    // (NarStream::setAnchors); patchContent uses them if they are found
+    const std::vector<std::string>& anchors() const { return needles_; }
+
+    // Store path as it appears in metadata (export streams, narinfo):
+    // glibc substitution and hash mappings, but no prefix
+    std::string mapStorePath(const std::string& path) const;
+
+    // Relative patching cost for ParallelNarProcessor scheduling
+    uint64_t estimateCost(const nar::NarNode& node, std::span<const std::byte> head) const;
+
+    const PatchConfig& config() const { return *config_; }
+
+private:
+    const PatchConfig* config_;
+    std::string glibcPattern_;  // oldGlibcPath escaped for CharTranslator regex
+    std::vector<std::string> needles_;  // What NixPathTranslator can change
+};
+
+// ============================================================================
+// patchNar - Patch a whole NAR with the best processor for the descriptors
+// ============================================================================
+
+// Reads the NAR from inFd and writes the patched NAR to `out`.
+// When jobs > 1 and inFd is a regular file, files are indexed and patched
+// in parallel; then, if placeFd is a regular file (not O_APPEND), output is
+// pwrite()n into placeFd at its current offset instead of going to `out`.
+// Otherwise the NAR is streamed with a read-ahead thread on inFd; tar
+// input or output (config.inputFormat/outputFormat) is always streamed.
+// Pass placeFd = -1 to always write through `out`.
+void patchNar(const PatchConfig& config, int inFd, std::ostream& out, int placeFd, unsigned jobs);
+
+// Serial streaming patch of any input format; export streams have every
+// NAR patched and their metadata paths mapped with Patcher::mapStorePath
+void patchStream(const PatchConfig& config, std::istream& in, std::ostream& out);
+
+// Patch one NAR for several targets in a single pass: outs[i] receives
+// the NAR patched with configs[i]. Parsing, path rules and file
+// classification (configs[0]'s rules and languages, which all configs
+// must share) happen once; only the rewrites run per config.
+void patchVariants(const std::vector<PatchConfig>& configs, std::istream& in,
+                   const std::vector<std::ostream*>& outs);
+
+// Patch a NAR from `in` and write a delta from it to the patched NAR
+// (see nar_delta.h) to `delta` instead of the NAR itself
+void writeDelta(const PatchConfig& config, std::istream& in, std::ostream& delta);
+
+// Patch the NAR in regular file inFd into regular file outFd (not
+// O_APPEND) serially, saving a checkpoint (see nar_checkpoint.h) to
+// checkpointFile after every `interval` input bytes. With `resume` and an
+// existing checkpointFile, both descriptors are repositioned and patching
+// continues from the checkpoint; otherwise it starts at their current
+// offsets. The checkpoint is removed once the NAR is complete.
+// Returns the size and SHA-256 of the whole patched NAR.
+std::pair<uint64_t, nar::Sha256::Digest> patchNarCheckpointed(
+    const PatchConfig& config, int inFd, int outFd, const std::string& checkpointFile,
+    uint64_t interval, bool resume);
+
+// Patch every NAR file in `items` into its output file, `workers` at a
+// time on one pool sharing a single Patcher (see nar_batch.h). A failed
+// NAR's partial output is removed. Returns one entry per item: null on
+// success, else the error.
+std::vector<std::exception_ptr> patchBatch(const PatchConfig& config,
+                                           const std::vector<nar::BatchItem>& items,
+                                           unsigned workers, uint64_t memoryBudget);
+
+// ============================================================================
+// patchExport - Patch an export stream path by path
+// ============================================================================
+
+// Receives the paths of an export stream one at a time
+class ExportSink {
+public:
+    virtual ~ExportSink() = default;
+
+    // Stream the next path's patched NAR is written to
+    virtual std::ostream& beginPath() = 0;
+
+    // Called after the NAR with the path's mapped metadata
+    virtual void endPath(const nar::ExportMetadata& metadata) = 0;
+};
+
+// Returns the number of paths patched
+size_t patchExport(const PatchConfig& config, std::istream& in, ExportSink& sink);
+
+} // namespace patchnar
+
+#endif // PATCHER_H
@@ -3,596 +3,422 @@
  *
  * Reads a NAR from stdin, patches ELF binaries, symlinks, and scripts,
  * and writes the modified NAR to stdout.
+ *
+ * The patching itself lives in libpatchnar (patcher.cc); this is the
+ * command-line front end.
  */
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
-#include "nar.h"
-#include "elf.h"
-#include "patchelf.h"
+#include "binary_cache.h"
+#include "chunk_store.h"
+#include "data_lexers.h"
+#include "fdstream.h"
+#include "nar_delta.h"
+#include "self_references.h"
+#include "patcher.h"
+#include "source_patcher.h"
+#include "verifier.h"
 
 #include <algorithm>
-#include <cstdarg>
-#include <cstddef>
-#include <cstring>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <unordered_set>
-#include <span>
-#include <sstream>
 #include <stdexcept>
 #include <string>
-#include <string_view>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
-// Source-highlight: shared tokenization from source_patcher + CharTranslator for path translation
-#include "source_patcher.h"
-#include <boost/regex.hpp>
-
-// Configuration (compile-time constants from configure)
-static const std::string prefix = INSTALL_PREFIX;
-static const std::string oldGlibcPath = OLD_GLIBC_PATH;
-
-// Runtime configuration
-static std::string glibcPath;
-static bool debugMode = false;
-
-// Additional paths to prefix in script strings
-// Default includes /nix/var/ which is commonly needed for nix daemon scripts
-static std::vector<std::string> addPrefixToPaths = {"/nix/var/"};
-
-
-
-// Hash mappings for inter-package reference substitution
-// Maps old store path basename to new store path basename
-// e.g., "abc123...-bash-5.2" -> "xyz789...-bash-5.2"
-static std::map<std::string, std::string> hashMappings;
-
-// Custom PreFormatter that translates Nix store paths in string literals
-// Extends CharTranslator for glibc regex replacement + manual prefix/hash handling
-class NixPathTranslator : public srchilite::CharTranslator {
-public:
-    NixPathTranslator() : srchilite::CharTranslator() {
-        // Use CharTranslator's regex for glibc path replacement
-        if (!oldGlibcPath.empty() && !glibcPath.empty()) {
-            static const auto escaped = boost::regex_replace(
-                oldGlibcPath, boost::regex(R"([.^$|()[\]{}*+?\\])"), R"(\\$&)");
-            set_translation(escaped, glibcPath);
-        }
-    }
-
-protected:
-    const std::string doPreformat(const std::string& text) override {
-        // 1. Apply CharTranslator's regex (glibc replacement)
-        std::string result = CharTranslator::doPreformat(text);
-
-        // 2. Apply hash mappings (dynamic lookup - can't use regex)
-        for (const auto& [oldHash, newHash] : hashMappings) {
-            size_t pos = 0;
-            while ((pos = result.find(oldHash, pos)) != std::string::npos) {
-                result.replace(pos, oldHash.length(), newHash);
-                pos += newHash.length();
-            }
-        }
-
-        // 3. Add prefix to /nix/store/ paths (with already-prefixed check)
-        if (!prefix.empty()) {
-            size_t pos = 0;
-            while ((pos = result.find("/nix/store/", pos)) != std::string::npos) {
-                bool alreadyPrefixed = (pos >= prefix.length() &&
-                    result.substr(pos - prefix.length(), prefix.length()) == prefix);
-                if (!alreadyPrefixed) {
-                    result.insert(pos, prefix);
-                    pos += prefix.length();
-                }
-                pos += 11;  // Skip "/nix/store/"
-            }
-
-            // Add prefix to additional paths (e.g., /nix/var/)
-            for (const auto& pattern : addPrefixToPaths) {
-                pos = 0;
-                while ((pos = result.find(pattern, pos)) != std::string::npos) {
-                    bool alreadyPrefixed = (pos >= prefix.length() &&
-                        result.substr(pos - prefix.length(), prefix.length()) == prefix);
-                    if (!alreadyPrefixed) {
-                        result.insert(pos, prefix);
-                        pos += prefix.length();
-                    }
-                    pos += pattern.length();
-                }
-            }
-        }
-
-        return result;
-    }
-};
-
-
-// Extensions to skip entirely (don't even call source-highlight)
-// These are documentation, binary, or compressed files that never need patching
-static const std::unordered_set<std::string> SKIP_EXTENSIONS = {
-    // Documentation
-    ".html", ".htm", ".xhtml", ".css", ".svg",
-    // Images
-    ".png", ".jpg", ".jpeg", ".gif", ".ico", ".webp", ".bmp",
-    // Compressed/archives
-    ".xz", ".gz", ".bz2", ".zst", ".zip", ".tar", ".7z",
-    // Fonts
-    ".ttf", ".otf", ".woff", ".woff2", ".eot",
-    // Other binary/doc formats
-    ".pdf", ".ps", ".dvi", ".info", ".texi", ".texinfo",
-    // Haddock/Haskell docs
-    ".haddock", ".hi", ".o", ".a", ".so", ".dylib",
-};
-
-
-
-
-// Whitelist of language files worth tokenizing for string literal patching
-// These are script/config files that may contain /nix/store paths
-// Default: shell scripts only; extensible via --add-lang option
-static std::unordered_set<std::string> patchableLangFiles = {
-    "sh.lang",
-    "zsh.lang",
-};
-
-static void debug(const char* format, ...)
-{
-    if (debugMode) {
-        va_list ap;
-        va_start(ap, format);
-        vfprintf(stderr, format, ap);
-        va_end(ap);
-    }
-}
-
-// Check if file should be skipped based on extension (non-patchable files)
-static inline bool shouldSkipByExtension(const std::string& filename)
+static void showHelp(const char* progName, const patchnar::PatchConfig& config)
 {
-    std::string ext = getExtension(filename);
-    return !ext.empty() && SKIP_EXTENSIONS.count(ext) > 0;
+    std::cerr << "Usage: " << progName << " [OPTIONS]\n"
+              << "\n"
+              << "Patch NAR stream for Android compatibility.\n"
+              << "Reads NAR from stdin, writes patched NAR to stdout.\n"
+              << "\n"
+              << "Compile-time settings:\n"
+              << "  prefix:              " << config.prefix << "\n"
+              << "  old-glibc:           " << config.oldGlibcPath << "\n"
+              << "  source-highlight:    " << sourceHighlightDataDir << "\n"
+              << "  add-prefix-to:       /nix/var/ (default)\n"
+              << "  patchable-langs:     sh.lang, zsh.lang (default)\n"
+              << "\n"
+              << "Options:\n"
+              << "  --prefix PATH        Installation prefix (overrides the compile-time one)\n"
+              << "  --old-glibc PATH     Standard glibc store path to substitute (overrides\n"
+              << "                       the compile-time one)\n"
+              << "  --glibc PATH         Android glibc store path (to replace old-glibc)\n"
+              << "  --mappings FILE      Hash mappings file for inter-package refs\n"
+              << "                       Format: OLD_PATH NEW_PATH (one per line)\n"
+              << "  --self-mapping MAP   Self-reference mapping (format: \"OLD_PATH NEW_PATH\")\n"
+              << "  --add-prefix-to PATH Additional path pattern to prefix in script strings\n"
+              << "  --add-lang LANG      Additional language to patch (e.g., python.lang, json.lang)\n"
+              << "  --no-native-lexers   Tokenize python.lang and perl.lang with source-highlight\n"
+              << "                       instead of the built-in lexers\n"
+              << "  --no-data-formats    Leave pkg-config (*.pc) and libtool (*.la) files\n"
+              << "                       alone (they are patched by default)\n"
+              << "  --no-local-tokenization\n"
+              << "                       Tokenize whole scripts, not just around store paths\n"
+              << "  --rule GLOB=ACTION   Handle a subtree by path (repeatable, last match wins)\n"
+              << "                       ACTION: skip, map-only, elf, script:LANG\n"
+              << "                       e.g. 'share/doc/**=map-only', 'libexec/**=script:sh'\n"
+              << "  --jobs N             Patch files on N threads when stdin is a regular file\n"
+              << "                       (default: number of CPUs; 1 = serial streaming);\n"
+              << "                       shell scripts over 2MB are also tokenized on N threads\n"
+              << "  --input-format FMT   Read FMT from stdin: nar (default), tar or export\n"
+              << "  --output-format FMT  Write FMT to stdout: nar (default), tar or export\n"
+              << "                       (export: nix-store --export stream; export\n"
+              << "                       input implies export output)\n"
+              << "  --binary-cache DIR   Write the patched NAR into a file:// binary cache\n"
+              << "                       (nar/<filehash>.nar.zst and <hash>.narinfo)\n"
+              << "                       instead of stdout\n"
+              << "  --store-path PATH    Store path of the input NAR (for --binary-cache;\n"
+              << "                       export streams carry their own)\n"
+              << "  --content-addressed PATH\n"
+              << "                       Input is content-addressed output PATH: compute\n"
+              << "                       the patched NAR's path (printed to stderr) and\n"
+              << "                       rewrite its self-references to it\n"
+              << "  --reference PATH     Other store path the patched output refers to\n"
+              << "                       (for --content-addressed and --binary-cache;\n"
+              << "                       repeatable)\n"
+              << "  --variant SPEC       Also write the NAR patched for another target, in\n"
+              << "                       the same pass (repeatable). SPEC is\n"
+              << "                       FILE[,prefix=P][,glibc=G][,old-glibc=O][,mappings=M]\n"
+              << "                       Unset keys are taken from the other options\n"
+              << "  --delta              Write a delta from the input NAR to the patched NAR\n"
+              << "                       instead of the patched NAR\n"
+              << "  --apply-delta FILE   Rebuild the patched NAR from the unpatched NAR on\n"
+              << "                       stdin and delta FILE, write it to stdout and exit\n"
+              << "  --checkpoint FILE    Save a checkpoint to FILE while patching (stdin and\n"
+              << "                       stdout must be regular files; serial); prints the\n"
+              << "                       patched NAR's hash when done\n"
+              << "  --checkpoint-interval SIZE\n"
+              << "                       Input bytes between checkpoints, with optional K, M\n"
+              << "                       or G suffix (default: 1G)\n"
+              << "  --resume             Continue from --checkpoint FILE if it exists (open\n"
+              << "                       stdout with 1<> so the partial output is kept)\n"
+              << "  --batch FILE         Patch many NAR files at once instead of stdin: FILE\n"
+              << "                       has an \"INPUT OUTPUT\" pair per line. They share one\n"
+              << "                       pool of --jobs threads, largest NARs first\n"
+              << "  --memory-budget SIZE Input bytes of the NARs --batch patches at once,\n"
+              << "                       with optional K, M or G suffix (default: 1G)\n"
+              << "  --chunk-store DIR    Also store the patched NAR in a deduplicating chunk store\n"
+              << "  --store-name NAME    Name for the stored NAR (default: its SHA-256)\n"
+              << "  --restore NAME       Write NAR NAME from --chunk-store to stdout and exit\n"
+              << "  --verify             Check every patched node for unprefixed store paths\n"
+              << "                       (scripts, ELF interpreter/RPATH, symlinks) and\n"
+              << "                       surviving old glibc or old mapping hashes; print\n"
+              << "                       them and exit with status 2\n"
+              << "  --debug              Enable debug output\n"
+              << "  --help               Show this help\n";
 }
 
+// ============================================================================
+// Option parsing
+// ============================================================================
 
+namespace {
 
-
-// Add a single hash mapping from full store paths
-// Extracts basenames and validates length match
-static void addMapping(const std::string& oldPath, const std::string& newPath)
+// "N", "NK", "NM" or "NG" in bytes; 0 if malformed
+uint64_t parseSize(const char* arg)
 {
-    // Extract basename (everything after last /)
-    std::string oldBase = oldPath.substr(oldPath.rfind('/') + 1);
-    std::string newBase = newPath.substr(newPath.rfind('/') + 1);
-
-    // Validate same length (required for safe substitution in NAR)
-    if (oldBase.length() == newBase.length()) {
-        debug("  mapping: %s -> %s\n", oldBase.c_str(), newBase.c_str());
-        hashMappings.emplace(std::move(oldBase), std::move(newBase));
-    } else {
-        std::cerr << "patchnar: warning: skipping mapping " << oldBase
-                  << " -> " << newBase << " (length mismatch: "
-                  << oldBase.length() << " vs " << newBase.length() << ")\n";
-    }
-}
-
-// Load hash mappings from file
-// Format: one mapping per line: "/nix/store/old-hash-name /nix/store/new-hash-name"
-static void loadMappings(const std::string& filename)
-{
-    std::ifstream file(filename);
-    if (!file) {
-        std::cerr << "patchnar: warning: cannot open mappings file: " << filename << "\n";
-        return;
-    }
-
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty()) continue;
-
-        size_t space = line.find(' ');
-        if (space == std::string::npos) continue;
-
-        std::string oldPath = line.substr(0, space);
-        std::string newPath = line.substr(space + 1);
-        addMapping(oldPath, newPath);
-    }
-
-    debug("patchnar: loaded %zu hash mappings\n", hashMappings.size());
-}
-
-// Apply hash mappings to content (text substitution, like sed)
-// This replaces old store path basenames with new ones
-static void applyHashMappings(std::vector<std::byte>& content)
-{
-    if (hashMappings.empty()) return;
-
-    // Convert to string for easier manipulation
-    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
-    bool modified = false;
-
-    for (const auto& [oldHash, newHash] : hashMappings) {
-        size_t pos = 0;
-        while ((pos = str.find(oldHash, pos)) != std::string::npos) {
-            str.replace(pos, oldHash.length(), newHash);
-            pos += newHash.length();
-            modified = true;
-        }
+    char* end = nullptr;
+    errno = 0;
+    uint64_t n = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *arg == '-' || errno != 0) {
+        return 0;
     }
-
-    if (modified) {
-        auto bytes = std::as_bytes(std::span(str));
-        content.assign(bytes.begin(), bytes.end());
+    switch (*end) {
+    case 'G': n <<= 10; [[fallthrough]];
+    case 'M': n <<= 10; [[fallthrough]];
+    case 'K': n <<= 10; ++end; break;
+    default: break;
     }
+    return *end == '\0' ? n : 0;
 }
 
-// Check if content is an ELF file
-static inline bool isElf(const std::span<const std::byte> content)
-{
-    if (content.size() < SELFMAG)
-        return false;
-    return memcmp(content.data(), ELFMAG, SELFMAG) == 0;
-}
+} // anonymous namespace
 
-// Check if content has a shebang (starts with #!)
-// Used only to determine if shebang patching should be applied
-static inline bool hasShebang(const std::span<const std::byte> content)
-{
-    if (content.size() < 2)
-        return false;
-    return std::to_integer<char>(content[0]) == '#' && std::to_integer<char>(content[1]) == '!';
-}
+// ============================================================================
+// Verification
+// ============================================================================
 
-// Check if ELF is 32-bit
-static inline bool isElf32(const std::span<const std::byte> content)
-{
-    if (content.size() < EI_CLASS + 1)
-        return false;
-    return std::to_integer<unsigned char>(content[EI_CLASS]) == ELFCLASS32;
-}
+namespace {
 
-// Replace occurrences of old path with new path in string
-static std::string replaceAll(std::string str,
-                              const std::string& from,
-                              const std::string& to)
+// Exit status: 2 if --verify found anything
+int reportViolations(const patchnar::Verifier* verifier)
 {
-    if (from.empty())
-        return str;
-
-    size_t pos = 0;
-    while ((pos = str.find(from, pos)) != std::string::npos) {
-        str.replace(pos, from.length(), to);
-        pos += to.length();
+    if (!verifier) {
+        return 0;
     }
-    return str;
-}
-
-// Apply hash mappings to a string (for symlinks, etc.)
-// Returns the original string if no mappings match (avoids copy)
-static std::string applyHashMappingsToString(std::string str)
-{
-    if (hashMappings.empty()) return str;
-
-    for (const auto& [oldHash, newHash] : hashMappings) {
-        size_t pos = 0;
-        while ((pos = str.find(oldHash, pos)) != std::string::npos) {
-            str.replace(pos, oldHash.length(), newHash);
-            pos += newHash.length();
-        }
+    const auto violations = verifier->violations();
+    for (const auto& v : violations) {
+        std::cerr << "patchnar: verify: " << v.path << "+" << v.offset << ": " << v.what << "\n";
     }
-    return str;
-}
-
-// Unified store path transformation (glibc → hash mapping → prefix)
-// Used by: ELF interpreter, RPATH entries, symlinks
-// Order matters: glibc must be replaced before hash mappings are applied
-static std::string transformStorePath(std::string path)
-{
-    // 1. Replace old glibc with Android glibc (must be first)
-    if (!oldGlibcPath.empty() && path.find(oldGlibcPath) != std::string::npos) {
-        path = replaceAll(std::move(path), oldGlibcPath, glibcPath);
+    if (violations.empty()) {
+        return 0;
     }
+    std::cerr << "patchnar: verify: " << violations.size() << " violations\n";
+    return 2;
+}
 
-    // 2. Apply hash mappings for inter-package references
-    path = applyHashMappingsToString(std::move(path));
+} // anonymous namespace
 
-    // 3. Add prefix to /nix/store paths
-    if (path.rfind("/nix/store/", 0) == 0) {
-        path.insert(0, prefix);
-    }
+// ============================================================================
+// Content-addressed output
+// ============================================================================
 
-    return path;
-}
+namespace {
 
-// Patch symlink target (takes by value to allow move semantics)
-static std::string patchSymlink(std::string target)
+// Patch a content-addressed output and move it to the path its patched
+// contents hash to. The self-references keep the old hash part while the
+// NAR is written, hashed modulo it, and are rewritten in place afterwards
+// (in stdout if it is a regular file, else in a temp file copied to stdout).
+void writeContentAddressed(const patchnar::PatchConfig& config, const std::string& oldPath,
+                           const std::vector<std::string>& references, unsigned jobs)
 {
-    // Handle relative symlinks with glibc basename (e.g., ../../hash-glibc/lib/...)
-    // This must be done before transformStorePath since relative paths won't match oldGlibcPath
-    if (!oldGlibcPath.empty() && target.find(oldGlibcPath) == std::string::npos) {
-        const auto oldBase = oldGlibcPath.substr(oldGlibcPath.rfind('/') + 1);
-        const auto newBase = glibcPath.substr(glibcPath.rfind('/') + 1);
-        if (!oldBase.empty() && target.find(oldBase) != std::string::npos) {
-            target = replaceAll(std::move(target), oldBase, newBase);
-        }
+    const std::string baseName = oldPath.substr(oldPath.rfind('/') + 1);
+    if (baseName.size() < 34 || baseName[32] != '-') {
+        throw std::invalid_argument("--content-addressed: not a store path: " + oldPath);
     }
-
-    return transformStorePath(std::move(target));
-}
-
-// Build new RPATH from old RPATH by transforming each entry
-static std::string buildNewRpath(const std::string& oldRpath)
-{
-    if (oldRpath.empty()) {
-        return {};
+    if (config.hashMappings.count(baseName)) {
+        throw std::invalid_argument("--content-addressed computes the self-mapping; do not pass one");
     }
+    const std::string hashPart = baseName.substr(0, 32);
+    const std::string name = baseName.substr(33);
 
-    std::string newRpath;
-    newRpath.reserve(oldRpath.size() + prefix.size() * 4);  // Estimate with prefix additions
-
-    std::string current;
+    const bool inPlace = nar::isPlaceableFile(STDOUT_FILENO);
+    const int fd = inPlace ? STDOUT_FILENO : nar::createTempFile();
 
-    for (size_t i = 0; i <= oldRpath.size(); ++i) {
-        if (i == oldRpath.size() || oldRpath[i] == ':') {
-            if (!current.empty()) {
-                if (!newRpath.empty()) {
-                    newRpath += ':';
-                }
-                newRpath += transformStorePath(std::move(current));
-                current.clear();
-            }
+    try {
+        nar::SelfReferenceOutputBuf buf(fd, hashPart);
+        std::ostream output(&buf);
+        output.exceptions(std::ios_base::badbit);
+        patchnar::patchNar(config, STDIN_FILENO, output, -1, jobs);
+        output.flush();
+
+        const nar::Sha256::Digest narHash = buf.finish();
+        const std::string newPath = nar::makeContentAddressedPath(name, narHash, references,
+                                                                  !buf.matches().empty());
+        buf.rewrite(newPath.substr(newPath.rfind('/') + 1, 32));
+        config.log("patchnar: %zu self-references rewritten\n", buf.matches().size());
+
+        if (inPlace) {
+            ::lseek(fd, static_cast<off_t>(buf.size()), SEEK_CUR);
         } else {
-            current += oldRpath[i];
+            nar::sendRange(fd, 0, STDOUT_FILENO, buf.size());
+            ::close(fd);
         }
+        std::cerr << "patchnar: content-addressed path " << newPath << "\n";
+    } catch (...) {
+        if (!inPlace) {
+            ::close(fd);
+        }
+        throw;
     }
-
-    return newRpath;
 }
 
-// Forward declarations for ELF patching (defined in patchelf.cc)
-template<ElfFileParams>
-class ElfFile;
+} // anonymous namespace
 
-// Patch ELF binary content
-template<class ElfFileType>
-static std::vector<std::byte> patchElfContent(
-    const std::span<const std::byte> content,
-    [[maybe_unused]] const bool executable)
-{
-    // Convert span to vector for patchelf (unique_ptr converts to shared_ptr)
-    auto fileContents = std::make_unique<std::vector<unsigned char>>(
-        reinterpret_cast<const unsigned char*>(content.data()),
-        reinterpret_cast<const unsigned char*>(content.data()) + content.size());
+// ============================================================================
+// Variants
+// ============================================================================
 
-    try {
-        ElfFileType elfFile(std::move(fileContents));
-
-        // Get current interpreter
-        std::string interp;
-        try {
-            interp = elfFile.getInterpreter();
-        } catch (...) {
-            // No interpreter (probably a shared library)
-            interp.clear();
-        }
+namespace {
 
-        // Patch interpreter using unified transformation
-        if (!interp.empty()) {
-            std::string newInterp = transformStorePath(interp);
-            if (newInterp != interp) {
-                debug("  interpreter: %s -> %s\n", interp.c_str(), newInterp.c_str());
-                elfFile.setInterpreter(newInterp);
-            }
-        }
+// "FILE[,key=value]...": `base` with the given targets replaced
+patchnar::PatchConfig parseVariant(const patchnar::PatchConfig& base, const std::string& spec,
+                                   std::string& file)
+{
+    patchnar::PatchConfig config = base;
+    config.verifier = nullptr;  // --verify checks the main output only
+    size_t pos = spec.find(',');
+    file = spec.substr(0, pos);
+    if (file.empty()) {
+        throw std::invalid_argument("--variant: missing output file in '" + spec + "'");
+    }
 
-        // Patch RPATH/RUNPATH
-        try {
-            std::string currentRpath = elfFile.getRPath();
-            if (!currentRpath.empty()) {
-                std::string newRpath = buildNewRpath(currentRpath);
-                if (newRpath != currentRpath) {
-                    debug("  rpath: %s -> %s\n", currentRpath.c_str(), newRpath.c_str());
-                    elfFile.modifyRPath(ElfFileType::rpSet, {}, newRpath);
-                }
+    while (pos != std::string::npos) {
+        const size_t start = pos + 1;
+        pos = spec.find(',', start);
+        const std::string item = spec.substr(start, pos == std::string::npos ? pos : pos - start);
+        const size_t eq = item.find('=');
+        const std::string key = item.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("--variant: expected key=value, got '" + item + "'");
+        } else if (key == "prefix") {
+            config.prefix = value;
+        } else if (key == "glibc") {
+            config.glibcPath = value;
+        } else if (key == "old-glibc") {
+            config.oldGlibcPath = value;
+        } else if (key == "mappings") {
+            config.hashMappings.clear();
+            if (!config.loadMappings(value)) {
+                throw std::invalid_argument("--variant: cannot read mappings " + value);
             }
-        } catch (...) {
-            // No RPATH section - that's fine
+        } else {
+            throw std::invalid_argument("--variant: unknown key '" + key + "'");
         }
-
-        elfFile.rewriteSections();
-
-        // Convert back to std::byte
-        auto bytes = std::as_bytes(std::span(*elfFile.fileContents));
-        return std::vector<std::byte>(bytes.begin(), bytes.end());
-    } catch (const std::exception& e) {
-        debug("  ELF patch failed: %s\n", e.what());
-        // Return original content on error
-        return std::vector<std::byte>(content.begin(), content.end());
     }
+    return config;
 }
 
-// Patch shebang only (fallback when language detection fails)
-// Used for files with shebangs that can't be processed by source-highlight
-static std::vector<std::byte> patchShebangOnly(const std::span<const std::byte> content)
-{
-    if (prefix.empty() || !hasShebang(content)) {
-        return std::vector<std::byte>(content.begin(), content.end());
-    }
-
-    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
-
-    // Find end of shebang line
-    size_t shebangEnd = str.find('\n');
-    if (shebangEnd == std::string::npos) shebangEnd = str.size();
+} // anonymous namespace
 
-    std::string shebang = str.substr(0, shebangEnd);
-
-    // Only patch if shebang contains /nix/store
-    if (shebang.find("/nix/store/") == std::string::npos) {
-        return {content.begin(), content.end()};
-    }
+// ============================================================================
+// Binary cache output
+// ============================================================================
 
-    // Apply transformations to the shebang
-    // Note: transformStorePath only handles one path, so we need to find all paths
-    std::string newShebang = shebang;
+namespace {
 
-    // Replace glibc paths
-    if (!oldGlibcPath.empty()) {
-        newShebang = replaceAll(std::move(newShebang), oldGlibcPath, glibcPath);
+// Stores each path of an export stream as its own cache entry
+class BinaryCacheSink : public patchnar::ExportSink {
+public:
+    explicit BinaryCacheSink(const nar::BinaryCache& cache) : cache_(cache), stream_(nullptr) {}
+
+    std::ostream& beginPath() override
+    {
+        // Export metadata lists the references; nothing to scan for
+        buf_ = std::make_unique<nar::BinaryCacheOutputBuf>(cache_, std::vector<std::string>{});
+        stream_.rdbuf(buf_.get());
+        stream_.exceptions(std::ios_base::badbit);
+        return stream_;
     }
 
-    // Apply hash mappings
-    newShebang = applyHashMappingsToString(std::move(newShebang));
-
-    // Add prefix to all /nix/store paths
-    size_t pos = 2;  // Skip #!
-    while ((pos = newShebang.find("/nix/store/", pos)) != std::string::npos) {
-        if (pos < prefix.length() ||
-            newShebang.substr(pos - prefix.length(), prefix.length()) != prefix) {
-            newShebang.insert(pos, prefix);
-            pos += prefix.length();
-        }
-        pos += 11;  // Skip "/nix/store/"
+    void endPath(const nar::ExportMetadata& metadata) override
+    {
+        const std::string info = buf_->finish(metadata.path, metadata.deriver, &metadata.references);
+        std::cerr << "patchnar: wrote " << info << "\n";
+        stream_.exceptions(std::ios_base::goodbit);
+        stream_.rdbuf(nullptr);
+        buf_.reset();
     }
 
-    if (newShebang != shebang) {
-        debug("  shebang (fallback): %s -> %s\n", shebang.c_str(), newShebang.c_str());
-        str.replace(0, shebangEnd, newShebang);
-        std::vector<std::byte> result(str.size());
-        std::memcpy(result.data(), str.data(), str.size());
-        return result;
-    }
-    return {content.begin(), content.end()};
-}
+private:
+    const nar::BinaryCache& cache_;
+    std::unique_ptr<nar::BinaryCacheOutputBuf> buf_;
+    std::ostream stream_;
+};
 
-// Patch source file content using source-highlight
-// Strings AND comments (including shebangs) are patched via NixPathTranslator
-static std::vector<std::byte> patchSource(
-    const std::span<const std::byte> content,
-    const std::string& langFile)
+void writeBinaryCache(const patchnar::PatchConfig& config, const std::string& dir,
+                      const std::string& storePath, const std::vector<std::string>& references,
+                      unsigned jobs)
 {
-    if (prefix.empty() || langFile.empty()) {
-        return std::vector<std::byte>(content.begin(), content.end());
-    }
-
-    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
-    NixPathTranslator translator;
-    std::string patched = patchSourceStrings(str, langFile, translator);
+    nar::BinaryCache cache(dir);
 
-    if (patched != str) {
-        std::vector<std::byte> result(patched.size());
-        std::memcpy(result.data(), patched.data(), patched.size());
-        return result;
+    if (config.inputFormat == nar::ArchiveFormat::Export) {
+        nar::ReadAheadInputStream input(STDIN_FILENO);
+        BinaryCacheSink sink(cache);
+        patchnar::patchExport(config, input, sink);
+        return;
     }
-    return {content.begin(), content.end()};
-}
 
-// Main content patcher
-// The path parameter is the relative path within the NAR (e.g., "bin/bash", "share/nix/nix.sh")
-static std::vector<std::byte> patchContent(
-    const std::span<const std::byte> content,
-    const bool executable,
-    const std::string& path)
-{
-    // Extract filename from path
-    std::string filename;
-    size_t lastSlash = path.rfind('/');
-    filename = (lastSlash != std::string::npos) ? path.substr(lastSlash + 1) : path;
-
-    // === ELF FILES ===
-    if (isElf(content)) {
-        debug("  patching ELF %s (%zu bytes)\n", path.c_str(), content.size());
-        auto result = isElf32(content)
-            ? patchElfContent<ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>>(content, executable)
-            : patchElfContent<ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>>(content, executable);
-        applyHashMappings(result);
-        return result;
+    // A single NAR may refer to itself, the mapped packages, glibc and the
+    // --reference paths; naming any other store path is an error
+    const patchnar::Patcher patcher(config);
+    const std::string path = patcher.mapStorePath(storePath);
+    std::vector<std::string> candidates{path};
+    candidates.insert(candidates.end(), references.begin(), references.end());
+    for (const auto& [oldBase, newBase] : config.hashMappings) {
+        candidates.push_back("/nix/store/" + newBase);
     }
-
-    // === SKIP NON-PATCHABLE EXTENSIONS ===
-    if (shouldSkipByExtension(filename)) {
-        debug("  skipping %s (non-patchable extension)\n", path.c_str());
-        auto result = std::vector<std::byte>(content.begin(), content.end());
-        applyHashMappings(result);
-        return result;
+    if (!config.glibcPath.empty()) {
+        candidates.push_back(config.glibcPath);
     }
 
-    // === LANGUAGE DETECTION ===
-    std::string str(reinterpret_cast<const char*>(content.data()), content.size());
-    std::string langFile = detectLanguageFromFile(filename, str);
-
-    // === SOURCE PATCHING (strings + comments including shebangs) ===
-    std::vector<std::byte> result;
-    if (!langFile.empty() && patchableLangFiles.count(langFile)) {
-        debug("  patching source %s (%zu bytes, lang=%s)\n",
-              path.c_str(), content.size(), langFile.c_str());
-        result = patchSource(content, langFile);
-    } else if (hasShebang(content)) {
-        // Fallback: patch shebang only when language detection fails
-        // This handles scripts with unusual interpreters (e.g., ld.so)
-        debug("  patching shebang-only %s (%zu bytes)\n", path.c_str(), content.size());
-        result = patchShebangOnly(content);
-    } else {
-        if (!langFile.empty()) {
-            debug("  skipping %s (lang=%s not in whitelist)\n", path.c_str(), langFile.c_str());
-        }
-        result = std::vector<std::byte>(content.begin(), content.end());
-    }
+    nar::BinaryCacheOutputBuf buf(cache, candidates);
+    std::ostream output(&buf);
+    output.exceptions(std::ios_base::badbit);
+    patchnar::patchNar(config, STDIN_FILENO, output, -1, jobs);
+    output.flush();
 
-    applyHashMappings(result);
-    return result;
+    const std::string info = buf.finish(path, "");
+    std::cerr << "patchnar: wrote " << info << "\n";
 }
 
-static void showHelp(const char* progName)
-{
-    std::cerr << "Usage: " << progName << " [OPTIONS]\n"
-              << "\n"
-              << "Patch NAR stream for Android compatibility.\n"
-              << "Reads NAR from stdin, writes patched NAR to stdout.\n"
-              << "\n"
-              << "Compile-time settings:\n"
-              << "  prefix:              " << prefix << "\n"
-              << "  old-glibc:           " << oldGlibcPath << "\n"
-              << "  source-highlight:    " << sourceHighlightDataDir << "\n"
-              << "  add-prefix-to:       /nix/var/ (default)\n"
-              << "  patchable-langs:     sh.lang, zsh.lang (default)\n"
-              << "\n"
-              << "Options:\n"
-              << "  --glibc PATH         Android glibc store path (to replace old-glibc)\n"
-              << "  --mappings FILE      Hash mappings file for inter-package refs\n"
-              << "                       Format: OLD_PATH NEW_PATH (one per line)\n"
-              << "  --self-mapping MAP   Self-reference mapping (format: \"OLD_PATH NEW_PATH\")\n"
-              << "  --add-prefix-to PATH Additional path pattern to prefix in script strings\n"
-              << "  --add-lang LANG      Additional language to patch (e.g., python.lang, json.lang)\n"
-              << "  --debug              Enable debug output\n"
-              << "  --help               Show this help\n";
-}
+} // anonymous namespace
 
 int main(int argc, char** argv)
 {
     static struct option longOptions[] = {
+        {"prefix",                   required_argument, nullptr, 'p'},
+        {"old-glibc",                required_argument, nullptr, 'G'},
         {"glibc",                    required_argument, nullptr, 'g'},
         {"mappings",                 required_argument, nullptr, 'm'},
         {"self-mapping",             required_argument, nullptr, 's'},
         {"add-prefix-to",            required_argument, nullptr, 'A'},
         {"add-lang",                 required_argument, nullptr, 'L'},
+        {"no-native-lexers",         no_argument,       nullptr, 'n'},
+        {"no-data-formats",          no_argument,       nullptr, 'F'},
+        {"no-local-tokenization",    no_argument,       nullptr, 'l'},
+        {"rule",                     required_argument, nullptr, 'R'},
+        {"jobs",                     required_argument, nullptr, 'j'},
+        {"input-format",             required_argument, nullptr, 'I'},
+        {"output-format",            required_argument, nullptr, 'O'},
+        {"binary-cache",             required_argument, nullptr, 'B'},
+        {"store-path",               required_argument, nullptr, 'P'},
+        {"content-addressed",        required_argument, nullptr, 'c'},
+        {"reference",                required_argument, nullptr, 'r'},
+        {"variant",                  required_argument, nullptr, 'V'},
+        {"delta",                    no_argument,       nullptr, 'D'},
+        {"apply-delta",              required_argument, nullptr, 'a'},
+        {"checkpoint",               required_argument, nullptr, 'K'},
+        {"checkpoint-interval",      required_argument, nullptr, 'k'},
+        {"resume",                   no_argument,       nullptr, 'Z'},
+        {"batch",                    required_argument, nullptr, 'b'},
+        {"memory-budget",            required_argument, nullptr, 'M'},
+        {"chunk-store",              required_argument, nullptr, 'C'},
+        {"store-name",               required_argument, nullptr, 'N'},
+        {"restore",                  required_argument, nullptr, 'X'},
+        {"verify",                   no_argument,       nullptr, 'v'},
         {"debug",                    no_argument,       nullptr, 'd'},
         {"help",                     no_argument,       nullptr, 'h'},
         {nullptr,                    0,                 nullptr, 0}
     };
 
+    patchnar::PatchConfig config;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string chunkStoreDir;
+    std::string storeName;
+    std::string restoreName;
+    bool outputFormatSet = false;
+    std::string binaryCacheDir;
+    std::string storePath;
+    std::string caPath;
+    std::vector<std::string> references;
+    std::vector<std::string> variantSpecs;
+    bool delta = false;
+    bool verify = false;
+    std::string applyDeltaFile;
+    std::string checkpointFile;
+    uint64_t checkpointInterval = 1ULL << 30;
+    bool resume = false;
+    std::string batchFile;
+    uint64_t memoryBudget = 1ULL << 30;
+
     int opt;
-    while ((opt = getopt_long(argc, argv, "g:m:s:A:L:dh", longOptions, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:G:g:m:s:A:L:nFlR:j:I:O:B:P:c:r:V:Da:K:k:Zb:M:C:N:X:vdh", longOptions, nullptr)) != -1) {
         switch (opt) {
+        case 'p':
+            config.prefix = optarg;
+            break;
+        case 'G':
+            config.oldGlibcPath = optarg;
+            break;
         case 'g':
-            glibcPath = optarg;
+            config.glibcPath = optarg;
             break;
         case 'm':
-            loadMappings(optarg);
+            config.loadMappings(optarg);
             break;
         case 's': {
             // Parse "OLD_PATH NEW_PATH" format
@@ -601,8 +427,8 @@ int main(int argc, char** argv)
             if (space != std::string::npos) {
                 std::string oldPath = arg.substr(0, space);
                 std::string newPath = arg.substr(space + 1);
-                addMapping(oldPath, newPath);
-                debug("patchnar: self-mapping: %s -> %s\n", oldPath.c_str(), newPath.c_str());
+                config.addMapping(oldPath, newPath);
+                config.log("patchnar: self-mapping: %s -> %s\n", oldPath.c_str(), newPath.c_str());
             } else {
                 std::cerr << "patchnar: error: --self-mapping requires \"OLD_PATH NEW_PATH\" format\n";
                 return 1;
@@ -610,44 +436,331 @@ int main(int argc, char** argv)
             break;
         }
         case 'A':
-            addPrefixToPaths.push_back(optarg);
+            config.addPrefixToPaths.push_back(optarg);
             break;
         case 'L':
-            patchableLangFiles.insert(optarg);
+            if (hasOnlyNativeLexer(optarg)) {
+                std::cerr << "patchnar: error: --add-lang " << optarg
+                          << ": not a language file (pkg-config and libtool files are"
+                          << " patched unless --no-data-formats is given)\n";
+                return 1;
+            }
+            config.patchableLangFiles.insert(optarg);
+            break;
+        case 'R':
+            try {
+                config.pathRules.add(optarg);
+            } catch (const std::invalid_argument& e) {
+                std::cerr << "patchnar: error: --rule: " << e.what() << "\n";
+                return 1;
+            }
+            break;
+        case 'j': {
+            char* end = nullptr;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1) {
+                std::cerr << "patchnar: error: --jobs requires a positive number\n";
+                return 1;
+            }
+            jobs = static_cast<unsigned>(n);
+            break;
+        }
+        case 'I':
+        case 'O':
+            try {
+                (opt == 'I' ? config.inputFormat : config.outputFormat) = nar::parseArchiveFormat(optarg);
+                outputFormatSet |= opt == 'O';
+            } catch (const std::invalid_argument& e) {
+                std::cerr << "patchnar: error: " << e.what() << "\n";
+                return 1;
+            }
+            break;
+        case 'B':
+            binaryCacheDir = optarg;
+            break;
+        case 'P':
+            storePath = optarg;
+            break;
+        case 'c':
+            caPath = optarg;
+            break;
+        case 'r':
+            references.push_back(optarg);
+            break;
+        case 'V':
+            variantSpecs.push_back(optarg);
+            break;
+        case 'D':
+            delta = true;
+            break;
+        case 'a':
+            applyDeltaFile = optarg;
+            break;
+        case 'K':
+            checkpointFile = optarg;
+            break;
+        case 'k':
+            checkpointInterval = parseSize(optarg);
+            if (checkpointInterval == 0) {
+                std::cerr << "patchnar: error: --checkpoint-interval requires a positive size\n";
+                return 1;
+            }
+            break;
+        case 'Z':
+            resume = true;
+            break;
+        case 'b':
+            batchFile = optarg;
+            break;
+        case 'M':
+            memoryBudget = parseSize(optarg);
+            if (memoryBudget == 0) {
+                std::cerr << "patchnar: error: --memory-budget requires a positive size\n";
+                return 1;
+            }
+            break;
+        case 'C':
+            chunkStoreDir = optarg;
+            break;
+        case 'N':
+            storeName = optarg;
+            break;
+        case 'X':
+            restoreName = optarg;
+            break;
+        case 'n':
+            config.nativeLexers = false;
+            break;
+        case 'F':
+            config.dataFormats = false;
+            break;
+        case 'l':
+            config.localTokenization = false;
+            break;
+        case 'v':
+            verify = true;
             break;
         case 'd':
-            debugMode = true;
+            config.debug = true;
             break;
         case 'h':
-            showHelp(argv[0]);
+            showHelp(argv[0], config);
             return 0;
         default:
-            showHelp(argv[0]);
+            showHelp(argv[0], config);
             return 1;
         }
     }
 
-    debug("patchnar: prefix=%s\n", prefix.c_str());
-    debug("patchnar: glibc=%s\n", glibcPath.c_str());
-    debug("patchnar: old-glibc=%s\n", oldGlibcPath.c_str());
-    debug("patchnar: source-highlight-data-dir=%s\n", sourceHighlightDataDir.c_str());
-    for (const auto& path : addPrefixToPaths) {
-        debug("patchnar: add-prefix-to=%s\n", path.c_str());
+    config.log("patchnar: prefix=%s\n", config.prefix.c_str());
+    config.log("patchnar: glibc=%s\n", config.glibcPath.c_str());
+    config.log("patchnar: old-glibc=%s\n", config.oldGlibcPath.c_str());
+    config.log("patchnar: source-highlight-data-dir=%s\n", sourceHighlightDataDir.c_str());
+    for (const auto& path : config.addPrefixToPaths) {
+        config.log("patchnar: add-prefix-to=%s\n", path.c_str());
     }
-    for (const auto& lang : patchableLangFiles) {
-        debug("patchnar: patchable-lang=%s\n", lang.c_str());
+    for (const auto& lang : config.patchableLangFiles) {
+        config.log("patchnar: patchable-lang=%s\n", lang.c_str());
+    }
+
+    // An export stream can only become another export stream
+    if (config.inputFormat == nar::ArchiveFormat::Export && !outputFormatSet) {
+        config.outputFormat = nar::ArchiveFormat::Export;
+    }
+
+    if (!binaryCacheDir.empty()) {
+        if (!chunkStoreDir.empty()) {
+            std::cerr << "patchnar: error: --binary-cache cannot be combined with --chunk-store\n";
+            return 1;
+        }
+        if (config.outputFormat == nar::ArchiveFormat::Tar) {
+            std::cerr << "patchnar: error: --binary-cache stores NARs, not tar\n";
+            return 1;
+        }
+        if (config.inputFormat != nar::ArchiveFormat::Export && storePath.empty()) {
+            std::cerr << "patchnar: error: --binary-cache requires --store-path\n";
+            return 1;
+        }
+        if (config.inputFormat == nar::ArchiveFormat::Export && !references.empty()) {
+            std::cerr << "patchnar: error: --reference does not apply to export input (its metadata lists the references)\n";
+            return 1;
+        }
+    }
+
+    if (!caPath.empty() && (!variantSpecs.empty() || delta || !binaryCacheDir.empty() ||
+                            !chunkStoreDir.empty() || config.outputFormat != nar::ArchiveFormat::Nar)) {
+        std::cerr << "patchnar: error: --content-addressed only writes a NAR to stdout\n";
+        return 1;
+    }
+    if (caPath.empty() && binaryCacheDir.empty() && !references.empty()) {
+        std::cerr << "patchnar: error: --reference requires --content-addressed or --binary-cache\n";
+        return 1;
+    }
+
+    if (!variantSpecs.empty() && (delta || !binaryCacheDir.empty() || !chunkStoreDir.empty())) {
+        std::cerr << "patchnar: error: --variant cannot be combined with --delta, --binary-cache or --chunk-store\n";
+        return 1;
+    }
+
+    if (delta && (!binaryCacheDir.empty() || !chunkStoreDir.empty())) {
+        std::cerr << "patchnar: error: --delta cannot be combined with --binary-cache or --chunk-store\n";
+        return 1;
+    }
+
+    if (!checkpointFile.empty() && (!caPath.empty() || !variantSpecs.empty() || delta ||
+                                    !binaryCacheDir.empty() || !chunkStoreDir.empty() ||
+                                    config.inputFormat != nar::ArchiveFormat::Nar ||
+                                    config.outputFormat != nar::ArchiveFormat::Nar)) {
+        std::cerr << "patchnar: error: --checkpoint only patches a NAR file into a NAR file\n";
+        return 1;
+    }
+    if (resume && checkpointFile.empty()) {
+        std::cerr << "patchnar: error: --resume requires --checkpoint\n";
+        return 1;
+    }
+
+    if (!batchFile.empty() && (!caPath.empty() || !variantSpecs.empty() || delta || verify ||
+                               !binaryCacheDir.empty() || !chunkStoreDir.empty() ||
+                               !checkpointFile.empty() || !applyDeltaFile.empty() ||
+                               !restoreName.empty() ||
+                               config.inputFormat != nar::ArchiveFormat::Nar ||
+                               config.outputFormat != nar::ArchiveFormat::Nar)) {
+        std::cerr << "patchnar: error: --batch only patches NAR files into NAR files\n";
+        return 1;
+    }
+
+    if (!restoreName.empty() && chunkStoreDir.empty()) {
+        std::cerr << "patchnar: error: --restore requires --chunk-store\n";
+        return 1;
+    }
+
+    config.tokenizeThreads = jobs;
+
+    std::unique_ptr<patchnar::Verifier> verifier;
+    if (verify) {
+        verifier = std::make_unique<patchnar::Verifier>(config);
+        config.verifier = verifier.get();
     }
 
     try {
         // Set stdin/stdout to binary mode
         std::ios_base::sync_with_stdio(false);
 
-        nar::NarProcessor processor(std::cin, std::cout);
-        processor.setContentPatcher(patchContent);
-        processor.setSymlinkPatcher(patchSymlink);
-        processor.process();
+        if (!restoreName.empty()) {
+            // Restore: the NAR is already patched, just send the chunks
+            nar::ChunkStore(chunkStoreDir).restore(restoreName, STDOUT_FILENO);
+            return 0;
+        }
 
-        return 0;
+        if (!applyDeltaFile.empty()) {
+            // Apply: no patching, the delta has the patched contents
+            std::ifstream deltaFile(applyDeltaFile, std::ios::binary);
+            if (!deltaFile) {
+                std::cerr << "patchnar: error: cannot open delta: " << applyDeltaFile << "\n";
+                return 1;
+            }
+            nar::ReadAheadInputStream input(STDIN_FILENO);
+            nar::WriteBehindOutputStream output(STDOUT_FILENO);
+            nar::applyDelta(input, deltaFile, output);
+            output.flush();
+            return 0;
+        }
+
+        // Load lang.map and compile the patchable languages while the NAR
+        // header and first files are read; NARs without scripts never wait
+        std::jthread warmup = warmSourceHighlight(
+            {config.patchableLangFiles.begin(), config.patchableLangFiles.end()});
+
+        if (!batchFile.empty()) {
+            const std::vector<nar::BatchItem> items = nar::readBatchFile(batchFile);
+            const auto errors = patchnar::patchBatch(config, items, jobs, memoryBudget);
+            size_t failed = 0;
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (!errors[i]) {
+                    continue;
+                }
+                failed++;
+                try {
+                    std::rethrow_exception(errors[i]);
+                } catch (const std::exception& e) {
+                    std::cerr << "patchnar: " << items[i].input << ": " << e.what() << "\n";
+                }
+            }
+            config.log("patchnar: batch: %zu NARs, %zu failed\n", items.size(), failed);
+            return failed ? 1 : 0;
+        }
+
+        if (!binaryCacheDir.empty()) {
+            writeBinaryCache(config, binaryCacheDir, storePath, references, jobs);
+            return reportViolations(verifier.get());
+        }
+
+        if (!checkpointFile.empty()) {
+            const auto [size, hash] = patchnar::patchNarCheckpointed(
+                config, STDIN_FILENO, STDOUT_FILENO, checkpointFile, checkpointInterval, resume);
+            std::cerr << "patchnar: NAR sha256:" << nar::toNixBase32(hash) << " (" << size << " bytes)\n";
+            return reportViolations(verifier.get());
+        }
+
+        // Output not placed with pwrite goes through a writer thread
+        nar::WriteBehindOutputStream stdoutStream(STDOUT_FILENO);
+
+        if (!caPath.empty()) {
+            writeContentAddressed(config, caPath, references, jobs);
+            return reportViolations(verifier.get());
+        }
+
+        if (!variantSpecs.empty()) {
+            // stdout gets the NAR for the main options, each FILE its variant
+            std::vector<patchnar::PatchConfig> configs{config};
+            std::vector<std::unique_ptr<std::ofstream>> files;
+            std::vector<std::ostream*> outs{&stdoutStream};
+            for (const auto& spec : variantSpecs) {
+                std::string file;
+                configs.push_back(parseVariant(config, spec, file));
+                files.push_back(std::make_unique<std::ofstream>(file, std::ios::binary | std::ios::trunc));
+                if (!*files.back()) {
+                    std::cerr << "patchnar: error: cannot create " << file << "\n";
+                    return 1;
+                }
+                files.back()->exceptions(std::ios_base::badbit | std::ios_base::failbit);
+                outs.push_back(files.back().get());
+            }
+            nar::ReadAheadInputStream input(STDIN_FILENO);
+            patchnar::patchVariants(configs, input, outs);
+            return reportViolations(verifier.get());
+        }
+
+        if (delta) {
+            nar::ReadAheadInputStream input(STDIN_FILENO);
+            patchnar::writeDelta(config, input, stdoutStream);
+            stdoutStream.flush();
+            return reportViolations(verifier.get());
+        }
+
+        // Optionally tee the output into the chunk store
+        std::unique_ptr<nar::ChunkStore> chunkStore;
+        std::unique_ptr<nar::ChunkingOutputBuf> chunker;
+        std::ostream output(stdoutStream.rdbuf());
+        output.exceptions(std::ios_base::badbit);
+        if (!chunkStoreDir.empty()) {
+            chunkStore = std::make_unique<nar::ChunkStore>(chunkStoreDir);
+            chunker = std::make_unique<nar::ChunkingOutputBuf>(*chunkStore, stdoutStream.rdbuf());
+            output.rdbuf(chunker.get());
+        }
+
+        // Regular-file output is written in place unless it is also chunked
+        patchnar::patchNar(config, STDIN_FILENO, output, chunker ? -1 : STDOUT_FILENO, jobs);
+
+        if (chunker) {
+            const std::string name = chunker->finish(storeName);
+            const auto& stats = chunker->stats();
+            std::cerr << "patchnar: stored NAR as " << name << " (" << stats.chunks << " chunks, "
+                      << stats.newChunks << " new, " << stats.newBytes << " of "
+                      << stats.bytes << " bytes written)\n";
+        }
+
+        return reportViolations(verifier.get());
     } catch (const std::exception& e) {
         std::cerr << "patchnar: " << e.what() << "\n";
         return 1;
@@ -0,0 +1,181 @@
+/*
+ * Path rules - segment-level glob automaton
+ *
+ * Every rule's glob is split into segments and appended to one shared
+ * segment table; an automaton position is an index into that table.
+ * A Cursor holds the set of positions still alive at a directory level.
+ * Stepping into an entry matches its name once against each live
+ * position, so subtrees that no rule can reach cost nothing further.
+ */
+
+#include "path_rules.h"
+
+#include <algorithm>
+#include <fnmatch.h>
+#include <stdexcept>
+
+namespace nar {
+
+// ============================================================================
+// PathAction
+// ============================================================================
+
+PathAction PathAction::parse(std::string_view text)
+{
+    if (text == "skip") {
+        return {.kind = Kind::Skip};
+    }
+    if (text == "map-only") {
+        return {.kind = Kind::MapOnly};
+    }
+    if (text == "elf") {
+        return {.kind = Kind::Elf};
+    }
+    if (text.starts_with("script:") && text.size() > 7) {
+        std::string lang(text.substr(7));
+        if (!lang.ends_with(".lang")) {
+            lang += ".lang";
+        }
+        return {.kind = Kind::Script, .lang = std::move(lang)};
+    }
+    throw std::invalid_argument("unknown rule action '" + std::string(text) +
+                                "' (expected skip, map-only, elf or script:LANG)");
+}
+
+std::string PathAction::toString() const
+{
+    switch (kind) {
+        case Kind::Default: return "default";
+        case Kind::Skip:    return "skip";
+        case Kind::MapOnly: return "map-only";
+        case Kind::Elf:     return "elf";
+        case Kind::Script:  return "script:" + lang;
+    }
+    return "default";
+}
+
+// ============================================================================
+// Rule compilation
+// ============================================================================
+
+void PathRules::add(std::string_view spec)
+{
+    size_t eq = spec.rfind('=');
+    if (eq == std::string_view::npos || eq == 0) {
+        throw std::invalid_argument("rule must be GLOB=ACTION: '" + std::string(spec) + "'");
+    }
+
+    const auto glob = spec.substr(0, eq);
+    const auto ruleIndex = static_cast<uint32_t>(rules_.size());
+    rules_.push_back({.glob = std::string(glob), .action = PathAction::parse(spec.substr(eq + 1))});
+    starts_.push_back(static_cast<uint32_t>(segments_.size()));
+
+    size_t start = 0;
+    while (start <= glob.size()) {
+        size_t slash = glob.find('/', start);
+        if (slash == std::string_view::npos) {
+            slash = glob.size();
+        }
+        const auto seg = glob.substr(start, slash - start);
+        start = slash + 1;
+
+        if (seg.empty() || seg == ".") {
+            continue;  // Tolerate leading "/", "./" and doubled slashes
+        }
+
+        Segment::Kind kind = Segment::Kind::Literal;
+        if (seg == "**") {
+            // Collapse runs of "**" - they match the same thing
+            if (!segments_.empty() && segments_.size() > starts_.back() &&
+                segments_.back().kind == Segment::Kind::DoubleStar) {
+                continue;
+            }
+            kind = Segment::Kind::DoubleStar;
+        } else if (seg.find_first_of("*?[") != std::string_view::npos) {
+            kind = Segment::Kind::Wildcard;
+        }
+        segments_.push_back({.kind = kind, .text = std::string(seg), .rule = ruleIndex});
+    }
+
+    segments_.push_back({.kind = Segment::Kind::Accept, .text = {}, .rule = ruleIndex});
+}
+
+// ============================================================================
+// Matching
+// ============================================================================
+
+// Add a position plus everything reachable without consuming a segment
+// ("**" may match zero segments)
+void PathRules::addClosure(std::vector<uint32_t>& set, uint32_t pos) const
+{
+    set.push_back(pos);
+    while (segments_[pos].kind == Segment::Kind::DoubleStar) {
+        set.push_back(++pos);
+    }
+}
+
+bool PathRules::matchSegment(const Segment& seg, std::string_view name) const
+{
+    switch (seg.kind) {
+        case Segment::Kind::Literal:
+            return seg.text == name;
+        case Segment::Kind::Wildcard:
+            return fnmatch(seg.text.c_str(), std::string(name).c_str(), FNM_PERIOD) == 0;
+        case Segment::Kind::DoubleStar:
+            return true;
+        case Segment::Kind::Accept:
+            return false;
+    }
+    return false;
+}
+
+PathRules::Cursor PathRules::root() const
+{
+    Cursor cursor;
+    for (uint32_t start : starts_) {
+        addClosure(cursor.positions, start);
+    }
+    std::sort(cursor.positions.begin(), cursor.positions.end());
+    cursor.positions.erase(std::unique(cursor.positions.begin(), cursor.positions.end()),
+                           cursor.positions.end());
+
+    // Rules such as "**=map-only" also match the root itself
+    for (uint32_t pos : cursor.positions) {
+        if (segments_[pos].kind == Segment::Kind::Accept) {
+            cursor.action = &rules_[segments_[pos].rule].action;
+        }
+    }
+    return cursor;
+}
+
+PathRules::Cursor PathRules::step(const Cursor& parent, std::string_view name) const
+{
+    Cursor child{.positions = {}, .action = parent.action};
+    if (parent.positions.empty()) {
+        return child;  // No rule can match below here - inherit only
+    }
+
+    for (uint32_t pos : parent.positions) {
+        const Segment& seg = segments_[pos];
+        if (seg.kind == Segment::Kind::DoubleStar) {
+            addClosure(child.positions, pos);  // "**" consumes and stays
+        } else if (matchSegment(seg, name)) {
+            addClosure(child.positions, pos + 1);
+        }
+    }
+
+    std::sort(child.positions.begin(), child.positions.end());
+    child.positions.erase(std::unique(child.positions.begin(), child.positions.end()),
+                          child.positions.end());
+
+    // Positions are ordered by rule, so the last accepting one is the
+    // most recently given rule
+    for (uint32_t pos : child.positions) {
+        if (segments_[pos].kind == Segment::Kind::Accept) {
+            child.action = &rules_[segments_[pos].rule].action;
+        }
+    }
+    return child;
+}
+
+} // namespace nar
@@ -0,0 +1,98 @@
+/*
+ * Path rules - per-subtree patch actions selected by glob
+ *
+ * Rules are given as GLOB=ACTION (e.g. "share/doc=skip", which also covers
+ * everything below share/doc) and compiled into a single segment-level
+ * automaton. The NAR parser advances a Cursor one path segment at a time
+ * while descending, so matching costs one step per directory entry instead
+ * of a full-path match per file. A matched action applies to the node and
+ * is inherited by its whole subtree.
+ *
+ * Glob syntax (anchored at the NAR root, '/' separates segments):
+ * - "*", "?" and "[...]" match within a single segment (fnmatch)
+ * - "**" matches zero or more whole segments
+ * - When several rules match the same node, the last one given wins;
+ *   a match on a node overrides an action inherited from its parent
+ */
+
+#ifndef PATH_RULES_H
+#define PATH_RULES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// PathAction - What to do with a node selected by a rule
+// ============================================================================
+
+struct PathAction {
+    enum class Kind {
+        Default,   // Normal classification (ELF / language detection)
+        Skip,      // Copy verbatim, no patching at all
+        MapOnly,   // Hash mappings only
+        Elf,       // ELF patching only, no language detection
+        Script     // Source patching with a fixed .lang file
+    };
+
+    Kind kind = Kind::Default;
+    std::string lang;  // .lang file for Kind::Script (e.g. "sh.lang")
+
+    // Parse an ACTION string: skip, map-only, elf, script:LANG
+    // Throws std::invalid_argument on unknown actions
+    static PathAction parse(std::string_view text);
+
+    std::string toString() const;
+};
+
+// ============================================================================
+// PathRules - Compiled rule automaton
+// ============================================================================
+
+class PathRules {
+public:
+    // Incremental matching state for one directory level
+    struct Cursor {
+        std::vector<uint32_t> positions;      // Active automaton positions
+        const PathAction* action = nullptr;   // Effective action (nullptr = default)
+    };
+
+    // Add a rule from "GLOB=ACTION" (throws std::invalid_argument)
+    void add(std::string_view spec);
+
+    bool empty() const { return rules_.empty(); }
+
+    // Cursor for the NAR root
+    Cursor root() const;
+
+    // Advance from a parent cursor into the child entry `name`
+    Cursor step(const Cursor& parent, std::string_view name) const;
+
+private:
+    struct Segment {
+        enum class Kind { Literal, Wildcard, DoubleStar, Accept };
+        Kind kind;
+        std::string text;
+        uint32_t rule;
+    };
+
+    struct Rule {
+        std::string glob;
+        PathAction action;
+    };
+
+    void addClosure(std::vector<uint32_t>& set, uint32_t pos) const;
+    bool matchSegment(const Segment& seg, std::string_view name) const;
+
+    std::vector<Segment> segments_;
+    std::vector<uint32_t> starts_;  // First segment position of each rule
+    std::vector<Rule> rules_;
+};
+
+} // namespace nar
+
+#endif // PATH_RULES_H
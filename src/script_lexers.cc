@@ -0,0 +1,621 @@
+// script_lexers.cc - Native string/comment scanners for common script languages
+
+#include "script_lexers.h"
+#include "data_lexers.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace {
+
+bool isIdentStart(char c)
+{
+    return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool isIdentChar(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+size_t lineEnd(std::string_view s, size_t i)
+{
+    const size_t end = s.find('\n', i);
+    return end == std::string_view::npos ? s.size() : end;
+}
+
+// ============================================================================
+// Python
+// ============================================================================
+
+class PythonLexer {
+public:
+    explicit PythonLexer(std::string_view s) : s_(s), n_(s.size()) {}
+
+    std::vector<SourceSpan> run()
+    {
+        size_t i = 0;
+        while (i < n_) {
+            const char c = s_[i];
+
+            if (c == '#') {
+                const size_t end = lineEnd(s_, i);
+                spans_.push_back({i, end, SourceSpan::Kind::Comment});
+                i = end;
+                continue;
+            }
+
+            bool fstring = false;
+            if (const size_t quote = stringStart(i, fstring); quote != NONE) {
+                const size_t end = skipString(quote, fstring);
+                spans_.push_back({quote, end, SourceSpan::Kind::String});
+                i = end;
+                continue;
+            }
+
+            if (isIdentStart(c)) {
+                while (i < n_ && isIdentChar(s_[i])) {
+                    ++i;
+                }
+                continue;
+            }
+            ++i;
+        }
+        return std::move(spans_);
+    }
+
+private:
+    static constexpr size_t NONE = std::string_view::npos;
+
+    // Position of the opening quote if a string (with optional prefix such
+    // as r, b, f, rb, Rf) starts at i
+    size_t stringStart(size_t i, bool& fstring) const
+    {
+        const char c = s_[i];
+        if (c == '"' || c == '\'') {
+            fstring = false;
+            return i;
+        }
+        if (!isIdentStart(c) || (i > 0 && isIdentChar(s_[i - 1]))) {
+            return NONE;
+        }
+
+        size_t j = i;
+        bool f = false;
+        while (j < n_ && j - i < 2 && s_[j] != '\0' && std::strchr("rRbBuUfF", s_[j])) {
+            f |= s_[j] == 'f' || s_[j] == 'F';
+            ++j;
+        }
+        if (j > i && j < n_ && (s_[j] == '"' || s_[j] == '\'')) {
+            fstring = f;
+            return j;
+        }
+        return NONE;
+    }
+
+    // Returns the end of the string whose opening quote is at q; strings
+    // that are not triple-quoted end at an unescaped newline
+    size_t skipString(size_t q, bool fstring) const
+    {
+        const char quote = s_[q];
+        const bool triple = q + 2 < n_ && s_[q + 1] == quote && s_[q + 2] == quote;
+        size_t i = q + (triple ? 3 : 1);
+
+        while (i < n_) {
+            const char c = s_[i];
+            if (c == '\\') {
+                i += 2;
+                continue;
+            }
+            if (c == '\n' && !triple) {
+                return i;
+            }
+            if (c == quote) {
+                if (!triple) {
+                    return i + 1;
+                }
+                if (i + 2 < n_ && s_[i + 1] == quote && s_[i + 2] == quote) {
+                    return i + 3;
+                }
+            }
+            if (fstring && c == '{') {
+                if (i + 1 < n_ && s_[i + 1] == '{') {
+                    i += 2;
+                    continue;
+                }
+                i = skipReplacementField(i + 1, triple);
+                continue;
+            }
+            ++i;
+        }
+        return std::min(i, n_);
+    }
+
+    // f-string "{expr!r:spec}": brackets nest and strings inside are lexed
+    // as strings (Python 3.12 allows reusing the outer quote there)
+    size_t skipReplacementField(size_t i, bool triple) const
+    {
+        int depth = 1;
+        while (i < n_) {
+            const char c = s_[i];
+            bool fstring = false;
+            if (const size_t quote = stringStart(i, fstring); quote != NONE) {
+                i = skipString(quote, fstring);
+                continue;
+            }
+            if (c == '\n' && !triple) {
+                return i;  // Let the enclosing string end here
+            }
+            if (c == '(' || c == '[' || c == '{') {
+                ++depth;
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (--depth == 0) {
+                    return i + 1;
+                }
+            }
+            ++i;
+        }
+        return n_;
+    }
+
+    std::string_view s_;
+    size_t n_;
+    std::vector<SourceSpan> spans_;
+};
+
+// ============================================================================
+// Perl
+// ============================================================================
+
+class PerlLexer {
+public:
+    explicit PerlLexer(std::string_view s) : s_(s), n_(s.size()) {}
+
+    std::vector<SourceSpan> run()
+    {
+        while (i_ < n_) {
+            const char c = s_[i_];
+            const bool lineStart = i_ == 0 || s_[i_ - 1] == '\n';
+
+            if (lineStart && c == '=' && i_ + 1 < n_ && std::isalpha(static_cast<unsigned char>(s_[i_ + 1]))) {
+                skipPod();
+                continue;
+            }
+
+            switch (c) {
+            case '\n':
+                ++i_;
+                if (!heredocs_.empty()) {
+                    readHeredocBodies();
+                }
+                break;
+
+            case ' ':
+            case '\t':
+            case '\r':
+                ++i_;
+                break;
+
+            case '#': {
+                const size_t end = lineEnd(s_, i_);
+                spans_.push_back({i_, end, SourceSpan::Kind::Comment});
+                i_ = end;
+                break;
+            }
+
+            case '"':
+            case '\'':
+            case '`': {
+                const size_t start = i_;
+                i_ = skipDelimited(i_);
+                spans_.push_back({start, i_, SourceSpan::Kind::String});
+                setTerm(false);
+                break;
+            }
+
+            case '$':
+                skipScalar();
+                setTerm(false);
+                break;
+
+            case '@':
+            case '%':
+            case '&':
+            case '*':
+                if (c != '@' && !expectTerm_) {
+                    ++i_;  // Operator (modulo, bitwise and, multiply)
+                    setTerm(true);
+                } else {
+                    skipSigil();
+                }
+                break;
+
+            case '/':
+                if (expectTerm_) {
+                    i_ = skipModifiers(skipDelimited(i_));  // Match regex
+                    setTerm(false);
+                } else {
+                    i_ += (i_ + 1 < n_ && s_[i_ + 1] == '/') ? 2 : 1;  // Division, //
+                    setTerm(true);
+                }
+                break;
+
+            case '<':
+                lexAngle();
+                break;
+
+            case '-':
+                if (i_ + 1 < n_ && s_[i_ + 1] == '>') {
+                    i_ += 2;
+                    afterArrow_ = true;
+                    expectTerm_ = false;
+                } else {
+                    ++i_;
+                    setTerm(true);
+                }
+                break;
+
+            case ')':
+            case ']':
+            case '}':
+                ++i_;
+                setTerm(false);
+                break;
+
+            default:
+                if (isIdentStart(c)) {
+                    if (!lexWord()) {
+                        return std::move(spans_);  // __END__ / __DATA__
+                    }
+                } else if (std::isdigit(static_cast<unsigned char>(c))) {
+                    while (i_ < n_ && (isIdentChar(s_[i_]) || s_[i_] == '.')) {
+                        ++i_;
+                    }
+                    setTerm(false);
+                } else {
+                    ++i_;
+                    setTerm(true);
+                }
+                break;
+            }
+        }
+        return std::move(spans_);
+    }
+
+private:
+    struct Heredoc {
+        std::string terminator;
+        bool indented;  // <<~ allows leading whitespace before the terminator
+    };
+
+    void setTerm(bool expectTerm)
+    {
+        expectTerm_ = expectTerm;
+        afterArrow_ = false;
+    }
+
+    static char closingDelimiter(char open)
+    {
+        switch (open) {
+        case '(': return ')';
+        case '[': return ']';
+        case '{': return '}';
+        case '<': return '>';
+        default: return open;
+        }
+    }
+
+    // Skips a delimited part starting at its opening delimiter; bracket
+    // delimiters nest. Returns the position after the closing delimiter.
+    size_t skipDelimited(size_t open) const
+    {
+        const char o = s_[open];
+        const char c = closingDelimiter(o);
+        const bool nests = c != o;
+        int depth = 1;
+
+        size_t i = open + 1;
+        while (i < n_) {
+            const char ch = s_[i];
+            if (ch == '\\') {
+                i += 2;
+                continue;
+            }
+            if (nests && ch == o) {
+                ++depth;
+            } else if (ch == c && --depth == 0) {
+                return i + 1;
+            }
+            ++i;
+        }
+        return n_;
+    }
+
+    size_t skipModifiers(size_t i) const
+    {
+        while (i < n_ && std::isalpha(static_cast<unsigned char>(s_[i]))) {
+            ++i;
+        }
+        return std::min(i, n_);
+    }
+
+    size_t skipSpace(size_t i) const
+    {
+        while (i < n_ && std::isspace(static_cast<unsigned char>(s_[i]))) {
+            ++i;
+        }
+        return i;
+    }
+
+    // POD block: from a "=word" line through the "=cut" line
+    void skipPod()
+    {
+        const size_t start = i_;
+        size_t i = i_;
+        while (i < n_) {
+            const size_t end = lineEnd(s_, i);
+            const bool cut = s_.substr(i, 4) == "=cut" && (i + 4 == end || !isIdentChar(s_[i + 4]));
+            i = end;
+            if (cut) {
+                break;
+            }
+            if (i < n_) {
+                ++i;
+            }
+        }
+        spans_.push_back({start, i, SourceSpan::Kind::Comment});
+        i_ = i;
+    }
+
+    // $name, ${...}, $#array, $#{...}, $^W and punctuation variables
+    // such as $" and $' (which must not start a string)
+    void skipScalar()
+    {
+        ++i_;
+        if (i_ < n_ && s_[i_] == '#') {
+            ++i_;
+            if (i_ < n_ && (s_[i_] == '{' || s_[i_] == '$')) {
+                return;
+            }
+        }
+        if (i_ >= n_) {
+            return;
+        }
+        const char c = s_[i_];
+        if (isIdentChar(c) || c == ':') {
+            skipName();
+        } else if (c == '^' && i_ + 1 < n_ && std::isupper(static_cast<unsigned char>(s_[i_ + 1]))) {
+            i_ += 2;
+        } else if (c != '{' && c != '$' && !std::isspace(static_cast<unsigned char>(c))) {
+            ++i_;
+        }
+    }
+
+    void skipSigil()
+    {
+        ++i_;
+        if (i_ < n_ && (isIdentChar(s_[i_]) || s_[i_] == ':')) {
+            skipName();
+        }
+        setTerm(false);
+    }
+
+    void skipName()
+    {
+        while (i_ < n_ && (isIdentChar(s_[i_]) || (s_[i_] == ':' && i_ + 1 < n_ && s_[i_ + 1] == ':'))) {
+            i_ += s_[i_] == ':' ? 2 : 1;
+        }
+    }
+
+    // "<<" heredoc or shift, "<FH>" readline, "<" comparison
+    void lexAngle()
+    {
+        if (i_ + 1 < n_ && s_[i_ + 1] == '<') {
+            size_t k = i_ + 2;
+            const bool indented = k < n_ && s_[k] == '~';
+            if (indented) {
+                ++k;
+            }
+            size_t q = k;
+            while (q < n_ && (s_[q] == ' ' || s_[q] == '\t')) {
+                ++q;
+            }
+            if (q < n_ && (s_[q] == '"' || s_[q] == '\'' || s_[q] == '`')) {
+                const size_t end = skipDelimited(q);
+                heredocs_.push_back({std::string(s_.substr(q + 1, end - q - 2)), indented});
+                i_ = end;
+                setTerm(false);
+                return;
+            }
+            if (k < n_ && isIdentStart(s_[k])) {
+                size_t end = k;
+                while (end < n_ && isIdentChar(s_[end])) {
+                    ++end;
+                }
+                heredocs_.push_back({std::string(s_.substr(k, end - k)), indented});
+                i_ = end;
+                setTerm(false);
+                return;
+            }
+            i_ += 2;  // Shift
+            setTerm(true);
+            return;
+        }
+
+        if (expectTerm_) {
+            // <STDIN>, <$fh>, <*.c>
+            size_t k = i_ + 1;
+            while (k < n_ && s_[k] != '>' && s_[k] != '\n' && s_[k] != ';') {
+                ++k;
+            }
+            if (k < n_ && s_[k] == '>') {
+                i_ = k + 1;
+                setTerm(false);
+                return;
+            }
+        }
+        ++i_;
+        setTerm(true);
+    }
+
+    // Bodies of the heredocs opened on the previous line, in order
+    void readHeredocBodies()
+    {
+        for (const auto& heredoc : heredocs_) {
+            const size_t start = i_;
+            bool found = false;
+            while (i_ < n_) {
+                const size_t end = lineEnd(s_, i_);
+                std::string_view line = s_.substr(i_, end - i_);
+                if (!line.empty() && line.back() == '\r') {
+                    line.remove_suffix(1);
+                }
+                if (heredoc.indented) {
+                    line.remove_prefix(std::min(line.find_first_not_of(" \t"), line.size()));
+                }
+                if (line == heredoc.terminator) {
+                    if (i_ > start) {
+                        spans_.push_back({start, i_, SourceSpan::Kind::String});
+                    }
+                    i_ = end < n_ ? end + 1 : end;
+                    found = true;
+                    break;
+                }
+                i_ = end < n_ ? end + 1 : end;
+            }
+            if (!found && i_ > start) {
+                spans_.push_back({start, i_, SourceSpan::Kind::String});
+            }
+        }
+        heredocs_.clear();
+    }
+
+    // Can the quote-like operator ending at j take a delimiter here?
+    // Rules out hash keys ({q}), fat commas (s => 1) and file tests (-s)
+    bool quoteLikeAt(size_t start, size_t j) const
+    {
+        if (afterArrow_ || (start > 0 && s_[start - 1] == '-')) {
+            return false;
+        }
+        const size_t k = skipSpace(j);
+        if (k >= n_) {
+            return false;
+        }
+        const char d = s_[k];
+        if (d == '=' || d == ',' || d == ';' || d == ')' || d == '}') {
+            return false;
+        }
+        if (d == '#' && k != j) {
+            return false;  // Comment after the word
+        }
+        return !isIdentChar(d);
+    }
+
+    // Returns false at __END__ / __DATA__
+    bool lexWord()
+    {
+        const size_t start = i_;
+        skipName();
+        const std::string_view word = s_.substr(start, i_ - start);
+        const bool lineStart = start == 0 || s_[start - 1] == '\n';
+
+        if (lineStart && (word == "__END__" || word == "__DATA__")) {
+            lexDataSection();
+            return false;
+        }
+
+        if ((word == "q" || word == "qq" || word == "qw" || word == "qx") && quoteLikeAt(start, i_)) {
+            i_ = skipDelimited(skipSpace(i_));
+            spans_.push_back({start, i_, SourceSpan::Kind::String});
+            setTerm(false);
+            return true;
+        }
+
+        if ((word == "m" || word == "qr") && quoteLikeAt(start, i_)) {
+            i_ = skipModifiers(skipDelimited(skipSpace(i_)));
+            setTerm(false);
+            return true;
+        }
+
+        if ((word == "s" || word == "tr" || word == "y") && quoteLikeAt(start, i_)) {
+            const size_t open = skipSpace(i_);
+            size_t end = skipDelimited(open);
+            if (closingDelimiter(s_[open]) != s_[open]) {
+                // s{...}{...}: the replacement has its own delimiters
+                const size_t second = skipSpace(end);
+                end = second < n_ ? skipDelimited(second) : n_;
+            } else if (end < n_) {
+                end = skipDelimited(end - 1);
+            }
+            i_ = skipModifiers(end);
+            setTerm(false);
+            return true;
+        }
+
+        static constexpr std::string_view termKeywords[] = {
+            "and", "cmp", "die", "eq", "ge", "grep", "gt", "if", "join", "le", "lt", "map",
+            "ne", "not", "or", "print", "push", "return", "say", "split", "unless", "unshift",
+            "until", "warn", "when", "while", "x", "xor",
+        };
+        const bool term = !afterArrow_ &&
+            std::find(std::begin(termKeywords), std::end(termKeywords), word) != std::end(termKeywords);
+        setTerm(term);
+        return true;
+    }
+
+    // After __END__: only POD is of interest
+    void lexDataSection()
+    {
+        i_ = lineEnd(s_, i_);
+        while (i_ < n_) {
+            ++i_;
+            if (i_ < n_ && s_[i_] == '=' && i_ + 1 < n_ && std::isalpha(static_cast<unsigned char>(s_[i_ + 1]))) {
+                skipPod();
+            } else {
+                i_ = lineEnd(s_, i_);
+            }
+        }
+    }
+
+    std::string_view s_;
+    size_t n_;
+    size_t i_ = 0;
+    bool expectTerm_ = true;   // A term (not an operator) comes next
+    bool afterArrow_ = false;  // Previous token was "->"
+    std::vector<Heredoc> heredocs_;
+    std::vector<SourceSpan> spans_;
+};
+
+} // anonymous namespace
+
+std::vector<SourceSpan> lexPython(std::string_view content)
+{
+    return PythonLexer(content).run();
+}
+
+std::vector<SourceSpan> lexPerl(std::string_view content)
+{
+    return PerlLexer(content).run();
+}
+
+std::optional<std::vector<SourceSpan>> lexSourceSpans(std::string_view content,
+                                                      const std::string& langFile)
+{
+    if (langFile == "python.lang") {
+        return lexPython(content);
+    }
+    if (langFile == "perl.lang") {
+        return lexPerl(content);
+    }
+    if (langFile == "json.lang") {
+        return lexJson(content);
+    }
+    if (langFile == "pkgconfig.lang") {
+        return lexPkgConfig(content);
+    }
+    if (langFile == "libtool.lang") {
+        return lexLibtool(content);
+    }
+    return std::nullopt;
+}
@@ -0,0 +1,38 @@
+// script_lexers.h - Native string/comment scanners for common script languages
+//
+// Purpose-built single-pass lexers that find the spans patchSourceStrings()
+// translates (string literals and comments) without going through
+// source-highlight's generic regex state machine. They only need to get
+// span boundaries right; everything else in the source is skipped.
+//
+// - python.lang: '#' comments; '...', "...", triple-quoted strings with
+//   any r/b/u/f prefix; f-string replacement fields may nest strings
+// - perl.lang: '#' comments, POD; '...', "...", `...`; q qq qw qx with
+//   any delimiters; heredocs (<<"EOF", <<'EOF', <<EOF, <<~EOF). Regex
+//   operators (m, qr, s, tr, y, /.../) are skipped, not patched, matching
+//   source-highlight which does not classify them as strings
+
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct SourceSpan {
+    enum class Kind { String, Comment };
+
+    size_t begin;
+    size_t end;  // One past the last byte
+    Kind kind;
+};
+
+// Spans of strings and comments in order, or nullopt if there is no
+// native lexer for langFile (e.g. "sh.lang"); data formats (JSON,
+// pkg-config, libtool) are dispatched to data_lexers.h
+std::optional<std::vector<SourceSpan>> lexSourceSpans(std::string_view content,
+                                                      const std::string& langFile);
+
+std::vector<SourceSpan> lexPython(std::string_view content);
+std::vector<SourceSpan> lexPerl(std::string_view content);
@@ -0,0 +1,141 @@
+/*
+ * Content-addressed store paths for NARs that refer to themselves
+ */
+
+#include "self_references.h"
+#include "fdstream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace nar {
+
+namespace {
+
+constexpr size_t BUFFER_SIZE = 256 * 1024;
+constexpr std::string_view STORE_DIR = "/nix/store";
+
+} // anonymous namespace
+
+// ============================================================================
+// SelfReferenceOutputBuf
+// ============================================================================
+
+SelfReferenceOutputBuf::SelfReferenceOutputBuf(int fd, std::string hashPart)
+    : fd_(fd), hashPart_(std::move(hashPart)), buffer_(BUFFER_SIZE)
+{
+    if (hashPart_.empty()) {
+        throw std::invalid_argument("self-references: empty hash part");
+    }
+    const off_t pos = ::lseek(fd_, 0, SEEK_CUR);
+    if (pos < 0) {
+        throw std::runtime_error(std::string("self-references: output not seekable: ") + strerror(errno));
+    }
+    base_ = static_cast<uint64_t>(pos);
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+SelfReferenceOutputBuf::int_type SelfReferenceOutputBuf::overflow(int_type ch)
+{
+    flushBuffer();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int SelfReferenceOutputBuf::sync()
+{
+    flushBuffer();
+    return 0;
+}
+
+void SelfReferenceOutputBuf::flushBuffer()
+{
+    const size_t size = static_cast<size_t>(pptr() - pbase());
+    if (size == 0) {
+        return;
+    }
+
+    pwriteExact(fd_, pbase(), size, static_cast<off_t>(base_ + size_));
+    size_ += size;
+    scan(pbase(), size, false);
+
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+// Like Nix's RewritingSink: matches are zeroed for hashing, and the last
+// hashPart - 1 bytes are held back in case a match straddles two blocks
+void SelfReferenceOutputBuf::scan(const char* data, size_t size, bool end)
+{
+    held_.append(data, size);
+
+    for (size_t pos = held_.find(hashPart_); pos != std::string::npos;
+         pos = held_.find(hashPart_, pos + hashPart_.size())) {
+        matches_.push_back(hashed_ + pos);
+        std::fill_n(held_.begin() + static_cast<ptrdiff_t>(pos), hashPart_.size(), '\0');
+    }
+
+    const size_t keep = end ? 0 : std::min(held_.size(), hashPart_.size() - 1);
+    const size_t ready = held_.size() - keep;
+    hash_.update(std::string_view(held_.data(), ready));
+    hashed_ += ready;
+    held_.erase(0, ready);
+}
+
+Sha256::Digest SelfReferenceOutputBuf::finish()
+{
+    flushBuffer();
+    scan(nullptr, 0, true);
+
+    // Offsets go into the hash too, so zeroed and live references differ
+    for (uint64_t match : matches_) {
+        hash_.update("|" + std::to_string(match));
+    }
+    return hash_.finish();
+}
+
+void SelfReferenceOutputBuf::rewrite(std::string_view newHashPart)
+{
+    if (newHashPart.size() != hashPart_.size()) {
+        throw std::invalid_argument("self-references: hash part length changed");
+    }
+    for (uint64_t match : matches_) {
+        pwriteExact(fd_, newHashPart.data(), newHashPart.size(), static_cast<off_t>(base_ + match));
+    }
+}
+
+// ============================================================================
+// Content-addressed store paths
+// ============================================================================
+
+std::string makeContentAddressedPath(std::string_view name, const Sha256::Digest& narHash,
+                                     std::vector<std::string> references, bool selfReference)
+{
+    // makeType("source", references), then makeStorePath()
+    std::sort(references.begin(), references.end());
+    std::string fingerprint = "source";
+    for (const auto& reference : references) {
+        fingerprint += ":" + reference;
+    }
+    if (selfReference) {
+        fingerprint += ":self";
+    }
+    fingerprint += ":sha256:" + toHex(narHash);
+    fingerprint += ":" + std::string(STORE_DIR) + ":" + std::string(name);
+
+    // compressHash(): fold the digest into 160 bits
+    const Sha256::Digest digest = Sha256::hash(std::as_bytes(std::span(fingerprint)));
+    std::array<uint8_t, 20> compressed{};
+    for (size_t i = 0; i < digest.size(); ++i) {
+        compressed[i % compressed.size()] ^= digest[i];
+    }
+
+    return std::string(STORE_DIR) + "/" + toNixBase32(compressed) + "-" + std::string(name);
+}
+
+} // namespace nar
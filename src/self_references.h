@@ -0,0 +1,83 @@
+/*
+ * Content-addressed store paths for NARs that refer to themselves
+ *
+ * The path of a content-addressed output depends on the hash of its NAR,
+ * which contains the path wherever the output refers to itself. Nix
+ * breaks the cycle by hashing the NAR modulo self-references: every
+ * occurrence of the path's hash part is hashed as zeros, and the offsets
+ * of the occurrences ("|<offset>" each) are hashed after the NAR.
+ *
+ * SelfReferenceOutputBuf does that while the patched NAR is written,
+ * remembering the offsets; once the new path is known, rewrite() patches
+ * its hash part in at those offsets. One pass plus O(references) writes
+ * replaces patching, hashing and patching again with --self-mapping.
+ */
+
+#ifndef SELF_REFERENCES_H
+#define SELF_REFERENCES_H
+
+#include "sha256.h"
+
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nar {
+
+// ============================================================================
+// SelfReferenceOutputBuf - Writes a NAR, hashing it modulo a hash part
+// ============================================================================
+
+class SelfReferenceOutputBuf : public std::streambuf {
+public:
+    // Writes to fd from its current offset with pwrite(), so the
+    // self-references can be rewritten in place (fd must be placeable)
+    SelfReferenceOutputBuf(int fd, std::string hashPart);
+
+    SelfReferenceOutputBuf(const SelfReferenceOutputBuf&) = delete;
+    SelfReferenceOutputBuf& operator=(const SelfReferenceOutputBuf&) = delete;
+
+    // Flush everything; returns the SHA-256 of the NAR modulo the hash part
+    Sha256::Digest finish();
+
+    // Replace every self-reference by newHashPart (same length); call after finish()
+    void rewrite(std::string_view newHashPart);
+
+    uint64_t size() const { return size_; }
+    const std::vector<uint64_t>& matches() const { return matches_; }
+
+protected:
+    int_type overflow(int_type ch) override;
+    int sync() override;
+
+private:
+    void flushBuffer();
+    void scan(const char* data, size_t size, bool end);
+
+    int fd_;
+    uint64_t base_;  // Offset of the NAR in fd
+    std::string hashPart_;
+    std::vector<char> buffer_;
+
+    Sha256 hash_;
+    uint64_t size_ = 0;              // Bytes written
+    uint64_t hashed_ = 0;            // Bytes hashed (held_ follows them)
+    std::string held_;               // Unhashed tail that may start a match
+    std::vector<uint64_t> matches_;  // NAR offsets of the self-references
+};
+
+// ============================================================================
+// Content-addressed store paths
+// ============================================================================
+
+// Store path of a recursive (NAR) SHA-256 content-addressed output named
+// `name`, as makeFixedOutputPath computes it: `references` are the other
+// store paths it refers to, selfReference whether it refers to itself
+std::string makeContentAddressedPath(std::string_view name, const Sha256::Digest& narHash,
+                                     std::vector<std::string> references, bool selfReference);
+
+} // namespace nar
+
+#endif // SELF_REFERENCES_H
@@ -0,0 +1,200 @@
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace nar {
+
+namespace {
+
+constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+constexpr uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+} // anonymous namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}
+{
+}
+
+void Sha256::compress(const uint8_t* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+               (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+
+    for (int i = 0; i < 64; ++i) {
+        const uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        const uint32_t ch = (e & f) ^ (~e & g);
+        const uint32_t t1 = h + s1 + ch + K[i] + w[i];
+        const uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        const uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+    state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+}
+
+void Sha256::update(std::span<const std::byte> data)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data.data());
+    size_t n = data.size();
+    length_ += n;
+
+    if (buffered_ > 0) {
+        const size_t take = std::min(n, buffer_.size() - buffered_);
+        std::memcpy(buffer_.data() + buffered_, p, take);
+        buffered_ += take;
+        p += take;
+        n -= take;
+        if (buffered_ < buffer_.size()) {
+            return;
+        }
+        compress(buffer_.data());
+        buffered_ = 0;
+    }
+
+    while (n >= 64) {
+        compress(p);
+        p += 64;
+        n -= 64;
+    }
+
+    std::memcpy(buffer_.data(), p, n);
+    buffered_ = n;
+}
+
+Sha256::Digest Sha256::finish()
+{
+    const uint64_t bits = length_ * 8;
+
+    // Padding: 0x80, zeros, then the bit length big-endian
+    buffer_[buffered_++] = 0x80;
+    if (buffered_ > 56) {
+        std::memset(buffer_.data() + buffered_, 0, 64 - buffered_);
+        compress(buffer_.data());
+        buffered_ = 0;
+    }
+    std::memset(buffer_.data() + buffered_, 0, 56 - buffered_);
+    for (int i = 0; i < 8; ++i) {
+        buffer_[56 + i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+    }
+    compress(buffer_.data());
+
+    Digest digest;
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<uint8_t>(state_[i] >> 24);
+        digest[i * 4 + 1] = static_cast<uint8_t>(state_[i] >> 16);
+        digest[i * 4 + 2] = static_cast<uint8_t>(state_[i] >> 8);
+        digest[i * 4 + 3] = static_cast<uint8_t>(state_[i]);
+    }
+    return digest;
+}
+
+Sha256::Digest Sha256::hash(std::span<const std::byte> data)
+{
+    Sha256 sha;
+    sha.update(data);
+    return sha.finish();
+}
+
+// Layout: state words, byte length, then the buffered tail of the input
+std::string Sha256::saveState() const
+{
+    std::string state(reinterpret_cast<const char*>(state_.data()), sizeof(state_));
+    state.append(reinterpret_cast<const char*>(&length_), sizeof(length_));
+    state.append(reinterpret_cast<const char*>(buffer_.data()), buffered_);
+    return state;
+}
+
+Sha256 Sha256::loadState(std::string_view state)
+{
+    Sha256 sha;
+    constexpr size_t fixed = sizeof(sha.state_) + sizeof(sha.length_);
+    if (state.size() < fixed) {
+        throw std::invalid_argument("truncated SHA-256 state");
+    }
+    std::memcpy(sha.state_.data(), state.data(), sizeof(sha.state_));
+    std::memcpy(&sha.length_, state.data() + sizeof(sha.state_), sizeof(sha.length_));
+    sha.buffered_ = state.size() - fixed;
+    if (sha.buffered_ != sha.length_ % sha.buffer_.size()) {
+        throw std::invalid_argument("inconsistent SHA-256 state");
+    }
+    std::memcpy(sha.buffer_.data(), state.data() + fixed, sha.buffered_);
+    return sha;
+}
+
+std::string toHex(std::span<const uint8_t> digest)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (uint8_t byte : digest) {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xf];
+    }
+    return hex;
+}
+
+std::string toNixBase32(std::span<const uint8_t> digest)
+{
+    // Nix's alphabet omits e, o, u and t; the digest is read as one
+    // little-endian number and printed most significant digit first
+    static constexpr char digits[] = "0123456789abcdfghijklmnpqrsvwxyz";
+    const size_t length = (digest.size() * 8 - 1) / 5 + 1;
+
+    std::string out;
+    out.reserve(length);
+    for (size_t n = length; n-- > 0;) {
+        const size_t bit = n * 5;
+        const size_t i = bit / 8;
+        const size_t j = bit % 8;
+        unsigned c = digest[i] >> j;
+        if (i + 1 < digest.size()) {
+            c |= static_cast<unsigned>(digest[i + 1]) << (8 - j);
+        }
+        out += digits[c & 0x1f];
+    }
+    return out;
+}
+
+} // namespace nar
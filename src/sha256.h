@@ -0,0 +1,60 @@
+/*
+ * SHA-256 (FIPS 180-4)
+ *
+ * Small streaming implementation so content addressing does not pull in
+ * a crypto library. Used to name chunks in the chunk store and for the
+ * hashes in binary cache .narinfo files.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace nar {
+
+class Sha256 {
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+
+    void update(std::span<const std::byte> data);
+    void update(std::string_view data)
+    {
+        update(std::as_bytes(std::span(data.data(), data.size())));
+    }
+
+    // Finish and return the digest (the object must not be updated after)
+    Digest finish();
+
+    static Digest hash(std::span<const std::byte> data);
+
+    // Hashing state as bytes, to continue the hash in another process
+    // (same byte order); loadState throws std::invalid_argument on garbage
+    std::string saveState() const;
+    static Sha256 loadState(std::string_view state);
+
+private:
+    void compress(const uint8_t* block);
+
+    std::array<uint32_t, 8> state_;
+    std::array<uint8_t, 64> buffer_{};
+    size_t buffered_ = 0;
+    uint64_t length_ = 0;  // Total bytes hashed
+};
+
+// Lowercase hexadecimal encoding of a digest
+std::string toHex(std::span<const uint8_t> digest);
+
+// Nix base-32 encoding ("sha256:<this>" in .narinfo files, store path hashes)
+std::string toNixBase32(std::span<const uint8_t> digest);
+
+} // namespace nar
+
+#endif // SHA256_H
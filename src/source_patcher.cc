@@ -7,8 +7,14 @@
 #endif
 
 #include "source_patcher.h"
+#include "script_lexers.h"
+#include "data_lexers.h"
+#include "lexer_restarts.h"
 
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 
@@ -25,14 +31,78 @@
 #include <boost/regex.hpp>
 #include <unordered_map>
 #include <algorithm>
+#include <mutex>
 
 const std::string sourceHighlightDataDir = SOURCE_HIGHLIGHT_DATA_DIR;
 
-// Language map for extension -> .lang file lookup (loaded once at startup)
-srchilite::LangMap langMap(sourceHighlightDataDir, "lang.map");
+namespace {
+
+// LangMap that reads lang.map when constructed; lookups on an opened map
+// only read it, so they need no locking
+struct LoadedLangMap : srchilite::LangMap {
+    LoadedLangMap() : srchilite::LangMap(sourceHighlightDataDir, "lang.map") { open(); }
+};
+
+} // anonymous namespace
+
+srchilite::LangMap& langMap()
+{
+    static LoadedLangMap map;
+    return map;
+}
 
 // Language inferrer for content-based detection (shebang, emacs mode, etc.)
-static srchilite::LanguageInfer languageInfer;
+static srchilite::LanguageInfer& languageInfer()
+{
+    static srchilite::LanguageInfer infer;
+    return infer;
+}
+
+// LanguageInfer is not documented as reentrant; serialize inference so
+// files can be patched from several threads
+static std::mutex detectMutex;
+
+// Compiled highlight states, one per .lang file
+// The .lang parser is a non-reentrant bison/flex parser, so states are built
+// once under a mutex and then shared (highlighting only reads them)
+static srchilite::HighlightStatePtr getHighlightState(const std::string& langFile)
+{
+    static std::mutex mutex;
+    static srchilite::RegexRuleFactory ruleFactory;
+    static srchilite::LangDefManager langDefManager(&ruleFactory);
+    static std::unordered_map<std::string, srchilite::HighlightStatePtr> states;
+
+    std::lock_guard lock(mutex);
+    auto it = states.find(langFile);
+    if (it == states.end()) {
+        it = states.emplace(langFile,
+            langDefManager.getHighlightState(sourceHighlightDataDir, langFile)).first;
+    }
+    return it->second;
+}
+
+std::jthread warmSourceHighlight(std::vector<std::string> langFiles)
+{
+    return std::jthread([langFiles = std::move(langFiles)](std::stop_token stop) {
+        try {
+            langMap();
+            if (stop.stop_requested()) {
+                return;
+            }
+            languageInfer();
+            for (const auto& langFile : langFiles) {
+                if (stop.stop_requested()) {
+                    return;
+                }
+                if (!hasOnlyNativeLexer(langFile)) {
+                    getHighlightState(langFile);
+                }
+            }
+        } catch (...) {
+            // Best effort: the first real use reports the error
+        }
+    });
+}
 
 // Detect language from content (shebang, emacs mode, xml, etc.)
 // Returns .lang filename (e.g., "sh.lang", "python.lang") or empty string
@@ -48,7 +118,11 @@ std::string detectLanguage(const std::string& content)
 
     // Content-based detection (shebang, emacs mode, xml, etc.)
     std::istringstream contentStream(normalized);
-    std::string inferredLang = languageInfer.infer(contentStream);
+    std::string inferredLang;
+    {
+        std::lock_guard lock(detectMutex);
+        inferredLang = languageInfer().infer(contentStream);
+    }
 
     if (!inferredLang.empty()) {
         // Normalize common interpreter variants not in lang.map
@@ -63,7 +137,7 @@ std::string detectLanguage(const std::string& content)
             lookupLang = aliasIt->second;
         }
 
-        std::string langFile = langMap.getMappedFileName(lookupLang);
+        std::string langFile = langMap().getMappedFileName(lookupLang);
         if (!langFile.empty()) {
             return langFile;
         }
@@ -91,7 +165,7 @@ std::string detectLanguageFromFile(
     size_t maxContentDetect)
 {
     // Try extension-based lookup first
-    std::string langFile = langMap.getMappedFileNameFromFileName(filename);
+    std::string langFile = langMap().getMappedFileNameFromFileName(filename);
     if (!langFile.empty()) {
         return langFile;
     }
@@ -102,50 +176,365 @@ std::string detectLanguageFromFile(
     return "";
 }
 
-std::string patchSourceStrings(
+// Copy content with each span passed through the translator; translated,
+// if given, gets where the translated spans are in the result
+static std::string patchSpans(
+    const std::string& content,
+    const std::vector<SourceSpan>& spans,
+    srchilite::CharTranslator& translator,
+    std::vector<SourceSpan>* translated)
+{
+    std::string out;
+    out.reserve(content.size());
+    size_t pos = 0;
+    for (const auto& span : spans) {
+        out.append(content, pos, span.begin - pos);
+        const size_t begin = out.size();
+        out += translator.preformat(content.substr(span.begin, span.end - span.begin));
+        if (translated) {
+            translated->push_back({begin, out.size(), span.kind});
+        }
+        pos = span.end;
+    }
+    out.append(content, pos, std::string::npos);
+    return out;
+}
+
+// Tokenize content with source-highlight, passing strings and comments
+// through their PreFormatters and everything else through normal, if
+// given (throws on source-highlight errors)
+static std::string highlightElements(
     const std::string& content,
     const std::string& langFile,
-    srchilite::CharTranslator& translator)
+    srchilite::PreFormatter& strings,
+    srchilite::PreFormatter& comments,
+    srchilite::PreFormatter* normal = nullptr)
 {
-    try {
-        srchilite::RegexRuleFactory ruleFactory;
-        srchilite::LangDefManager langDefManager(&ruleFactory);
-        srchilite::SourceHighlighter highlighter(
-            langDefManager.getHighlightState(sourceHighlightDataDir, langFile));
-        highlighter.setOptimize(false);
+    srchilite::SourceHighlighter highlighter(getHighlightState(langFile));
+    highlighter.setOptimize(false);
+
+    // Output collection
+    std::ostringstream outputStream;
+    srchilite::BufferedOutput bufferedOutput(outputStream);
+
+    // Identity formatter for non-string elements (outputs text as-is)
+    auto identityFormatter = std::make_unique<srchilite::TextStyleFormatter>(
+        "$text", &bufferedOutput);
+    if (normal) {
+        identityFormatter->setPreFormatter(normal);
+    }
+
+    // String formatter with caller-supplied path translation
+    auto stringFormatter = std::make_unique<srchilite::TextStyleFormatter>(
+        "$text", &bufferedOutput);
+    stringFormatter->setPreFormatter(&strings);
+
+    // Comment formatter with path translation (handles shebangs)
+    auto commentFormatter = std::make_unique<srchilite::TextStyleFormatter>(
+        "$text", &bufferedOutput);
+    commentFormatter->setPreFormatter(&comments);
+
+    // Register formatters
+    srchilite::FormatterManager formatterManager(std::move(identityFormatter));
+    formatterManager.addFormatter("string", std::move(stringFormatter));
+    formatterManager.addFormatter("comment", std::move(commentFormatter));
+    highlighter.setFormatterManager(&formatterManager);
+
+    // Process entire content at once
+    highlighter.highlightParagraph(content);
+
+    return outputStream.str();
+}
+
+namespace {
+
+// Passes strings and comments through a translator and records where
+// they end up in the output: every element goes through one of its
+// PreFormatters in order, so the output lengths add up to offsets
+class TranslationRecorder {
+public:
+    TranslationRecorder(srchilite::CharTranslator& translator, std::vector<SourceSpan>& translated)
+        : strings_(*this, SourceSpan::Kind::String),
+          comments_(*this, SourceSpan::Kind::Comment),
+          normal_(*this, std::nullopt),
+          translator_(translator), translated_(translated) {}
+
+    std::string highlight(const std::string& content, const std::string& langFile)
+    {
+        return highlightElements(content, langFile, strings_, comments_, &normal_);
+    }
+
+private:
+    struct Element : srchilite::PreFormatter {
+        Element(TranslationRecorder& recorder, std::optional<SourceSpan::Kind> kind)
+            : recorder(recorder), kind(kind) {}
+
+        const std::string doPreformat(const std::string& text) override
+        {
+            const size_t begin = recorder.offset_;
+            std::string out = kind ? recorder.translator_.preformat(text) : text;
+            recorder.offset_ += out.size();
+            if (kind) {
+                recorder.translated_.push_back({begin, recorder.offset_, *kind});
+            }
+            return out;
+        }
+
+        TranslationRecorder& recorder;
+        std::optional<SourceSpan::Kind> kind;
+    };
+
+    Element strings_;
+    Element comments_;
+    Element normal_;
+    srchilite::CharTranslator& translator_;
+    std::vector<SourceSpan>& translated_;
+    size_t offset_ = 0;
+};
+
+} // anonymous namespace
+
+// Tokenize content with source-highlight, passing strings and comments
+// through the translator; translated, if given, gets where they are in
+// the result (throws on source-highlight errors)
+static std::string highlightStrings(
+    const std::string& content,
+    const std::string& langFile,
+    srchilite::CharTranslator& translator,
+    std::vector<SourceSpan>* translated)
+{
+    if (translated) {
+        return TranslationRecorder(translator, *translated).highlight(content, langFile);
+    }
+    return highlightElements(content, langFile, translator, translator);
+}
+
+// Every occurrence of every needle, by position
+static std::vector<NeedleMatch> findNeedles(
+    const std::string& content,
+    std::span<const std::string> needles)
+{
+    std::vector<NeedleMatch> matches;
+    for (const auto& needle : needles) {
+        if (needle.empty()) {
+            continue;
+        }
+        for (size_t pos = content.find(needle); pos != std::string::npos;
+             pos = content.find(needle, pos + 1)) {
+            matches.push_back({pos, pos + needle.size()});
+        }
+    }
+    std::sort(matches.begin(), matches.end(),
+              [](const NeedleMatch& a, const NeedleMatch& b) { return a.begin < b.begin; });
+    return matches;
+}
+
+// A stretch of content tokenized on its own: it starts at a restart
+// point (or the top) and ends at one (or the end)
+struct TokenRange {
+    size_t begin;
+    size_t end;
+};
+
+// Below this, splitting a range is not worth starting a thread
+static constexpr size_t PARALLEL_PIECE_SIZE = 1 << 20;  // 1MB
+
+// From the restart point before each match to the one after it;
+// overlapping ranges are merged
+static std::vector<TokenRange> rangesAroundMatches(
+    size_t size,
+    const std::vector<NeedleMatch>& matches,
+    const std::vector<size_t>& restarts)
+{
+    // First restart point past offset, or the end of the content
+    auto restartAfter = [&](size_t offset) {
+        auto it = std::upper_bound(restarts.begin(), restarts.end(), offset);
+        return it == restarts.end() ? size : *it;
+    };
 
-        // Output collection
-        std::ostringstream outputStream;
-        srchilite::BufferedOutput bufferedOutput(outputStream);
+    std::vector<TokenRange> ranges;
+    size_t k = 0;
+    while (k < matches.size()) {
+        const size_t begin = *(std::upper_bound(restarts.begin(), restarts.end(), matches[k].begin) - 1);
+        size_t end = restartAfter(matches[k].end - 1);
+        while (++k < matches.size() && matches[k].begin < end) {
+            end = std::max(end, restartAfter(matches[k].end - 1));
+        }
+        ranges.push_back({begin, end});
+    }
+    return ranges;
+}
+
+// Cut ranges at restart points into pieces of about pieceSize bytes
+static std::vector<TokenRange> splitRanges(
+    const std::vector<TokenRange>& ranges,
+    const std::vector<size_t>& restarts,
+    size_t pieceSize)
+{
+    std::vector<TokenRange> pieces;
+    for (const auto& range : ranges) {
+        size_t begin = range.begin;
+        while (range.end - begin > 2 * pieceSize) {
+            auto it = std::lower_bound(restarts.begin(), restarts.end(), begin + pieceSize);
+            if (it == restarts.end() || *it >= range.end) {
+                break;
+            }
+            pieces.push_back({begin, *it});
+            begin = *it;
+        }
+        pieces.push_back({begin, range.end});
+    }
+    return pieces;
+}
+
+// Tokenize each range, one translator per thread, and copy the rest
+static std::string highlightRanges(
+    const std::string& content,
+    const std::string& langFile,
+    const std::vector<TokenRange>& ranges,
+    std::span<srchilite::CharTranslator* const> translators,
+    std::vector<SourceSpan>* translated)
+{
+    std::vector<std::string> patched(ranges.size());
+    std::vector<std::vector<SourceSpan>> pieceSpans(translated ? ranges.size() : 0);
+    auto spansOf = [&](size_t i) { return translated ? &pieceSpans[i] : nullptr; };
+    const size_t threads = std::min(translators.size(), ranges.size());
+
+    if (threads <= 1) {
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            patched[i] = highlightStrings(content.substr(ranges[i].begin, ranges[i].end - ranges[i].begin),
+                                          langFile, *translators[0], spansOf(i));
+        }
+    } else {
+        std::atomic<size_t> next{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        {
+            std::vector<std::jthread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, translator = translators[t]] {
+                    try {
+                        for (size_t i = next++; i < ranges.size(); i = next++) {
+                            patched[i] = highlightStrings(
+                                content.substr(ranges[i].begin, ranges[i].end - ranges[i].begin),
+                                langFile, *translator, spansOf(i));
+                        }
+                    } catch (...) {
+                        std::lock_guard lock(errorMutex);
+                        error = std::current_exception();
+                        next = ranges.size();
+                    }
+                });
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    std::string out;
+    out.reserve(content.size());
+    size_t pos = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        out.append(content, pos, ranges[i].begin - pos);
+        if (translated) {
+            for (const auto& span : pieceSpans[i]) {
+                translated->push_back({out.size() + span.begin, out.size() + span.end, span.kind});
+            }
+        }
+        out += patched[i];
+        pos = ranges[i].end;
+    }
+    out.append(content, pos, std::string::npos);
+    return out;
+}
 
-        // Identity formatter for non-string elements (outputs text as-is)
-        auto identityFormatter = std::make_unique<srchilite::TextStyleFormatter>(
-            "$text", &bufferedOutput);
+// patchSourceStrings() with up to threads translators from makeTranslator
+// (translator is the first); found are the needle matches if known
+static std::string patchStrings(
+    const std::string& content,
+    const std::string& langFile,
+    srchilite::CharTranslator& translator,
+    const TranslatorFactory* makeTranslator,
+    unsigned threads,
+    bool nativeLexers,
+    std::span<const std::string> needles,
+    const std::vector<NeedleMatch>* found,
+    std::vector<SourceSpan>* translated)
+{
+    if (translated) {
+        translated->clear();
+    }
 
-        // String formatter with caller-supplied path translation
-        auto stringFormatter = std::make_unique<srchilite::TextStyleFormatter>(
-            "$text", &bufferedOutput);
-        stringFormatter->setPreFormatter(&translator);
+    // Nothing the translator would change: no need to tokenize at all
+    std::vector<NeedleMatch> matches;
+    if (!needles.empty()) {
+        matches = found ? *found : findNeedles(content, needles);
+        if (matches.empty()) {
+            return content;
+        }
+    }
 
-        // Comment formatter with path translation (handles shebangs)
-        auto commentFormatter = std::make_unique<srchilite::TextStyleFormatter>(
-            "$text", &bufferedOutput);
-        commentFormatter->setPreFormatter(&translator);
+    if (nativeLexers || hasOnlyNativeLexer(langFile)) {
+        if (auto spans = lexSourceSpans(content, langFile)) {
+            return patchSpans(content, *spans, translator, translated);
+        }
+    }
 
-        // Register formatters
-        srchilite::FormatterManager formatterManager(std::move(identityFormatter));
-        formatterManager.addFormatter("string", std::move(stringFormatter));
-        formatterManager.addFormatter("comment", std::move(commentFormatter));
-        highlighter.setFormatterManager(&formatterManager);
+    try {
+        const bool parallel = threads > 1 && content.size() >= 2 * PARALLEL_PIECE_SIZE;
+        std::optional<std::vector<size_t>> restarts;
+        if (!needles.empty() || parallel) {
+            restarts = findRestartPoints(content, langFile);
+        }
 
-        // Process entire content at once
-        highlighter.highlightParagraph(content);
+        std::vector<TokenRange> ranges{{0, content.size()}};
+        if (restarts && !needles.empty()) {
+            ranges = rangesAroundMatches(content.size(), matches, *restarts);
+        }
 
-        return outputStream.str();
+        std::vector<std::unique_ptr<srchilite::CharTranslator>> owned;
+        std::vector<srchilite::CharTranslator*> translators{&translator};
+        if (restarts && parallel) {
+            ranges = splitRanges(ranges, *restarts, PARALLEL_PIECE_SIZE);
+            while (translators.size() < std::min<size_t>(threads, ranges.size())) {
+                owned.push_back((*makeTranslator)());
+                translators.push_back(owned.back().get());
+            }
+        }
+        return highlightRanges(content, langFile, ranges, translators, translated);
 
     } catch (const std::exception& e) {
         fprintf(stderr, "  source-highlight patching failed (%s): %s\n",
                 langFile.c_str(), e.what());
+        if (translated) {
+            *translated = {{0, content.size(), SourceSpan::Kind::String}};
+        }
         return content;
     }
 }
+
+std::string patchSourceStrings(
+    const std::string& content,
+    const std::string& langFile,
+    srchilite::CharTranslator& translator,
+    bool nativeLexers,
+    std::span<const std::string> needles)
+{
+    return patchStrings(content, langFile, translator, nullptr, 1, nativeLexers, needles, nullptr, nullptr);
+}
+
+std::string patchSourceStrings(
+    const std::string& content,
+    const std::string& langFile,
+    const TranslatorFactory& makeTranslator,
+    unsigned threads,
+    bool nativeLexers,
+    std::span<const std::string> needles,
+    const std::vector<NeedleMatch>* matches,
+    std::vector<SourceSpan>* translated)
+{
+    std::unique_ptr<srchilite::CharTranslator> translator = makeTranslator();
+    return patchStrings(content, langFile, *translator, &makeTranslator, threads, nativeLexers, needles,
+                        matches, translated);
+}
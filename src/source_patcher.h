@@ -5,15 +5,30 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <span>
 #include <string>
+#include <thread>
+#include <vector>
 #include <srchilite/chartranslator.h>
 #include <srchilite/langmap.h>
 
+#include "script_lexers.h"
+
 // Source-highlight data directory (compile-time constant from configure)
 extern const std::string sourceHighlightDataDir;
 
-// Language map for extension -> .lang file lookup (loaded once)
-extern srchilite::LangMap langMap;
+// Language map for extension -> .lang file lookup
+// Loaded from lang.map on first use (thread-safe), not at program load
+srchilite::LangMap& langMap();
+
+// Build the language map, language inferrer and the highlight states of
+// langFiles on a background thread, so the first script does not pay for
+// it. Everything stays lazy: users that get there first build it
+// themselves. The returned thread checks for a stop request between steps,
+// so destroying it early waits for one step at most.
+std::jthread warmSourceHighlight(std::vector<std::string> langFiles);
 
 // Detect language from file content (shebang, emacs mode, xml, etc.)
 // Returns .lang filename (e.g., "sh.lang", "python.lang") or empty string.
@@ -36,8 +51,44 @@ std::string detectLanguageFromFile(
 // Patch source content: apply translator to string literals only.
 // Uses source-highlight to tokenize the content according to langFile,
 // then applies the translator's doPreformat() to "string" elements.
+// With nativeLexers, languages that have a native lexer (script_lexers.h)
+// skip source-highlight; spans get the same translator either way.
+// needles are the strings the translator can act on (e.g. "/nix/store/"):
+// content without any is returned as is, and source-highlight only
+// tokenizes around the matches where restart points are known
+// (lexer_restarts.h). Without needles every byte is tokenized.
 // Returns the patched content, or the original content on error.
 std::string patchSourceStrings(
     const std::string& content,
     const std::string& langFile,
-    srchilite::CharTranslator& translator);
+    srchilite::CharTranslator& translator,
+    bool nativeLexers = true,
+    std::span<const std::string> needles = {});
+
+// Where a needle occurs in content
+struct NeedleMatch {
+    size_t begin;
+    size_t end;
+};
+
+// Makes a fresh translator for one tokenizing thread
+using TranslatorFactory = std::function<std::unique_ptr<srchilite::CharTranslator>()>;
+
+// patchSourceStrings() for big files: content of at least 2MB is cut at
+// restart points into pieces of about 1MB, which are tokenized on up to
+// threads threads with their own translators and joined in order. Content
+// without restart points (other languages, or a pre-scan that gave up) is
+// tokenized on one thread. matches, if given, are every occurrence of the
+// needles by position (e.g. found while reading content), so content is
+// not searched for them again. translated, if given, gets where the
+// strings and comments the translator received are in the result (all
+// of it on error), so it can be checked without tokenizing it again.
+std::string patchSourceStrings(
+    const std::string& content,
+    const std::string& langFile,
+    const TranslatorFactory& makeTranslator,
+    unsigned threads,
+    bool nativeLexers = true,
+    std::span<const std::string> needles = {},
+    const std::vector<NeedleMatch>* matches = nullptr,
+    std::vector<SourceSpan>* translated = nullptr);
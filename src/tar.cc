@@ -0,0 +1,530 @@
+/*
+ * Tar reader and writer for the NarNode event stream
+ */
+
+#include "tar.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nar {
+
+namespace {
+
+constexpr size_t BLOCK_SIZE = 512;
+
+// ustar header field offsets and sizes
+constexpr size_t NAME_OFF = 0,       NAME_LEN = 100;
+constexpr size_t MODE_OFF = 100,     MODE_LEN = 8;
+constexpr size_t UID_OFF = 108,      UID_LEN = 8;
+constexpr size_t GID_OFF = 116,      GID_LEN = 8;
+constexpr size_t SIZE_OFF = 124,     SIZE_LEN = 12;
+constexpr size_t MTIME_OFF = 136,    MTIME_LEN = 12;
+constexpr size_t CHKSUM_OFF = 148,   CHKSUM_LEN = 8;
+constexpr size_t TYPE_OFF = 156;
+constexpr size_t LINK_OFF = 157,     LINK_LEN = 100;
+constexpr size_t MAGIC_OFF = 257;
+constexpr size_t PREFIX_OFF = 345,   PREFIX_LEN = 155;
+
+// Name of the entry holding a non-directory root
+constexpr const char* ROOT_FILE_NAME = "out";
+
+size_t padding(uint64_t size)
+{
+    return (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+}
+
+// ============================================================================
+// Reading
+// ============================================================================
+
+// One node of the buffered tree; default-constructed nodes are directories
+struct TreeNode {
+    NarNode::Type type = NarNode::Type::DirectoryStart;
+    std::vector<std::byte> content;
+    std::string target;
+    bool executable = false;
+    std::map<std::string, TreeNode> children;  // Byte order, as in NARs
+};
+
+std::string fieldString(const char* field, size_t size)
+{
+    return std::string(field, strnlen(field, size));
+}
+
+// Octal (NUL/space terminated) or GNU base-256 numeric field
+uint64_t parseNumber(const char* field, size_t size)
+{
+    const auto* bytes = reinterpret_cast<const unsigned char*>(field);
+
+    if (bytes[0] & 0x80) {
+        if (bytes[0] == 0xff) {
+            throw std::runtime_error("tar: negative numeric field");
+        }
+        uint64_t value = bytes[0] & 0x7f;
+        for (size_t i = 1; i < size; ++i) {
+            if (value >> 56) {
+                throw std::runtime_error("tar: numeric field overflow");
+            }
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < size && (field[i] == ' ' || field[i] == '\0')) {
+        ++i;
+    }
+    uint64_t value = 0;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + static_cast<uint64_t>(field[i] - '0');
+    }
+    return value;
+}
+
+// Accept both the unsigned sum (POSIX) and the signed one (old tars)
+bool checksumValid(const char* block)
+{
+    uint64_t unsignedSum = 0;
+    int64_t signedSum = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        const bool inField = i >= CHKSUM_OFF && i < CHKSUM_OFF + CHKSUM_LEN;
+        const char c = inField ? ' ' : block[i];
+        unsignedSum += static_cast<unsigned char>(c);
+        signedSum += static_cast<signed char>(c);
+    }
+    const uint64_t stored = parseNumber(block + CHKSUM_OFF, CHKSUM_LEN);
+    return stored == unsignedSum || static_cast<int64_t>(stored) == signedSum;
+}
+
+// Returns false at a clean end of input
+bool readBlock(std::istream& in, char* block)
+{
+    in.read(block, BLOCK_SIZE);
+    const auto got = static_cast<size_t>(in.gcount());
+    if (got == 0) {
+        return false;
+    }
+    if (got != BLOCK_SIZE) {
+        throw std::runtime_error("Unexpected EOF reading tar header");
+    }
+    return true;
+}
+
+std::vector<std::byte> readData(std::istream& in, uint64_t size)
+{
+    std::vector<std::byte> data(size);
+    if (size > 0) {
+        in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(size));
+        if (static_cast<uint64_t>(in.gcount()) != size) {
+            throw std::runtime_error("Unexpected EOF reading tar entry data");
+        }
+    }
+    if (const size_t pad = padding(size); pad > 0) {
+        char skip[BLOCK_SIZE];
+        in.read(skip, static_cast<std::streamsize>(pad));
+        if (static_cast<size_t>(in.gcount()) != pad) {
+            throw std::runtime_error("Unexpected EOF reading tar entry data");
+        }
+    }
+    return data;
+}
+
+std::string dataString(const std::vector<std::byte>& data)
+{
+    const auto* chars = reinterpret_cast<const char*>(data.data());
+    return std::string(chars, strnlen(chars, data.size()));
+}
+
+// pax extended header records: "LENGTH KEY=VALUE\n"
+void parsePax(const std::vector<std::byte>& data, std::map<std::string, std::string>& records)
+{
+    const std::string text(reinterpret_cast<const char*>(data.data()), data.size());
+    size_t pos = 0;
+    while (pos < text.size()) {
+        const size_t space = text.find(' ', pos);
+        if (space == std::string::npos) {
+            break;
+        }
+        const size_t length = std::stoull(text.substr(pos, space - pos));
+        if (length == 0 || pos + length > text.size()) {
+            throw std::runtime_error("tar: malformed pax header");
+        }
+        const std::string record = text.substr(space + 1, pos + length - space - 2);
+        const size_t equals = record.find('=');
+        if (equals != std::string::npos) {
+            records[record.substr(0, equals)] = record.substr(equals + 1);
+        }
+        pos += length;
+    }
+}
+
+// Path components relative to the archive root ("./a//b/" -> {a, b})
+std::vector<std::string> splitPath(const std::string& name)
+{
+    std::vector<std::string> components;
+    size_t pos = 0;
+    while (pos <= name.size()) {
+        size_t slash = name.find('/', pos);
+        if (slash == std::string::npos) {
+            slash = name.size();
+        }
+        std::string component = name.substr(pos, slash - pos);
+        if (component == "..") {
+            throw std::runtime_error("tar: entry escapes the archive root: " + name);
+        }
+        if (!component.empty() && component != ".") {
+            components.push_back(std::move(component));
+        }
+        pos = slash + 1;
+    }
+    return components;
+}
+
+TreeNode& insertNode(TreeNode& root, const std::vector<std::string>& components,
+                     const std::string& name)
+{
+    TreeNode* dir = &root;
+    for (size_t i = 0; i + 1 < components.size(); ++i) {
+        dir = &dir->children[components[i]];
+        if (dir->type != NarNode::Type::DirectoryStart) {
+            throw std::runtime_error("tar: parent of " + name + " is not a directory");
+        }
+    }
+    return dir->children[components.back()];
+}
+
+const TreeNode* findNode(const TreeNode& root, const std::vector<std::string>& components)
+{
+    const TreeNode* node = &root;
+    for (const auto& component : components) {
+        auto it = node->children.find(component);
+        if (it == node->children.end()) {
+            return nullptr;
+        }
+        node = &it->second;
+    }
+    return node;
+}
+
+std::generator<NarNode> emitNode(TreeNode& node, std::string path, PathRules::Cursor cursor,
+                                 const PathRules* rules, NarStream::Stats& stats)
+{
+    switch (node.type) {
+    case NarNode::Type::RegularFile:
+        stats.filesPatched++;
+        stats.totalBytes += node.content.size();
+        co_yield NarNode{
+            .type = NarNode::Type::RegularFile,
+            .path = std::move(path),
+            .content = std::move(node.content),
+            .executable = node.executable,
+            .action = cursor.action
+        };
+        break;
+
+    case NarNode::Type::Symlink:
+        stats.symlinksPatched++;
+        co_yield NarNode{
+            .type = NarNode::Type::Symlink,
+            .path = std::move(path),
+            .target = std::move(node.target),
+            .action = cursor.action
+        };
+        break;
+
+    default:
+        co_yield NarNode{.type = NarNode::Type::DirectoryStart, .path = path, .action = cursor.action};
+
+        for (auto& [name, child] : node.children) {
+            std::string childPath = path.empty() ? name : path + "/" + name;
+            PathRules::Cursor childCursor = rules ? rules->step(cursor, name) : PathRules::Cursor{};
+
+            co_yield NarNode{.type = NarNode::Type::EntryStart, .name = name, .path = childPath};
+            for (auto&& item : emitNode(child, childPath, std::move(childCursor), rules, stats)) {
+                co_yield std::move(item);
+            }
+            co_yield NarNode{.type = NarNode::Type::EntryEnd, .path = std::move(childPath)};
+
+            // Release contents of finished subtrees early
+            child.children.clear();
+        }
+
+        stats.directoriesProcessed++;
+        co_yield NarNode{.type = NarNode::Type::DirectoryEnd, .path = std::move(path)};
+        break;
+    }
+}
+
+// ============================================================================
+// Writing
+// ============================================================================
+
+// Octal with a trailing NUL, or GNU base-256 when the value does not fit
+void putNumber(char* field, size_t size, uint64_t value)
+{
+    const int digits = static_cast<int>(size - 1);
+    if (digits >= 22 || value < (uint64_t{1} << (3 * digits))) {
+        snprintf(field, size, "%0*llo", digits, static_cast<unsigned long long>(value));
+        return;
+    }
+    std::memset(field, 0, size);
+    field[0] = static_cast<char>(0x80);
+    for (size_t i = size - 1; i > 0 && value > 0; --i) {
+        field[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+}
+
+void putString(char* field, size_t size, const std::string& s)
+{
+    std::memcpy(field, s.data(), std::min(size, s.size()));
+}
+
+void appendPaxRecord(std::string& records, const std::string& key, const std::string& value)
+{
+    // The length prefix counts itself, so grow it until it is stable
+    const size_t base = key.size() + value.size() + 3;  // ' ', '=', '\n'
+    size_t length = base + 1;
+    while (std::to_string(length).size() + base != length) {
+        length = std::to_string(length).size() + base;
+    }
+    records += std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+void writePadding(std::ostream& out, uint64_t size)
+{
+    static constexpr char zeros[BLOCK_SIZE] = {};
+    out.write(zeros, static_cast<std::streamsize>(padding(size)));
+}
+
+void writeEntry(std::ostream& out, const std::string& name, char type, unsigned mode,
+                uint64_t size, const std::string& link = {})
+{
+    // Names and link targets beyond the ustar fields go in a pax header
+    if (name.size() > NAME_LEN || link.size() > LINK_LEN) {
+        std::string records;
+        if (name.size() > NAME_LEN) {
+            appendPaxRecord(records, "path", name);
+        }
+        if (link.size() > LINK_LEN) {
+            appendPaxRecord(records, "linkpath", link);
+        }
+        writeEntry(out, "././@PaxHeader", 'x', 0644, records.size());
+        out.write(records.data(), static_cast<std::streamsize>(records.size()));
+        writePadding(out, records.size());
+    }
+
+    char block[BLOCK_SIZE] = {};
+    putString(block + NAME_OFF, NAME_LEN, name);
+    putNumber(block + MODE_OFF, MODE_LEN, mode);
+    putNumber(block + UID_OFF, UID_LEN, 0);
+    putNumber(block + GID_OFF, GID_LEN, 0);
+    putNumber(block + SIZE_OFF, SIZE_LEN, size);
+    putNumber(block + MTIME_OFF, MTIME_LEN, 1);  // Store paths have mtime 1
+    block[TYPE_OFF] = type;
+    putString(block + LINK_OFF, LINK_LEN, link);
+    std::memcpy(block + MAGIC_OFF, "ustar\0" "00", 8);
+
+    std::memset(block + CHKSUM_OFF, ' ', CHKSUM_LEN);
+    unsigned sum = 0;
+    for (char c : block) {
+        sum += static_cast<unsigned char>(c);
+    }
+    snprintf(block + CHKSUM_OFF, CHKSUM_LEN, "%06o", sum);
+    block[CHKSUM_OFF + 7] = ' ';
+
+    out.write(block, BLOCK_SIZE);
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// parseTar
+// ============================================================================
+
+std::generator<NarNode> parseTar(std::istream& in, const PathRules* rules, NarStream::Stats& stats)
+{
+    TreeNode root;
+    bool rootEntry = false;  // Archive has an explicit "." entry
+    size_t entries = 0;
+
+    std::map<std::string, std::string> pax;
+    std::string longName;
+    std::string longLink;
+    char block[BLOCK_SIZE];
+
+    while (readBlock(in, block)) {
+        if (std::all_of(block, block + BLOCK_SIZE, [](char c) { return c == '\0'; })) {
+            break;  // End-of-archive marker
+        }
+        if (!checksumValid(block)) {
+            throw std::runtime_error("tar: header checksum mismatch (not a tar archive?)");
+        }
+
+        const char type = block[TYPE_OFF];
+        uint64_t size = parseNumber(block + SIZE_OFF, SIZE_LEN);
+        if (auto it = pax.find("size"); it != pax.end()) {
+            size = std::stoull(it->second);
+        }
+
+        // Extension headers describe the next entry
+        if (type == 'x') {
+            parsePax(readData(in, size), pax);
+            continue;
+        }
+        if (type == 'g') {
+            readData(in, size);
+            continue;
+        }
+        if (type == 'L') {
+            longName = dataString(readData(in, size));
+            continue;
+        }
+        if (type == 'K') {
+            longLink = dataString(readData(in, size));
+            continue;
+        }
+
+        std::string name = fieldString(block + NAME_OFF, NAME_LEN);
+        if (std::memcmp(block + MAGIC_OFF, "ustar\0", 6) == 0 && block[PREFIX_OFF] != '\0') {
+            name = fieldString(block + PREFIX_OFF, PREFIX_LEN) + "/" + name;
+        }
+        std::string link = fieldString(block + LINK_OFF, LINK_LEN);
+        if (!longName.empty()) {
+            name = std::move(longName);
+        }
+        if (!longLink.empty()) {
+            link = std::move(longLink);
+        }
+        if (auto it = pax.find("path"); it != pax.end()) {
+            name = it->second;
+        }
+        if (auto it = pax.find("linkpath"); it != pax.end()) {
+            link = it->second;
+        }
+        pax.clear();
+        longName.clear();
+        longLink.clear();
+
+        const auto components = splitPath(name);
+        const uint64_t mode = parseNumber(block + MODE_OFF, MODE_LEN);
+        entries++;
+
+        if (components.empty()) {
+            if (type != '5') {
+                throw std::runtime_error("tar: archive root entry is not a directory");
+            }
+            rootEntry = true;
+            readData(in, size);
+            continue;
+        }
+
+        switch (type) {
+        case '0':
+        case '\0':
+        case '7': {
+            TreeNode& node = insertNode(root, components, name);
+            node = TreeNode{.type = NarNode::Type::RegularFile};
+            node.content = readData(in, size);
+            node.executable = (mode & 0100) != 0;
+            break;
+        }
+
+        case '1': {
+            // NARs have no hard links: copy the earlier file
+            const TreeNode* source = findNode(root, splitPath(link));
+            if (!source || source->type != NarNode::Type::RegularFile) {
+                throw std::runtime_error("tar: hard link " + name + " to missing file " + link);
+            }
+            TreeNode copy{.type = NarNode::Type::RegularFile};
+            copy.content = source->content;
+            copy.executable = source->executable;
+            readData(in, size);
+            insertNode(root, components, name) = std::move(copy);
+            break;
+        }
+
+        case '2': {
+            TreeNode& node = insertNode(root, components, name);
+            node = TreeNode{.type = NarNode::Type::Symlink};
+            node.target = link;
+            readData(in, size);
+            break;
+        }
+
+        case '5': {
+            TreeNode& node = insertNode(root, components, name);
+            if (node.type != NarNode::Type::DirectoryStart) {
+                node = TreeNode{};
+            }
+            readData(in, size);
+            break;
+        }
+
+        default:
+            throw std::runtime_error(std::string("tar: unsupported entry type '") + type + "' for " + name);
+        }
+    }
+
+    // A lone file or symlink is the whole store path
+    PathRules::Cursor cursor = rules ? rules->root() : PathRules::Cursor{};
+    if (!rootEntry && entries == 1 && root.children.size() == 1 &&
+        root.children.begin()->second.type != NarNode::Type::DirectoryStart) {
+        for (auto&& node : emitNode(root.children.begin()->second, "", std::move(cursor), rules, stats)) {
+            co_yield std::move(node);
+        }
+        co_return;
+    }
+
+    for (auto&& node : emitNode(root, "", std::move(cursor), rules, stats)) {
+        co_yield std::move(node);
+    }
+}
+
+// ============================================================================
+// writeTarNode / writeTarTrailer
+// ============================================================================
+
+void writeTarNode(std::ostream& out, const NarNode& node)
+{
+    switch (node.type) {
+    case NarNode::Type::Invalid:
+        throw std::runtime_error("Attempted to write Invalid NarNode (uninitialized node)");
+
+    case NarNode::Type::DirectoryStart:
+        writeEntry(out, node.path.empty() ? "./" : "./" + node.path + "/", '5', 0755, 0);
+        break;
+
+    case NarNode::Type::RegularFile:
+        writeEntry(out, node.path.empty() ? ROOT_FILE_NAME : "./" + node.path, '0',
+                   node.executable ? 0755 : 0644, node.content.size());
+        out.write(reinterpret_cast<const char*>(node.content.data()),
+                  static_cast<std::streamsize>(node.content.size()));
+        writePadding(out, node.content.size());
+        break;
+
+    case NarNode::Type::Symlink:
+        writeEntry(out, node.path.empty() ? ROOT_FILE_NAME : "./" + node.path, '2', 0777, 0, node.target);
+        break;
+
+    case NarNode::Type::DirectoryEnd:
+    case NarNode::Type::EntryStart:
+    case NarNode::Type::EntryEnd:
+        break;
+    }
+}
+
+void writeTarTrailer(std::ostream& out)
+{
+    static constexpr char zeros[2 * BLOCK_SIZE] = {};
+    out.write(zeros, sizeof(zeros));
+}
+
+} // namespace nar
@@ -0,0 +1,45 @@
+/*
+ * Tar reader and writer for the NarNode event stream
+ *
+ * Lets store trees shipped as tarballs go through the same patch loop as
+ * NARs, without unpacking to disk and re-packing as a NAR:
+ * - parseTar() reads a whole archive into a tree, then yields it as the
+ *   NarNode events parseNode() would produce for the equivalent NAR
+ *   (entries sorted by name, implicit parent directories filled in)
+ * - writeTarNode() turns each event into ustar entries, with pax headers
+ *   for names, link targets and sizes that do not fit
+ *
+ * Entry names are relative to the store path ("./bin/foo" or "bin/foo"),
+ * i.e. archives made with `tar -C $out -cf x.tar .`. An archive holding a
+ * single non-directory entry and no "." entry stands for a store path
+ * that is a single file; such a root is written as one entry named "out".
+ *
+ * Tar metadata that NARs cannot express is dropped: ownership, times and
+ * all permission bits except the owner-executable bit. Hard links become
+ * copies; device, FIFO and sparse entries are rejected.
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+#include "nar.h"
+
+#include <generator>
+#include <istream>
+#include <ostream>
+
+namespace nar {
+
+// Yield the archive as NarNode events (reads the whole archive first;
+// contents are held in memory until yielded)
+std::generator<NarNode> parseTar(std::istream& in, const PathRules* rules, NarStream::Stats& stats);
+
+// Write one event as tar entries (EntryStart/EntryEnd/DirectoryEnd write nothing)
+void writeTarNode(std::ostream& out, const NarNode& node);
+
+// End-of-archive marker (two zero blocks)
+void writeTarTrailer(std::ostream& out);
+
+} // namespace nar
+
+#endif // TAR_H
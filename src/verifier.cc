@@ -0,0 +1,217 @@
+/*
+ * verifier.cc - Checks patched nodes for references patching should have removed
+ */
+
+#include "verifier.h"
+#include "patcher.h"
+#include "elf.h"
+#include "patchelf.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace patchnar {
+
+namespace {
+
+constexpr std::string_view STORE = "/nix/store/";
+constexpr size_t HASH_LEN = 32;
+
+bool isBase32(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z' && c != 'e' && c != 'o' && c != 'u' && c != 't');
+}
+
+using Elf32 = ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef, Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel, Elf32_Rela, 32>;
+using Elf64 = ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef, Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel, Elf64_Rela, 64>;
+
+// Interpreter and RPATH of an ELF file, with where they are in it
+struct ElfPaths {
+    std::string interp;  // "" when absent
+    uint64_t interpOffset = 0;
+    std::string rpath;   // "" when absent
+    uint64_t rpathOffset = 0;
+};
+
+template<class ElfFileType>
+ElfPaths readElfPaths(std::span<const std::byte> content)
+{
+    auto contents = std::make_shared<std::vector<unsigned char>>(
+        reinterpret_cast<const unsigned char*>(content.data()),
+        reinterpret_cast<const unsigned char*>(content.data()) + content.size());
+    const ElfFileType elfFile(std::move(contents));
+
+    ElfPaths paths;
+    if (auto interp = elfFile.findSection(".interp")) {  // Shared libraries have none
+        paths.interp = elfFile.getInterpreter();
+        paths.interpOffset = interp->offset;
+    }
+    if (auto offset = elfFile.findRPathOffset()) {
+        paths.rpath = elfFile.getRPath();
+        paths.rpathOffset = *offset;
+    }
+    return paths;
+}
+
+} // anonymous namespace
+
+Verifier::Verifier(const PatchConfig& config)
+    : config_(config)
+{
+    auto addStale = [&](std::string_view baseName, std::string what) {
+        if (baseName.size() >= HASH_LEN) {
+            stale_.emplace(std::string(baseName.substr(0, HASH_LEN)), std::move(what));
+        }
+    };
+
+    const std::string& oldGlibc = config.oldGlibcPath;
+    if (!oldGlibc.empty() && !config.glibcPath.empty() && oldGlibc != config.glibcPath) {
+        addStale(std::string_view(oldGlibc).substr(oldGlibc.rfind('/') + 1), "old glibc " + oldGlibc);
+    }
+    for (const auto& [oldBase, newBase] : config.hashMappings) {
+        if (oldBase.compare(0, HASH_LEN, newBase, 0, HASH_LEN) != 0) {
+            addStale(oldBase, "unmapped " + oldBase);
+        }
+    }
+}
+
+void Verifier::checkFile(const std::string& path, std::span<const std::byte> content, const FilePlan& plan,
+                         std::span<const SourceSpan> translated)
+{
+    const std::string_view text(reinterpret_cast<const char*>(content.data()), content.size());
+    std::vector<Violation> found;
+
+    switch (plan.kind) {
+    case FilePlan::Kind::Source:
+        // Only what was translated: the rest is never patched
+        for (const auto& span : translated) {
+            checkUnprefixed(path, text, span.begin, span.end, "script", found);
+        }
+        break;
+    case FilePlan::Kind::Shebang:
+        checkUnprefixed(path, text, 0, std::min(text.find('\n'), text.size()), "shebang", found);
+        break;
+    case FilePlan::Kind::Elf:
+        checkElf(path, content, found);
+        break;
+    case FilePlan::Kind::MapOnly:
+        break;
+    }
+    checkStaleHashes(path, text, found);
+
+    add(found);
+}
+
+void Verifier::checkSymlink(const std::string& path, const std::string& target)
+{
+    std::vector<Violation> found;
+    if (!config_.prefix.empty() && target.starts_with(STORE)) {
+        found.push_back({path, 0, "unprefixed symlink target " + target});
+    }
+    checkStaleHashes(path, target, found);
+    add(found);
+}
+
+// Every /nix/store/ in text[begin, end) must follow the prefix
+void Verifier::checkUnprefixed(const std::string& path, std::string_view text, size_t begin, size_t end,
+                               const char* where, std::vector<Violation>& found) const
+{
+    const std::string& prefix = config_.prefix;
+    if (prefix.empty()) {
+        return;
+    }
+
+    const std::string_view range = text.substr(0, end);
+    for (size_t pos = range.find(STORE, begin); pos != std::string_view::npos; pos = range.find(STORE, pos + 1)) {
+        if (pos >= prefix.size() && text.compare(pos - prefix.size(), prefix.size(), prefix) == 0) {
+            continue;
+        }
+        const size_t last = std::min(range.find_first_of(" \t\n\"'`:;", pos), range.size());
+        found.push_back({path, pos,
+                         std::string("unprefixed ") + where + " path " + std::string(range.substr(pos, last - pos))});
+    }
+}
+
+// Skip-ahead scan: a window of HASH_LEN bytes can only be a hash part if
+// all of its bytes are base-32 digits, so jump past any byte that is not
+void Verifier::checkStaleHashes(const std::string& path, std::string_view data,
+                                std::vector<Violation>& found) const
+{
+    if (stale_.empty()) {
+        return;
+    }
+
+    size_t i = 0;
+    while (i + HASH_LEN <= data.size()) {
+        size_t j = HASH_LEN;
+        while (j > 0 && isBase32(data[i + j - 1])) {
+            --j;
+        }
+        if (j > 0) {
+            i += j;
+            continue;
+        }
+        if (auto it = stale_.find(data.substr(i, HASH_LEN)); it != stale_.end()) {
+            found.push_back({path, i, it->second});
+        }
+        ++i;
+    }
+}
+
+void Verifier::checkElf(const std::string& path, std::span<const std::byte> content,
+                        std::vector<Violation>& found) const
+{
+    if (config_.prefix.empty()) {
+        return;
+    }
+
+    ElfPaths paths;
+    try {
+        paths = content.size() > EI_CLASS && std::to_integer<unsigned char>(content[EI_CLASS]) == ELFCLASS32
+            ? readElfPaths<Elf32>(content)
+            : readElfPaths<Elf64>(content);
+    } catch (const std::exception&) {
+        return;  // Not an ELF patchelf can read; the patcher left it alone too
+    }
+    const std::string& rpath = paths.rpath;
+
+    if (paths.interp.starts_with(STORE)) {
+        found.push_back({path, paths.interpOffset, "unprefixed ELF interpreter " + paths.interp});
+    }
+
+    size_t start = 0;
+    while (start <= rpath.size() && !rpath.empty()) {
+        const size_t end = std::min(rpath.find(':', start), rpath.size());
+        const std::string_view entry = std::string_view(rpath).substr(start, end - start);
+        if (entry.starts_with(STORE)) {
+            found.push_back({path, paths.rpathOffset + start, "unprefixed RPATH entry " + std::string(entry)});
+        }
+        start = end + 1;
+    }
+}
+
+void Verifier::add(std::vector<Violation>& found)
+{
+    if (found.empty()) {
+        return;
+    }
+    std::lock_guard lock(mutex_);
+    violations_.insert(violations_.end(), std::make_move_iterator(found.begin()),
+                       std::make_move_iterator(found.end()));
+}
+
+std::vector<Violation> Verifier::violations() const
+{
+    std::vector<Violation> result;
+    {
+        std::lock_guard lock(mutex_);
+        result = violations_;
+    }
+    std::sort(result.begin(), result.end(), [](const Violation& a, const Violation& b) {
+        return a.path != b.path ? a.path < b.path : a.offset < b.offset;
+    });
+    return result;
+}
+
+} // namespace patchnar
@@ -0,0 +1,83 @@
+/*
+ * verifier.h - Checks patched nodes for references patching should have removed
+ *
+ * Run on every node right after it is patched (--verify), so a release
+ * gate needs no second read of the NAR:
+ * - scripts: "/nix/store/" without the prefix in front (in the strings
+ *   and comments the patcher translated, the shebang line for
+ *   shebang-only scripts)
+ * - ELF: interpreter and RPATH entries under an unprefixed /nix/store
+ * - symlinks: absolute targets under an unprefixed /nix/store
+ * - everything: the hash part of the substituted old glibc, or of the
+ *   old side of a hash mapping
+ *
+ * Hash parts are found in one pass over the bytes for all of them (the
+ * same skip-ahead scan Nix uses for references); the rest are plain
+ * substring searches.
+ */
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "script_lexers.h"
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace patchnar {
+
+struct PatchConfig;
+struct FilePlan;
+
+struct Violation {
+    std::string path;
+    uint64_t offset;   // In the file contents or symlink target
+    std::string what;
+};
+
+class Verifier {
+public:
+    // `config` must outlive the Verifier
+    explicit Verifier(const PatchConfig& config);
+
+    // Check a node as patched (thread-safe). For Kind::Source, translated
+    // are the spans the patcher passed through its translator
+    void checkFile(const std::string& path, std::span<const std::byte> content, const FilePlan& plan,
+                   std::span<const SourceSpan> translated = {});
+    void checkSymlink(const std::string& path, const std::string& target);
+
+    // Violations found so far, ordered by path and offset
+    std::vector<Violation> violations() const;
+
+private:
+    void checkUnprefixed(const std::string& path, std::string_view text, size_t begin, size_t end,
+                         const char* where, std::vector<Violation>& found) const;
+    void checkStaleHashes(const std::string& path, std::string_view data,
+                          std::vector<Violation>& found) const;
+    void checkElf(const std::string& path, std::span<const std::byte> content,
+                  std::vector<Violation>& found) const;
+    void add(std::vector<Violation>& found);
+
+    const PatchConfig& config_;
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+
+    // Hash part that must not survive -> what it belonged to
+    std::unordered_map<std::string, std::string, StringHash, std::equal_to<>> stale_;
+
+    mutable std::mutex mutex_;
+    std::vector<Violation> violations_;
+};
+
+} // namespace patchnar
+
+#endif // VERIFIER_H
@@ -0,0 +1,193 @@
+/*
+ * libpatchnar-feed - Patch a NAR from stdin through the libpatchnar C API
+ *
+ * Usage: libpatchnar-feed [CHUNK_SIZE]
+ *        libpatchnar-feed loop COUNT PREFIX
+ *
+ * With CHUNK_SIZE > 0 the NAR is fed to a session in pieces of that many
+ * bytes; with 0 (or no argument) patchnar_patch_fd() is used.
+ *
+ * In loop mode COUNT writer processes trickle the NAR into pipes, and one
+ * patchnar_loop patches all of them at once into PREFIX-0.nar ...
+ */
+
+#include <libpatchnar.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int writeAll(void* user, const void* data, size_t size)
+{
+    const char* p = data;
+    (void)user;
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, size);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int fail(const char* what)
+{
+    fprintf(stderr, "libpatchnar-feed: %s: %s\n", what, patchnar_last_error());
+    return 1;
+}
+
+static int writeFd(void* user, const void* data, size_t size)
+{
+    const char* p = data;
+    int fd = *(int*)user;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int loopFailures = 0;
+
+static void sessionDone(void* user, patchnar_session* session, int status)
+{
+    (void)user;
+    if (status != 0 || patchnar_session_finish(session) != 0) {
+        fprintf(stderr, "libpatchnar-feed: session: %s\n", patchnar_last_error());
+        loopFailures++;
+    }
+}
+
+static int runLoop(const patchnar_config* config, int count, const char* prefix)
+{
+    /* The whole NAR, for the writers */
+    size_t size = 0, capacity = 1 << 16;
+    char* nar = malloc(capacity);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, nar + size, capacity - size)) > 0) {
+        size += (size_t)n;
+        if (size == capacity) {
+            capacity *= 2;
+            nar = realloc(nar, capacity);
+        }
+    }
+
+    patchnar_loop* loop = patchnar_loop_new(sessionDone, NULL);
+    if (!loop) {
+        return fail("loop");
+    }
+    patchnar_session** sessions = calloc((size_t)count, sizeof *sessions);
+    int* outs = calloc((size_t)count, sizeof *outs);
+
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("libpatchnar-feed: pipe");
+            return 1;
+        }
+        if (fork() == 0) {
+            /* Writer: pieces of a different size for each stream */
+            size_t chunk = 1000 + 4093 * (size_t)i;
+            close(fds[0]);
+            for (size_t off = 0; off < size; off += chunk) {
+                size_t len = size - off < chunk ? size - off : chunk;
+                if (write(fds[1], nar + off, len) != (ssize_t)len) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+
+        char path[4096];
+        snprintf(path, sizeof path, "%s-%d.nar", prefix, i);
+        outs[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        sessions[i] = patchnar_session_new(config, writeFd, &outs[i]);
+        if (outs[i] < 0 || !sessions[i] || patchnar_loop_add(loop, sessions[i], fds[0]) != 0) {
+            return fail("add");
+        }
+    }
+
+    int remaining;
+    while ((remaining = patchnar_loop_run(loop, -1)) > 0) {
+    }
+    if (remaining < 0) {
+        return fail("run");
+    }
+
+    for (int i = 0; i < count; i++) {
+        wait(NULL);
+        patchnar_session_free(sessions[i]);
+        close(outs[i]);
+    }
+    patchnar_loop_free(loop);
+    free(sessions);
+    free(outs);
+    free(nar);
+    return loopFailures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 3 && strcmp(argv[1], "loop") == 0) {
+        patchnar_config* config = patchnar_config_new();
+        if (!config) {
+            return fail("config");
+        }
+        int status = runLoop(config, atoi(argv[2]), argv[3]);
+        patchnar_config_free(config);
+        return status;
+    }
+
+    size_t chunkSize = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+    patchnar_config* config = patchnar_config_new();
+    if (!config) {
+        return fail("config");
+    }
+
+    if (chunkSize == 0) {
+        int rc = patchnar_patch_fd(config, STDIN_FILENO, STDOUT_FILENO, 1);
+        patchnar_config_free(config);
+        return rc == 0 ? 0 : fail("patch");
+    }
+
+    patchnar_session* session = patchnar_session_new(config, writeAll, NULL);
+    if (!session) {
+        return fail("session");
+    }
+
+    char* buffer = malloc(chunkSize);
+    int status = 0;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buffer, chunkSize);
+        if (n < 0) {
+            perror("libpatchnar-feed: read");
+            status = 1;
+            break;
+        }
+        if (n == 0) {
+            if (patchnar_session_finish(session) != 0) {
+                status = fail("finish");
+            }
+            break;
+        }
+        if (patchnar_session_feed(session, buffer, (size_t)n) != 0) {
+            status = fail("feed");
+            break;
+        }
+    }
+
+    free(buffer);
+    patchnar_session_free(session);
+    patchnar_config_free(config);
+    return status;
+}
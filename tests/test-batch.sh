@@ -0,0 +1,86 @@
+#!/bin/sh
+# Test that --batch patches several NAR files like separate runs would
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+PREFIX=/data/data/com.termux.nix/files/usr
+
+# NARs of very different sizes, one with only a symlink
+mkdir -p big/bin small/bin links
+printf '#!/nix/store/bash111-bash/bin/bash\necho "/nix/store/big111-big/share"\n' > big/bin/run
+head -c 2000000 /dev/zero | tr '\0' 'x' > big/bin/blob
+printf '#!/bin/sh\nexec "/nix/store/small111-small/bin/tool" "$@"\n' > small/bin/run
+chmod +x big/bin/run small/bin/run
+ln -s /nix/store/link111-link/bin/sh links/sh
+
+for name in big small links; do
+    create_test_nar $name $name.nar
+    run_patchnar --jobs 1 < $name.nar > $name.expected.nar
+done
+
+cat > batch.txt << 'EOF2'
+# input output
+big.nar big.out.nar
+
+small.nar small.out.nar
+links.nar links.out.nar
+EOF2
+
+
+# Test 1: Every NAR matches a separate run
+echo "Testing --batch..."
+
+if run_patchnar --batch batch.txt --jobs 3; then
+    log_pass "Batch succeeds"
+else
+    log_fail "Batch succeeds"
+fi
+for name in big small links; do
+    if cmp -s $name.expected.nar $name.out.nar; then
+        log_pass "$name.nar matches a separate run"
+    else
+        log_fail "$name.nar matches a separate run"
+    fi
+done
+result=$(extract_from_nar small.out.nar /bin/run)
+assert_contains "$result" "exec \"$PREFIX/nix/store/small111-small/bin/tool\"" "Script patched in batch"
+
+
+# Test 2: A budget smaller than any NAR still gets through them all
+echo ""
+echo "Testing a tiny --memory-budget..."
+
+rm -f *.out.nar
+run_patchnar --batch batch.txt --jobs 3 --memory-budget 1K
+all_match=1
+for name in big small links; do
+    cmp -s $name.expected.nar $name.out.nar || all_match=0
+done
+assert_equals "1" "$all_match" "All NARs patched one at a time"
+
+
+# Test 3: A failing NAR does not stop the others
+echo ""
+echo "Testing a missing input..."
+
+printf 'missing.nar missing.out.nar\nsmall.nar small2.out.nar\n' > bad.txt
+if run_patchnar --batch bad.txt --jobs 2 2> err.txt; then
+    log_fail "Batch with a missing input fails"
+else
+    log_pass "Batch with a missing input fails"
+fi
+assert_contains "$(cat err.txt)" "missing.nar" "Error names the input"
+if cmp -s small.expected.nar small2.out.nar && [ ! -e missing.out.nar ]; then
+    log_pass "Other NARs still patched"
+else
+    log_fail "Other NARs still patched"
+fi
+
+print_summary
@@ -0,0 +1,155 @@
+#!/bin/sh
+# Test --binary-cache output (file:// binary cache layout)
+# The compressed NAR must match stdout output and the narinfo must describe it
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+LIB=/nix/store/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-libfoo-1.0
+APP=/nix/store/bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb-app-1.0
+NEWLIB=/nix/store/cccccccccccccccccccccccccccccccc-libfoo-1.0
+NEWAPP=/nix/store/dddddddddddddddddddddddddddddddd-app-1.0
+
+mkdir -p app/bin
+printf '#!/nix/store/abc123-bash-5.2/bin/bash\nexec %s/bin/foo "$@"\n' "$LIB" > app/bin/run
+chmod +x app/bin/run
+printf '%s %s\n%s %s\n' "$LIB" "$NEWLIB" "$APP" "$NEWAPP" > mappings.txt
+
+create_test_nar app app.nar
+run_patchnar --mappings mappings.txt < app.nar > reference.nar
+
+# narinfo FIELD FILE
+narinfo() {
+    sed -n "s/^$1: //p" "$2"
+}
+
+
+# Test 1: single NAR
+echo "Testing single NAR..."
+
+run_patchnar --mappings mappings.txt --binary-cache cache --store-path "$APP" \
+    < app.nar > stdout.txt 2> err.txt
+
+info=cache/dddddddddddddddddddddddddddddddd.narinfo
+if [ -f "$info" ]; then
+    log_pass "narinfo named by the mapped store path hash"
+else
+    log_fail "narinfo named by the mapped store path hash" "$info" "$(ls cache)"
+    print_summary
+    exit 1
+fi
+
+assert_equals "" "$(cat stdout.txt)" "nothing written to stdout"
+assert_equals "$NEWAPP" "$(narinfo StorePath "$info")" "StorePath mapped"
+assert_equals "zstd" "$(narinfo Compression "$info")" "Compression"
+assert_equals "$(wc -c < reference.nar | tr -d ' ')" "$(narinfo NarSize "$info")" "NarSize"
+assert_equals "cccccccccccccccccccccccccccccccc-libfoo-1.0" "$(narinfo References "$info")" \
+    "References scanned from contents"
+
+url=$(narinfo URL "$info")
+assert_equals "$(wc -c < "cache/$url" | tr -d ' ')" "$(narinfo FileSize "$info")" "FileSize"
+assert_contains "$url" "$(narinfo FileHash "$info" | sed 's/^sha256://')" "URL named by FileHash"
+assert_contains "$(cat cache/nix-cache-info)" "StoreDir: /nix/store" "nix-cache-info written"
+
+if command -v zstd >/dev/null 2>&1; then
+    zstd -dq < "cache/$url" > decompressed.nar
+    if cmp -s reference.nar decompressed.nar; then
+        log_pass "compressed NAR matches stdout output"
+    else
+        log_fail "compressed NAR matches stdout output"
+    fi
+else
+    log_skip "zstd not available"
+fi
+
+if command -v nix-hash >/dev/null 2>&1; then
+    assert_equals "sha256:$(nix-hash --type sha256 --flat --base32 reference.nar)" \
+        "$(narinfo NarHash "$info")" "NarHash"
+    assert_equals "sha256:$(nix-hash --type sha256 --flat --base32 "cache/$url")" \
+        "$(narinfo FileHash "$info")" "FileHash"
+else
+    log_skip "nix-hash not available"
+fi
+
+
+# Test 2: export stream, one entry per path
+echo ""
+echo "Testing export stream..."
+
+u64() {
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+        $(($1 & 255)) $((($1 >> 8) & 255)) $((($1 >> 16) & 255)) $((($1 >> 24) & 255)))"
+    printf '\000\000\000\000'
+}
+str() {
+    u64 ${#1}
+    printf '%s' "$1"
+    head -c $(((8 - ${#1} % 8) % 8)) /dev/zero
+}
+
+mkdir -p lib/bin
+printf 'foo\n' > lib/bin/foo
+create_test_nar lib lib.nar
+{
+    u64 1; cat lib.nar; u64 1163413838; str "$LIB"; u64 0; str ""; u64 0
+    u64 1; cat app.nar; u64 1163413838; str "$APP"; u64 1; str "$LIB"; str ""; u64 0
+    u64 0
+} > closure.export
+
+run_patchnar --input-format export --mappings mappings.txt --binary-cache cache2 \
+    < closure.export 2> err.txt
+
+assert_equals "$NEWLIB" "$(narinfo StorePath cache2/cccccccccccccccccccccccccccccccc.narinfo)" \
+    "first path stored"
+assert_equals "cccccccccccccccccccccccccccccccc-libfoo-1.0" \
+    "$(narinfo References cache2/dddddddddddddddddddddddddddddddd.narinfo)" \
+    "References from export metadata"
+
+
+# Test 3: missing store path
+echo ""
+echo "Testing missing --store-path..."
+
+if run_patchnar --binary-cache cache3 < app.nar 2> err.txt; then
+    log_fail "--store-path required"
+else
+    assert_contains "$(cat err.txt)" "requires --store-path" "--store-path required"
+fi
+
+
+# Test 4: a dependency without a mapping must be declared
+echo ""
+echo "Testing unmapped dependency..."
+
+EXT=/nix/store/ffffffffffffffffffffffffffffffff-ext-2.0
+mkdir -p dep/bin
+printf '#!/bin/sh\nexec %s/bin/foo\nexec "%s/bin/ext"\n' "$LIB" "$EXT" > dep/bin/run
+chmod +x dep/bin/run
+create_test_nar dep dep.nar
+
+if run_patchnar --mappings mappings.txt --binary-cache cache4 --store-path "$APP" \
+    < dep.nar 2> err.txt; then
+    log_fail "undeclared reference rejected"
+else
+    assert_contains "$(cat err.txt)" "/nix/store/ffffffffffffffffffffffffffffffff-" \
+        "undeclared reference named in the error"
+fi
+if ls cache4/*.narinfo >/dev/null 2>&1; then
+    log_fail "no narinfo for an incomplete closure"
+else
+    log_pass "no narinfo for an incomplete closure"
+fi
+
+run_patchnar --mappings mappings.txt --binary-cache cache4 --store-path "$APP" \
+    --reference "$EXT" < dep.nar 2> err.txt
+assert_equals "cccccccccccccccccccccccccccccccc-libfoo-1.0 ffffffffffffffffffffffffffffffff-ext-2.0" \
+    "$(narinfo References cache4/dddddddddddddddddddddddddddddddd.narinfo)" \
+    "--reference adds a candidate"
+
+print_summary
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Test --checkpoint and --resume
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/share/doc/deep pkg/lib
+for i in 1 2 3 4 5 6 7 8; do
+    cat > "pkg/bin/tool$i" << 'EOF'
+#!/nix/store/abc123-bash-5.2/bin/bash
+exec /nix/store/abc123-coreutils/bin/true "$@"
+EOF
+    chmod +x "pkg/bin/tool$i"
+    head -c 4096 /dev/zero > "pkg/share/doc/deep/data$i"
+done
+ln -s /nix/store/lib111-libfoo/lib/libfoo.so pkg/lib/libfoo.so
+
+create_test_nar pkg input.nar
+run_patchnar < input.nar > expected.nar
+
+
+# Test 1: A checkpointed run writes the same NAR and removes the checkpoint
+echo "Testing checkpointed run..."
+
+run_patchnar --checkpoint ckpt --checkpoint-interval 1 < input.nar > output.nar 2> err.txt
+if cmp -s expected.nar output.nar; then
+    log_pass "checkpointed output matches normal output"
+else
+    log_fail "checkpointed output differs from normal output"
+fi
+if [ -e ckpt ]; then
+    log_fail "checkpoint left behind after a complete run"
+else
+    log_pass "checkpoint removed after a complete run"
+fi
+assert_contains "$(cat err.txt)" "patchnar: NAR sha256:" "NAR hash reported"
+full_hash=$(grep -o 'sha256:[a-z0-9]*' err.txt)
+
+
+# Test 2: A run that dies halfway resumes from its last checkpoint
+echo ""
+echo "Testing resume after failure..."
+
+size=$(wc -c < input.nar)
+head -c $((size * 2 / 3)) input.nar > truncated.nar
+if run_patchnar --checkpoint ckpt --checkpoint-interval 1 < truncated.nar > resumed.nar 2> /dev/null; then
+    log_fail "truncated input did not fail"
+else
+    log_pass "truncated input fails"
+fi
+if [ -e ckpt ]; then
+    log_pass "checkpoint kept after failure"
+else
+    log_fail "no checkpoint after failure"
+fi
+
+run_patchnar --checkpoint ckpt --resume < input.nar 1<> resumed.nar 2> err.txt
+if cmp -s expected.nar resumed.nar; then
+    log_pass "resumed output matches normal output"
+else
+    log_fail "resumed output differs from normal output"
+fi
+assert_contains "$(cat err.txt)" "$full_hash" "resumed run reports the full NAR hash"
+
+
+# Test 3: Resuming into a truncated output is refused
+echo ""
+echo "Testing resume into truncated output..."
+
+run_patchnar --checkpoint ckpt --checkpoint-interval 1 < truncated.nar > resumed.nar 2> /dev/null || true
+status=0
+run_patchnar --checkpoint ckpt --resume < input.nar > resumed.nar 2> err.txt || status=$?
+assert_equals "1" "$status" "truncated output rejected"
+assert_contains "$(cat err.txt)" "shorter than the checkpoint" "error explains the truncated output"
+
+
+# Test 4: --resume without a checkpoint starts over
+echo ""
+echo "Testing resume without checkpoint..."
+
+rm -f ckpt
+run_patchnar --checkpoint ckpt --resume < input.nar > output.nar 2> /dev/null
+if cmp -s expected.nar output.nar; then
+    log_pass "fresh run with --resume matches normal output"
+else
+    log_fail "fresh run with --resume differs from normal output"
+fi
+
+print_summary
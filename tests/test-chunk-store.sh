@@ -0,0 +1,99 @@
+#!/bin/sh
+# Test the deduplicating chunk store (--chunk-store / --restore)
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/share
+printf '#!/nix/store/abc123-bash-5.2/bin/bash\necho hello\n' > pkg/bin/hello
+chmod +x pkg/bin/hello
+i=1
+while [ $i -le 400 ]; do
+    echo "line $i of a fairly large data file /nix/store/xyz$i-data/share"
+    i=$((i + 1))
+done > pkg/share/data1
+cp pkg/share/data1 pkg/share/data2
+cat pkg/share/data1 pkg/share/data1 pkg/share/data1 > pkg/share/data3
+
+create_test_nar pkg gen1.nar
+
+# Second generation: a small insertion in the middle of one file
+sed '200a inserted line' pkg/share/data3 > data3.new
+mv data3.new pkg/share/data3
+create_test_nar pkg gen2.nar
+
+
+# Test 1: storing still writes the NAR to stdout
+echo "Testing store with passthrough..."
+
+run_patchnar --chunk-store store --store-name gen1 < gen1.nar > out1.nar 2> log1.txt
+run_patchnar < gen1.nar > direct1.nar
+
+if cmp -s out1.nar direct1.nar; then
+    log_pass "output unchanged when storing"
+else
+    log_fail "output unchanged when storing"
+fi
+assert_contains "$(cat log1.txt)" "stored NAR as gen1" "store reports the NAR name"
+
+
+# Test 2: restore reproduces the NAR
+echo ""
+echo "Testing restore..."
+
+run_patchnar --chunk-store store --restore gen1 > restored1.nar
+
+if cmp -s direct1.nar restored1.nar; then
+    log_pass "restored NAR identical"
+else
+    log_fail "restored NAR identical"
+fi
+
+
+# Test 3: a near-identical generation shares most chunks
+echo ""
+echo "Testing deduplication..."
+
+cat gen2.nar | run_patchnar --chunk-store store --store-name gen2 > out2.nar 2> log2.txt
+total=$(sed -n 's/.*(\([0-9]*\) chunks, \([0-9]*\) new.*/\1/p' log2.txt)
+new=$(sed -n 's/.*(\([0-9]*\) chunks, \([0-9]*\) new.*/\2/p' log2.txt)
+
+if [ -n "$total" ] && [ "$new" -lt "$total" ]; then
+    log_pass "second generation reuses chunks ($new of $total new)"
+else
+    log_fail "second generation reuses chunks" "fewer new than total" "$new of $total"
+fi
+
+run_patchnar --chunk-store store --restore gen2 > restored2.nar
+if cmp -s out2.nar restored2.nar; then
+    log_pass "second generation restores"
+else
+    log_fail "second generation restores"
+fi
+
+
+# Test 4: default name is the NAR's SHA-256; unknown names fail
+echo ""
+echo "Testing default name and missing NAR..."
+
+run_patchnar --chunk-store store < gen1.nar > /dev/null 2> log3.txt
+name=$(sed -n 's/.*stored NAR as \([0-9a-f]*\) .*/\1/p' log3.txt)
+if [ ${#name} -eq 64 ] && [ -f "store/nars/$name" ]; then
+    log_pass "default name is a SHA-256"
+else
+    log_fail "default name is a SHA-256" "64 hex digits" "$name"
+fi
+
+if run_patchnar --chunk-store store --restore missing > /dev/null 2>&1; then
+    log_fail "unknown NAR name rejected"
+else
+    log_pass "unknown NAR name rejected"
+fi
+
+print_summary
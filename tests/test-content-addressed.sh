@@ -0,0 +1,84 @@
+#!/bin/sh
+# Test --content-addressed self-reference rewriting
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+OLD=/nix/store/0123456789abcdfghijklmnpqrsvwxyz-hello-1.0
+BASH_PATH=/nix/store/abcdabcdabcdabcdabcdabcdabcdabcd-bash-5.2
+
+mkdir -p pkg/bin pkg/share
+
+printf '#!%s/bin/bash\nexec %s/libexec/hello "$@"\n' "$BASH_PATH" "$OLD" > pkg/bin/hello
+chmod +x pkg/bin/hello
+printf 'data dir: %s/share/data\n' "$OLD" > pkg/share/config
+ln -s "$OLD/share/config" pkg/share/link
+
+create_test_nar pkg input.nar
+
+
+# Test 1: Self-references move to the printed path
+echo "Testing self-reference rewriting..."
+
+run_patchnar --content-addressed "$OLD" --reference "$BASH_PATH" < input.nar > output.nar 2> err.txt
+new=$(sed -n 's/^patchnar: content-addressed path //p' err.txt)
+new_hash=$(basename "$new" | cut -c1-32)
+
+case "$new" in
+    /nix/store/????????????????????????????????-hello-1.0)
+        log_pass "content-addressed path printed" ;;
+    *)
+        log_fail "content-addressed path printed" "store path" "'$new'" ;;
+esac
+if grep -q 0123456789abcdfghijklmnpqrsvwxyz output.nar; then
+    log_fail "old hash part still present"
+else
+    log_pass "old hash part gone"
+fi
+result=$(extract_from_nar output.nar /share/config)
+assert_contains "$result" "$new_hash-hello-1.0/share/data" "file self-reference rewritten"
+
+
+# Test 2: Same NAR as patching with the computed self-mapping
+echo ""
+echo "Testing against --self-mapping..."
+
+run_patchnar --self-mapping "$OLD $new" < input.nar > mapped.nar
+if cmp -s output.nar mapped.nar; then
+    log_pass "one pass matches --self-mapping with the computed path"
+else
+    log_fail "one pass differs from --self-mapping with the computed path"
+fi
+
+
+# Test 3: Piped output gets the same result (rewritten in a temp file)
+echo ""
+echo "Testing piped output..."
+
+run_patchnar --content-addressed "$OLD" --reference "$BASH_PATH" < input.nar 2> /dev/null | cat > piped.nar
+if cmp -s output.nar piped.nar; then
+    log_pass "piped output identical"
+else
+    log_fail "piped output differs"
+fi
+
+
+# Test 4: References are part of the path
+echo ""
+echo "Testing references change the path..."
+
+run_patchnar --content-addressed "$OLD" < input.nar > noref.nar 2> err.txt
+other=$(sed -n 's/^patchnar: content-addressed path //p' err.txt)
+if [ -n "$other" ] && [ "$other" != "$new" ]; then
+    log_pass "different references give a different path"
+else
+    log_fail "different references give a different path" "not '$new'" "'$other'"
+fi
+
+print_summary
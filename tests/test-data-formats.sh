@@ -0,0 +1,117 @@
+#!/bin/sh
+# Test the native JSON, pkg-config and libtool patchers
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+PREFIX=/data/data/com.termux.nix/files/usr
+LANGS="--add-lang json.lang"
+
+mkdir -p pkg/lib/pkgconfig pkg/share
+
+cat > pkg/share/manifest.json << 'EOF'
+{
+  "bin": "/nix/store/bin111-tool/bin/tool",
+  "quoted": "say \"/nix/store/esc111-esc/bin/x\"",
+  "list": ["/nix/store/one111-one", "plain"],
+  "/nix/store/key111-key": 1
+}
+EOF
+
+cat > pkg/lib/pkgconfig/foo.pc << 'EOF'
+# Installed in /nix/store/cmt111-comment
+prefix=/nix/store/foo111-foo
+libdir=${prefix}/lib
+
+Name: foo
+Libs: -L/nix/store/foo111-foo/lib -lfoo \
+  -L/nix/store/dep111-dep/lib
+Cflags: -I/nix/store/foo111-dev/include
+EOF
+
+cat > pkg/lib/libfoo.la << 'EOF'
+# libfoo.la - a libtool library file
+# Generated by libtool, for /nix/store/cmt222-comment
+dlname='libfoo.so.1'
+dependency_libs=' -L/nix/store/dep222-dep/lib /nix/store/dep222-dep/lib/libdep.la'
+libdir='/nix/store/foo222-foo/lib'
+EOF
+
+cp pkg/lib/pkgconfig/foo.pc pkg/share/notes.txt
+
+
+# Test 1: Values are patched, comments and other files are not
+echo "Testing value patching..."
+
+create_test_nar pkg input.nar
+run_patchnar $LANGS < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /share/manifest.json)
+assert_contains "$result" "\"bin\": \"$PREFIX/nix/store/bin111-tool/bin/tool\"" "JSON value patched"
+assert_contains "$result" "say \\\"$PREFIX/nix/store/esc111-esc/bin/x\\\"\"" "JSON escaped quotes handled"
+assert_contains "$result" "[\"$PREFIX/nix/store/one111-one\", \"plain\"]" "JSON array patched"
+assert_contains "$result" "\"$PREFIX/nix/store/key111-key\": 1" "JSON key patched"
+
+result=$(extract_from_nar output.nar /lib/pkgconfig/foo.pc)
+assert_contains "$result" "prefix=$PREFIX/nix/store/foo111-foo" "pkg-config variable patched"
+assert_contains "$result" "Libs: -L$PREFIX/nix/store/foo111-foo/lib -lfoo" "pkg-config keyword patched"
+assert_contains "$result" "  -L$PREFIX/nix/store/dep111-dep/lib" "pkg-config continuation line patched"
+assert_contains "$result" "Cflags: -I$PREFIX/nix/store/foo111-dev/include" "pkg-config Cflags patched"
+assert_contains "$result" "# Installed in /nix/store/cmt111-comment" "pkg-config comment untouched"
+
+result=$(extract_from_nar output.nar /lib/libfoo.la)
+assert_contains "$result" "dependency_libs=' -L$PREFIX/nix/store/dep222-dep/lib $PREFIX/nix/store/dep222-dep/lib/libdep.la'" \
+    "libtool dependency_libs patched"
+assert_contains "$result" "libdir='$PREFIX/nix/store/foo222-foo/lib'" "libtool libdir patched"
+assert_contains "$result" "# Generated by libtool, for /nix/store/cmt222-comment" "libtool comment untouched"
+
+result=$(extract_from_nar output.nar /share/notes.txt)
+assert_contains "$result" "prefix=/nix/store/foo111-foo" "other files untouched"
+
+
+# Test 2: pkg-config and libtool are on by default, JSON is opt-in
+echo ""
+echo "Testing default languages..."
+
+run_patchnar < input.nar > default.nar
+result=$(extract_from_nar default.nar /lib/pkgconfig/foo.pc)
+assert_contains "$result" "prefix=$PREFIX/nix/store/foo111-foo" "pkg-config patched by default"
+result=$(extract_from_nar default.nar /lib/libfoo.la)
+assert_contains "$result" "libdir='$PREFIX/nix/store/foo222-foo/lib'" "libtool patched by default"
+result=$(extract_from_nar default.nar /share/manifest.json)
+assert_contains "$result" "\"bin\": \"/nix/store/bin111-tool/bin/tool\"" "JSON untouched without --add-lang"
+
+run_patchnar --no-data-formats < input.nar > nodata.nar
+result=$(extract_from_nar nodata.nar /lib/pkgconfig/foo.pc)
+assert_contains "$result" "prefix=/nix/store/foo111-foo" "pkg-config untouched with --no-data-formats"
+result=$(extract_from_nar nodata.nar /lib/libfoo.la)
+assert_contains "$result" "libdir='/nix/store/foo222-foo/lib'" "libtool untouched with --no-data-formats"
+
+
+# Test 3: pkg-config and libtool have no source-highlight fallback
+echo ""
+echo "Testing --no-native-lexers..."
+
+run_patchnar --no-native-lexers < input.nar > nonative.nar
+result=$(extract_from_nar nonative.nar /lib/libfoo.la)
+assert_contains "$result" "libdir='$PREFIX/nix/store/foo222-foo/lib'" "libtool patched natively anyway"
+
+
+# Test 4: They are not languages --add-lang can name
+echo ""
+echo "Testing --add-lang pkgconfig.lang..."
+
+if run_patchnar --add-lang pkgconfig.lang < input.nar > /dev/null 2> err.txt; then
+    log_fail "--add-lang pkgconfig.lang rejected"
+else
+    assert_contains "$(cat err.txt)" "pkgconfig.lang: not a language file" \
+        "--add-lang pkgconfig.lang rejected"
+fi
+
+print_summary
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Test delta output (--delta) and rebuilding with --apply-delta
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/lib pkg/share
+
+# A long script whose shebang gets prefixed, an absolute symlink and a
+# large file patching leaves alone
+{
+    echo '#!/nix/store/abc123-bash-5.2/bin/bash'
+    seq 1 5000 | sed 's/^/echo line /'
+} > pkg/bin/tool
+chmod +x pkg/bin/tool
+ln -s /nix/store/lib111-libfoo/lib/libfoo.so pkg/lib/libfoo.so
+seq 1 50000 > pkg/share/data.txt
+
+create_test_nar pkg input.nar
+run_patchnar < input.nar > patched.nar
+
+
+# Test 1: Applying the delta to the input gives the patched NAR
+echo "Testing delta round trip..."
+
+run_patchnar --delta < input.nar > nar.delta
+if run_patchnar --apply-delta nar.delta < input.nar > applied.nar && cmp -s patched.nar applied.nar; then
+    log_pass "applied delta matches patched NAR"
+else
+    log_fail "applied delta differs from patched NAR"
+fi
+
+result=$(extract_from_nar applied.nar /bin/tool)
+assert_contains "$result" "#!/data/data/com.termux.nix/files/usr/nix/store/abc123-bash-5.2/bin/bash" \
+    "shebang patched in applied NAR"
+
+
+# Test 2: The delta only carries what changed
+echo ""
+echo "Testing delta size..."
+
+delta_size=$(wc -c < nar.delta)
+tool_size=$(wc -c < pkg/bin/tool)
+if [ "$delta_size" -lt "$tool_size" ]; then
+    log_pass "delta ($delta_size bytes) smaller than the one patched file ($tool_size bytes)"
+else
+    log_fail "delta ($delta_size bytes) not smaller than the patched file ($tool_size bytes)"
+fi
+
+
+# Test 3: A different base NAR is rejected
+echo ""
+echo "Testing wrong base NAR..."
+
+seq 2 50001 > pkg/share/data.txt
+create_test_nar pkg other.nar
+if run_patchnar --apply-delta nar.delta < other.nar > wrong.nar 2> err.txt; then
+    log_fail "delta applied to a different base NAR"
+else
+    assert_contains "$(cat err.txt)" "does not match" "mismatched result reported"
+fi
+
+
+# Test 4: Deltas are only written between NARs
+echo ""
+echo "Testing non-NAR output rejected..."
+
+if run_patchnar --delta --output-format tar < input.nar > /dev/null 2> err.txt; then
+    log_fail "--delta accepted tar output"
+else
+    assert_contains "$(cat err.txt)" "only written between NARs" "tar output rejected"
+fi
+
+print_summary
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Test nix-store --export streams (--input-format export)
+# Every embedded NAR is patched and metadata paths go through the mappings
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+# Export framing: little-endian u64 and padded strings
+u64() {
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+        $(($1 & 255)) $((($1 >> 8) & 255)) $((($1 >> 16) & 255)) $((($1 >> 24) & 255)))"
+    printf '\000\000\000\000'
+}
+str() {
+    u64 ${#1}
+    printf '%s' "$1"
+    head -c $(((8 - ${#1} % 8) % 8)) /dev/zero
+}
+# export_path NAR PATH DERIVER REFS...
+export_path() {
+    nar=$1 path=$2 deriver=$3
+    shift 3
+    u64 1
+    cat "$nar"
+    u64 1163413838   # "NIXE"
+    str "$path"
+    u64 $#
+    for ref in "$@"; do str "$ref"; done
+    str "$deriver"
+    u64 0
+}
+
+LIB=/nix/store/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-libfoo-1.0
+APP=/nix/store/bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb-app-1.0
+NEWLIB=/nix/store/cccccccccccccccccccccccccccccccc-libfoo-1.0
+NEWAPP=/nix/store/dddddddddddddddddddddddddddddddd-app-1.0
+DRV=/nix/store/eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee-app-1.0.drv
+
+mkdir -p lib/share app/bin
+printf 'data for %s\n' "$LIB" > lib/share/info
+printf '#!/nix/store/abc123-bash-5.2/bin/bash\nexec %s/share/info\n' "$LIB" > app/bin/run
+chmod +x app/bin/run
+ln -s "$LIB/share/info" app/bin/info
+
+printf '%s %s\n%s %s\n' "$LIB" "$NEWLIB" "$APP" "$NEWAPP" > mappings.txt
+
+create_test_nar lib lib.nar
+create_test_nar app app.nar
+{ export_path lib.nar "$LIB" ""; export_path app.nar "$APP" "$DRV" "$LIB" "$APP"; u64 0; } > input.export
+
+run_patchnar --mappings mappings.txt < lib.nar > lib-patched.nar
+run_patchnar --mappings mappings.txt < app.nar > app-patched.nar
+{
+    export_path lib-patched.nar "$NEWLIB" ""
+    export_path app-patched.nar "$NEWAPP" "$DRV" "$NEWLIB" "$NEWAPP"
+    u64 0
+} > expected.export
+
+
+# Test 1: whole stream in one process
+echo "Testing export stream..."
+
+run_patchnar --input-format export --mappings mappings.txt < input.export > output.export
+if cmp -s expected.export output.export; then
+    log_pass "export stream patched path by path"
+else
+    log_fail "export stream patched path by path"
+fi
+
+
+# Test 2: pipe input behaves the same
+echo ""
+echo "Testing piped export stream..."
+
+cat input.export | run_patchnar --input-format export --mappings mappings.txt > piped.export
+if cmp -s expected.export piped.export; then
+    log_pass "piped export stream"
+else
+    log_fail "piped export stream"
+fi
+
+
+# Test 3: truncated and mismatched streams fail
+echo ""
+echo "Testing malformed streams..."
+
+head -c $(($(wc -c < input.export) - 16)) input.export > truncated.export
+if run_patchnar --input-format export < truncated.export > /dev/null 2>&1; then
+    log_fail "truncated export rejected"
+else
+    log_pass "truncated export rejected"
+fi
+
+if run_patchnar --input-format export --output-format nar < input.export > /dev/null 2> err.txt; then
+    log_fail "export to nar rejected"
+else
+    assert_contains "$(cat err.txt)" "export" "export to nar rejected"
+fi
+
+print_summary
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Test the libpatchnar C API against the patchnar CLI
+# Sessions fed in small or odd-sized pieces must produce the same NAR
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+FEED=${LIBPATCHNAR_FEED:-$(dirname "$0")/libpatchnar-feed}
+if [ ! -x "$FEED" ]; then
+    log_skip "libpatchnar-feed not built"
+    exit 77
+fi
+FEED="$(cd "$(dirname "$FEED")" && pwd)/$(basename "$FEED")"
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/share pkg/lib
+printf '#!/nix/store/abc123-bash-5.2/bin/bash\necho "/nix/store/xyz-data/share"\n' > pkg/bin/script
+chmod +x pkg/bin/script
+head -c 300000 /dev/zero | tr '\0' 'z' > pkg/share/blob
+ln -s /nix/store/abc123-bash-5.2/bin/bash pkg/bin/sh
+: > pkg/lib/empty
+
+create_test_nar pkg input.nar
+run_patchnar < input.nar > reference.nar
+
+
+# Test 1: descriptor API
+echo "Testing patchnar_patch_fd..."
+
+"$FEED" 0 < input.nar > fd.nar
+if cmp -s reference.nar fd.nar; then
+    log_pass "patchnar_patch_fd matches CLI"
+else
+    log_fail "patchnar_patch_fd matches CLI"
+fi
+
+
+# Test 2: sessions with various feed sizes
+for chunk in 1 7 4096 1048576; do
+    echo ""
+    echo "Testing session fed in $chunk-byte pieces..."
+
+    "$FEED" $chunk < input.nar > session-$chunk.nar
+    if cmp -s reference.nar session-$chunk.nar; then
+        log_pass "session ($chunk-byte feeds) matches CLI"
+    else
+        log_fail "session ($chunk-byte feeds) matches CLI"
+    fi
+done
+
+
+# Test 3: truncated input is an error
+echo ""
+echo "Testing truncated input..."
+
+head -c 1000 input.nar > truncated.nar
+if "$FEED" 512 < truncated.nar > /dev/null 2> err.txt; then
+    log_fail "truncated input fails"
+else
+    log_pass "truncated input fails"
+fi
+
+
+# Test 4: sessions multiplexed by a loop
+echo ""
+echo "Testing patchnar_loop with 4 sessions..."
+
+if "$FEED" loop 4 loop < input.nar 2> loop-err.txt; then
+    all_match=1
+    for i in 0 1 2 3; do
+        cmp -s reference.nar loop-$i.nar || all_match=0
+    done
+    if [ $all_match -eq 1 ]; then
+        log_pass "loop sessions match CLI"
+    else
+        log_fail "loop sessions match CLI"
+    fi
+else
+    log_fail "loop sessions match CLI ($(cat loop-err.txt))"
+fi
+
+print_summary
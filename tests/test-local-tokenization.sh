@@ -0,0 +1,88 @@
+#!/bin/sh
+# Test that tokenizing scripts around matches gives the whole-file result
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+PREFIX=/data/data/com.termux.nix/files/usr
+
+mkdir -p pkg/bin
+
+cat > pkg/bin/mixed.sh << 'EOF'
+#!/bin/sh
+# it's a comment mentioning /nix/store/cmt111-comment
+BASH="/nix/store/bash111-bash/bin/bash"
+echo "line one
+/nix/store/multi111-multi/bin/x
+line three"
+n=${#BASH} # count
+cat <<EOF2
+don't /nix/store/here111-heredoc/bin/y
+EOF2
+v=`/nix/store/tick111-tick/bin/z`
+echo a#b /nix/store/word111-word/bin/w
+exec "/nix/store/last111-last/bin/sh" "$@"
+EOF
+
+cat > pkg/bin/plain.sh << 'EOF'
+#!/bin/sh
+# No store paths here; it's left as is
+echo "hello" 'world'
+EOF
+
+# A store path across the first 64KB boundary, where the reader's scan
+# switches blocks
+{
+    printf '#!/bin/sh\n# '
+    head -c 65515 /dev/zero | tr '\0' x
+    printf '\necho "/nix/store/blk111-block/bin/b"\n'
+} > pkg/bin/block.sh
+
+chmod +x pkg/bin/*.sh
+
+
+# Test 1: Same output as tokenizing whole files
+echo "Testing local tokenization..."
+
+create_test_nar pkg input.nar
+run_patchnar < input.nar > local.nar
+run_patchnar --no-local-tokenization < input.nar > full.nar
+
+assert_equals "$(extract_from_nar full.nar /bin/mixed.sh)" \
+    "$(extract_from_nar local.nar /bin/mixed.sh)" "Same script as whole-file tokenization"
+
+result=$(extract_from_nar local.nar /bin/mixed.sh)
+assert_contains "$result" "# it's a comment mentioning $PREFIX/nix/store/cmt111-comment" "Comment patched"
+assert_contains "$result" "BASH=\"$PREFIX/nix/store/bash111-bash/bin/bash\"" "String after comment patched"
+assert_contains "$result" "exec \"$PREFIX/nix/store/last111-last/bin/sh\"" "Last line patched"
+
+
+# Test 2: Scripts without matches are left alone
+echo ""
+echo "Testing scripts without store paths..."
+
+assert_equals "$(extract_from_nar input.nar /bin/plain.sh)" \
+    "$(extract_from_nar local.nar /bin/plain.sh)" "Script without store paths unchanged"
+
+
+
+# Test 3: Matches found while reading, across blocks and with --jobs
+echo ""
+echo "Testing matches across read blocks..."
+
+result=$(extract_from_nar local.nar /bin/block.sh | tail -n 1)
+assert_equals "echo \"$PREFIX/nix/store/blk111-block/bin/b\"" "$result" "Path across blocks patched"
+
+run_patchnar --jobs 2 < input.nar > jobs.nar
+assert_equals "$(extract_from_nar full.nar /bin/mixed.sh)" \
+    "$(extract_from_nar jobs.nar /bin/mixed.sh)" "Same script with --jobs"
+assert_equals "$result" "$(extract_from_nar jobs.nar /bin/block.sh | tail -n 1)" \
+    "Path across blocks patched with --jobs"
+
+print_summary
@@ -0,0 +1,134 @@
+#!/bin/sh
+# Test the native python/perl lexers against source-highlight
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+PREFIX=/data/data/com.termux.nix/files/usr
+
+mkdir -p pkg/bin
+
+# Test 1: Same output as source-highlight for plain strings and comments
+echo "Testing native lexers match source-highlight..."
+
+cat > pkg/bin/plain_python << 'EOF'
+#!/nix/store/abc123-python-3.11/bin/python3
+# Data lives in /nix/store/cmt111-data/share
+config = "/nix/store/cfg111-config/etc/app.conf"
+data = '/nix/store/data111-data/share/app'
+escaped = "say \"/nix/store/esc111-esc/bin/x\""
+doc = """
+Installed to /nix/store/doc111-doc/share/doc
+"""
+print(config, data)  # /nix/store/tail111-tail
+EOF
+chmod +x pkg/bin/plain_python
+
+cat > pkg/bin/plain_perl << 'EOF'
+#!/nix/store/abc123-perl-5.38/bin/perl
+use strict;
+# Data lives in /nix/store/cmt222-data/share
+my $config = "/nix/store/cfg222-config/etc/app.conf";
+my $data = '/nix/store/data222-data/share/app';
+my $ratio = $total / 2;
+print "$config\n";  # /nix/store/tail222-tail
+EOF
+chmod +x pkg/bin/plain_perl
+
+create_test_nar pkg input.nar
+run_patchnar --add-lang python.lang --add-lang perl.lang < input.nar > native.nar
+run_patchnar --add-lang python.lang --add-lang perl.lang --no-native-lexers < input.nar > highlight.nar
+
+if cmp -s native.nar highlight.nar; then
+    log_pass "native and source-highlight output identical"
+else
+    log_fail "native and source-highlight output differ"
+fi
+
+result=$(extract_from_nar native.nar /bin/plain_python)
+assert_contains "$result" "config = \"$PREFIX/nix/store/cfg111-config/etc/app.conf\"" \
+    "python string patched"
+assert_contains "$result" "\"\"\"
+Installed to $PREFIX/nix/store/doc111-doc/share/doc" \
+    "python triple-quoted string patched"
+
+result=$(extract_from_nar native.nar /bin/plain_perl)
+assert_contains "$result" "my \$data = '$PREFIX/nix/store/data222-data/share/app';" \
+    "perl string patched"
+
+
+# Test 2: Python constructs the native lexer handles itself
+echo ""
+echo "Testing python prefixes and f-strings..."
+
+cat > pkg/bin/fancy_python << 'EOF'
+#!/nix/store/abc123-python-3.11/bin/python3
+raw = r'/nix/store/raw333-raw\d+'
+fmt = f"{opts['key']} at /nix/store/fmt333-fmt/lib {{literal}}"
+text = b'/nix/store/byt333-bytes'
+EOF
+chmod +x pkg/bin/fancy_python
+
+create_test_nar pkg input.nar
+run_patchnar --add-lang python.lang < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /bin/fancy_python)
+assert_contains "$result" "raw = r'$PREFIX/nix/store/raw333-raw\\d+'" \
+    "raw string patched"
+assert_contains "$result" "fmt = f\"{opts['key']} at $PREFIX/nix/store/fmt333-fmt/lib {{literal}}\"" \
+    "f-string with nested quotes patched"
+assert_contains "$result" "text = b'$PREFIX/nix/store/byt333-bytes'" \
+    "bytes literal patched"
+
+
+# Test 3: Perl quote-like operators, heredocs and POD
+echo ""
+echo "Testing perl quote-like operators, heredocs and POD..."
+
+cat > pkg/bin/fancy_perl << 'EOF'
+#!/nix/store/abc123-perl-5.38/bin/perl
+local $" = ':';
+my $lib = q{/nix/store/lib444-lib/{perl}};
+my $bin = qq(/nix/store/bin444-bin/$name);
+my %opts = (s => 1, q => 2);
+(my $clean = $path) =~ s{/usr/bin}{/opt/bin}g;
+print <<"EOT";
+Using /nix/store/doc444-heredoc/share
+EOT
+
+=head1 FILES
+
+F</nix/store/pod444-pod/etc/conf>
+
+=cut
+
+my $after = "/nix/store/aft444-after/bin";
+__END__
+"/nix/store/end444-end/data"
+EOF
+chmod +x pkg/bin/fancy_perl
+
+create_test_nar pkg input.nar
+run_patchnar --add-lang perl.lang < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /bin/fancy_perl)
+assert_contains "$result" "my \$lib = q{$PREFIX/nix/store/lib444-lib/{perl}};" \
+    "q{} with nested braces patched"
+assert_contains "$result" "my \$bin = qq($PREFIX/nix/store/bin444-bin/\$name);" \
+    "qq() patched"
+assert_contains "$result" "Using $PREFIX/nix/store/doc444-heredoc/share" \
+    "heredoc body patched"
+assert_contains "$result" "F<$PREFIX/nix/store/pod444-pod/etc/conf>" \
+    "POD patched"
+assert_contains "$result" "my \$after = \"$PREFIX/nix/store/aft444-after/bin\";" \
+    "string after \$\" and POD patched"
+assert_contains "$result" '"/nix/store/end444-end/data"' \
+    "__END__ data unchanged"
+
+print_summary
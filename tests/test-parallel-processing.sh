@@ -0,0 +1,133 @@
+#!/bin/sh
+# Test parallel (indexed, out-of-order) processing of seekable input
+# Output must be byte-identical to serial streaming
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/lib/sub pkg/share/doc
+
+i=1
+while [ $i -le 40 ]; do
+    printf '#!/nix/store/abc123-bash-5.2/bin/bash\necho "/nix/store/xyz%03d-data/share"\n' $i \
+        > pkg/lib/sub/script$i.sh
+    head -c $((i * 300)) /dev/zero | tr '\0' 'x' > pkg/share/doc/file$i
+    i=$((i + 1))
+done
+ln -s /nix/store/abc123-bash-5.2/bin/bash pkg/bin/sh
+: > pkg/empty
+
+echo "/nix/store/xyz007-data /nix/store/new007-data" > mappings.txt
+
+create_test_nar pkg input.nar
+
+
+# Test 1: parallel output matches serial output
+echo "Testing parallel output matches serial..."
+
+run_patchnar --jobs 1 --mappings mappings.txt < input.nar > serial.nar
+run_patchnar --jobs 4 --mappings mappings.txt < input.nar > parallel.nar
+
+if cmp -s serial.nar parallel.nar; then
+    log_pass "parallel output identical to serial"
+else
+    log_fail "parallel output identical to serial"
+fi
+
+
+# Test 2: non-seekable input falls back to streaming
+echo ""
+echo "Testing pipe input with --jobs..."
+
+cat input.nar | run_patchnar --jobs 4 --mappings mappings.txt > piped.nar
+
+if cmp -s serial.nar piped.nar; then
+    log_pass "piped input identical to serial"
+else
+    log_fail "piped input identical to serial"
+fi
+
+
+# Test 3: patching actually happened in the parallel run
+echo ""
+echo "Testing parallel patching results..."
+
+result=$(extract_from_nar parallel.nar /lib/sub/script7.sh)
+assert_contains "$result" "/data/data/com.termux.nix/files/usr/nix/store/new007-data/share" \
+    "script patched and mapped in parallel run"
+
+
+# Test 4: piped output takes the ordered writer; file output is placed
+echo ""
+echo "Testing pipe output with --jobs..."
+
+run_patchnar --jobs 4 --mappings mappings.txt < input.nar | cat > ordered.nar
+
+if cmp -s serial.nar ordered.nar; then
+    log_pass "piped output identical to serial"
+else
+    log_fail "piped output identical to serial"
+fi
+
+
+# Test 5: placed output over a longer existing file is truncated
+echo ""
+echo "Testing placed output over existing file..."
+
+cat input.nar input.nar > reused.nar
+run_patchnar --jobs 4 --mappings mappings.txt < input.nar 1<> reused.nar
+
+if cmp -s serial.nar reused.nar; then
+    log_pass "stale tail of existing output file removed"
+else
+    log_fail "stale tail of existing output file removed"
+fi
+
+
+# Test 6: a slow reader makes the writer park workers; output is unchanged
+echo ""
+echo "Testing a slow consumer with --jobs..."
+
+# More output than the write-behind buffers and the pipe hold, so the
+# writer blocks until the reader wakes up
+mkdir -p big/share
+i=1
+while [ $i -le 64 ]; do
+    head -c 131072 /dev/zero | tr '\0' 'y' > big/share/blob$i
+    i=$((i + 1))
+done
+create_test_nar big big.nar
+run_patchnar --jobs 1 < big.nar > big.serial.nar
+
+run_patchnar --jobs 8 --debug < big.nar 2> throttled.log | { sleep 2; cat; } > throttled.nar
+
+if cmp -s big.serial.nar throttled.nar; then
+    log_pass "output to a slow consumer identical to serial"
+else
+    log_fail "output to a slow consumer identical to serial"
+fi
+if grep -q "patchnar: [1-7] of 8 workers active" throttled.log; then
+    log_pass "workers parked while the output is blocked"
+else
+    log_fail "workers parked while the output is blocked"
+fi
+
+
+# Test 7: truncated input is an error
+echo ""
+echo "Testing truncated input..."
+
+head -c 2000 input.nar > truncated.nar
+if run_patchnar --jobs 4 < truncated.nar > out.nar 2>/dev/null; then
+    log_fail "truncated input rejected"
+else
+    log_pass "truncated input rejected"
+fi
+
+print_summary
@@ -0,0 +1,75 @@
+#!/bin/sh
+# Test that huge scripts tokenized in pieces on several threads come out
+# the same as tokenized on one
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+PREFIX=/data/data/com.termux.nix/files/usr
+
+mkdir -p pkg/bin
+
+cat > block.sh << 'EOF'
+# it's a comment mentioning /nix/store/cmt111-comment
+BASH="/nix/store/bash111-bash/bin/bash"
+echo "line one
+/nix/store/multi111-multi/bin/x
+line three"
+n=${#BASH} # count
+cat <<EOF2
+here /nix/store/here111-heredoc/bin/y
+EOF2
+v=$(/nix/store/tick111-tick/bin/z)
+echo a#b '/nix/store/word111-word/bin/w'
+EOF
+
+# Double the block until the script is over 4MB
+cp block.sh body.sh
+while [ "$(wc -c < body.sh)" -lt 4194304 ]; do
+    cat body.sh body.sh > body2.sh
+    mv body2.sh body.sh
+done
+{ echo '#!/bin/sh'; cat body.sh; echo 'exec "/nix/store/last111-last/bin/sh" "$@"'; } > pkg/bin/huge.sh
+
+# Same size, but a command substitution leaves no restart points: the
+# lexer may or may not see backticks as quotes, and no other backtick
+# settles it
+{ echo '#!/bin/sh'; echo 'now=`date`'; cat body.sh; } > pkg/bin/open.sh
+
+chmod +x pkg/bin/*.sh
+create_test_nar pkg input.nar
+
+
+# Test 1: Pieces on several threads give the serial result
+echo "Testing parallel tokenization..."
+
+run_patchnar --jobs 1 < input.nar > serial.nar
+run_patchnar --jobs 4 < input.nar > parallel.nar
+run_patchnar --jobs 4 --no-local-tokenization < input.nar > whole.nar
+
+serial=$(extract_from_nar serial.nar /bin/huge.sh | md5sum)
+assert_equals "$serial" "$(extract_from_nar parallel.nar /bin/huge.sh | md5sum)" \
+    "Same script as serial tokenization"
+assert_equals "$serial" "$(extract_from_nar whole.nar /bin/huge.sh | md5sum)" \
+    "Same script without local tokenization"
+
+result=$(extract_from_nar parallel.nar /bin/huge.sh | head -n 3)
+assert_contains "$result" "BASH=\"$PREFIX/nix/store/bash111-bash/bin/bash\"" "First piece patched"
+result=$(extract_from_nar parallel.nar /bin/huge.sh | tail -n 1)
+assert_contains "$result" "exec \"$PREFIX/nix/store/last111-last/bin/sh\"" "Last piece patched"
+
+
+# Test 2: Without restart points the file is tokenized in one piece
+echo ""
+echo "Testing scripts without split points..."
+
+assert_equals "$(extract_from_nar serial.nar /bin/open.sh | md5sum)" \
+    "$(extract_from_nar parallel.nar /bin/open.sh | md5sum)" "Same script on one thread"
+
+print_summary
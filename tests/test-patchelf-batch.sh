@@ -0,0 +1,95 @@
+#!/bin/sh
+# Test that patchelf --batch applies the operations of every line per file
+
+. "$(dirname "$0")/test-helper.sh"
+
+PATCHELF="${PATCHELF:-$(dirname "$0")/../src/patchelf}"
+if [ ! -x "$PATCHELF" ]; then
+    log_skip "patchelf not built at $PATCHELF"
+    exit 77
+fi
+
+# Any dynamically linked ELF executable will do
+ELF=
+for tool in env ls cat; do
+    candidate=$(readlink -f "$(command -v $tool)" 2>/dev/null)
+    if [ -f "$candidate" ] && [ "$(head -c 4 "$candidate" | tail -c 3)" = "ELF" ]; then
+        ELF=$candidate
+        break
+    fi
+done
+if [ -z "$ELF" ]; then
+    log_skip "no ELF executable found"
+    exit 77
+fi
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+cp "$ELF" a
+cp "$ELF" b
+cp "$ELF" a.cli
+chmod u+w a b a.cli
+
+# a is listed twice; its operations are merged
+cat > batch.jsonl << 'EOF2'
+{"file": "a", "args": ["--set-interpreter", "/data/lib/ld-linux.so"]}
+{"file": "b", "args": ["--set-rpath", "/data/b/lib"]}
+
+{"file": "a", "args": ["--set-rpath", "/data/a/lib:$ORIGIN", "--add-needed", "libextra.so"]}
+EOF2
+
+
+# Test 1: Every file gets all of its operations
+echo "Testing --batch..."
+
+if "$PATCHELF" --batch batch.jsonl; then
+    log_pass "Batch succeeds"
+else
+    log_fail "Batch succeeds"
+fi
+assert_equals "$("$PATCHELF" --print-interpreter a)" "/data/lib/ld-linux.so" "Interpreter of a"
+assert_equals "$("$PATCHELF" --print-rpath a)" "/data/a/lib:\$ORIGIN" "RPATH of a"
+assert_contains "$("$PATCHELF" --print-needed a)" "libextra.so" "NEEDED of a"
+assert_equals "$("$PATCHELF" --print-rpath b)" "/data/b/lib" "RPATH of b"
+
+
+# Test 2: Same result as one command line with the same operations
+echo ""
+echo "Testing against a single invocation..."
+
+"$PATCHELF" --set-interpreter /data/lib/ld-linux.so --set-rpath '/data/a/lib:$ORIGIN' \
+    --add-needed libextra.so a.cli
+if cmp -s a a.cli; then
+    log_pass "a matches a single invocation"
+else
+    log_fail "a matches a single invocation"
+fi
+
+
+# Test 3: Anything but per-file operations is rejected
+echo ""
+echo "Testing bad batch lines..."
+
+echo '{"file": "b", "args": ["--output", "c"]}' > bad-op.jsonl
+if "$PATCHELF" --batch bad-op.jsonl 2>/dev/null; then
+    log_fail "Non-operation rejected"
+else
+    log_pass "Non-operation rejected"
+fi
+
+echo '{"file": "b", "args": ["--print-rpath"]} x' > bad-json.jsonl
+if "$PATCHELF" --batch bad-json.jsonl 2>/dev/null; then
+    log_fail "Malformed line rejected"
+else
+    log_pass "Malformed line rejected"
+fi
+
+if "$PATCHELF" --batch batch.jsonl a 2>/dev/null; then
+    log_fail "File arguments rejected with --batch"
+else
+    log_pass "File arguments rejected with --batch"
+fi
+
+print_summary
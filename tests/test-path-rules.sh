@@ -0,0 +1,116 @@
+#!/bin/sh
+# Test --rule GLOB=ACTION path rules (skip, map-only, script:LANG, elf)
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/share/doc/sub pkg/libexec
+
+cat > pkg/bin/tool.sh << 'EOF2'
+#!/nix/store/abc123-bash-5.2/bin/bash
+echo "/nix/store/oldhash-data/share"
+EOF2
+
+cat > pkg/share/doc/sub/example.sh << 'EOF2'
+#!/nix/store/abc123-bash-5.2/bin/bash
+echo "/nix/store/oldhash-data/share"
+EOF2
+
+# No shebang and no extension: only patched when forced by a rule
+cat > pkg/libexec/helper << 'EOF2'
+DATA="/nix/store/abc123-data/share"
+EOF2
+
+echo "/nix/store/oldhash-data /nix/store/newhash-data" > mappings.txt
+
+create_test_nar pkg input.nar
+
+
+# Test 1: skip leaves the whole subtree untouched
+echo "Testing skip rule..."
+
+run_patchnar --mappings mappings.txt --rule 'share/doc/**=skip' \
+             < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /share/doc/sub/example.sh)
+assert_not_contains "$result" "/data/data/com.termux.nix/files/usr" \
+    "skipped subtree not prefixed"
+assert_contains "$result" "oldhash-data" \
+    "skipped subtree not hash-mapped"
+
+result=$(extract_from_nar output.nar /bin/tool.sh)
+assert_contains "$result" "/data/data/com.termux.nix/files/usr/nix/store/abc123-bash-5.2" \
+    "files outside the rule still patched"
+
+
+# Test 2: map-only applies hash mappings but no prefix
+echo ""
+echo "Testing map-only rule..."
+
+run_patchnar --mappings mappings.txt --rule 'share/doc=map-only' \
+             < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /share/doc/sub/example.sh)
+assert_contains "$result" "newhash-data" \
+    "map-only applies hash mapping (inherited by subtree)"
+assert_not_contains "$result" "/data/data/com.termux.nix/files/usr" \
+    "map-only does not add prefix"
+
+
+# Test 3: script:LANG forces source patching
+echo ""
+echo "Testing script rule..."
+
+run_patchnar --rule 'libexec/*=script:sh' < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /libexec/helper)
+assert_contains "$result" 'DATA="/data/data/com.termux.nix/files/usr/nix/store/abc123-data/share"' \
+    "forced script patched without detection"
+
+
+# Test 4: last matching rule wins, deeper match overrides inherited action
+echo ""
+echo "Testing rule precedence..."
+
+run_patchnar --mappings mappings.txt \
+             --rule 'share/**=skip' --rule '**/*.sh=map-only' \
+             < input.nar > output.nar
+
+result=$(extract_from_nar output.nar /share/doc/sub/example.sh)
+assert_contains "$result" "newhash-data" \
+    "later rule overrides earlier one"
+
+
+# Test 5: elf on a file that is not an ELF only maps hashes
+echo ""
+echo "Testing elf rule on a script..."
+
+run_patchnar --mappings mappings.txt --rule 'bin/**=elf' --debug \
+             < input.nar > output.nar 2> debug.txt
+
+result=$(extract_from_nar output.nar /bin/tool.sh)
+assert_contains "$result" "newhash-data" \
+    "elf rule on a script applies hash mapping"
+assert_not_contains "$result" "/data/data/com.termux.nix/files/usr" \
+    "elf rule on a script does not add prefix"
+assert_contains "$(cat debug.txt)" "map-only bin/tool.sh (elf rule, not an ELF)" \
+    "elf rule named as the reason"
+
+
+# Test 6: invalid action is rejected
+echo ""
+echo "Testing invalid rule..."
+
+if run_patchnar --rule 'bin/**=frobnicate' < input.nar > output.nar 2>/dev/null; then
+    log_fail "invalid action rejected"
+else
+    log_pass "invalid action rejected"
+fi
+
+print_summary
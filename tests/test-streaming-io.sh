@@ -0,0 +1,71 @@
+#!/bin/sh
+# Test streaming I/O through the read-ahead and write-behind threads
+# Input arriving in bursts and output errors must behave like plain I/O
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+mkdir -p pkg/bin pkg/share
+
+i=1
+while [ $i -le 20 ]; do
+    printf '#!/nix/store/abc123-bash-5.2/bin/bash\necho "/nix/store/xyz%03d-data/share"\n' $i \
+        > pkg/bin/script$i
+    chmod +x pkg/bin/script$i
+    head -c $((i * 100000)) /dev/zero | tr '\0' 'y' > pkg/share/blob$i
+    i=$((i + 1))
+done
+
+create_test_nar pkg input.nar
+run_patchnar --jobs 1 < input.nar > reference.nar
+
+
+# Test 1: input delivered in bursts through a pipe
+echo "Testing bursty pipe input..."
+
+size=$(wc -c < input.nar)
+half=$((size / 2))
+{ head -c $half input.nar; sleep 1; tail -c +$((half + 1)) input.nar; } \
+    | run_patchnar > bursty.nar
+
+if cmp -s reference.nar bursty.nar; then
+    log_pass "bursty input identical to file input"
+else
+    log_fail "bursty input identical to file input"
+fi
+
+
+# Test 2: output through a pipe
+echo ""
+echo "Testing pipe output..."
+
+cat input.nar | run_patchnar | cat > piped.nar
+
+if cmp -s reference.nar piped.nar; then
+    log_pass "piped output identical to file output"
+else
+    log_fail "piped output identical to file output"
+fi
+
+
+# Test 3: write errors are reported
+echo ""
+echo "Testing write error..."
+
+if [ -w /dev/full ]; then
+    if cat input.nar | run_patchnar > /dev/full 2> err.txt; then
+        log_fail "write error returns failure"
+    else
+        assert_contains "$(cat err.txt)" "write error" "write error reported"
+    fi
+else
+    log_skip "/dev/full not available"
+fi
+
+print_summary
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Test tar input and output (--input-format tar / --output-format tar)
+# A tarball of a store tree must patch exactly like the NAR of that tree
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+if ! command -v tar >/dev/null 2>&1; then
+    log_skip "tar command not available"
+    exit 77
+fi
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+longdir=share/a-directory-name-long-enough-that-the-full-path-needs-a-pax-header
+mkdir -p pkg/bin pkg/lib "pkg/$longdir"
+printf '#!/nix/store/abc123-bash-5.2/bin/bash\necho "/nix/store/xyz-data/share"\n' > pkg/bin/script
+chmod +x pkg/bin/script
+head -c 100000 /dev/zero | tr '\0' 'q' > pkg/lib/data
+printf 'nested\n' > "pkg/$longdir/file-with-a-long-name-as-well.txt"
+ln -s /nix/store/abc123-bash-5.2/bin/bash pkg/bin/sh
+ln -s ../lib/data pkg/bin/data-link
+
+create_test_nar pkg input.nar
+run_patchnar < input.nar > reference.nar
+(cd pkg && tar -cf ../input.tar .)
+
+
+# Test 1: tar in, NAR out
+echo "Testing tar input..."
+
+run_patchnar --input-format tar < input.tar > from-tar.nar
+if cmp -s reference.nar from-tar.nar; then
+    log_pass "tar input patches like the NAR"
+else
+    log_fail "tar input patches like the NAR"
+fi
+
+
+# Test 2: NAR in, tar out
+echo ""
+echo "Testing tar output..."
+
+run_patchnar --output-format tar < input.nar > output.tar
+mkdir out
+if tar -xf output.tar -C out; then
+    log_pass "tar output extracts"
+else
+    log_fail "tar output extracts"
+fi
+
+assert_equals "$(extract_from_nar reference.nar /bin/script)" "$(cat out/bin/script)" \
+    "patched script in tar output"
+assert_equals "$(nix nar readlink reference.nar /bin/sh)" "$(readlink out/bin/sh)" \
+    "patched symlink in tar output"
+if [ -x out/bin/script ] && [ ! -x out/lib/data ]; then
+    log_pass "executable bits preserved"
+else
+    log_fail "executable bits preserved"
+fi
+if cmp -s "pkg/$longdir/file-with-a-long-name-as-well.txt" \
+          "out/$longdir/file-with-a-long-name-as-well.txt"; then
+    log_pass "long path preserved"
+else
+    log_fail "long path preserved"
+fi
+
+
+# Test 3: tar in, tar out matches NAR in, tar out
+echo ""
+echo "Testing tar to tar..."
+
+run_patchnar --input-format tar --output-format tar < input.tar > tar-to-tar.tar
+if cmp -s output.tar tar-to-tar.tar; then
+    log_pass "tar to tar identical to NAR to tar"
+else
+    log_fail "tar to tar identical to NAR to tar"
+fi
+
+
+# Test 4: hard links become copies; entries without a root are accepted
+echo ""
+echo "Testing hard links..."
+
+mkdir hl
+printf 'same\n' > hl/one
+ln hl/one hl/two
+(cd hl && tar -cf ../hl.tar one two)
+run_patchnar --input-format tar < hl.tar > hl.nar
+assert_equals "same" "$(extract_from_nar hl.nar /two)" "hard link copied"
+
+
+# Test 5: malformed input
+echo ""
+echo "Testing malformed tar..."
+
+if head -c 1024 input.nar | run_patchnar --input-format tar > /dev/null 2> err.txt; then
+    log_fail "non-tar input rejected"
+else
+    assert_contains "$(cat err.txt)" "tar" "non-tar input rejected"
+fi
+
+print_summary
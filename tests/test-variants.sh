@@ -0,0 +1,73 @@
+#!/bin/sh
+# Test runtime targets (--prefix, --old-glibc) and --variant tee output
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+OTHER=/data/data/org.example.nix/files/usr
+
+mkdir -p pkg/bin pkg/lib
+
+cat > pkg/bin/script << 'EOF'
+#!/nix/store/abc123-bash-5.2/bin/bash
+echo hello
+EOF
+chmod +x pkg/bin/script
+ln -s /nix/store/lib111-libfoo/lib/libfoo.so pkg/lib/libfoo.so
+
+create_test_nar pkg input.nar
+
+
+# Test 1: --prefix overrides the compile-time prefix
+echo "Testing --prefix..."
+
+run_patchnar --prefix "$OTHER" < input.nar > other.nar
+result=$(extract_from_nar other.nar /bin/script)
+assert_contains "$result" "#!$OTHER/nix/store/abc123-bash-5.2/bin/bash" \
+    "shebang uses runtime prefix"
+result=$(strings other.nar | grep -o "/[^ ]*lib111-libfoo[^ ]*" | head -1)
+assert_equals "$OTHER/nix/store/lib111-libfoo/lib/libfoo.so" "$result" \
+    "symlink uses runtime prefix"
+
+
+# Test 2: Variants equal separate runs
+echo ""
+echo "Testing --variant..."
+
+run_patchnar < input.nar > default.nar
+run_patchnar --variant "variant.nar,prefix=$OTHER" --variant same.nar < input.nar > main.nar
+
+if cmp -s main.nar default.nar; then
+    log_pass "stdout unchanged by --variant"
+else
+    log_fail "stdout differs with --variant"
+fi
+if cmp -s variant.nar other.nar; then
+    log_pass "variant matches a separate --prefix run"
+else
+    log_fail "variant differs from a separate --prefix run"
+fi
+if cmp -s same.nar default.nar; then
+    log_pass "variant without overrides matches stdout"
+else
+    log_fail "variant without overrides differs from stdout"
+fi
+
+
+# Test 3: Bad specs are rejected
+echo ""
+echo "Testing invalid variant spec..."
+
+if run_patchnar --variant "bad.nar,colour=blue" < input.nar > /dev/null 2> err.txt; then
+    log_fail "unknown variant key accepted"
+else
+    assert_contains "$(cat err.txt)" "unknown key" "unknown variant key rejected"
+fi
+
+print_summary
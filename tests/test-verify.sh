@@ -0,0 +1,88 @@
+#!/bin/sh
+# Test --verify checks of the patched output
+
+. "$(dirname "$0")/test-helper.sh"
+
+check_nix_available
+check_patchnar_available
+
+WORKDIR=$(create_workdir)
+setup_workdir_cleanup "$WORKDIR"
+cd "$WORKDIR"
+
+OLD_GLIBC_PATH=/nix/store/0123456789abcdfghijklmnpqrsvwxyz-glibc-2.40
+NEW_GLIBC_PATH=/nix/store/zyxwvsrqpnmlkjihgfdcba9876543210-glibc-android-2.40
+GLIBC_ARGS="--old-glibc $OLD_GLIBC_PATH --glibc $NEW_GLIBC_PATH"
+
+mkdir -p pkg/bin pkg/lib pkg/share
+
+cat > pkg/bin/tool << 'EOF'
+#!/nix/store/abc123-bash-5.2/bin/bash
+echo hello
+EOF
+chmod +x pkg/bin/tool
+ln -s /nix/store/lib111-libfoo/lib/libfoo.so pkg/lib/libfoo.so
+
+
+# Test 1: A clean NAR passes and the output is unchanged
+echo "Testing clean NAR..."
+
+create_test_nar pkg input.nar
+run_patchnar $GLIBC_ARGS < input.nar > plain.nar
+
+status=0
+run_patchnar $GLIBC_ARGS --verify < input.nar > verified.nar 2> err.txt || status=$?
+assert_equals "0" "$status" "clean NAR verifies"
+if cmp -s plain.nar verified.nar; then
+    log_pass "--verify does not change the output"
+else
+    log_fail "--verify changed the output"
+fi
+
+
+# Test 2: Old glibc bytes that no patcher rewrites are reported
+echo ""
+echo "Testing surviving old glibc reference..."
+
+printf 'libc=%s/lib/libc.so.6\n' "$OLD_GLIBC_PATH" > pkg/share/paths.dat
+create_test_nar pkg input.nar
+
+status=0
+run_patchnar $GLIBC_ARGS --verify < input.nar > output.nar 2> err.txt || status=$?
+assert_equals "2" "$status" "violations give exit status 2"
+assert_contains "$(cat err.txt)" "share/paths.dat+16: old glibc $OLD_GLIBC_PATH" \
+    "old glibc reported with path and offset"
+rm pkg/share/paths.dat
+
+
+# Test 3: Symlinks left unprefixed by a rule are reported
+echo ""
+echo "Testing unprefixed symlink..."
+
+create_test_nar pkg input.nar
+
+status=0
+run_patchnar $GLIBC_ARGS --verify --rule 'lib/**=map-only' < input.nar > output.nar 2> err.txt || status=$?
+assert_equals "2" "$status" "unprefixed symlink fails verification"
+assert_contains "$(cat err.txt)" "unprefixed symlink target /nix/store/lib111-libfoo/lib/libfoo.so" \
+    "unprefixed symlink reported"
+
+
+# Test 4: Store paths outside strings and comments are not checked
+echo ""
+echo "Testing unquoted store path in a script..."
+
+cat > pkg/bin/run << 'EOF'
+#!/nix/store/abc123-bash-5.2/bin/bash
+exec /nix/store/abc123-coreutils/bin/true "$@"
+EOF
+chmod +x pkg/bin/run
+create_test_nar pkg input.nar
+
+status=0
+run_patchnar $GLIBC_ARGS --verify --rule 'bin/run=script:sh' < input.nar > output.nar 2> err.txt || status=$?
+assert_equals "0" "$status" "unquoted store path is not a violation"
+assert_not_contains "$(cat err.txt)" "unprefixed script path" "nothing reported for the script"
+rm pkg/bin/run
+
+print_summary